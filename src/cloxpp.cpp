@@ -1,5 +1,8 @@
 #include <gflags/gflags.h>
 
+#include <cctype>
+#include <cstdlib>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -10,13 +13,57 @@
 
 DEFINE_bool(debug, false, "Toggle debug information");
 DEFINE_bool(debug_stack, false, "Toggle debug stack information");
+DEFINE_bool(debug_gc, false, "Log every garbage collection");
+DEFINE_bool(gc_stress, false, "Collect garbage on every allocation");
+DEFINE_bool(stats, false, "Print runtime statistics when a script finishes");
+DEFINE_bool(dump_quickened, false,
+            "Print how many arithmetic sites each function specialized");
+DEFINE_bool(fold, true, "Fold constant expressions and drop dead code");
+DEFINE_bool(peephole, true, "Fuse common bytecode sequences after compiling");
 DEFINE_string(scanner, "readall", "Scanner type [readall | byone]");
+DEFINE_int32(scan_threads, 1,
+             "Threads the readall scanner uses; 0 for one per megabyte of "
+             "source, up to the cores");
+DEFINE_string(backend, "stack", "Bytecode the VM runs [stack | register]");
+DEFINE_string(jit, "off",
+              "Compile hot functions to x86-64 [off | on | always]");
+DEFINE_bool(emit_bytecode, false,
+            "Write the compiled script next to it as a .loxc file instead of "
+            "running it");
+DEFINE_string(cache_dir, "",
+              "Cache compiled scripts in this directory, $CLOXPP_CACHE_DIR "
+              "when empty; off when both are");
+DEFINE_uint64(cache_mb, 64, "Size the compile cache is trimmed to");
+DEFINE_int32(O, 1,
+             "Optimization level: 0 for none, 1 for the bytecode passes, 2 to "
+             "add the SSA optimizer");
 
 int main(int argc, char** argv) {
+  // Accept the usual -O0, -O1 and -O2 spelling.
+  std::vector<std::string> spelled(argv, argv + argc);
+  std::vector<char*> flags;
+  for (auto& argument : spelled) {
+    if (argument.size() > 2 && argument.compare(0, 2, "-O") == 0 &&
+        std::isdigit(static_cast<unsigned char>(argument[2]))) {
+      argument = "--O=" + argument.substr(2);
+    }
+    flags.push_back(argument.data());
+  }
+  flags.push_back(nullptr);
+  argv = flags.data();
   gflags::ParseCommandLineFlags(&argc, &argv, true);
   std::vector<std::string> arguments(argv, argv + argc);
 
-  auto compiler = std::make_unique<lox::compiler::Compiler>();
+  if (FLAGS_cache_dir.empty() && std::getenv("CLOXPP_CACHE_DIR")) {
+    FLAGS_cache_dir = std::getenv("CLOXPP_CACHE_DIR");
+  }
+  // Only scripts are cached, not the lines of a session.
+  std::unique_ptr<lox::compiler::CompileCache> cache;
+  if (arguments.size() > 1 && !FLAGS_cache_dir.empty()) {
+    cache = std::make_unique<lox::compiler::CompileCache>(
+        FLAGS_cache_dir, FLAGS_cache_mb << 20, FLAGS_debug);
+  }
+  auto compiler = std::make_unique<lox::compiler::Compiler>(std::move(cache));
   auto vm = std::make_unique<lox::lang::VM>(std::move(compiler));
   auto lox = std::make_unique<lox::lang::Lox>(std::move(vm));
 
@@ -0,0 +1,176 @@
+#include <folly/File.h>
+#include <folly/FileUtil.h>
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "compiler/Compiler.h"
+#include "compiler/Globals.h"
+#include "compiler/Heap.h"
+#include "compiler/Parser.h"
+
+DEFINE_bool(fold, true, "Fold constant expressions and drop dead code");
+DEFINE_bool(peephole, true, "Fuse common bytecode sequences after compiling");
+DEFINE_string(scanner, "readall", "Scanner type [readall | byone]");
+DEFINE_int32(scan_threads, 1,
+             "Threads the readall scanner uses; 0 for one per megabyte of "
+             "source, up to the cores");
+DEFINE_string(backend, "stack", "Bytecode to compile to [stack | register]");
+DEFINE_int32(O, 1,
+             "Optimization level: 0 for none, 1 for the bytecode passes, 2 to "
+             "add the SSA optimizer");
+DEFINE_int64(lines, 1000000, "Lines of the script generated without scripts");
+DEFINE_string(generate, "blocks",
+              "Script to generate: functions of statements [blocks] or "
+              "functions that each fill their constant pool [constants]");
+DEFINE_string(write, "", "Where to also write the generated script");
+DEFINE_double(seconds, 1.0, "Time to spend on each measurement");
+
+namespace {
+
+using lox::compiler::Closure;
+using lox::compiler::Globals;
+using lox::compiler::Heap;
+
+// A script of about `lines` lines: a couple of hundred functions of blocks
+// that declare, branch, loop, call and print. The functions share a few
+// constants and globals, so no pool runs out however long it gets.
+std::string generate(int64_t lines) {
+  constexpr int kFunctions = 200;
+  constexpr int kBlockLines = 9;
+  int64_t blocks = std::max<int64_t>(1, lines / kFunctions / kBlockLines);
+  std::string script = "var g = 0;\nfun f0(a, b) { return a; }\n";
+  for (int f = 1; f < kFunctions; f++) {
+    script += "fun f" + std::to_string(f) + "(a, b) {\n";
+    for (int64_t block = 0; block < blocks; block++) {
+      script +=
+          "  {\n"
+          "    var x = a + b * 2;\n"
+          "    var y = (x - 1) / 3;\n"
+          "    if (x > y and y != nil) x = x - y; else y = y + x;\n"
+          "    while (x < 100 or !y) x = x + 1;\n"
+          "    for (var k = 0; k < 3; k = k + 1) y = y * 2;\n"
+          "    g = g + f" +
+          std::to_string(f - 1) +
+          "(x, y) - y;\n"
+          "    print \"x is \" + \"even\";\n"
+          "  }\n";
+    }
+    script += "  return a;\n}\n";
+  }
+  return script;
+}
+
+// A script of about `lines` lines like test/limit/too_many_constants.lox:
+// a couple of hundred functions that each use the same 255 numbers and
+// strings over and over, eight to a line, which is the worst case for
+// finding constants already in the pool.
+std::string generateConstants(int64_t lines) {
+  constexpr int kFunctions = 200;
+  constexpr int kConstants = 255;
+  constexpr int kPerLine = 8;
+  int64_t uses = std::max<int64_t>(1, lines / kFunctions - 2) * kPerLine;
+  std::string script;
+  for (int f = 0; f < kFunctions; f++) {
+    script += "fun f" + std::to_string(f) + "() {\n";
+    for (int64_t use = 0; use < uses; use++) {
+      // Each pass over the constants goes round in another order.
+      int64_t step = int64_t{1} << (use / kConstants % 4);
+      int64_t constant = use % kConstants * step % kConstants;
+      script += use % kPerLine == 0 ? "  " : " ";
+      if (constant % 2 == 0) {
+        script += std::to_string(constant) + ";";
+      } else {
+        script += "\"s" + std::to_string(constant) + "\";";
+      }
+      if (use % kPerLine == kPerLine - 1) {
+        script += "\n";
+      }
+    }
+    script += "\n}\n";
+  }
+  return script;
+}
+
+// The best time of `compile` over the passes in --seconds, or a negative
+// one after a compile error.
+double measure(const std::function<Closure(Heap&, Globals&)>& compile) {
+  using Clock = std::chrono::steady_clock;
+  std::chrono::duration<double> best{0}, spent{0};
+  for (int pass = 0; pass == 0 || spent.count() < FLAGS_seconds; pass++) {
+    Heap heap;
+    Globals globals;
+    heap.pause();
+    auto start = Clock::now();
+    Closure script = compile(heap, globals);
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    heap.resume();
+    if (script == nullptr) {
+      return -1;
+    }
+    spent += elapsed;
+    if (pass == 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return best.count();
+}
+
+}  // namespace
+
+// Compiler throughput: compiles the given scripts, or a generated one of
+// --lines lines, over and over and reports the best pass in lines/s, for the
+// parser alone and with the optimization passes the flags enable.
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  std::string source;
+  if (argc < 2) {
+    if (FLAGS_generate == "constants") {
+      source = generateConstants(FLAGS_lines);
+    } else {
+      source = generate(FLAGS_lines);
+    }
+    if (!FLAGS_write.empty() &&
+        !folly::writeFile(source, FLAGS_write.c_str())) {
+      std::cerr << "compilebench: cannot write " << FLAGS_write << "\n";
+      return 74;
+    }
+  }
+  for (int i = 1; i < argc; i++) {
+    std::string script;
+    folly::readFile(folly::File(argv[i]).fd(), script);
+    source += script;
+  }
+  auto lines = std::count(source.begin(), source.end(), '\n');
+
+  struct Stage {
+    const char* name;
+    std::function<Closure(Heap&, Globals&)> run;
+  };
+  const Stage stages[] = {
+      {"parse",
+       [&source](Heap& heap, Globals& globals) {
+         return lox::compiler::Parser(source, FLAGS_scanner, heap, globals)
+             .run();
+       }},
+      {"compile",
+       [&source](Heap& heap, Globals& globals) {
+         return lox::compiler::Compiler().compile(source, heap, globals);
+       }},
+  };
+  for (const auto& stage : stages) {
+    double seconds = measure(stage.run);
+    if (seconds < 0) {
+      return 65;
+    }
+    std::printf("%-8s %10.0f lines/s %8.1f MB/s  %td lines, %zu bytes\n",
+                stage.name, lines / seconds, source.size() / seconds / 1e6,
+                lines, source.size());
+  }
+}
@@ -0,0 +1,243 @@
+#include "Bytecode.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace lox {
+namespace compiler {
+
+Bytecode::StackEffect Bytecode::stackEffect(OpCode code,
+                                             const uint8_t* operands) {
+  switch (code) {
+    case OpCode::CONSTANT:
+    case OpCode::NIL:
+    case OpCode::TRUE:
+    case OpCode::FALSE:
+    case OpCode::GET_LOCAL:
+    case OpCode::GET_GLOBAL:
+    case OpCode::GET_UPVALUE:
+    case OpCode::CLOSURE:
+    case OpCode::CLASS:
+      return {0, 1};
+    case OpCode::GET_LOCAL_GET_LOCAL:
+      return {0, 2};
+    case OpCode::NEGATE:
+    case OpCode::NOT:
+    case OpCode::PRINT:
+    case OpCode::SET_GLOBAL:
+    case OpCode::SET_LOCAL:
+    case OpCode::SET_UPVALUE:
+    case OpCode::GET_PROPERTY:
+    case OpCode::ADD_CONST:
+    case OpCode::JUMP_IF_FALSE:
+      return {1, 1};
+    case OpCode::RETURN:
+    case OpCode::POP:
+    case OpCode::DEFINE_GLOBAL:
+    case OpCode::CLOSE_UPVALUE:
+    case OpCode::POP_JUMP_IF_FALSE:
+      return {1, 0};
+    case OpCode::ADD:
+    case OpCode::SUBSTRACT:
+    case OpCode::MULTIPLY:
+    case OpCode::DIVIDE:
+    case OpCode::EQUAL:
+    case OpCode::GREATER:
+    case OpCode::LESS:
+    case OpCode::NOT_EQUAL:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::LESS_EQUAL:
+    case OpCode::ADD_NUM_NUM:
+    case OpCode::ADD_STR_STR:
+    case OpCode::SUBSTRACT_NUM_NUM:
+    case OpCode::MULTIPLY_NUM_NUM:
+    case OpCode::DIVIDE_NUM_NUM:
+    case OpCode::GREATER_NUM:
+    case OpCode::LESS_NUM:
+    case OpCode::GREATER_EQUAL_NUM:
+    case OpCode::LESS_EQUAL_NUM:
+    case OpCode::SET_PROPERTY:
+    case OpCode::METHOD:
+    case OpCode::INHERIT:
+    case OpCode::GET_SUPER:
+      return {2, 1};
+    case OpCode::EQUAL_JUMP_IF_FALSE:
+    case OpCode::NOT_EQUAL_JUMP_IF_FALSE:
+    case OpCode::GREATER_JUMP_IF_FALSE:
+    case OpCode::LESS_JUMP_IF_FALSE:
+    case OpCode::GREATER_EQUAL_JUMP_IF_FALSE:
+    case OpCode::LESS_EQUAL_JUMP_IF_FALSE:
+      return {2, 0};
+    case OpCode::POPN:
+      return {operands[0], 0};
+    case OpCode::CALL:
+      return {operands[0] + 1, 1};
+    case OpCode::INVOKE:
+      return {operands[1] + 1, 1};
+    case OpCode::SUPER_INVOKE:
+      // The receiver, the arguments and the superclass.
+      return {operands[1] + 2, 1};
+    case OpCode::JUMP:
+    case OpCode::LOOP:
+      return {0, 0};
+  }
+  return {0, 0};
+}
+
+size_t Bytecode::maxDepth(const Chunk& chunk, int arity) {
+  auto instructions = decode(chunk);
+  std::vector<int> depths(instructions.size() + 1, -1);
+  std::vector<size_t> pending;
+  auto reach = [&](size_t i, int depth) {
+    if (depths[i] == -1) {
+      depths[i] = depth;
+      pending.push_back(i);
+    }
+  };
+  int most = arity + 1;
+  reach(0, most);
+  while (!pending.empty()) {
+    size_t i = pending.back();
+    pending.pop_back();
+    if (i == instructions.size()) {
+      continue;
+    }
+    const auto& instruction = instructions[i];
+    auto effect = stackEffect(instruction.code, instruction.operands.data());
+    int after = depths[i] - effect.pops + effect.pushes;
+    most = std::max(most, after);
+    if (isJump(instruction.code)) {
+      reach(instruction.target, after);
+    }
+    if (instruction.code != OpCode::RETURN &&
+        instruction.code != OpCode::JUMP && instruction.code != OpCode::LOOP) {
+      reach(i + 1, after);
+    }
+  }
+  return most;
+}
+
+std::vector<Bytecode::Instruction> Bytecode::decode(const Chunk& chunk) {
+  std::vector<Instruction> instructions;
+  std::unordered_map<size_t, int> indices;
+  std::vector<size_t> targets;
+  for (size_t offset = 0; offset < chunk.code.size();) {
+    auto code = static_cast<OpCode>(chunk.code[offset]);
+    size_t size = instructionSize(code);
+    Instruction instruction{code, {}, chunk.lines[offset]};
+    instruction.operands.assign(chunk.code.begin() + offset + 1,
+                                chunk.code.begin() + offset + size);
+    indices.emplace(offset, static_cast<int>(instructions.size()));
+    size_t target = 0;
+    if (isJump(code)) {
+      size_t jump = (instruction.operands[0] << 8) | instruction.operands[1];
+      target = code == OpCode::LOOP ? offset + size - jump
+                                    : offset + size + jump;
+    }
+    targets.push_back(target);
+    instructions.push_back(std::move(instruction));
+    offset += size;
+  }
+  indices.emplace(chunk.code.size(), static_cast<int>(instructions.size()));
+
+  for (size_t i = 0; i < instructions.size(); i++) {
+    if (isJump(instructions[i].code)) {
+      instructions[i].target = indices.at(targets[i]);
+    }
+  }
+  return instructions;
+}
+
+void Bytecode::encode(const std::vector<Instruction>& instructions,
+                      Chunk& chunk) {
+  std::vector<size_t> offsets;
+  size_t offset = 0;
+  for (const auto& instruction : instructions) {
+    offsets.push_back(offset);
+    offset += 1 + instruction.operands.size();
+  }
+  offsets.push_back(offset);
+
+  chunk.code.clear();
+  chunk.lines.clear();
+  for (size_t i = 0; i < instructions.size(); i++) {
+    const auto& instruction = instructions[i];
+    chunk.addCode(instruction.code, instruction.line);
+    if (instruction.target != -1) {
+      size_t end = offsets[i + 1];
+      size_t target = offsets[instruction.target];
+      size_t jump = instruction.code == OpCode::LOOP ? end - target
+                                                     : target - end;
+      // The passes only ever shrink code, so this cannot trigger.
+      if (jump > std::numeric_limits<uint16_t>::max()) {
+        throw std::logic_error("jump out of range after rewriting");
+      }
+      chunk.addOperand((jump >> 8) & 0xff);
+      chunk.addOperand(jump & 0xff);
+    } else {
+      for (auto operand : instruction.operands) {
+        chunk.addOperand(operand);
+      }
+    }
+  }
+}
+
+bool Bytecode::fits(const std::vector<Instruction>& instructions) {
+  std::vector<size_t> offsets;
+  size_t offset = 0;
+  for (const auto& instruction : instructions) {
+    offsets.push_back(offset);
+    offset += 1 + instruction.operands.size();
+  }
+  offsets.push_back(offset);
+
+  for (size_t i = 0; i < instructions.size(); i++) {
+    int target = instructions[i].target;
+    if (target == -1) {
+      continue;
+    }
+    size_t end = offsets[i + 1];
+    size_t jump = offsets[target] < end ? end - offsets[target]
+                                        : offsets[target] - end;
+    if (jump > std::numeric_limits<uint16_t>::max()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<bool> Bytecode::targets(
+    const std::vector<Instruction>& instructions) {
+  std::vector<bool> targets(instructions.size() + 1, false);
+  for (const auto& instruction : instructions) {
+    if (instruction.target != -1) {
+      targets[instruction.target] = true;
+    }
+  }
+  return targets;
+}
+
+void Bytecode::remove(std::vector<Instruction>& instructions,
+                      const std::vector<bool>& removed) {
+  std::vector<int> remap(instructions.size() + 1);
+  std::vector<Instruction> kept;
+  for (size_t i = 0; i < instructions.size(); i++) {
+    remap[i] = static_cast<int>(kept.size());
+    if (!removed[i]) {
+      kept.push_back(std::move(instructions[i]));
+    }
+  }
+  remap[instructions.size()] = static_cast<int>(kept.size());
+
+  for (auto& instruction : kept) {
+    if (instruction.target != -1) {
+      instruction.target = remap[instruction.target];
+    }
+  }
+  instructions = std::move(kept);
+}
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Chunk.h"
+
+namespace lox {
+namespace compiler {
+
+// Decoded form of a chunk's code for the passes that rewrite it. Jumps refer
+// to their target by instruction index, so instructions can be added or
+// dropped freely and the offsets are only worked out again by encode().
+class Bytecode {
+ public:
+  struct Instruction {
+    OpCode code;
+    std::vector<uint8_t> operands;
+    int line;
+    // Index of the jump target, for jumps. May be one past the end.
+    int target{-1};
+  };
+
+  static bool isJump(OpCode code) {
+    switch (code) {
+      case OpCode::JUMP:
+      case OpCode::JUMP_IF_FALSE:
+      case OpCode::LOOP:
+      case OpCode::POP_JUMP_IF_FALSE:
+      case OpCode::EQUAL_JUMP_IF_FALSE:
+      case OpCode::NOT_EQUAL_JUMP_IF_FALSE:
+      case OpCode::GREATER_JUMP_IF_FALSE:
+      case OpCode::LESS_JUMP_IF_FALSE:
+      case OpCode::GREATER_EQUAL_JUMP_IF_FALSE:
+      case OpCode::LESS_EQUAL_JUMP_IF_FALSE:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  // Values an instruction takes off the stack and puts back. Calls count
+  // the callee among the values taken.
+  struct StackEffect {
+    int pops;
+    int pushes;
+  };
+  static StackEffect stackEffect(OpCode code, const uint8_t* operands);
+
+  // Most values a frame of `chunk` holds at once, counting the callee and
+  // the `arity` arguments it starts with.
+  static size_t maxDepth(const Chunk& chunk, int arity);
+
+  static std::vector<Instruction> decode(const Chunk& chunk);
+  static void encode(const std::vector<Instruction>& instructions,
+                     Chunk& chunk);
+  // Whether every jump's distance fits in its two operand bytes.
+  static bool fits(const std::vector<Instruction>& instructions);
+
+  // Marks every instruction some jump lands on, plus the end.
+  static std::vector<bool> targets(
+      const std::vector<Instruction>& instructions);
+
+  // Drops the instructions flagged in `removed`. Jumps to a dropped
+  // instruction move on to the next one that is kept.
+  static void remove(std::vector<Instruction>& instructions,
+                     const std::vector<bool>& removed);
+};
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,474 @@
+#include "BytecodeFile.h"
+
+#include <fcntl.h>
+#include <folly/FileUtil.h>
+#include <folly/hash/SpookyHashV2.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "Bytecode.h"
+#include "ParseError.h"
+
+namespace lox {
+namespace compiler {
+
+namespace {
+
+constexpr char kMagic[4] = {'L', 'O', 'X', 'C'};
+
+enum class Tag : uint8_t { NIL, FALSE, TRUE, NUMBER, STRING, FUNCTION };
+
+// How deep functions may nest in a file; the reader recurses once a level.
+constexpr int kMaxNesting = 1024;
+
+uint64_t checksum(const void* data, size_t size) {
+  return folly::hash::SpookyHashV2::Hash64(data, size, 0);
+}
+
+class Writer {
+ public:
+  template <typename T>
+  void put(T value) {
+    auto bits = static_cast<std::make_unsigned_t<T>>(value);
+    for (size_t i = 0; i < sizeof(T); i++) {
+      out_.push_back(static_cast<char>((bits >> (8 * i)) & 0xff));
+    }
+  }
+  void put(std::string_view bytes) {
+    put(static_cast<uint32_t>(bytes.size()));
+    out_.append(bytes);
+  }
+
+  void function(Function function) {
+    const Chunk& chunk = function->chunk();
+    put(std::string_view(function->name()));
+    put(static_cast<uint32_t>(function->arity()));
+    put(static_cast<uint32_t>(chunk.code.size()));
+    out_.append(chunk.code.begin(), chunk.code.end());
+    for (int line : chunk.lines) {
+      put(static_cast<int32_t>(line));
+    }
+    put(static_cast<uint32_t>(chunk.upvalues.size()));
+    for (const auto& upvalue : chunk.upvalues) {
+      put(upvalue.index);
+      put(static_cast<uint8_t>(upvalue.isLocal));
+    }
+    put(static_cast<uint32_t>(chunk.caches.size()));
+    put(static_cast<uint32_t>(chunk.constants.size()));
+    for (const auto& constant : chunk.constants) {
+      if (constant.isNil()) {
+        put(static_cast<uint8_t>(Tag::NIL));
+      } else if (constant.isBool()) {
+        put(static_cast<uint8_t>(constant.asBool() ? Tag::TRUE : Tag::FALSE));
+      } else if (constant.isNumber()) {
+        put(static_cast<uint8_t>(Tag::NUMBER));
+        uint64_t bits;
+        double number = constant.asNumber();
+        std::memcpy(&bits, &number, sizeof(bits));
+        put(bits);
+      } else if (constant.isString()) {
+        put(static_cast<uint8_t>(Tag::STRING));
+        put(std::string_view(constant.asString()->chars));
+      } else {
+        put(static_cast<uint8_t>(Tag::FUNCTION));
+        this->function(constant.asFunction());
+      }
+    }
+  }
+
+  void append(std::string_view bytes) { out_.append(bytes); }
+
+  const std::string& bytes() const { return out_; }
+
+ private:
+  std::string out_;
+};
+
+class Reader {
+ public:
+  Reader(const uint8_t* data, size_t size, Heap& heap)
+      : pos_(data), end_(data + size), heap_(heap) {}
+
+  template <typename T>
+  T get() {
+    using Bits = std::make_unsigned_t<T>;
+    const uint8_t* bytes = take(sizeof(T));
+    Bits bits = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+      bits |= static_cast<Bits>(static_cast<Bits>(bytes[i]) << (8 * i));
+    }
+    return static_cast<T>(bits);
+  }
+  std::string_view string() {
+    uint32_t size = get<uint32_t>();
+    return {reinterpret_cast<const char*>(take(size)), size};
+  }
+  const uint8_t* take(size_t size) {
+    if (static_cast<size_t>(end_ - pos_) < size) {
+      throw ParseError("Bytecode file is truncated.\n");
+    }
+    const uint8_t* bytes = pos_;
+    pos_ += size;
+    return bytes;
+  }
+  bool done() const { return pos_ == end_; }
+  size_t left() const { return static_cast<size_t>(end_ - pos_); }
+
+  // Reads the count of a table whose entries take at least `each` bytes,
+  // rejecting more than the bytes left could hold or more than `max`.
+  uint32_t count(size_t each, size_t max) {
+    uint32_t count = get<uint32_t>();
+    if (count > max || (each > 0 && count > left() / each)) {
+      throw ParseError("Bytecode file has a bad count.\n");
+    }
+    return count;
+  }
+
+  // `slots` maps the file's global slots to the ones they got.
+  Function function(const std::vector<uint16_t>& slots, int depth = 0) {
+    if (depth > kMaxNesting) {
+      throw ParseError("Bytecode file nests functions too deeply.\n");
+    }
+    auto chunk = std::make_unique<Chunk>();
+    std::string name(string());
+    auto arity = static_cast<int>(get<uint32_t>());
+    uint32_t size = get<uint32_t>();
+    if (size == 0) {
+      throw ParseError("Bytecode file has a function without code.\n");
+    }
+    const uint8_t* code = take(size);
+    chunk->code.assign(code, code + size);
+    const uint8_t* lines = take(size_t{size} * sizeof(int32_t));
+    chunk->lines.resize(size);
+    if constexpr (sizeof(int) == sizeof(int32_t) &&
+                  __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {
+      std::memcpy(chunk->lines.data(), lines, size_t{size} * sizeof(int32_t));
+    } else {
+      Reader table(lines, size_t{size} * sizeof(int32_t), heap_);
+      for (auto& line : chunk->lines) {
+        line = table.get<int32_t>();
+      }
+    }
+    relocate(*chunk, slots);
+
+    for (uint32_t i = count(2, kMaxUpvalues); i > 0; i--) {
+      uint8_t index = get<uint8_t>();
+      chunk->upvalues.emplace_back(index, get<uint8_t>() != 0);
+    }
+    chunk->caches.resize(count(0, kMaxCaches));
+    uint32_t constants = count(1, Chunk::kMaxConstants);
+    chunk->constants.reserve(constants);
+    for (uint32_t i = 0; i < constants; i++) {
+      switch (static_cast<Tag>(get<uint8_t>())) {
+        case Tag::NIL:
+          chunk->constants.emplace_back(std::monostate());
+          break;
+        case Tag::FALSE:
+          chunk->constants.emplace_back(false);
+          break;
+        case Tag::TRUE:
+          chunk->constants.emplace_back(true);
+          break;
+        case Tag::NUMBER: {
+          uint64_t bits = get<uint64_t>();
+          double number;
+          std::memcpy(&number, &bits, sizeof(number));
+          chunk->constants.emplace_back(number);
+          break;
+        }
+        case Tag::STRING:
+          chunk->constants.emplace_back(heap_.makeString(string()));
+          break;
+        case Tag::FUNCTION:
+          chunk->constants.emplace_back(function(slots, depth + 1));
+          break;
+        default:
+          throw ParseError("Bytecode file has a bad constant.\n");
+      }
+    }
+    check(*chunk, arity);
+    return heap_.allocate<FunctionObject>(arity, name, std::move(chunk));
+  }
+
+ private:
+  // Operands are a byte for upvalues and a u16 for caches.
+  static constexpr size_t kMaxUpvalues = 256;
+  static constexpr size_t kMaxCaches =
+      std::numeric_limits<uint16_t>::max() + size_t{1};
+
+  // Rewrites the global operands for the slots the names got here, and
+  // checks the instructions stay within the code.
+  static void relocate(Chunk& chunk, const std::vector<uint16_t>& slots) {
+    size_t i = 0;
+    while (i < chunk.code.size()) {
+      if (chunk.code[i] >= codes.size()) {
+        throw ParseError("Bytecode file has a bad instruction.\n");
+      }
+      auto code = static_cast<OpCode>(chunk.code[i]);
+      size_t size = instructionSize(code);
+      if (i + size > chunk.code.size()) {
+        throw ParseError("Bytecode file is truncated.\n");
+      }
+      if (code == OpCode::DEFINE_GLOBAL || code == OpCode::GET_GLOBAL ||
+          code == OpCode::SET_GLOBAL) {
+        size_t slot = (chunk.code[i + 1] << 8) | chunk.code[i + 2];
+        if (slot >= slots.size()) {
+          throw ParseError("Bytecode file has a bad global.\n");
+        }
+        chunk.code[i + 1] = static_cast<uint8_t>(slots[slot] >> 8);
+        chunk.code[i + 2] = static_cast<uint8_t>(slots[slot] & 0xff);
+      }
+      i += size;
+    }
+  }
+
+  // Checks the operands against the rest of the chunk, which `relocate`
+  // runs too early to see: constants of the kind the VM reads them as,
+  // upvalues and caches that exist, and jumps that land on an instruction.
+  // Then follows every path through the code with the depth of the stack
+  // there, so no instruction takes values or names locals below the frame,
+  // paths meet at the same depth and none runs off the end. The deepest the
+  // stack gets becomes the chunk's maxDepth, which has to fit on the stack.
+  static void check(Chunk& chunk, int arity) {
+    const auto& code = chunk.code;
+    std::vector<bool> starts(code.size());
+    for (size_t i = 0; i < code.size();) {
+      starts[i] = true;
+      i += instructionSize(static_cast<OpCode>(code[i]));
+    }
+    auto target = [&](size_t i, OpCode op) {
+      size_t jump = code[i + 1] << 8 | code[i + 2];
+      size_t end = i + instructionSize(op);
+      // A backward jump past the start wraps around to a huge target.
+      return op == OpCode::LOOP ? end - jump : end + jump;
+    };
+    auto constant = [&](uint8_t index) -> const Value& {
+      if (index >= chunk.constants.size()) {
+        throw ParseError("Bytecode file has a bad constant operand.\n");
+      }
+      return chunk.constants[index];
+    };
+    auto name = [&](uint8_t index) {
+      if (!constant(index).isString()) {
+        throw ParseError("Bytecode file has a bad name operand.\n");
+      }
+    };
+    for (size_t i = 0; i < code.size();) {
+      auto op = static_cast<OpCode>(code[i]);
+      const uint8_t* operands = &code[i + 1];
+      switch (op) {
+        case OpCode::CONSTANT:
+        case OpCode::ADD_CONST:
+          constant(operands[0]);
+          break;
+        case OpCode::CLASS:
+        case OpCode::METHOD:
+        case OpCode::GET_SUPER:
+        case OpCode::INVOKE:
+        case OpCode::SUPER_INVOKE:
+          name(operands[0]);
+          break;
+        case OpCode::GET_PROPERTY:
+        case OpCode::SET_PROPERTY:
+          name(operands[0]);
+          if (static_cast<size_t>(operands[1] << 8 | operands[2]) >=
+              chunk.caches.size()) {
+            throw ParseError("Bytecode file has a bad cache operand.\n");
+          }
+          break;
+        case OpCode::CLOSURE: {
+          const Value& value = constant(operands[0]);
+          if (!value.isFunction()) {
+            throw ParseError("Bytecode file has a bad closure operand.\n");
+          }
+          // Captured upvalues of the enclosing function must exist too.
+          for (const auto& upvalue : value.asFunction()->chunk().upvalues) {
+            if (!upvalue.isLocal && upvalue.index >= chunk.upvalues.size()) {
+              throw ParseError("Bytecode file has a bad upvalue.\n");
+            }
+          }
+          break;
+        }
+        case OpCode::GET_UPVALUE:
+        case OpCode::SET_UPVALUE:
+          if (operands[0] >= chunk.upvalues.size()) {
+            throw ParseError("Bytecode file has a bad upvalue.\n");
+          }
+          break;
+        default:
+          break;
+      }
+      if (Bytecode::isJump(op)) {
+        size_t to = target(i, op);
+        if (to >= code.size() || !starts[to]) {
+          throw ParseError("Bytecode file has a bad jump.\n");
+        }
+      }
+      i += instructionSize(op);
+    }
+
+    // The callee and its arguments are there on entry.
+    std::vector<int> depths(code.size(), -1);
+    std::vector<size_t> pending;
+    auto reach = [&](size_t i, int depth) {
+      if (i >= code.size()) {
+        throw ParseError("Bytecode file runs off the end of a function.\n");
+      }
+      if (depths[i] == -1) {
+        depths[i] = depth;
+        pending.push_back(i);
+      } else if (depths[i] != depth) {
+        throw ParseError("Bytecode file has an unbalanced stack.\n");
+      }
+    };
+    reach(0, arity + 1);
+    int most = arity + 1;
+    while (!pending.empty()) {
+      size_t i = pending.back();
+      pending.pop_back();
+      int depth = depths[i];
+      auto op = static_cast<OpCode>(code[i]);
+      const uint8_t* operands = &code[i + 1];
+      auto local = [](uint8_t slot, int depth) {
+        if (slot >= depth) {
+          throw ParseError("Bytecode file has a bad local.\n");
+        }
+      };
+      switch (op) {
+        case OpCode::GET_LOCAL:
+        case OpCode::SET_LOCAL:
+          local(operands[0], depth);
+          break;
+        case OpCode::GET_LOCAL_GET_LOCAL:
+          // The first local is pushed before the second is read.
+          local(operands[0], depth);
+          local(operands[1], depth + 1);
+          break;
+        case OpCode::CLOSURE:
+          for (const auto& upvalue :
+               chunk.constants[operands[0]].asFunction()->chunk().upvalues) {
+            if (upvalue.isLocal) {
+              local(upvalue.index, depth);
+            }
+          }
+          break;
+        default:
+          break;
+      }
+      auto effect = Bytecode::stackEffect(op, operands);
+      if (depth < effect.pops) {
+        throw ParseError("Bytecode file has an unbalanced stack.\n");
+      }
+      int after = depth - effect.pops + effect.pushes;
+      most = std::max(most, after);
+      if (Bytecode::isJump(op)) {
+        reach(target(i, op), after);
+      }
+      if (op != OpCode::RETURN && op != OpCode::JUMP && op != OpCode::LOOP) {
+        reach(i + instructionSize(op), after);
+      }
+    }
+    if (static_cast<size_t>(most) > Chunk::kMaxStackSize) {
+      throw ParseError(
+          "Bytecode file has a function too deep for the stack.\n");
+    }
+    chunk.maxDepth = most;
+  }
+
+  const uint8_t* pos_;
+  const uint8_t* end_;
+  Heap& heap_;
+};
+
+}  // namespace
+
+bool BytecodeFile::is(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  // Reading a pipe would take the bytes from the script.
+  struct stat info;
+  char magic[sizeof(kMagic)];
+  bool matches = ::fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+                 folly::readFull(fd, magic, sizeof(magic)) ==
+                     static_cast<ssize_t>(sizeof(magic)) &&
+                 std::memcmp(magic, kMagic, sizeof(magic)) == 0;
+  ::close(fd);
+  return matches;
+}
+
+bool BytecodeFile::write(Function script, const Globals& globals,
+                         const std::string& path) {
+  return folly::writeFile(bytes(script, globals), path.c_str());
+}
+
+std::string BytecodeFile::bytes(Function script, const Globals& globals) {
+  Writer body;
+  body.put(static_cast<uint32_t>(globals.size()));
+  for (size_t slot = 0; slot < globals.size(); slot++) {
+    body.put(std::string_view(globals.name(slot)->chars));
+  }
+  body.function(script);
+
+  Writer writer;
+  for (char c : kMagic) {
+    writer.put(static_cast<uint8_t>(c));
+  }
+  writer.put(kVersion);
+  writer.put(static_cast<uint32_t>(codes.size()));
+  writer.put(checksum(body.bytes().data(), body.bytes().size()));
+  writer.append(body.bytes());
+  return writer.bytes();
+}
+
+Closure BytecodeFile::load(const std::string& path, Heap& heap,
+                           Globals& globals) {
+  std::string bytes;
+  if (!folly::readFile(path.c_str(), bytes)) {
+    throw ParseError("Cannot read " + path + ".\n");
+  }
+  return load(bytes, path, heap, globals);
+}
+
+Closure BytecodeFile::load(std::string_view bytes, const std::string& name,
+                           Heap& heap, Globals& globals) {
+  const auto* data = reinterpret_cast<const uint8_t*>(bytes.data());
+  Reader reader(data, bytes.size(), heap);
+  if (std::memcmp(reader.take(sizeof(kMagic)), kMagic, sizeof(kMagic)) != 0) {
+    throw ParseError(name + " is not a bytecode file.\n");
+  }
+  if (reader.get<uint32_t>() != kVersion ||
+      reader.get<uint32_t>() != codes.size()) {
+    throw ParseError(name + " was written by another version; compile it " +
+                     "again.\n");
+  }
+  uint64_t sum = reader.get<uint64_t>();
+  if (checksum(data + bytes.size() - reader.left(), reader.left()) != sum) {
+    throw ParseError(name + " is corrupted.\n");
+  }
+  std::vector<uint16_t> slots(reader.count(4, Globals::kMaxGlobals));
+  for (auto& slot : slots) {
+    int resolved = globals.resolve(heap.makeString(reader.string()));
+    if (resolved < 0) {
+      throw ParseError("Too many global variables.\n");
+    }
+    slot = static_cast<uint16_t>(resolved);
+  }
+  Function script = reader.function(slots);
+  if (!reader.done()) {
+    throw ParseError(name + " has trailing bytes.\n");
+  }
+  return heap.allocate<ClosureObject>(script);
+}
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "Chunk.h"
+#include "Globals.h"
+#include "Heap.h"
+#include "Value.h"
+
+namespace lox {
+namespace compiler {
+
+// Compiled scripts on disk, so a script can be run without scanning and
+// parsing it again. A file holds, after a header, the names of the globals
+// the code refers to by slot and then the script function, each function
+// followed by the ones in its constants:
+//
+//   "LOXC"  u32 version  u32 opcode count  u64 checksum
+//   u32 globals  { string name }
+//   function: string name  u32 arity
+//             u32 code size  { u8 code }  { i32 line }
+//             u32 upvalues  { u8 index  u8 isLocal }
+//             u32 caches
+//             u32 constants  { u8 tag  payload }
+//
+// Integers are little endian, strings a u32 size and the bytes. The checksum
+// is a SpookyHash of everything after it, so a damaged file is rejected
+// rather than run. Counts, operands and the stack depth along every path are
+// checked too, and no function may need more stack than the VM has; what the
+// code does with the values, such as a METHOD finding its class under the
+// closure, is trusted to be what the compiler emits.
+// Chunks own their code, which the VM quickens in place, so the file is read
+// whole and each code and line table copied out of it in one go.
+//
+// The code is whatever the emitting run compiled, so the optimization flags
+// of the loading run do not apply to it.
+class BytecodeFile {
+ public:
+  // Bumped whenever the layout or the meaning of the code changes.
+  static constexpr uint32_t kVersion = 2;
+
+  // Whether the file at `path` starts with the magic number.
+  static bool is(const std::string& path);
+
+  // Writes `script`, whose global operands are slots of `globals`. Returns
+  // false if the file could not be written.
+  static bool write(Function script, const Globals& globals,
+                    const std::string& path);
+  // The bytes write() puts in the file.
+  static std::string bytes(Function script, const Globals& globals);
+
+  // Rebuilds the script in the file at `path`, interning its strings in
+  // `heap` and giving its globals slots in `globals`. Collections have to
+  // be paused. Throws ParseError for a file this build cannot run or that
+  // is damaged.
+  static Closure load(const std::string& path, Heap& heap, Globals& globals);
+  // The same for a file already in memory, called `name` in errors.
+  static Closure load(std::string_view bytes, const std::string& name,
+                      Heap& heap, Globals& globals);
+};
+
+}  // namespace compiler
+}  // namespace lox
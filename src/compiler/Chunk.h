@@ -1,72 +1,111 @@
 #pragma once
 #include <algorithm>
+#include <array>
 #include <cstdint>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <string_view>
 #include <unordered_map>
 #include <vector>
 
+#include "NativeCode.h"
+#include "RegisterCode.h"
 #include "Scope.h"
 #include "Value.h"
 
 namespace lox {
 namespace compiler {
 
-const std::vector<std::string> codes{
-    "CONSTANT",      "NIL",          "TRUE",         "FALSE",
-    "RETURN",        "NEGATE",       "ADD",          "SUBSTRACT",
-    "MULTIPLY",      "DIVIDE",       "NOT",          "EQUAL",
-    "GREATER",       "LESS",         "NOT_EQUAL",    "GREATER_EQUAL",
-    "LESS_EQUAL",    "PRINT",        "POP",          "DEFINE_GLOBAL",
-    "GET_GLOBAL",    "SET_GLOBAL",   "GET_LOCAL",    "SET_LOCAL",
-    "JUMP_IF_FALSE", "JUMP",         "LOOP",         "CALL",
-    "CLOSURE",       "SET_UPVALUE",  "GET_UPVALUE",  "CLOSE_UPVALUE",
-    "CLASS",         "SET_PROPERTY", "GET_PROPERTY", "METHOD",
-    "INVOKE",        "INHERIT",      "SUPER_INVOKE"};
+// X-macro list of every opcode with the number of operand bytes that follow
+// it. Keeps OpCode, the printable names, the instruction sizes and the VM
+// dispatch table in the same order. After SUPER_INVOKE come the
+// superinstructions, which only the peephole pass emits, and then the
+// specialized forms the VM quickens generic instructions into. Those have to
+// stay last.
+#define LOX_OPCODES(X)              \
+  X(CONSTANT, 1)                    \
+  X(NIL, 0)                         \
+  X(TRUE, 0)                        \
+  X(FALSE, 0)                       \
+  X(RETURN, 0)                      \
+  X(NEGATE, 0)                      \
+  X(ADD, 0)                         \
+  X(SUBSTRACT, 0)                   \
+  X(MULTIPLY, 0)                    \
+  X(DIVIDE, 0)                      \
+  X(NOT, 0)                         \
+  X(EQUAL, 0)                       \
+  X(GREATER, 0)                     \
+  X(LESS, 0)                        \
+  X(NOT_EQUAL, 0)                   \
+  X(GREATER_EQUAL, 0)               \
+  X(LESS_EQUAL, 0)                  \
+  X(PRINT, 0)                       \
+  X(POP, 0)                         \
+  X(DEFINE_GLOBAL, 2)               \
+  X(GET_GLOBAL, 2)                  \
+  X(SET_GLOBAL, 2)                  \
+  X(GET_LOCAL, 1)                   \
+  X(SET_LOCAL, 1)                   \
+  X(JUMP_IF_FALSE, 2)               \
+  X(JUMP, 2)                        \
+  X(LOOP, 2)                        \
+  X(CALL, 1)                        \
+  X(CLOSURE, 1)                     \
+  X(SET_UPVALUE, 1)                 \
+  X(GET_UPVALUE, 1)                 \
+  X(CLOSE_UPVALUE, 0)               \
+  X(CLASS, 1)                       \
+  X(SET_PROPERTY, 3)                \
+  X(GET_PROPERTY, 3)                \
+  X(METHOD, 1)                      \
+  X(INVOKE, 2)                      \
+  X(INHERIT, 0)                     \
+  X(GET_SUPER, 1)                   \
+  X(SUPER_INVOKE, 2)                \
+  X(POPN, 1)                        \
+  X(GET_LOCAL_GET_LOCAL, 2)         \
+  X(ADD_CONST, 1)                   \
+  X(POP_JUMP_IF_FALSE, 2)           \
+  X(EQUAL_JUMP_IF_FALSE, 2)         \
+  X(NOT_EQUAL_JUMP_IF_FALSE, 2)     \
+  X(GREATER_JUMP_IF_FALSE, 2)       \
+  X(LESS_JUMP_IF_FALSE, 2)          \
+  X(GREATER_EQUAL_JUMP_IF_FALSE, 2) \
+  X(LESS_EQUAL_JUMP_IF_FALSE, 2)    \
+  X(ADD_NUM_NUM, 0)                 \
+  X(ADD_STR_STR, 0)                 \
+  X(SUBSTRACT_NUM_NUM, 0)           \
+  X(MULTIPLY_NUM_NUM, 0)            \
+  X(DIVIDE_NUM_NUM, 0)              \
+  X(GREATER_NUM, 0)                 \
+  X(LESS_NUM, 0)                    \
+  X(GREATER_EQUAL_NUM, 0)           \
+  X(LESS_EQUAL_NUM, 0)
 
 enum class OpCode {
-  CONSTANT,
-  NIL,
-  TRUE,
-  FALSE,
-  RETURN,
-  NEGATE,
-  ADD,
-  SUBSTRACT,
-  MULTIPLY,
-  DIVIDE,
-  NOT,
-  EQUAL,
-  GREATER,
-  LESS,
-  NOT_EQUAL,
-  GREATER_EQUAL,
-  LESS_EQUAL,
-  PRINT,
-  POP,
-  DEFINE_GLOBAL,
-  GET_GLOBAL,
-  SET_GLOBAL,
-  GET_LOCAL,
-  SET_LOCAL,
-  JUMP_IF_FALSE,
-  JUMP,
-  LOOP,
-  CALL,
-  CLOSURE,
-  SET_UPVALUE,
-  GET_UPVALUE,
-  CLOSE_UPVALUE,
-  CLASS,
-  SET_PROPERTY,
-  GET_PROPERTY,
-  METHOD,
-  INVOKE,
-  INHERIT,
-  GET_SUPER,
-  SUPER_INVOKE,
+#define LOX_OPCODE_ENUM(name, operands) name,
+  LOX_OPCODES(LOX_OPCODE_ENUM)
+#undef LOX_OPCODE_ENUM
+};
+
+const std::vector<std::string> codes{
+#define LOX_OPCODE_NAME(name, operands) #name,
+    LOX_OPCODES(LOX_OPCODE_NAME)
+#undef LOX_OPCODE_NAME
 };
 
+// Size in bytes of an instruction, opcode included.
+inline size_t instructionSize(OpCode code) {
+  static constexpr uint8_t kSizes[] = {
+#define LOX_OPCODE_SIZE(name, operands) 1 + operands,
+      LOX_OPCODES(LOX_OPCODE_SIZE)
+#undef LOX_OPCODE_SIZE
+  };
+  return kSizes[static_cast<size_t>(code)];
+}
+
 class Upvalue {
  public:
   uint8_t index;
@@ -75,6 +114,55 @@ class Upvalue {
       : index(index), isLocal(isLocal) {}
 };
 
+// Inline cache for one GET_PROPERTY or SET_PROPERTY instruction. Entries
+// are keyed on the receiver's shape, which also pins down its class, and
+// remember where the property was found: a field slot, a method (checked
+// against the class version), or for stores that add a field, the shape the
+// instance moves to.
+struct PropertyCache {
+  static constexpr size_t kEntries = 4;
+
+  struct Entry {
+    // Keeps `shape` alive.
+    Class klass{nullptr};
+    const Shape* shape{nullptr};
+    int slot{-1};
+    Shape* next{nullptr};
+    Closure method{nullptr};
+    uint32_t version{0};
+  };
+
+  Entry* find(const Shape* shape) {
+    for (size_t i = 0; i < size; i++) {
+      if (entries[i].shape == shape) {
+        return &entries[i];
+      }
+    }
+    return nullptr;
+  }
+
+  // Returns a cleared entry, evicting the oldest one once the cache is full.
+  Entry& add() {
+    Entry* entry;
+    if (size < kEntries) {
+      entry = &entries[size++];
+    } else {
+      entry = &entries[evict];
+      evict = (evict + 1) % kEntries;
+    }
+    *entry = Entry();
+    return *entry;
+  }
+
+  void remove(Entry* entry) {
+    *entry = entries[--size];
+  }
+
+  std::array<Entry, kEntries> entries;
+  uint8_t size{0};
+  uint8_t evict{0};
+};
+
 struct Chunk {
   enum class Type {
     NONE,
@@ -89,6 +177,30 @@ struct Chunk {
   Type type{Type::NONE};
   Type enclosingType{Type::NONE};
   bool hasSuperclass{false};
+  std::vector<PropertyCache> caches;
+  // Most stack slots a frame of the chunk uses at once, from the callee's
+  // slot up. Calls check there is room for them; see Bytecode::maxDepth().
+  size_t maxDepth{0};
+  // Filled in only when the register backend is selected.
+  RegisterCode registers;
+  // Filled in by the JIT once the function gets hot.
+  NativeCode native;
+  // The C++ function a translated program made of the chunk, given the
+  // runtime and the frame's slots; see CppTranslator.
+  using Translated = void (*)(void* runtime, Value* slots);
+  Translated translated{nullptr};
+  // Where each constant is, by its bits, once there are too many to search:
+  // a number's bit pattern, or the pointer to an interned string or a
+  // function. Only kept while the chunk is compiled; see dropConstantIndex().
+  std::unique_ptr<std::unordered_map<uint64_t, uint8_t>> constantIndex;
+
+  // The constant pool is addressed by one byte.
+  static constexpr size_t kMaxConstants =
+      std::numeric_limits<uint8_t>::max() + 1;
+  // Pools up to this size are searched rather than indexed.
+  static constexpr size_t kSearchedConstants = 16;
+  // Values the VM's stack holds, all frames together.
+  static constexpr size_t kMaxStackSize = 64 * 1024;
 
   void addCode(const OpCode& c, int line) {
     code.push_back(static_cast<uint8_t>(c));
@@ -100,15 +212,50 @@ struct Chunk {
     lines.push_back(0);
   }
 
-  uint8_t addConstant(const Value& v) {
-    auto it = std::find(constants.cbegin(), constants.cend(), v);
-    if (it == constants.end()) {
-      constants.push_back(std::move(v));
-      return (uint8_t)(constants.size() - 1);
+  // Returns the index of a new property cache, or -1 when there are too many.
+  int addCache() {
+    if (caches.size() > std::numeric_limits<uint16_t>::max()) {
+      return -1;
+    }
+    caches.emplace_back();
+    return static_cast<int>(caches.size() - 1);
+  }
+
+  // Returns the index of the constant matching `v` bit for bit, so that -0
+  // does not turn into 0, adding it if needed. Returns -1 when the pool is
+  // full.
+  int addConstant(const Value& v) {
+    if (constants.size() <= kSearchedConstants) {
+      for (size_t i = 0; i < constants.size(); i++) {
+        if (constants[i].bits() == v.bits()) {
+          return static_cast<int>(i);
+        }
+      }
     } else {
-      return (uint8_t)(std::distance(constants.cbegin(), it));
+      if (!constantIndex) {
+        constantIndex =
+            std::make_unique<std::unordered_map<uint64_t, uint8_t>>();
+        constantIndex->reserve(kMaxConstants);
+        // Backwards, so duplicates find the first of them.
+        for (size_t i = constants.size(); i-- > 0;) {
+          (*constantIndex)[constants[i].bits()] = static_cast<uint8_t>(i);
+        }
+      }
+      auto found = constantIndex->find(v.bits());
+      if (found != constantIndex->end()) {
+        return found->second;
+      }
+    }
+    if (constants.size() == kMaxConstants) {
+      return -1;
+    }
+    if (constantIndex) {
+      constantIndex->emplace(v.bits(), static_cast<uint8_t>(constants.size()));
     }
+    constants.push_back(v);
+    return static_cast<int>(constants.size() - 1);
   }
+  void dropConstantIndex() { constantIndex.reset(); }
 };
 
 }  // namespace compiler
@@ -0,0 +1,144 @@
+#include "CompileCache.h"
+
+#include <folly/hash/SpookyHashV2.h>
+#include <gflags/gflags.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <exception>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "BytecodeFile.h"
+#include "Compiler.h"
+
+DECLARE_string(backend);
+DECLARE_bool(fold);
+DECLARE_bool(peephole);
+DECLARE_int32(O);
+DECLARE_string(scanner);
+
+namespace fs = std::filesystem;
+
+namespace lox {
+namespace compiler {
+
+namespace {
+
+constexpr std::string_view kExtension{".loxc"};
+
+}  // namespace
+
+CompileCache::CompileCache(std::string directory, uint64_t capacity,
+                           bool report)
+    : directory_(std::move(directory)), capacity_(capacity), report_(report) {
+  std::error_code error;
+  fs::create_directories(directory_, error);
+}
+
+Closure CompileCache::load(std::string_view source, Heap& heap,
+                           Globals& globals) {
+  std::string entry = path(source);
+  Closure closure{nullptr};
+  std::error_code error;
+  if (fs::exists(entry, error)) {
+    try {
+      closure = BytecodeFile::load(entry, heap, globals);
+      fs::last_write_time(entry, fs::file_time_type::clock::now(), error);
+    } catch (std::exception&) {
+      // Whatever is wrong with the entry, compiling again replaces it.
+      fs::remove(entry, error);
+    }
+  }
+  if (closure != nullptr) {
+    hits_++;
+  } else {
+    misses_++;
+  }
+  if (report_) {
+    std::cout << "== compile cache " << (closure ? "hit" : "miss") << " "
+              << entry << " (" << hits_ << " hits, " << misses_
+              << " misses) ==\n";
+  }
+  return closure;
+}
+
+void CompileCache::store(std::string_view source, Function script,
+                         const Globals& globals) {
+  std::string entry = path(source);
+  std::string temporary = entry + ".tmp" + std::to_string(::getpid());
+  std::error_code error;
+  if (!BytecodeFile::write(script, globals, temporary)) {
+    fs::remove(temporary, error);
+    return;
+  }
+  fs::rename(temporary, entry, error);
+  if (error) {
+    fs::remove(temporary, error);
+    return;
+  }
+  evict();
+}
+
+std::string CompileCache::path(std::string_view source) const {
+  // Every flag Compiler reads, as each can change the code it emits.
+  std::string key = "cloxpp " + std::to_string(Compiler::kVersion) + " " +
+                    std::to_string(BytecodeFile::kVersion) + " " +
+                    FLAGS_scanner + " " + FLAGS_backend + " " +
+                    std::to_string(FLAGS_O) + " " +
+                    std::to_string(FLAGS_fold) + " " +
+                    std::to_string(FLAGS_peephole) + "\n";
+  uint64_t seed1 = 0, seed2 = 0;
+  folly::hash::SpookyHashV2::Hash128(key.data(), key.size(), &seed1, &seed2);
+  folly::hash::SpookyHashV2::Hash128(source.data(), source.size(), &seed1,
+                                     &seed2);
+  char name[33];
+  std::snprintf(name, sizeof(name), "%016llx%016llx",
+                static_cast<unsigned long long>(seed1),
+                static_cast<unsigned long long>(seed2));
+  return (fs::path(directory_) / (name + std::string(kExtension))).string();
+}
+
+void CompileCache::evict() {
+  struct Entry {
+    fs::path path;
+    fs::file_time_type used;
+    uint64_t size;
+  };
+  std::vector<Entry> entries;
+  uint64_t total = 0;
+  std::error_code error;
+  for (fs::directory_iterator it(directory_, error), end; !error && it != end;
+       it.increment(error)) {
+    if (it->path().extension() != kExtension) {
+      continue;
+    }
+    std::error_code stat;
+    Entry entry{it->path(), it->last_write_time(stat), it->file_size(stat)};
+    if (!stat) {
+      total += entry.size;
+      entries.push_back(std::move(entry));
+    }
+  }
+  if (total <= capacity_) {
+    return;
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry& a, const Entry& b) { return a.used < b.used; });
+  for (const auto& entry : entries) {
+    if (total <= capacity_) {
+      break;
+    }
+    if (fs::remove(entry.path, error)) {
+      total -= entry.size;
+    }
+  }
+}
+
+}  // namespace compiler
+}  // namespace lox
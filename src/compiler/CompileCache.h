@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "Globals.h"
+#include "Heap.h"
+#include "Value.h"
+
+namespace lox {
+namespace compiler {
+
+// Directory of compiled scripts, so a script that has not changed is loaded
+// rather than compiled again. Entries are bytecode files named after a
+// 128-bit hash of the source, the compiler version and the flags that
+// change what it emits.
+//
+// An entry is written to a temporary file and renamed into place, so
+// concurrent interpreters never see half of one. Hits refresh the entry's
+// modification time and the least recently used entries are removed once
+// the directory holds more than `capacity` bytes. Failing to read or write
+// the cache only costs the compilation.
+class CompileCache {
+ public:
+  // With `report`, every lookup is logged with the running counts.
+  CompileCache(std::string directory, uint64_t capacity, bool report);
+
+  // Returns the cached script for `source`, or nullptr. An entry that does
+  // not load is removed. Collections have to be paused.
+  Closure load(std::string_view source, Heap& heap, Globals& globals);
+  // Caches `script`, just compiled from `source`.
+  void store(std::string_view source, Function script,
+             const Globals& globals);
+
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+ private:
+  std::string path(std::string_view source) const;
+  void evict();
+
+  const std::string directory_;
+  const uint64_t capacity_;
+  const bool report_;
+  uint64_t hits_{0};
+  uint64_t misses_{0};
+};
+
+}  // namespace compiler
+}  // namespace lox
@@ -1,25 +1,108 @@
 #pragma once
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
 #include <vector>
 
+#include "Bytecode.h"
+#include "CompileCache.h"
+#include "ConstantFolder.h"
+#include "Globals.h"
+#include "Heap.h"
+#include "ParseError.h"
 #include "Parser.h"
+#include "Peephole.h"
+#include "RegisterCompiler.h"
+#include "Source.h"
+#include "SsaOptimizer.h"
 #include "Value.h"
 
 DECLARE_string(scanner);
+DECLARE_string(backend);
+DECLARE_bool(fold);
+DECLARE_bool(peephole);
+DECLARE_int32(O);
 
 namespace lox {
 namespace compiler {
 
 class Compiler {
  public:
+  // Bumped whenever the same source and flags would compile differently,
+  // which invalidates compile caches.
+  static constexpr uint32_t kVersion = 1;
+
   Compiler() {}
+  explicit Compiler(std::unique_ptr<CompileCache> cache)
+      : cache_(std::move(cache)) {}
 
-  Closure compile(const std::string& code) {
-    auto parser = Parser(code, FLAGS_scanner);
-    return parser.run();
+  Closure compile(const std::string& code, Heap& heap, Globals& globals) {
+    Source source = Source::buffer(code);
+    return compile(source, heap, globals);
+  }
+  Closure compile(Source& source, Heap& heap, Globals& globals) {
+    // Bytecode files hold stack code only, and a stream is not hashed before
+    // it is read.
+    bool cached = cache_ && FLAGS_backend != "register" && !source.streamed();
+    if (cached) {
+      if (Closure closure = cache_->load(source.text(), heap, globals)) {
+        return closure;
+      }
+    }
+    auto parser = Parser(source, FLAGS_scanner, heap, globals);
+    auto closure = parser.run();
+    if (closure) {
+      try {
+        optimize(closure->function, heap);
+      } catch (ParseError& error) {
+        std::cout << error.what();
+        return nullptr;
+      }
+      if (cached) {
+        cache_->store(source.text(), closure->function, globals);
+      }
+    }
+    return closure;
   }
 
  private:
+  // Runs the enabled passes over `function` and every function nested in it,
+  // then records how deep their stacks get. -O0 runs none, -O1 the bytecode
+  // passes and -O2 adds the SSA ones.
+  static void optimize(Function function, Heap& heap) {
+    if (FLAGS_O >= 1 && FLAGS_fold) {
+      ConstantFolder::optimize(function->chunk(), heap);
+    }
+    if (FLAGS_O >= 2) {
+      SsaOptimizer::optimize(function->chunk(), function->arity());
+    }
+    // The register form is translated from plain stack code and replaces
+    // the superinstructions.
+    if (FLAGS_backend == "register") {
+      RegisterCompiler::compile(function->chunk(), function->arity());
+    } else if (FLAGS_O >= 1 && FLAGS_peephole) {
+      Peephole::optimize(function->chunk());
+    }
+    Chunk& chunk = function->chunk();
+    chunk.maxDepth = std::max(Bytecode::maxDepth(chunk, function->arity()),
+                              chunk.registers.frameSize);
+    // Such a function could never be called, and its bytecode file would
+    // not load.
+    if (chunk.maxDepth > Chunk::kMaxStackSize) {
+      throw ParseError("ParseError [line " + std::to_string(chunk.lines[0]) +
+                       "]: Too much stack needed in one function.\n");
+    }
+    for (const auto& constant : function->chunk().constants) {
+      if (constant.isFunction()) {
+        optimize(constant.asFunction(), heap);
+      }
+    }
+  }
+
   bool hadError{false};
+  std::unique_ptr<CompileCache> cache_;
 };
 
 }  // namespace compiler
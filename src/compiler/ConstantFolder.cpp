@@ -0,0 +1,246 @@
+#include "ConstantFolder.h"
+
+#include <limits>
+
+namespace lox {
+namespace compiler {
+
+namespace {
+
+bool isFalsy(const Value& value) { return visit(FalsinessVisitor(), value); }
+
+}  // namespace
+
+void ConstantFolder::optimize(Chunk& chunk, Heap& heap) {
+  ConstantFolder folder(chunk, heap);
+  auto instructions = Bytecode::decode(chunk);
+  bool changed = false;
+  // Pruning can bring literals next to their users again, and folding can
+  // make more code unreachable.
+  while (folder.fold(instructions) | folder.prune(instructions)) {
+    changed = true;
+  }
+  if (changed) {
+    Bytecode::encode(instructions, chunk);
+  }
+  chunk.dropConstantIndex();
+}
+
+bool ConstantFolder::fold(std::vector<Instruction>& instructions) {
+  // A single pass that keeps the rewritten code in `out` and folds at its
+  // end after each instruction, like a shift-reduce parser. Jumps keep
+  // pointing at original indices until the end; `remap` records where each
+  // one landed in `out`. An entry of `out` that was dropped is taken over by
+  // the next instruction pushed there, which is exactly where the jump should
+  // now land.
+  std::vector<bool> wasTarget = Bytecode::targets(instructions);
+  std::vector<Instruction> out;
+  std::vector<bool> isTarget;
+  std::vector<int> remap(instructions.size() + 1);
+  bool changed = false;
+  bool pendingTarget = false;
+  for (size_t i = 0; i < instructions.size(); i++) {
+    remap[i] = static_cast<int>(out.size());
+    out.push_back(std::move(instructions[i]));
+    isTarget.push_back(wasTarget[i] || pendingTarget);
+    changed |= reduce(out, isTarget);
+    // Only the head of what was folded away can have been a target, and it
+    // sat right where the next instruction goes.
+    pendingTarget = isTarget.size() > out.size() && isTarget[out.size()];
+    isTarget.resize(out.size());
+  }
+  remap[instructions.size()] = static_cast<int>(out.size());
+
+  for (auto& instruction : out) {
+    if (instruction.target != -1) {
+      instruction.target = remap[instruction.target];
+    }
+  }
+  instructions = std::move(out);
+  return changed;
+}
+
+bool ConstantFolder::reduce(std::vector<Instruction>& out,
+                            std::vector<bool>& isTarget) {
+  bool changed = false;
+  for (;;) {
+    size_t n = out.size();
+    if (n < 2 || isTarget[n - 1]) {
+      return changed;
+    }
+    const Instruction& last = out[n - 1];
+    auto right = literal(out[n - 2]);
+
+    if (right && last.code == OpCode::POP) {
+      out.resize(n - 2);
+      return true;
+    }
+    if (right && last.code == OpCode::JUMP_IF_FALSE) {
+      if (isFalsy(*right)) {
+        out[n - 1].code = OpCode::JUMP;
+      } else {
+        out.pop_back();
+      }
+      return true;
+    }
+    if (right && last.code == OpCode::NOT) {
+      auto folded = load(Value(isFalsy(*right)), last.line);
+      out.pop_back();
+      out.back() = *folded;
+      changed = true;
+      continue;
+    }
+    if (right && last.code == OpCode::NEGATE && right->isNumber()) {
+      auto folded = load(Value(-right->asNumber()), last.line);
+      if (!folded) {
+        return changed;
+      }
+      out.pop_back();
+      out.back() = *folded;
+      changed = true;
+      continue;
+    }
+
+    if (n < 3 || isTarget[n - 2]) {
+      return changed;
+    }
+    auto left = literal(out[n - 3]);
+    if (!left || !right) {
+      return changed;
+    }
+    auto result = evaluate(last.code, *left, *right);
+    if (!result) {
+      return changed;
+    }
+    auto folded = load(*result, last.line);
+    if (!folded) {
+      return changed;
+    }
+    out.resize(n - 2);
+    out.back() = *folded;
+    changed = true;
+  }
+}
+
+bool ConstantFolder::prune(std::vector<Instruction>& instructions) {
+  std::vector<bool> reached(instructions.size(), false);
+  std::vector<size_t> work{0};
+  while (!work.empty()) {
+    size_t i = work.back();
+    work.pop_back();
+    if (i >= instructions.size() || reached[i]) {
+      continue;
+    }
+    reached[i] = true;
+    const auto& instruction = instructions[i];
+    if (instruction.target != -1) {
+      work.push_back(instruction.target);
+    }
+    if (instruction.code != OpCode::JUMP && instruction.code != OpCode::LOOP &&
+        instruction.code != OpCode::RETURN) {
+      work.push_back(i + 1);
+    }
+  }
+
+  std::vector<bool> removed(instructions.size(), false);
+  bool changed = false;
+  for (size_t i = 0; i < instructions.size(); i++) {
+    removed[i] = !reached[i];
+    changed |= removed[i];
+  }
+  // Jumps to the next instruction that is kept.
+  for (size_t i = 0; i < instructions.size(); i++) {
+    if (removed[i] || instructions[i].code != OpCode::JUMP) {
+      continue;
+    }
+    size_t next = i + 1;
+    while (next < instructions.size() && removed[next]) {
+      next++;
+    }
+    if (static_cast<size_t>(instructions[i].target) == next) {
+      removed[i] = true;
+      changed = true;
+    }
+  }
+  if (changed) {
+    Bytecode::remove(instructions, removed);
+  }
+  return changed;
+}
+
+folly::Optional<Value> ConstantFolder::literal(
+    const Instruction& instruction) const {
+  switch (instruction.code) {
+    case OpCode::CONSTANT:
+      return chunk_.constants[instruction.operands[0]];
+    case OpCode::TRUE:
+      return Value(true);
+    case OpCode::FALSE:
+      return Value(false);
+    case OpCode::NIL:
+      return Value();
+    default:
+      return folly::Optional<Value>();
+  }
+}
+
+folly::Optional<Value> ConstantFolder::evaluate(OpCode code, const Value& a,
+                                                const Value& b) {
+  if (code == OpCode::EQUAL) {
+    return Value(a == b);
+  }
+  if (code == OpCode::NOT_EQUAL) {
+    return Value(!(a == b));
+  }
+  if (code == OpCode::ADD && !(a.isNumber() && b.isNumber())) {
+    if (!a.isString() && !b.isString()) {
+      return folly::Optional<Value>();
+    }
+    return Value(heap_.makeString(visit(StringVisitor(), a) +
+                                  visit(StringVisitor(), b)));
+  }
+  if (!a.isNumber() || !b.isNumber()) {
+    return folly::Optional<Value>();
+  }
+  double x = a.asNumber();
+  double y = b.asNumber();
+  switch (code) {
+    case OpCode::ADD:
+      return Value(x + y);
+    case OpCode::SUBSTRACT:
+      return Value(x - y);
+    case OpCode::MULTIPLY:
+      return Value(x * y);
+    case OpCode::DIVIDE:
+      return Value(x / y);
+    case OpCode::GREATER:
+      return Value(x > y);
+    case OpCode::LESS:
+      return Value(x < y);
+    case OpCode::GREATER_EQUAL:
+      return Value(x >= y);
+    case OpCode::LESS_EQUAL:
+      return Value(x <= y);
+    default:
+      return folly::Optional<Value>();
+  }
+}
+
+folly::Optional<Bytecode::Instruction> ConstantFolder::load(const Value& value,
+                                                           int line) {
+  if (value.isNil()) {
+    return Instruction{OpCode::NIL, {}, line};
+  }
+  if (value.isBool()) {
+    return Instruction{value.asBool() ? OpCode::TRUE : OpCode::FALSE, {},
+                       line};
+  }
+  int index = chunk_.addConstant(value);
+  if (index < 0) {
+    return folly::Optional<Instruction>();
+  }
+  return Instruction{OpCode::CONSTANT, {static_cast<uint8_t>(index)}, line};
+}
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <folly/Optional.h>
+
+#include <vector>
+
+#include "Bytecode.h"
+#include "Chunk.h"
+#include "Heap.h"
+#include "Value.h"
+
+namespace lox {
+namespace compiler {
+
+// Compile-time evaluation over a chunk's bytecode:
+//
+//  - operators whose operands are all literals (CONSTANT, TRUE, FALSE, NIL)
+//    are replaced by their result, following the VM's rules, so
+//    `1 + 2 - 3 * 4` becomes a single CONSTANT;
+//  - JUMP_IF_FALSE on a literal becomes a JUMP or disappears, and a literal
+//    that is immediately popped is dropped;
+//  - code no path reaches, e.g. after a return or in `while (false)`, is
+//    removed, as are jumps to the next instruction.
+//
+// Operands that would fail at runtime are left alone so the error still
+// happens there.
+class ConstantFolder {
+ public:
+  static void optimize(Chunk& chunk, Heap& heap);
+
+ private:
+  using Instruction = Bytecode::Instruction;
+
+  ConstantFolder(Chunk& chunk, Heap& heap) : chunk_(chunk), heap_(heap) {}
+
+  // Both return whether they changed anything.
+  bool fold(std::vector<Instruction>& instructions);
+  bool prune(std::vector<Instruction>& instructions);
+
+  // Folds the end of `out` as far as it goes.
+  bool reduce(std::vector<Instruction>& out, std::vector<bool>& isTarget);
+
+  folly::Optional<Value> literal(const Instruction& instruction) const;
+  folly::Optional<Value> evaluate(OpCode code, const Value& a,
+                                  const Value& b);
+  folly::Optional<Instruction> load(const Value& value, int line);
+
+  Chunk& chunk_;
+  Heap& heap_;
+};
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,529 @@
+#include "CppTranslator.h"
+
+#include <cmath>
+#include <iomanip>
+#include <stdexcept>
+
+namespace lox {
+namespace compiler {
+
+namespace {
+
+// A C++ string literal holding `text`.
+std::string quote(std::string_view text) {
+  std::ostringstream out;
+  out << '"';
+  for (char c : text) {
+    auto byte = static_cast<unsigned char>(c);
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c == '\n') {
+      out << "\\n";
+    } else if (byte < 0x20 || byte >= 0x7f || c == '?') {
+      // Three octal digits always end the escape; '?' would start trigraphs.
+      out << '\\' << std::oct << std::setw(3) << std::setfill('0')
+          << static_cast<int>(byte) << std::dec;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+  return out.str();
+}
+
+// A C++ expression for the double `value`.
+std::string number(double value) {
+  if (std::isnan(value)) {
+    return "std::nan(\"\")";
+  }
+  if (std::isinf(value)) {
+    return value < 0 ? "-HUGE_VAL" : "HUGE_VAL";
+  }
+  std::ostringstream out;
+  out << std::setprecision(17) << value;
+  std::string literal = out.str();
+  if (literal.find_first_of(".e") == std::string::npos) {
+    literal += ".0";
+  }
+  return literal;
+}
+
+// The C++ operator of a number comparison or arithmetic instruction.
+const char* numberOperator(OpCode code) {
+  switch (code) {
+    case OpCode::SUBSTRACT:
+      return "-";
+    case OpCode::MULTIPLY:
+      return "*";
+    case OpCode::DIVIDE:
+      return "/";
+    case OpCode::GREATER:
+    case OpCode::GREATER_JUMP_IF_FALSE:
+      return ">";
+    case OpCode::LESS:
+    case OpCode::LESS_JUMP_IF_FALSE:
+      return "<";
+    case OpCode::GREATER_EQUAL:
+    case OpCode::GREATER_EQUAL_JUMP_IF_FALSE:
+      return ">=";
+    case OpCode::LESS_EQUAL:
+    case OpCode::LESS_EQUAL_JUMP_IF_FALSE:
+      return "<=";
+    default:
+      throw std::logic_error("not a number operator: " +
+                             codes[static_cast<size_t>(code)]);
+  }
+}
+
+std::string label(int target) { return "L" + std::to_string(target); }
+
+}  // namespace
+
+std::string CppTranslator::translate(Function script, const std::string& path,
+                                     std::string_view bytecode) {
+  std::ostringstream out;
+  out << "// Generated by lox2cpp from " << path << "; do not edit.\n"
+      << "#include <cmath>\n"
+      << "#include <iostream>\n\n"
+      << "#include \"runtime/AotRuntime.h\"\n\n"
+      << "namespace {\n\n"
+      << "using lox::lang::AotRuntime;\n"
+      << "using lox::lang::CallFrame;\n\n"
+      << "const unsigned char kBytecode[] = {";
+  // Sixteen bytes a line.
+  for (size_t i = 0; i < bytecode.size(); i++) {
+    out << (i % 16 == 0 ? "\n   " : "") << " 0x" << std::hex
+        << std::setw(2) << std::setfill('0')
+        << static_cast<int>(static_cast<unsigned char>(bytecode[i]))
+        << std::dec << ",";
+  }
+  out << "\n};\n";
+
+  auto all = functions(script);
+  std::vector<std::string> names;
+  std::vector<int> depths;
+  for (size_t i = 0; i < all.size(); i++) {
+    names.push_back("lox_" + all[i]->name() + "_" + std::to_string(i));
+    CppTranslator translator(all[i], names.back());
+    translator.analyze();
+    translator.generate(out);
+    depths.push_back(translator.maxDepth_);
+  }
+
+  out << "\nconst lox::lang::AotProgram::Function kFunctions[] = {\n";
+  for (size_t i = 0; i < all.size(); i++) {
+    out << "    {" << quote(all[i]->name()) << ", 0x" << std::hex
+        << fingerprint(all[i]->chunk()) << std::dec << "ULL, " << depths[i]
+        << ", " << names[i] << "},\n";
+  }
+  out << "};\n\n"
+      << "}  // namespace\n\n"
+      << "const lox::lang::AotProgram lox::lang::kProgram{\n"
+      << "    " << quote(path) << ", kBytecode, sizeof(kBytecode), kFunctions, "
+      << all.size() << "};\n";
+  return out.str();
+}
+
+CppTranslator::CppTranslator(Function function, std::string name)
+    : function_(function), chunk_(function->chunk()), name_(std::move(name)) {}
+
+void CppTranslator::analyze() {
+  instructions_ = Bytecode::decode(chunk_);
+  size_t count = instructions_.size();
+  depths_.assign(count + 1, -1);
+  targets_.assign(count + 1, false);
+  captured_.assign(1, true);
+  // The callee and its arguments.
+  depths_[0] = function_->arity() + 1;
+
+  // Code only reached by jumping back, like the increment of a for loop,
+  // takes another round.
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t i = 0; i < count; i++) {
+      int depth = depths_[i];
+      if (depth == -1) {
+        continue;
+      }
+      const auto& instruction = instructions_[i];
+      const auto& operands = instruction.operands;
+      bool fallsThrough = true;
+      auto effect = Bytecode::stackEffect(instruction.code, operands.data());
+      int after = depth - effect.pops + effect.pushes;
+      switch (instruction.code) {
+        case OpCode::CLOSURE:
+          for (const auto& upvalue :
+               chunk_.constants[operands[0]].asFunction()->chunk().upvalues) {
+            if (upvalue.isLocal) {
+              captured_.resize(std::max<size_t>(captured_.size(),
+                                                upvalue.index + 1u));
+              captured_[upvalue.index] = true;
+              closes_ = true;
+            }
+          }
+          break;
+        case OpCode::CLOSE_UPVALUE:
+          captured_.resize(std::max<size_t>(captured_.size(), depth));
+          captured_[depth - 1] = true;
+          break;
+        case OpCode::RETURN:
+        case OpCode::JUMP:
+        case OpCode::LOOP:
+          fallsThrough = false;
+          break;
+        default:
+          break;
+      }
+      maxDepth_ = std::max({maxDepth_, depth, after});
+      if (Bytecode::isJump(instruction.code)) {
+        targets_[instruction.target] = true;
+        if (depths_[instruction.target] == -1) {
+          depths_[instruction.target] = after;
+          changed = true;
+        }
+      }
+      if (fallsThrough && depths_[i + 1] == -1) {
+        depths_[i + 1] = after;
+      }
+    }
+  }
+  captured_.resize(std::max<size_t>(captured_.size(), maxDepth_), false);
+}
+
+void CppTranslator::generate(std::ostream& out) {
+  for (size_t i = 0; i < instructions_.size(); i++) {
+    if (depths_[i] == -1) {
+      continue;
+    }
+    if (targets_[i]) {
+      body_ << label(i) << ":\n";
+    }
+    instruction(i);
+  }
+  size_t end = instructions_.size();
+  if (targets_[end] && depths_[end] != -1) {
+    body_ << label(end) << ":;\n";
+  }
+
+  out << "\n// " << function_->name() << "\n"
+      << "void " << name_ << "(void* runtime, Value* s) {\n"
+      << "  auto& rt = *static_cast<AotRuntime*>(runtime);\n";
+  if (usesFrame_ || usesConstants_ || usesCaches_) {
+    out << "  CallFrame& frame = rt.frame();\n";
+  }
+  if (usesConstants_) {
+    out << "  const Value* k = "
+           "frame.closure->function->chunk().constants.data();\n";
+  }
+  if (usesCaches_) {
+    out << "  PropertyCache* caches = "
+           "frame.closure->function->chunk().caches.data();\n";
+  }
+  if (usesGlobals_) {
+    out << "  Value* globals = rt.globals();\n";
+  }
+  for (int position = 1; position < maxDepth_; position++) {
+    if (captured_[position]) {
+      continue;
+    }
+    out << "  Value v" << position;
+    if (position <= function_->arity()) {
+      out << " = s[" << position << "]";
+    }
+    out << ";\n";
+  }
+  out << body_.str() << "}\n";
+}
+
+void CppTranslator::instruction(size_t i) {
+  const auto& instruction = instructions_[i];
+  const auto& operands = instruction.operands;
+  const int depth = depths_[i];
+  const std::string top = depth > 0 ? slot(depth - 1) : "";
+  const std::string second = depth > 1 ? slot(depth - 2) : "";
+  auto word = [&](int at) {
+    return static_cast<uint16_t>(operands[at] << 8 | operands[at + 1]);
+  };
+  auto global = [&]() {
+    usesGlobals_ = true;
+    return "globals[" + std::to_string(word(0)) + "]";
+  };
+  auto cache = [&]() {
+    usesCaches_ = true;
+    return "caches[" + std::to_string(word(1)) + "]";
+  };
+
+  switch (instruction.code) {
+    case OpCode::CONSTANT:
+      line(slot(depth) + " = " + constant(operands[0]) + ";");
+      break;
+    case OpCode::NIL:
+      line(slot(depth) + " = Value();");
+      break;
+    case OpCode::TRUE:
+      line(slot(depth) + " = Value(true);");
+      break;
+    case OpCode::FALSE:
+      line(slot(depth) + " = Value(false);");
+      break;
+    case OpCode::POP:
+    case OpCode::POPN:
+      break;
+    case OpCode::GET_LOCAL:
+      line(slot(depth) + " = " + slot(operands[0]) + ";");
+      break;
+    case OpCode::GET_LOCAL_GET_LOCAL:
+      line(slot(depth) + " = " + slot(operands[0]) + ";");
+      line(slot(depth + 1) + " = " + slot(operands[1]) + ";");
+      break;
+    case OpCode::SET_LOCAL:
+      if (slot(operands[0]) != top) {
+        line(slot(operands[0]) + " = " + top + ";");
+      }
+      break;
+    case OpCode::GET_GLOBAL:
+      line("if (" + global() + ".isUndefined()) {");
+      line("  rt.runtimeError(\"Undefined variable\");");
+      line("}");
+      line(slot(depth) + " = " + global() + ";");
+      break;
+    case OpCode::SET_GLOBAL:
+      line("if (" + global() + ".isUndefined()) {");
+      line("  rt.runtimeError(\"Undefined variable\");");
+      line("}");
+      line(global() + " = " + top + ";");
+      break;
+    case OpCode::DEFINE_GLOBAL:
+      line("if (!" + global() + ".isUndefined()) {");
+      line("  rt.runtimeError(\"Variable already defined\");");
+      line("}");
+      line(global() + " = " + top + ";");
+      break;
+    case OpCode::GET_UPVALUE:
+      usesFrame_ = true;
+      line(slot(depth) + " = *frame.closure->upvalues[" +
+           std::to_string(operands[0]) + "]->location;");
+      break;
+    case OpCode::SET_UPVALUE:
+      usesFrame_ = true;
+      line("*frame.closure->upvalues[" + std::to_string(operands[0]) +
+           "]->location = " + top + ";");
+      break;
+    case OpCode::CLOSE_UPVALUE:
+      line("rt.closeUpvalue(&" + top + ");");
+      break;
+    case OpCode::CLOSURE:
+      usesFrame_ = true;
+      sync(depth);
+      line("rt.pushClosure(" + constant(operands[0]) +
+           ".asFunction(), frame);");
+      reload(depth, depth + 1);
+      break;
+    case OpCode::CLASS:
+      sync(depth);
+      line("rt.pushClass(" + string(operands[0]) + ");");
+      reload(depth, depth + 1);
+      break;
+    case OpCode::METHOD:
+      sync(depth);
+      line("rt.defineMethod(" + string(operands[0]) + ");");
+      break;
+    case OpCode::INHERIT:
+      sync(depth);
+      line("rt.inherit();");
+      break;
+    case OpCode::GET_SUPER:
+      sync(depth);
+      line("rt.bindMethod(rt.popSuperclass(), " + string(operands[0]) + ");");
+      reload(depth - 2, depth - 1);
+      break;
+    case OpCode::GET_PROPERTY:
+      sync(depth);
+      line("rt.loadProperty(" + string(operands[0]) + ", " + cache() + ");");
+      reload(depth - 1, depth);
+      break;
+    case OpCode::SET_PROPERTY:
+      sync(depth);
+      line("rt.storeProperty(" + string(operands[0]) + ", " + cache() + ");");
+      reload(depth - 2, depth - 1);
+      break;
+    case OpCode::CALL: {
+      int callee = depth - 1 - operands[0];
+      sync(depth);
+      line("rt.callValue(s[" + std::to_string(callee) + "], " +
+           std::to_string(operands[0]) + ");");
+      reload(callee, callee + 1);
+      break;
+    }
+    case OpCode::INVOKE: {
+      int receiver = depth - 1 - operands[1];
+      sync(depth);
+      line("rt.invoke(" + string(operands[0]) + ", " +
+           std::to_string(operands[1]) + ");");
+      reload(receiver, receiver + 1);
+      break;
+    }
+    case OpCode::SUPER_INVOKE: {
+      int receiver = depth - 2 - operands[1];
+      sync(depth);
+      line("rt.invokeFromClass(rt.popSuperclass(), " + string(operands[0]) +
+           ", " + std::to_string(operands[1]) + ");");
+      reload(receiver, receiver + 1);
+      break;
+    }
+    case OpCode::ADD:
+      line("if (" + second + ".isNumber() && " + top + ".isNumber()) {");
+      line("  " + second + " = Value(" + second + ".asNumber() + " + top +
+           ".asNumber());");
+      line("} else {");
+      nesting_++;
+      sync(depth);
+      line(second + " = rt.concatenate(" + second + ", " + top + ");");
+      nesting_--;
+      line("}");
+      break;
+    case OpCode::ADD_CONST: {
+      const Value& value = chunk_.constants[operands[0]];
+      if (value.isNumber()) {
+        line("if (" + top + ".isNumber()) {");
+        line("  " + top + " = Value(" + top + ".asNumber() + " +
+             number(value.asNumber()) + ");");
+        line("} else {");
+        nesting_++;
+      }
+      sync(depth);
+      line(top + " = rt.concatenate(" + top + ", " + constant(operands[0]) +
+           ");");
+      if (value.isNumber()) {
+        nesting_--;
+        line("}");
+      }
+      break;
+    }
+    case OpCode::SUBSTRACT:
+    case OpCode::MULTIPLY:
+    case OpCode::DIVIDE:
+    case OpCode::GREATER:
+    case OpCode::LESS:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::LESS_EQUAL:
+      checkNumbers(depth);
+      line(second + " = Value(" + second + ".asNumber() " +
+           numberOperator(instruction.code) + " " + top + ".asNumber());");
+      break;
+    case OpCode::EQUAL:
+      line(second + " = Value(" + second + " == " + top + ");");
+      break;
+    case OpCode::NOT_EQUAL:
+      line(second + " = Value(" + second + " != " + top + ");");
+      break;
+    case OpCode::NOT:
+      line(top + " = Value(rt.isFalsy(" + top + "));");
+      break;
+    case OpCode::NEGATE:
+      line("if (!" + top + ".isNumber()) {");
+      line("  rt.runtimeError(\"Operand must be a number.\");");
+      line("}");
+      line(top + " = Value(-" + top + ".asNumber());");
+      break;
+    case OpCode::PRINT:
+      line("std::cout << \"[Out]: \" << " + top + " << \"\\n\";");
+      break;
+    case OpCode::JUMP:
+    case OpCode::LOOP:
+      line("goto " + label(instruction.target) + ";");
+      break;
+    case OpCode::JUMP_IF_FALSE:
+    case OpCode::POP_JUMP_IF_FALSE:
+      line("if (rt.isFalsy(" + top + ")) goto " + label(instruction.target) +
+           ";");
+      break;
+    case OpCode::EQUAL_JUMP_IF_FALSE:
+      line("if (!(" + second + " == " + top + ")) goto " +
+           label(instruction.target) + ";");
+      break;
+    case OpCode::NOT_EQUAL_JUMP_IF_FALSE:
+      line("if (!(" + second + " != " + top + ")) goto " +
+           label(instruction.target) + ";");
+      break;
+    case OpCode::GREATER_JUMP_IF_FALSE:
+    case OpCode::LESS_JUMP_IF_FALSE:
+    case OpCode::GREATER_EQUAL_JUMP_IF_FALSE:
+    case OpCode::LESS_EQUAL_JUMP_IF_FALSE:
+      checkNumbers(depth);
+      line("if (!(" + second + ".asNumber() " +
+           numberOperator(instruction.code) + " " + top +
+           ".asNumber())) goto " + label(instruction.target) + ";");
+      break;
+    case OpCode::RETURN:
+      // The result goes where the callee was, once the frame's captured
+      // slots, the callee's included, are closed.
+      if (closes_) {
+        line("{");
+        line("  Value result = " + top + ";");
+        line("  rt.closeUpvalue(s);");
+        line("  s[0] = result;");
+        line("}");
+      } else {
+        line("s[0] = " + top + ";");
+      }
+      line("return;");
+      break;
+    default:
+      throw std::logic_error("cannot translate " +
+                             codes[static_cast<size_t>(instruction.code)]);
+  }
+}
+
+std::string CppTranslator::slot(int position) const {
+  if (captured_[position]) {
+    return "s[" + std::to_string(position) + "]";
+  }
+  return "v" + std::to_string(position);
+}
+
+std::string CppTranslator::constant(uint8_t index) {
+  const Value& value = chunk_.constants[index];
+  if (value.isNumber()) {
+    return "Value(" + number(value.asNumber()) + ")";
+  }
+  usesConstants_ = true;
+  return "k[" + std::to_string(index) + "]";
+}
+
+std::string CppTranslator::string(uint8_t index) {
+  return constant(index) + ".asString()";
+}
+
+void CppTranslator::sync(int depth) {
+  for (int position = 1; position < depth; position++) {
+    if (!captured_[position]) {
+      line("s[" + std::to_string(position) + "] = v" +
+           std::to_string(position) + ";");
+    }
+  }
+  line("rt.top(s + " + std::to_string(depth) + ");");
+}
+
+void CppTranslator::reload(int from, int to) {
+  for (int position = from; position < to; position++) {
+    if (!captured_[position]) {
+      line("v" + std::to_string(position) + " = s[" +
+           std::to_string(position) + "];");
+    }
+  }
+}
+
+void CppTranslator::checkNumbers(int depth) {
+  line("if (!" + slot(depth - 2) + ".isNumber() || !" + slot(depth - 1) +
+       ".isNumber()) {");
+  line("  rt.runtimeError(\"Operands must be numbers.\");");
+  line("}");
+}
+
+void CppTranslator::line(const std::string& code) {
+  body_ << std::string(2 * (nesting_ + 1), ' ') << code << "\n";
+}
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Bytecode.h"
+#include "Chunk.h"
+#include "Value.h"
+
+namespace lox {
+namespace compiler {
+
+// Ahead-of-time translation of a compiled script to C++, one function per
+// Lox function. The generated functions run a frame the way the interpreter
+// would, without dispatch: the stack depth of every instruction is known, so
+// each stack slot of the frame becomes a C++ variable, jumps become gotos
+// and constants are inlined.
+//
+// The variables are written back to the frame before anything that can
+// allocate or call, so the collector and callees see the frame as the
+// interpreter would have it, and the results are read back afterwards.
+// Slots that closures capture live in the frame only.
+//
+// The program embeds the script as a bytecode file and loads it when it
+// starts, for the heap objects the constants refer to, without linking the
+// compiler. The fingerprint of each function's bytecode guards against the
+// loaded functions differing from the translated ones.
+class CppTranslator {
+ public:
+  // Returns the C++ program for `script` from `path`, whose bytecode file
+  // holds `bytecode`.
+  static std::string translate(Function script, const std::string& path,
+                               std::string_view bytecode);
+
+  // `script` and every function nested in it, in the order the translated
+  // program lists them.
+  static std::vector<Function> functions(Function script) {
+    std::vector<Function> all{script};
+    for (size_t i = 0; i < all.size(); i++) {
+      for (const auto& constant : all[i]->chunk().constants) {
+        if (constant.isFunction()) {
+          all.push_back(constant.asFunction());
+        }
+      }
+    }
+    return all;
+  }
+
+  // FNV-1a hash of the chunk's code.
+  static uint64_t fingerprint(const Chunk& chunk) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (uint8_t byte : chunk.code) {
+      hash = (hash ^ byte) * 0x100000001b3;
+    }
+    return hash;
+  }
+
+ private:
+  CppTranslator(Function function, std::string name);
+
+  // Works out the stack depth at each instruction, which jump targets are
+  // reachable and which slots closures capture.
+  void analyze();
+  void generate(std::ostream& out);
+  void instruction(size_t i);
+
+  // The C++ expression for the stack slot at `position`.
+  std::string slot(int position) const;
+  // The C++ expression for a constant.
+  std::string constant(uint8_t index);
+  std::string string(uint8_t index);
+  // Writes the slots below `depth` back to the frame and sets the stack top
+  // there, before a runtime operation.
+  void sync(int depth);
+  // Reads the slots from `from` up to `to` back from the frame.
+  void reload(int from, int to);
+  // Raises the runtime error unless the two values on top of the stack at
+  // `depth` are numbers.
+  void checkNumbers(int depth);
+  void line(const std::string& code);
+
+  Function function_;
+  Chunk& chunk_;
+  std::string name_;
+  std::vector<Bytecode::Instruction> instructions_;
+  // Per instruction, -1 where it cannot be reached.
+  std::vector<int> depths_;
+  std::vector<bool> targets_;
+  // Per stack position, whether it has to stay in the frame.
+  std::vector<bool> captured_;
+  int maxDepth_{0};
+  bool closes_{false};
+  bool usesFrame_{false};
+  bool usesConstants_{false};
+  bool usesGlobals_{false};
+  bool usesCaches_{false};
+  // Blocks the line being generated is in.
+  int nesting_{0};
+  std::ostringstream body_;
+};
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "Chunk.h"
+#include "Value.h"
+
+namespace lox {
+namespace compiler {
+
+// Slot storage for global variables. The parser resolves every global name to
+// a slot once, at compile time, and the VM indexes `values` directly. New
+// slots start out undefined so reading a global before its definition is
+// still reported at runtime.
+class Globals {
+ public:
+  static constexpr size_t kMaxGlobals =
+      std::numeric_limits<uint16_t>::max() + 1;
+
+  // Returns the slot for `name`, adding one if needed, or -1 when all slots
+  // are taken.
+  int resolve(String name) {
+    auto found = slots_.find(name);
+    if (found != slots_.end()) {
+      return found->second;
+    }
+    if (names_.size() == kMaxGlobals) {
+      return -1;
+    }
+    uint16_t slot = static_cast<uint16_t>(names_.size());
+    slots_.emplace(name, slot);
+    names_.push_back(name);
+    values_.push_back(Value::undefined());
+    return slot;
+  }
+
+  String name(size_t slot) const { return names_[slot]; }
+  Value* values() { return values_.data(); }
+  size_t size() const { return names_.size(); }
+
+  template <typename Marker>
+  void mark(Marker&& marker) const {
+    for (size_t slot = 0; slot < names_.size(); slot++) {
+      marker(names_[slot], values_[slot]);
+    }
+  }
+
+ private:
+  StringMap<uint16_t> slots_;
+  std::vector<String> names_;
+  std::vector<Value> values_;
+};
+
+}  // namespace compiler
+}  // namespace lox
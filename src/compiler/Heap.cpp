@@ -0,0 +1,127 @@
+#include "Heap.h"
+
+#include <algorithm>
+#include <iostream>
+
+namespace lox {
+namespace compiler {
+
+Heap::~Heap() {
+  while (objects_ != nullptr) {
+    Object* next = objects_->next;
+    delete objects_;
+    objects_ = next;
+  }
+}
+
+void Heap::markObject(Object* object) {
+  if (object == nullptr || object->marked) {
+    return;
+  }
+  object->marked = true;
+  gray_.push_back(object);
+}
+
+void Heap::collect() {
+  size_t before = bytesAllocated_;
+
+  markRoots_();
+  while (!gray_.empty()) {
+    Object* object = gray_.back();
+    gray_.pop_back();
+    blacken(object);
+  }
+  removeWhiteStrings();
+  sweep();
+
+  nextCollection_ =
+      std::max(bytesAllocated_ * kHeapGrowFactor, kInitialCollectionThreshold);
+  collections_++;
+
+  if (log_) {
+    std::cout << "=== GC: collected " << before - bytesAllocated_
+              << " bytes (from " << before << " to " << bytesAllocated_
+              << ") next at " << nextCollection_ << " ===\n";
+  }
+}
+
+void Heap::blacken(Object* object) {
+  switch (object->type) {
+    case ObjectType::STRING:
+    case ObjectType::NATIVE:
+      break;
+    case ObjectType::FUNCTION: {
+      auto function = static_cast<Function>(object);
+      for (const auto& constant : function->chunk().constants) {
+        markValue(constant);
+      }
+      for (const auto& cache : function->chunk().caches) {
+        for (size_t i = 0; i < cache.size; i++) {
+          markObject(cache.entries[i].klass);
+          markObject(cache.entries[i].method);
+        }
+      }
+      break;
+    }
+    case ObjectType::CLOSURE: {
+      auto closure = static_cast<Closure>(object);
+      markObject(closure->function);
+      for (auto upvalue : closure->upvalues) {
+        markObject(upvalue);
+      }
+      break;
+    }
+    case ObjectType::UPVALUE:
+      markValue(static_cast<UpvalueValue>(object)->closed);
+      break;
+    case ObjectType::CLASS: {
+      auto klass = static_cast<Class>(object);
+      for (const auto& method : klass->methods) {
+        markObject(method.first);
+        markObject(method.second);
+      }
+      klass->shape.forEachName([this](String name) { markObject(name); });
+      break;
+    }
+    case ObjectType::INSTANCE: {
+      auto instance = static_cast<Instance>(object);
+      markObject(instance->klass);
+      instance->forEachField([this](const Value& value) { markValue(value); });
+      break;
+    }
+    case ObjectType::BOUND_METHOD: {
+      auto bound = static_cast<BoundMethod>(object);
+      markObject(bound->self);
+      markObject(bound->method);
+      break;
+    }
+  }
+}
+
+void Heap::removeWhiteStrings() {
+  for (auto it = strings_.begin(); it != strings_.end();) {
+    if (!it->second->marked) {
+      it = strings_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void Heap::sweep() {
+  Object** link = &objects_;
+  while (*link != nullptr) {
+    Object* object = *link;
+    if (object->marked) {
+      object->marked = false;
+      link = &object->next;
+    } else {
+      *link = object->next;
+      bytesAllocated_ -= object->size;
+      delete object;
+    }
+  }
+}
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Chunk.h"
+#include "Value.h"
+
+namespace lox {
+namespace compiler {
+
+// Owns every object created by the compiler and the VM and reclaims the
+// unreachable ones with a tracing mark-and-sweep collector.
+//
+// A collection starts when the bytes charged to live objects cross
+// `nextCollection_`, which is then reset to a multiple of what survived.
+// Roots are supplied by whoever owns the heap through `setRoots`; the
+// callback is expected to call markValue/markObject on each of them.
+// Objects are only swept by a collection triggered from a later allocation,
+// so a freshly allocated object is safe until the next allocate() call.
+class Heap {
+ public:
+  // Objects are charged their own size, plus the characters of strings.
+  // What they own out of line, such as instance fields, method tables,
+  // shapes and chunks, is not charged, so the heap can grow well past the
+  // threshold before a collection when large instances or classes are
+  // garbage.
+  static constexpr size_t kInitialCollectionThreshold = 1024 * 1024;
+  static constexpr size_t kHeapGrowFactor = 2;
+
+  Heap() = default;
+  Heap(const Heap&) = delete;
+  Heap& operator=(const Heap&) = delete;
+  ~Heap();
+
+  template <typename T, typename... Args>
+  T* allocate(Args&&... args) {
+    size_t size = sizeof(T);
+    if (shouldCollect(size)) {
+      collect();
+    }
+    T* object = new T(std::forward<Args>(args)...);
+    track(object, size);
+    return object;
+  }
+
+  // Returns the interned string with these contents, allocating it on first
+  // use.
+  String makeString(std::string chars) {
+    auto found = strings_.find(chars);
+    if (found != strings_.end()) {
+      return found->second;
+    }
+    return intern(std::move(chars));
+  }
+  // Same, copying the characters only for a string not seen before.
+  String makeString(std::string_view chars) {
+    auto found = strings_.find(chars);
+    if (found != strings_.end()) {
+      return found->second;
+    }
+    return intern(std::string(chars));
+  }
+
+  void setRoots(std::function<void()> markRoots) {
+    markRoots_ = std::move(markRoots);
+  }
+  // Collect on every allocation, to shake out missing roots.
+  void setStressMode(bool stress) { stress_ = stress; }
+  void setLogging(bool log) { log_ = log; }
+
+  // Collections are suspended while paused, e.g. while the compiler holds
+  // objects that are not reachable from any root yet.
+  void pause() { paused_++; }
+  void resume() { paused_--; }
+
+  void markValue(const Value& value) {
+    if (value.isObject()) {
+      markObject(value.asObject());
+    }
+  }
+  void markObject(Object* object);
+
+  void collect();
+
+  size_t bytesAllocated() const { return bytesAllocated_; }
+  size_t collections() const { return collections_; }
+
+ private:
+  String intern(std::string chars) {
+    size_t size = sizeof(StringObject) + chars.size();
+    if (shouldCollect(size)) {
+      collect();
+    }
+    uint32_t hash = hashString(chars);
+    String string = new StringObject(std::move(chars), hash);
+    track(string, size);
+    strings_.emplace(string->chars, string);
+    return string;
+  }
+
+  struct StringViewHash {
+    size_t operator()(std::string_view chars) const {
+      return hashString(chars);
+    }
+  };
+
+  Object* objects_{nullptr};
+  // Weak: entries are dropped when their string is swept.
+  std::unordered_map<std::string_view, String, StringViewHash> strings_;
+  std::vector<Object*> gray_;
+  std::function<void()> markRoots_;
+  size_t bytesAllocated_{0};
+  size_t nextCollection_{kInitialCollectionThreshold};
+  size_t collections_{0};
+  int paused_{0};
+  bool stress_{false};
+  bool log_{false};
+
+  bool shouldCollect(size_t size) const {
+    return paused_ == 0 && markRoots_ &&
+           (stress_ || bytesAllocated_ + size > nextCollection_);
+  }
+
+  void track(Object* object, size_t size) {
+    object->size = static_cast<uint32_t>(size);
+    object->next = objects_;
+    objects_ = object;
+    bytesAllocated_ += size;
+  }
+
+  void blacken(Object* object);
+  void removeWhiteStrings();
+  void sweep();
+};
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,469 @@
+#include "Jit.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "Value.h"
+
+namespace lox {
+namespace compiler {
+
+namespace {
+
+using Reg = X64Assembler::Reg;
+
+// Where the code keeps its state, all in callee-saved registers: the VM,
+// the frame's slots, the stack top, the globals and the quiet NaN mask
+// numbers are told apart with. RAX, RCX, RDX and the XMM registers are
+// scratch.
+constexpr Reg kVm = X64Assembler::RBX;
+constexpr Reg kSlots = X64Assembler::R12;
+constexpr Reg kTop = X64Assembler::R13;
+constexpr Reg kGlobals = X64Assembler::R14;
+constexpr Reg kNanMask = X64Assembler::R15;
+
+constexpr Reg RAX = X64Assembler::RAX;
+constexpr Reg RCX = X64Assembler::RCX;
+constexpr Reg RDX = X64Assembler::RDX;
+
+constexpr int32_t kValueSize = static_cast<int32_t>(sizeof(Value));
+
+// Whether `code` is a form the interpreter specialized for numbers.
+bool quickened(OpCode code) {
+  return code == OpCode::ADD_NUM_NUM || code >= OpCode::SUBSTRACT_NUM_NUM;
+}
+
+}  // namespace
+
+bool Jit::compile(Chunk& chunk, const Helpers& helpers) {
+  if (!supported()) {
+    return false;
+  }
+  Jit jit(chunk, helpers);
+  jit.generate();
+  return jit.install();
+}
+
+Jit::Jit(Chunk& chunk, const Helpers& helpers)
+    : chunk_(chunk),
+      helpers_(helpers),
+      entries_(chunk.code.size(), false) {
+  for (size_t offset = 0; offset <= chunk.code.size(); offset++) {
+    labels_.push_back(as_.newLabel());
+  }
+  error_ = as_.newLabel();
+  exit_ = as_.newLabel();
+  entries_[0] = true;
+  for (size_t offset = 0; offset < chunk.code.size();) {
+    auto code = static_cast<OpCode>(chunk.code[offset]);
+    size_t next = offset + instructionSize(code);
+    if (code == OpCode::LOOP) {
+      entries_[next - (chunk.code[offset + 1] << 8 | chunk.code[offset + 2])] =
+          true;
+    } else if (code == OpCode::CLOSURE) {
+      Function function = chunk.constants[chunk.code[offset + 1]].asFunction();
+      for (const auto& upvalue : function->chunk().upvalues) {
+        closes_ = closes_ || upvalue.isLocal;
+      }
+    }
+    offset = next;
+  }
+}
+
+void Jit::generate() {
+  // Entry: save what the code keeps in callee-saved registers, which also
+  // aligns the stack for the helper calls, and go to the given address.
+  as_.push(X64Assembler::RBX);
+  as_.push(X64Assembler::R12);
+  as_.push(X64Assembler::R13);
+  as_.push(X64Assembler::R14);
+  as_.push(X64Assembler::R15);
+  as_.mov(kVm, X64Assembler::RDI);
+  as_.mov(kSlots, X64Assembler::RSI);
+  as_.mov(kTop, X64Assembler::RDX);
+  as_.mov(kGlobals, X64Assembler::R8);
+  as_.movImm(kNanMask, Value::kQuietNan);
+  as_.jmp(X64Assembler::RCX);
+
+  for (size_t offset = 0; offset < chunk_.code.size();) {
+    as_.bind(labels_[offset]);
+    instruction(offset);
+    offset += instructionSize(static_cast<OpCode>(chunk_.code[offset]));
+  }
+  as_.bind(labels_[chunk_.code.size()]);
+  as_.jmp(error_);
+
+  // Slow paths never fall through into the next one, so new ones are not
+  // added while this runs.
+  for (size_t i = 0; i < slowPaths_.size(); i++) {
+    SlowPath path = slowPaths_[i];
+    as_.bind(path.label);
+    if (path.bail) {
+      callHelper(helpers_.bail, path.offset);
+      as_.jmp(exit_);
+      continue;
+    }
+    step(path.offset, helpers_.step);
+    auto code = static_cast<OpCode>(chunk_.code[path.offset]);
+    as_.jmp(labels_[path.offset + instructionSize(code)]);
+  }
+
+  as_.bind(error_);
+  as_.movImm(RAX, 0);
+  as_.bind(exit_);
+  as_.pop(X64Assembler::R15);
+  as_.pop(X64Assembler::R14);
+  as_.pop(X64Assembler::R13);
+  as_.pop(X64Assembler::R12);
+  as_.pop(X64Assembler::RBX);
+  as_.ret();
+}
+
+void Jit::instruction(size_t offset) {
+  const uint8_t* ip = &chunk_.code[offset];
+  auto code = static_cast<OpCode>(*ip);
+  size_t next = offset + instructionSize(code);
+  uint16_t jump = 0;
+  if (next - offset == 3) {
+    jump = static_cast<uint16_t>(ip[1] << 8 | ip[2]);
+  }
+
+  switch (code) {
+    case OpCode::CONSTANT:
+      pushImmediate(chunk_.constants[ip[1]].bits());
+      break;
+    case OpCode::NIL:
+      pushImmediate(Value::kNil);
+      break;
+    case OpCode::TRUE:
+      pushImmediate(Value::kTrue);
+      break;
+    case OpCode::FALSE:
+      pushImmediate(Value::kFalse);
+      break;
+    case OpCode::POP:
+      as_.subImm(kTop, kValueSize);
+      break;
+    case OpCode::POPN:
+      as_.subImm(kTop, kValueSize * ip[1]);
+      break;
+    case OpCode::GET_LOCAL:
+      as_.load(RAX, kSlots, kValueSize * ip[1]);
+      push(RAX);
+      break;
+    case OpCode::GET_LOCAL_GET_LOCAL:
+      // The second slot may be the one the first push writes.
+      as_.load(RAX, kSlots, kValueSize * ip[1]);
+      as_.store(kTop, 0, RAX);
+      as_.load(RCX, kSlots, kValueSize * ip[2]);
+      as_.store(kTop, kValueSize, RCX);
+      as_.addImm(kTop, 2 * kValueSize);
+      break;
+    case OpCode::SET_LOCAL:
+      as_.load(RAX, kTop, -kValueSize);
+      as_.store(kSlots, kValueSize * ip[1], RAX);
+      break;
+    case OpCode::GET_GLOBAL:
+      // Undefined globals are reported by the helper.
+      as_.load(RAX, kGlobals, kValueSize * jump);
+      as_.movImm(RCX, Value::kUndefined);
+      as_.cmp(RAX, RCX);
+      as_.jump(X64Assembler::EQUAL, slowPath(offset));
+      push(RAX);
+      break;
+    case OpCode::SET_GLOBAL:
+      as_.load(RAX, kGlobals, kValueSize * jump);
+      as_.movImm(RCX, Value::kUndefined);
+      as_.cmp(RAX, RCX);
+      as_.jump(X64Assembler::EQUAL, slowPath(offset));
+      as_.load(RAX, kTop, -kValueSize);
+      as_.store(kGlobals, kValueSize * jump, RAX);
+      break;
+    case OpCode::JUMP:
+      as_.jmp(labels_[next + jump]);
+      break;
+    case OpCode::LOOP:
+      as_.jmp(labels_[next - jump]);
+      break;
+    case OpCode::JUMP_IF_FALSE:
+    case OpCode::POP_JUMP_IF_FALSE:
+      as_.load(RAX, kTop, -kValueSize);
+      if (code == OpCode::POP_JUMP_IF_FALSE) {
+        as_.subImm(kTop, kValueSize);
+      }
+      falsy();
+      as_.test(RAX, RAX);
+      as_.jump(X64Assembler::NOT_EQUAL, labels_[next + jump]);
+      break;
+    case OpCode::NOT:
+      as_.load(RAX, kTop, -kValueSize);
+      falsy();
+      as_.movImm(RCX, Value::kFalse);
+      as_.add(RAX, RCX);
+      as_.store(kTop, -kValueSize, RAX);
+      break;
+    case OpCode::NEGATE:
+      as_.load(RAX, kTop, -kValueSize);
+      checkNumber(RAX, slowPath(offset));
+      as_.movImm(RCX, Value::kSignBit);
+      as_.xorq(RAX, RCX);
+      as_.store(kTop, -kValueSize, RAX);
+      break;
+    case OpCode::ADD_CONST: {
+      const Value& constant = chunk_.constants[ip[1]];
+      if (!constant.isNumber()) {
+        step(offset, helpers_.step);
+        break;
+      }
+      as_.load(RAX, kTop, -kValueSize);
+      checkNumber(RAX, slowPath(offset));
+      as_.movq(X64Assembler::XMM0, RAX);
+      as_.movImm(RCX, constant.bits());
+      as_.movq(X64Assembler::XMM1, RCX);
+      as_.addsd(X64Assembler::XMM0, X64Assembler::XMM1);
+      as_.movq(RAX, X64Assembler::XMM0);
+      as_.store(kTop, -kValueSize, RAX);
+      break;
+    }
+    case OpCode::ADD:
+    case OpCode::ADD_NUM_NUM:
+    case OpCode::SUBSTRACT:
+    case OpCode::SUBSTRACT_NUM_NUM:
+    case OpCode::MULTIPLY:
+    case OpCode::MULTIPLY_NUM_NUM:
+    case OpCode::DIVIDE:
+    case OpCode::DIVIDE_NUM_NUM:
+      arithmetic(code, offset);
+      break;
+    case OpCode::GREATER:
+    case OpCode::GREATER_NUM:
+    case OpCode::LESS:
+    case OpCode::LESS_NUM:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::GREATER_EQUAL_NUM:
+    case OpCode::LESS_EQUAL:
+    case OpCode::LESS_EQUAL_NUM:
+      compare(code, offset);
+      break;
+    case OpCode::GREATER_JUMP_IF_FALSE:
+    case OpCode::LESS_JUMP_IF_FALSE:
+    case OpCode::GREATER_EQUAL_JUMP_IF_FALSE:
+    case OpCode::LESS_EQUAL_JUMP_IF_FALSE:
+      compareJump(code, offset, labels_[next + jump]);
+      break;
+    case OpCode::EQUAL:
+    case OpCode::NOT_EQUAL:
+      as_.load(RAX, kTop, -2 * kValueSize);
+      as_.load(RCX, kTop, -kValueSize);
+      as_.subImm(kTop, kValueSize);
+      equal();
+      if (code == OpCode::EQUAL) {
+        as_.movImm(RCX, Value::kFalse);
+        as_.add(RAX, RCX);
+      } else {
+        as_.movImm(RCX, Value::kTrue);
+        as_.sub(RCX, RAX);
+        as_.mov(RAX, RCX);
+      }
+      as_.store(kTop, -kValueSize, RAX);
+      break;
+    case OpCode::EQUAL_JUMP_IF_FALSE:
+    case OpCode::NOT_EQUAL_JUMP_IF_FALSE:
+      as_.load(RAX, kTop, -2 * kValueSize);
+      as_.load(RCX, kTop, -kValueSize);
+      as_.subImm(kTop, 2 * kValueSize);
+      equal();
+      as_.test(RAX, RAX);
+      as_.jump(code == OpCode::EQUAL_JUMP_IF_FALSE ? X64Assembler::EQUAL
+                                                   : X64Assembler::NOT_EQUAL,
+               labels_[next + jump]);
+      break;
+    case OpCode::RETURN:
+      if (closes_) {
+        step(offset, helpers_.step);
+      }
+      // The result replaces the callee.
+      as_.load(RAX, kTop, -kValueSize);
+      as_.store(kSlots, 0, RAX);
+      as_.lea(RAX, kSlots, kValueSize);
+      as_.jmp(exit_);
+      break;
+    case OpCode::CALL:
+      step(offset, helpers_.call);
+      break;
+    case OpCode::INVOKE:
+      step(offset, helpers_.invoke);
+      break;
+    default:
+      step(offset, helpers_.step);
+      break;
+  }
+}
+
+bool Jit::install() {
+  std::vector<uint8_t> code = as_.finish();
+  size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  size_t size = (code.size() + page - 1) / page * page;
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  std::memcpy(memory, code.data(), code.size());
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return false;
+  }
+
+  NativeCode& native = chunk_.native;
+  native.memory_ = static_cast<uint8_t*>(memory);
+  native.size_ = size;
+  native.entries_.assign(chunk_.code.size(), -1);
+  for (size_t offset = 0; offset < chunk_.code.size(); offset++) {
+    if (entries_[offset]) {
+      native.entries_[offset] = as_.offset(labels_[offset]);
+    }
+  }
+  return true;
+}
+
+void Jit::push(Reg value) {
+  as_.store(kTop, 0, value);
+  as_.addImm(kTop, kValueSize);
+}
+
+void Jit::pushImmediate(uint64_t bits) {
+  as_.movImm(RAX, bits);
+  push(RAX);
+}
+
+void Jit::checkNumber(Reg value, Label fail) {
+  as_.mov(RDX, value);
+  as_.andq(RDX, kNanMask);
+  as_.cmp(RDX, kNanMask);
+  as_.jump(X64Assembler::EQUAL, fail);
+}
+
+void Jit::falsy() {
+  // Nil and false are the two patterns right after kNil.
+  as_.movImm(RCX, Value::kNil);
+  as_.sub(RAX, RCX);
+  as_.cmpImm(RAX, 2);
+  as_.set(X64Assembler::BELOW, RAX);
+}
+
+void Jit::equal() {
+  Label bits = as_.newLabel();
+  Label done = as_.newLabel();
+  checkNumber(RAX, bits);
+  checkNumber(RCX, bits);
+  as_.movq(X64Assembler::XMM0, RAX);
+  as_.movq(X64Assembler::XMM1, RCX);
+  // Unordered, so NaN, sets the parity flag.
+  as_.ucomisd(X64Assembler::XMM0, X64Assembler::XMM1);
+  as_.set(X64Assembler::EQUAL, RAX);
+  as_.set(X64Assembler::NOT_PARITY, RCX);
+  as_.andq(RAX, RCX);
+  as_.jmp(done);
+  as_.bind(bits);
+  as_.cmp(RAX, RCX);
+  as_.set(X64Assembler::EQUAL, RAX);
+  as_.bind(done);
+}
+
+void Jit::numbers(size_t offset) {
+  Label slow = slowPath(offset);
+  as_.load(RAX, kTop, -2 * kValueSize);
+  as_.load(RCX, kTop, -kValueSize);
+  checkNumber(RAX, slow);
+  checkNumber(RCX, slow);
+  as_.movq(X64Assembler::XMM0, RAX);
+  as_.movq(X64Assembler::XMM1, RCX);
+}
+
+void Jit::arithmetic(OpCode code, size_t offset) {
+  numbers(offset);
+  switch (code) {
+    case OpCode::ADD:
+    case OpCode::ADD_NUM_NUM:
+      as_.addsd(X64Assembler::XMM0, X64Assembler::XMM1);
+      break;
+    case OpCode::SUBSTRACT:
+    case OpCode::SUBSTRACT_NUM_NUM:
+      as_.subsd(X64Assembler::XMM0, X64Assembler::XMM1);
+      break;
+    case OpCode::MULTIPLY:
+    case OpCode::MULTIPLY_NUM_NUM:
+      as_.mulsd(X64Assembler::XMM0, X64Assembler::XMM1);
+      break;
+    default:
+      as_.divsd(X64Assembler::XMM0, X64Assembler::XMM1);
+      break;
+  }
+  as_.movq(RAX, X64Assembler::XMM0);
+  as_.store(kTop, -2 * kValueSize, RAX);
+  as_.subImm(kTop, kValueSize);
+}
+
+void Jit::compare(OpCode code, size_t offset) {
+  numbers(offset);
+  // a < b is b > a; unordered compares as below, so NaN gives false.
+  bool swap = code == OpCode::LESS || code == OpCode::LESS_NUM ||
+              code == OpCode::LESS_EQUAL || code == OpCode::LESS_EQUAL_NUM;
+  bool inclusive = code == OpCode::GREATER_EQUAL ||
+                   code == OpCode::GREATER_EQUAL_NUM ||
+                   code == OpCode::LESS_EQUAL || code == OpCode::LESS_EQUAL_NUM;
+  if (swap) {
+    as_.ucomisd(X64Assembler::XMM1, X64Assembler::XMM0);
+  } else {
+    as_.ucomisd(X64Assembler::XMM0, X64Assembler::XMM1);
+  }
+  as_.set(inclusive ? X64Assembler::ABOVE_EQUAL : X64Assembler::ABOVE, RAX);
+  as_.movImm(RCX, Value::kFalse);
+  as_.add(RAX, RCX);
+  as_.store(kTop, -2 * kValueSize, RAX);
+  as_.subImm(kTop, kValueSize);
+}
+
+void Jit::compareJump(OpCode code, size_t offset, Label target) {
+  numbers(offset);
+  as_.subImm(kTop, 2 * kValueSize);
+  bool swap = code == OpCode::LESS_JUMP_IF_FALSE ||
+              code == OpCode::LESS_EQUAL_JUMP_IF_FALSE;
+  bool inclusive = code == OpCode::GREATER_EQUAL_JUMP_IF_FALSE ||
+                   code == OpCode::LESS_EQUAL_JUMP_IF_FALSE;
+  if (swap) {
+    as_.ucomisd(X64Assembler::XMM1, X64Assembler::XMM0);
+  } else {
+    as_.ucomisd(X64Assembler::XMM0, X64Assembler::XMM1);
+  }
+  as_.jump(inclusive ? X64Assembler::BELOW : X64Assembler::BELOW_EQUAL,
+           target);
+}
+
+void Jit::callHelper(Helper helper, size_t offset) {
+  as_.mov(X64Assembler::RDI, kVm);
+  as_.mov(X64Assembler::RSI, kTop);
+  as_.movImm(RDX, reinterpret_cast<uint64_t>(&chunk_.code[offset]));
+  as_.movImm(RAX, reinterpret_cast<uint64_t>(helper));
+  as_.call(RAX);
+}
+
+void Jit::step(size_t offset, Helper helper) {
+  callHelper(helper, offset);
+  as_.test(RAX, RAX);
+  as_.jump(X64Assembler::EQUAL, error_);
+  as_.mov(kTop, RAX);
+}
+
+X64Assembler::Label Jit::slowPath(size_t offset) {
+  auto code = static_cast<OpCode>(chunk_.code[offset]);
+  Label label = as_.newLabel();
+  slowPaths_.push_back({label, offset, quickened(code)});
+  return label;
+}
+
+}  // namespace compiler
+}  // namespace lox
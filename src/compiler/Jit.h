@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Chunk.h"
+#include "X64Assembler.h"
+
+namespace lox {
+namespace compiler {
+
+// Baseline compiler from a chunk's stack bytecode to x86-64, run on the
+// functions the VM finds hot. The generated code keeps the interpreter's
+// frame and stack layout, one instruction after the other, so the VM can
+// hand a frame over at the start or at a loop header and take it back at
+// any instruction.
+//
+// Loads, stores, jumps and number arithmetic and comparisons are done inline.
+// Everything else, and the operands inline code does not handle, goes to
+// the VM's `step` helper, which runs the instruction the way the interpreter
+// does. Calls run the callee to completion in their helper, going straight
+// into its native code when it has some. When the operands of an
+// instruction the interpreter quickened turn out not to be numbers, the code
+// bails out instead and the interpreter carries on with the frame.
+class Jit {
+ public:
+  // Callbacks into the VM. Each gets the VM, the stack top and the
+  // instruction, and returns the stack top, or nullptr after a runtime
+  // error, which the VM rethrows once it is out of the generated code.
+  using Helper = Value* (*)(void* vm, Value* sp, const uint8_t* ip);
+  struct Helpers {
+    Helper step;
+    // CALL and INVOKE, which can go straight into the callee's native code.
+    Helper call;
+    Helper invoke;
+    // Leaves the frame to the interpreter at the instruction.
+    Helper bail;
+  };
+
+  // Whether this build can run the code it generates.
+  static constexpr bool supported() {
+#if defined(__x86_64__)
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // Fills in `chunk.native`. Returns false, leaving it alone, if executable
+  // memory could not be had.
+  static bool compile(Chunk& chunk, const Helpers& helpers);
+
+ private:
+  using Reg = X64Assembler::Reg;
+  using Xmm = X64Assembler::Xmm;
+  using Label = X64Assembler::Label;
+
+  // Out-of-line code for an instruction whose inline code did not apply.
+  struct SlowPath {
+    Label label;
+    size_t offset;
+    bool bail;
+  };
+
+  Jit(Chunk& chunk, const Helpers& helpers);
+
+  void generate();
+  void instruction(size_t offset);
+  bool install();
+
+  void push(Reg value);
+  void pushImmediate(uint64_t bits);
+  // Jumps to `fail` unless `value` holds a number. Clobbers RDX.
+  void checkNumber(Reg value, Label fail);
+  // Leaves 1 in RAX if RAX is nil or false, 0 otherwise. Clobbers RCX.
+  void falsy();
+  // Leaves 1 in RAX if the values in RAX and RCX are equal, 0 otherwise.
+  void equal();
+  // Loads the two operands on top of the stack as numbers into XMM0 and
+  // XMM1, going to the slow path of the instruction otherwise.
+  void numbers(size_t offset);
+  void arithmetic(OpCode code, size_t offset);
+  void compare(OpCode code, size_t offset);
+  void compareJump(OpCode code, size_t offset, Label target);
+  void callHelper(Helper helper, size_t offset);
+  // Calls `helper` for the instruction and takes the stack top it returns.
+  void step(size_t offset, Helper helper);
+  Label slowPath(size_t offset);
+
+  Chunk& chunk_;
+  const Helpers& helpers_;
+  X64Assembler as_;
+  // Per bytecode offset; one past the end for the code that has no next
+  // instruction to go on to.
+  std::vector<Label> labels_;
+  std::vector<bool> entries_;
+  std::vector<SlowPath> slowPaths_;
+  Label error_;
+  Label exit_;
+  // Whether the function makes closures capturing its locals, which its
+  // RETURN then has to close.
+  bool closes_{false};
+};
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "Chunk.h"
+#include "Value.h"
+
+namespace lox {
+namespace compiler {
+
+// Direct-mapped cache of method lookups, shared by every call site. An entry
+// is only valid for the class version it was filled under, and a missing
+// method is cached as nullptr. Entries hold raw pointers that the collector
+// does not trace, so the cache has to be cleared whenever objects may be
+// swept.
+class MethodCache {
+ public:
+  static constexpr size_t kEntries = 1024;
+
+  struct Stats {
+    uint64_t hits{0};
+    uint64_t misses{0};
+    uint64_t invalidations{0};
+  };
+
+  // Returns the method `name` of `klass`, or nullptr if it has none.
+  Closure find(Class klass, String name) {
+    Entry& entry = entries_[index(klass, name)];
+    if (entry.klass == klass && entry.name == name) {
+      if (entry.version == klass->version) {
+        stats_.hits++;
+        return entry.method;
+      }
+      stats_.invalidations++;
+    }
+    stats_.misses++;
+
+    auto found = klass->methods.find(name);
+    entry.klass = klass;
+    entry.name = name;
+    entry.version = klass->version;
+    entry.method = found == klass->methods.end() ? nullptr : found->second;
+    return entry.method;
+  }
+
+  void clear() { entries_.fill(Entry()); }
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  struct Entry {
+    Class klass{nullptr};
+    String name{nullptr};
+    uint32_t version{0};
+    Closure method{nullptr};
+  };
+
+  static size_t index(Class klass, String name) {
+    auto address = reinterpret_cast<uintptr_t>(klass) >> 4;
+    return (address ^ name->hash) & (kEntries - 1);
+  }
+
+  std::array<Entry, kEntries> entries_;
+  Stats stats_;
+};
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,63 @@
+#pragma once
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lox {
+namespace compiler {
+
+class Value;
+
+// Machine code the JIT made for a chunk, and the counters that decide when
+// to make it. The code works on the frame the interpreter set up and can be
+// entered at the start of the chunk or at a loop header, with the stack as
+// the interpreter left it there.
+class NativeCode {
+ public:
+  // Takes the VM, the frame's slots, the stack top, the address to start at
+  // and the globals. Returns the stack top, one past the result stored over
+  // the callee when the function returned, or nullptr after a runtime error.
+  using Entry = Value* (*)(void* vm, Value* slots, Value* sp, const void* at,
+                           Value* globals);
+
+  NativeCode() = default;
+  NativeCode(const NativeCode&) = delete;
+  NativeCode& operator=(const NativeCode&) = delete;
+  ~NativeCode() {
+    if (memory_ != nullptr) {
+      munmap(memory_, size_);
+    }
+  }
+
+  bool compiled() const { return memory_ != nullptr; }
+  size_t size() const { return size_; }
+  // Whether the code can be entered at the instruction at `offset`.
+  bool enters(size_t offset) const {
+    return offset < entries_.size() && entries_[offset] >= 0;
+  }
+  Value* enter(void* vm, Value* slots, Value* sp, size_t offset,
+               Value* globals) const {
+    auto entry = reinterpret_cast<Entry>(memory_);
+    return entry(vm, slots, sp, memory_ + entries_[offset], globals);
+  }
+
+  uint32_t calls{0};
+  uint32_t loops{0};
+  uint32_t bailouts{0};
+  // Set when the chunk could not be compiled or its code gave up too often;
+  // it stays in the interpreter from then on.
+  bool disabled{false};
+
+ private:
+  friend class Jit;
+
+  uint8_t* memory_{nullptr};
+  size_t size_{0};
+  // Offset in the code of each instruction it can be entered at, or -1.
+  std::vector<int32_t> entries_;
+};
+
+}  // namespace compiler
+}  // namespace lox
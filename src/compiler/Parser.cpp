@@ -1,5 +1,7 @@
 #include "Parser.h"
 
+#include <charconv>
+
 #include "../RuntimeError.h"
 #include "ParseError.h"
 
@@ -34,8 +36,9 @@ Closure Parser::run() {
   if (!hadError_) {
     chunk->scope.clear();
     chunk->upvalues.clear();
-    auto func = std::make_shared<FunctionObject>(0, "script", std::move(chunk));
-    return std::make_shared<ClosureObject>(std::move(func));
+    chunk->dropConstantIndex();
+    auto func = heap_.allocate<FunctionObject>(0, "script", std::move(chunk));
+    return heap_.allocate<ClosureObject>(func);
   }
 
   return nullptr;
@@ -80,7 +83,7 @@ void Parser::classDeclaration(Chunk& chunk, int depth) {
   auto klass = scanner_->consume(Token::Type::IDENTIFIER, kExpectIdentifier);
 
   declareVariable(chunk, klass, depth);
-  emitConstant(chunk, klass.lexeme, OpCode::CLASS, klass.line);
+  emitConstant(chunk, makeString(klass.lexeme), OpCode::CLASS, klass.line);
   defineVariable(chunk, klass, depth);
   int scope = depth + 1;
 
@@ -127,10 +130,10 @@ void Parser::methodDeclaration(Chunk& chunk, int depth) {
            method.lexeme == "init" ? FunctionType::CONSTRUCTOR
                                    : FunctionType::METHOD,
            depth);
-  emitConstant(chunk, method.lexeme, OpCode::METHOD, method.line);
+  emitConstant(chunk, makeString(method.lexeme), OpCode::METHOD, method.line);
 }
 
-void Parser::function(Chunk& chunk, const std::string& name,
+void Parser::function(Chunk& chunk, std::string_view name,
                       const FunctionType& type, int depth) {
   int line = scanner_->previous().line;
   auto function_chunk = std::make_unique<Chunk>();
@@ -160,22 +163,26 @@ void Parser::function(Chunk& chunk, const std::string& name,
   scanner_->consume(Token::Type::LEFT_BRACE, kExpectLeftBrace);
 
   block(*function_chunk, scope);
-  if (!function_chunk->code.empty()) {
-    if (type == FunctionType::CONSTRUCTOR) {
-      if (function_chunk->code.back() == static_cast<uint8_t>(OpCode::RETURN)) {
-        parse_error(scanner_->previous(),
-                    "class init function should have no return statement");
-      }
-      function_chunk->addCode(OpCode::GET_LOCAL, line);
-      function_chunk->addOperand(0);
-      emitReturn(*function_chunk);
-    } else if (function_chunk->code.back() !=
-               static_cast<uint8_t>(OpCode::RETURN)) {
-      emitReturnNil(*function_chunk);
+  // Every function ends with a return, even when the body already returns on
+  // all paths: the VM reads code without bounds checks, and a branch may jump
+  // right past the last explicit RETURN.
+  if (type == FunctionType::CONSTRUCTOR) {
+    if (!function_chunk->code.empty() &&
+        function_chunk->code.back() == static_cast<uint8_t>(OpCode::RETURN)) {
+      parse_error(scanner_->previous(),
+                  "class init function should have no return statement");
     }
+    function_chunk->addCode(OpCode::GET_LOCAL, line);
+    function_chunk->addOperand(0);
+    emitReturn(*function_chunk);
+  } else {
+    emitReturnNil(*function_chunk);
   }
-  Function func =
-      std::make_shared<FunctionObject>(arity, name, std::move(function_chunk));
+  // The locals name tokens, which point into the source.
+  function_chunk->scope.clear();
+  function_chunk->dropConstantIndex();
+  Function func = heap_.allocate<FunctionObject>(arity, std::string(name),
+                                                 std::move(function_chunk));
 
   emitConstant(chunk, func, OpCode::CLOSURE, line);
 }
@@ -371,15 +378,18 @@ void Parser::dot(Chunk& chunk, int depth, bool canAssign) {
 
   if (canAssign && scanner_->match(Token::Type::EQUAL)) {
     expression(chunk, depth);
-    emitConstant(chunk, identifier.lexeme, OpCode::SET_PROPERTY,
+    emitConstant(chunk, makeString(identifier.lexeme), OpCode::SET_PROPERTY,
                  identifier.line);
+    emitCache(chunk, identifier);
   } else if (scanner_->match(Token::Type::LEFT_PAREN)) {
     uint8_t argCount = argumentList(chunk, depth);
-    emitConstant(chunk, identifier.lexeme, OpCode::INVOKE, identifier.line);
+    emitConstant(chunk, makeString(identifier.lexeme), OpCode::INVOKE,
+                 identifier.line);
     chunk.addOperand(argCount);
   } else {
-    emitConstant(chunk, identifier.lexeme, OpCode::GET_PROPERTY,
+    emitConstant(chunk, makeString(identifier.lexeme), OpCode::GET_PROPERTY,
                  identifier.line);
+    emitCache(chunk, identifier);
   }
 }
 
@@ -404,14 +414,18 @@ void Parser::super_(Chunk& chunk, int depth, bool canAssign) {
 
   emitNamedVariable(chunk, OpCode::GET_LOCAL, 0,
                     method.line);  // this
-  namedVariable(chunk, Token(Token::Type::SUPER, "super", method.line), false,
-                depth);
+  Token superToken(Token::Type::SUPER, "super", method.line);
   if (scanner_->match(Token::Type::LEFT_PAREN)) {
     uint8_t argCount = argumentList(chunk, depth);
-    emitConstant(chunk, method.lexeme, OpCode::SUPER_INVOKE, method.line);
+    // The superclass goes above the arguments, where SUPER_INVOKE pops it.
+    namedVariable(chunk, superToken, false, depth);
+    emitConstant(chunk, makeString(method.lexeme), OpCode::SUPER_INVOKE,
+                 method.line);
     chunk.addOperand(argCount);
   } else {
-    emitConstant(chunk, method.lexeme, OpCode::GET_SUPER, method.line);
+    namedVariable(chunk, superToken, false, depth);
+    emitConstant(chunk, makeString(method.lexeme), OpCode::GET_SUPER,
+                 method.line);
   }
 }
 
@@ -448,7 +462,7 @@ void Parser::defineVariable(Chunk& chunk, const Token& name, int depth) {
     chunk.scope.initialize(name, depth);
     return;
   }
-  emitConstant(chunk, name.lexeme, OpCode::DEFINE_GLOBAL, name.line);
+  emitGlobal(chunk, OpCode::DEFINE_GLOBAL, resolveGlobal(name), name.line);
 }
 
 void Parser::expression(Chunk& chunk, int depth) {
@@ -461,7 +475,7 @@ void Parser::grouping(Chunk& chunk, int depth, bool canAssign) {
 }
 
 void Parser::unary(Chunk& chunk, int depth, bool canAssign) {
-  const Token& op = scanner_->previous();
+  const Token op = scanner_->previous();
   parsePrecedence(chunk, depth, Precedence::UNARY);
   switch (op.type) {
     case Token::Type::MINUS:
@@ -475,7 +489,7 @@ void Parser::unary(Chunk& chunk, int depth, bool canAssign) {
   }
 }
 void Parser::binary(Chunk& chunk, int depth, bool canAssign) {
-  const Token& op = scanner_->previous();
+  const Token op = scanner_->previous();
   const auto rule = getRule(op);
   parsePrecedence(chunk, depth,
                   (Precedence)(static_cast<int>(rule.precedence) + 1));
@@ -517,13 +531,15 @@ void Parser::binary(Chunk& chunk, int depth, bool canAssign) {
 }
 
 void Parser::number(Chunk& chunk, int depth, bool canAssign) {
-  double number = atof(scanner_->previous().lexeme.c_str());
+  std::string_view lexeme = scanner_->previous().lexeme;
+  double number = 0;
+  std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), number);
   emitConstant(chunk, number, OpCode::CONSTANT, scanner_->previous().line);
 }
 
 void Parser::string(Chunk& chunk, int depth, bool canAssign) {
-  emitConstant(chunk, scanner_->previous().lexeme, OpCode::CONSTANT,
-               scanner_->previous().line);
+  emitConstant(chunk, makeString(scanner_->previous().lexeme),
+               OpCode::CONSTANT, scanner_->previous().line);
 }
 
 void Parser::literal(Chunk& chunk, int depth, bool canAssign) {
@@ -543,7 +559,8 @@ void Parser::literal(Chunk& chunk, int depth, bool canAssign) {
 }
 
 void Parser::variable(Chunk& chunk, int depth, bool canAssign) {
-  namedVariable(chunk, scanner_->previous(), canAssign, depth);
+  const Token name = scanner_->previous();
+  namedVariable(chunk, name, canAssign, depth);
 }
 
 size_t Parser::resolveUpvalue(Chunk& chunk, const Token& name) {
@@ -596,9 +613,15 @@ void Parser::namedVariable(Chunk& chunk, const Token& token, bool canAssign,
     set = OpCode::SET_UPVALUE;
     offset = upvalue;
   } else {
-    get = OpCode::GET_GLOBAL;
-    set = OpCode::SET_GLOBAL;
-    offset = chunk.addConstant(token.lexeme);
+    int slot = resolveGlobal(token);
+    int line = token.line;
+    if (canAssign && scanner_->match(Token::Type::EQUAL)) {
+      expression(chunk, depth);
+      emitGlobal(chunk, OpCode::SET_GLOBAL, slot, line);
+    } else {
+      emitGlobal(chunk, OpCode::GET_GLOBAL, slot, line);
+    }
+    return;
   }
 
   if (canAssign && scanner_->match(Token::Type::EQUAL)) {
@@ -612,23 +635,23 @@ void Parser::namedVariable(Chunk& chunk, const Token& token, bool canAssign,
 void Parser::parsePrecedence(Chunk& chunk, int depth,
                              const Precedence& precedence) {
   scanner_->advance();
-  const auto rule = getRule(scanner_->previous());
-  if (rule.prefix == nullptr) {
+  ParseFn prefix = getRule(scanner_->previous()).prefix;
+  if (prefix == nullptr) {
     parse_error(scanner_->previous(), "Expected expression.");
     return;
   }
 
   bool canAssign = precedence <= Precedence::ASSIGNMENT;
-  rule.prefix(chunk, depth, canAssign);
+  (this->*prefix)(chunk, depth, canAssign);
 
   while (precedence <= getRule(scanner_->current()).precedence) {
     scanner_->advance();
-    const auto infixRule = getRule(scanner_->previous());
-    if (infixRule.infix == nullptr) {
+    ParseFn infix = getRule(scanner_->previous()).infix;
+    if (infix == nullptr) {
       parse_error(scanner_->previous(), "Expected infix expression.");
       return;
     }
-    infixRule.infix(chunk, depth, canAssign);
+    (this->*infix)(chunk, depth, canAssign);
   }
 }
 }  // namespace compiler
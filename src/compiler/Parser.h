@@ -1,10 +1,16 @@
 #pragma once
+#include <array>
+#include <cstddef>
 #include <string>
+#include <string_view>
 
 #include "Chunk.h"
+#include "Globals.h"
+#include "Heap.h"
 #include "Scanner.h"
 #include "ScannerFactory.h"
 #include "Scope.h"
+#include "Source.h"
 #include "Value.h"
 #include "debug.h"
 
@@ -25,21 +31,25 @@ enum class Precedence {
   PRIMARY,
 };
 
-struct ParseRule {
-  std::function<void(Chunk& chunk, int depth, bool canAssign)> prefix;
-  std::function<void(Chunk& chunk, int depth, bool canAssign)> infix;
-  const Precedence precedence;
-};
-
 class Parser {
  public:
-  Parser(const std::string& source, const std::string& scanner)
-      : scanner_{ScannerFactory::get(scanner)(source)} {}
+  Parser(std::string_view source, const std::string& scanner, Heap& heap,
+         Globals& globals)
+      : scanner_{ScannerFactory::get(scanner)(source)},
+        heap_(heap),
+        globals_(globals) {}
+  Parser(Source& source, const std::string& scanner, Heap& heap,
+         Globals& globals)
+      : scanner_{ScannerFactory::get(scanner, source)},
+        heap_(heap),
+        globals_(globals) {}
 
   Closure run();
 
  private:
   std::unique_ptr<Scanner> scanner_;
+  Heap& heap_;
+  Globals& globals_;
   bool hadError_{false};
 
   enum class FunctionType {
@@ -67,7 +77,7 @@ class Parser {
   void forStatement(Chunk& chunk, int depth);
   void returnStatement(Chunk& chunk, int depth);
   void expression(Chunk& chunk, int depth);
-  void function(Chunk& chunk, const std::string& name, const FunctionType& type,
+  void function(Chunk& chunk, std::string_view name, const FunctionType& type,
                 int depth);
   void grouping(Chunk& chunk, int depth, bool canAssign);
   void unary(Chunk& chunk, int depth, bool canAssign);
@@ -108,17 +118,49 @@ class Parser {
   }
   inline void emitConstant(Chunk& chunk, const Value& constant,
                            const OpCode& code, int line) {
-    auto offset = chunk.addConstant(constant);
+    int offset = chunk.addConstant(constant);
+    if (offset < 0) {
+      parse_error(scanner_->previous(), "Too many constants in one chunk.");
+    }
     chunk.addCode(code, line);
     chunk.addOperand(offset);
   }
 
+  inline Value makeString(std::string_view chars) {
+    return heap_.makeString(chars);
+  }
+
   inline void emitNamedVariable(Chunk& chunk, const OpCode& code,
                                 uint8_t offset, int line) {
     chunk.addCode(code, line);
     chunk.addOperand(offset);
   }
 
+  inline int resolveGlobal(const Token& name) {
+    int slot = globals_.resolve(heap_.makeString(name.lexeme));
+    if (slot == -1) {
+      parse_error(name, "Too many global variables.");
+    }
+    return slot;
+  }
+
+  inline void emitGlobal(Chunk& chunk, const OpCode& code, int slot,
+                         int line) {
+    chunk.addCode(code, line);
+    chunk.addOperand((slot >> 8) & 0xff);
+    chunk.addOperand(slot & 0xff);
+  }
+
+  // Property access instructions carry the index of their inline cache.
+  inline void emitCache(Chunk& chunk, const Token& name) {
+    int cache = chunk.addCache();
+    if (cache == -1) {
+      parse_error(name, "Too many property accesses in one function.");
+    }
+    chunk.addOperand((cache >> 8) & 0xff);
+    chunk.addOperand(cache & 0xff);
+  }
+
   inline int emitJump(Chunk& chunk, const OpCode& code, int line) {
     chunk.addCode(code, line);
     chunk.addOperand(0xff);
@@ -154,101 +196,52 @@ class Parser {
     throw ParseError(ss.str());
   }
 
-  const ParseRule& getRule(const Token& token) {
-    auto grouping = [this](Chunk& chunk, int depth, bool canAssign) {
-      this->grouping(chunk, depth, canAssign);
-    };
-    auto unary = [this](Chunk& chunk, int depth, bool canAssign) {
-      this->unary(chunk, depth, canAssign);
-    };
-    auto binary = [this](Chunk& chunk, int depth, bool canAssign) {
-      this->binary(chunk, depth, canAssign);
-    };
-    auto number = [this](Chunk& chunk, int depth, bool canAssign) {
-      this->number(chunk, depth, canAssign);
-    };
-    auto literal = [this](Chunk& chunk, int depth, bool canAssign) {
-      this->literal(chunk, depth, canAssign);
-    };
-    auto string = [this](Chunk& chunk, int depth, bool canAssign) {
-      this->string(chunk, depth, canAssign);
-    };
-    auto variable = [this](Chunk& chunk, int depth, bool canAssign) {
-      this->variable(chunk, depth, canAssign);
-    };
-    auto and_ = [this](Chunk& chunk, int depth, bool canAssign) {
-      this->and_(chunk, depth, canAssign);
-    };
-    auto or_ = [this](Chunk& chunk, int depth, bool canAssign) {
-      this->or_(chunk, depth, canAssign);
-    };
-    auto call = [this](Chunk& chunk, int depth, bool canAssign) {
-      this->call(chunk, depth, canAssign);
-    };
-    auto dot = [this](Chunk& chunk, int depth, bool canAssign) {
-      this->dot(chunk, depth, canAssign);
-    };
-    auto this_ = [this](Chunk& chunk, int depth, bool canAssign) {
-      this->this_(chunk, depth, canAssign);
-    };
-    auto super_ = [this](Chunk& chunk, int depth, bool canAssign) {
-      this->super_(chunk, depth, canAssign);
+  using ParseFn = void (Parser::*)(Chunk& chunk, int depth, bool canAssign);
+  struct ParseRule {
+    ParseFn prefix{nullptr};
+    ParseFn infix{nullptr};
+    Precedence precedence{Precedence::NONE};
+  };
+  static constexpr size_t kTokenTypes =
+      static_cast<size_t>(Token::Type::ERROR) + 1;
+
+  static constexpr std::array<ParseRule, kTokenTypes> ruleTable() {
+    using Type = Token::Type;
+    std::array<ParseRule, kTokenTypes> table{};
+    auto rule = [&table](Type type, ParseFn prefix, ParseFn infix,
+                         Precedence precedence = Precedence::NONE) {
+      table[static_cast<size_t>(type)] = {prefix, infix, precedence};
     };
+    rule(Type::LEFT_PAREN, &Parser::grouping, &Parser::call, Precedence::CALL);
+    rule(Type::DOT, nullptr, &Parser::dot, Precedence::CALL);
+    rule(Type::MINUS, &Parser::unary, &Parser::binary, Precedence::TERM);
+    rule(Type::PLUS, nullptr, &Parser::binary, Precedence::TERM);
+    rule(Type::SLASH, nullptr, &Parser::binary, Precedence::FACTOR);
+    rule(Type::STAR, nullptr, &Parser::binary, Precedence::FACTOR);
+    rule(Type::BANG, &Parser::unary, nullptr);
+    rule(Type::GREATER, nullptr, &Parser::binary, Precedence::COMPARISON);
+    rule(Type::LESS, nullptr, &Parser::binary, Precedence::COMPARISON);
+    rule(Type::BANG_EQUAL, nullptr, &Parser::binary, Precedence::EQUALITY);
+    rule(Type::EQUAL_EQUAL, nullptr, &Parser::binary, Precedence::EQUALITY);
+    rule(Type::GREATER_EQUAL, nullptr, &Parser::binary,
+         Precedence::COMPARISON);
+    rule(Type::LESS_EQUAL, nullptr, &Parser::binary, Precedence::COMPARISON);
+    rule(Type::IDENTIFIER, &Parser::variable, nullptr);
+    rule(Type::STRING, &Parser::string, nullptr);
+    rule(Type::NUMBER, &Parser::number, nullptr);
+    rule(Type::AND, nullptr, &Parser::and_, Precedence::AND);
+    rule(Type::FALSE, &Parser::literal, nullptr);
+    rule(Type::NIL, &Parser::literal, nullptr);
+    rule(Type::OR, nullptr, &Parser::or_, Precedence::OR);
+    rule(Type::SUPER, &Parser::super_, nullptr);
+    rule(Type::THIS, &Parser::this_, nullptr);
+    rule(Type::TRUE, &Parser::literal, nullptr);
+    return table;
+  }
 
-    static const std::vector<ParseRule> rules = {
-        {grouping, call, Precedence::CALL},         // LEFT_PAREN
-        {nullptr, nullptr, Precedence::NONE},       // RIGHT_PAREN
-        {nullptr, nullptr, Precedence::NONE},       // LEFT_BRACE
-        {nullptr, nullptr, Precedence::NONE},       // RIGHT_BRACE
-        {nullptr, nullptr, Precedence::NONE},       // COMMA
-        {nullptr, dot, Precedence::CALL},           // DOT
-        {unary, binary, Precedence::TERM},          // MINUS
-        {nullptr, binary, Precedence::TERM},        // PLUS
-        {nullptr, nullptr, Precedence::NONE},       // COLON
-        {nullptr, nullptr, Precedence::NONE},       // SEMICOLON
-        {nullptr, binary, Precedence::FACTOR},      // SLASH
-        {nullptr, binary, Precedence::FACTOR},      // STAR
-        {unary, nullptr, Precedence::NONE},         // BANG
-        {nullptr, nullptr, Precedence::NONE},       // EQUAL
-        {nullptr, binary, Precedence::COMPARISON},  // GREATER
-        {nullptr, binary, Precedence::COMPARISON},  // LESS
-        {nullptr, nullptr, Precedence::NONE},       // QUESTION
-        {nullptr, binary, Precedence::EQUALITY},    // BANG_EQUAL
-        {nullptr, binary, Precedence::EQUALITY},    // EQUAL_EQUAL
-        {nullptr, binary, Precedence::COMPARISON},  // GREATER_EQUAL
-        {nullptr, binary, Precedence::COMPARISON},  // LESS_EQUAL
-        {nullptr, nullptr, Precedence::NONE},       // MINUS_EQUAL
-        {nullptr, nullptr, Precedence::NONE},       // PLUS_EQUAL
-        {nullptr, nullptr, Precedence::NONE},       // SLASH_EQUAL
-        {nullptr, nullptr, Precedence::NONE},       // STAR_EQUAL
-        {nullptr, nullptr, Precedence::NONE},       // MINUS_MINUS
-        {nullptr, nullptr, Precedence::NONE},       // PLUS_PLUS
-        {variable, nullptr, Precedence::NONE},      // IDENTIFIER
-        {string, nullptr, Precedence::NONE},        // STRING
-        {number, nullptr, Precedence::NONE},        // NUMBER
-        {nullptr, and_, Precedence::AND},           // AND
-        {nullptr, nullptr, Precedence::NONE},       // CLASS
-        {nullptr, nullptr, Precedence::NONE},       // ELSE
-        {literal, nullptr, Precedence::NONE},       // FALSE
-        {nullptr, nullptr, Precedence::NONE},       // FUN
-        {nullptr, nullptr, Precedence::NONE},       // LAMBDA
-        {nullptr, nullptr, Precedence::NONE},       // FOR
-        {nullptr, nullptr, Precedence::NONE},       // IF
-        {literal, nullptr, Precedence::NONE},       // NIL
-        {nullptr, or_, Precedence::OR},             // OR
-        {nullptr, nullptr, Precedence::NONE},       // PRINT
-        {nullptr, nullptr, Precedence::NONE},       // RETURN
-        {super_, nullptr, Precedence::NONE},        // SUPER
-        {this_, nullptr, Precedence::NONE},         // THIS
-        {literal, nullptr, Precedence::NONE},       // TRUE;
-        {nullptr, nullptr, Precedence::NONE},       // VAR
-        {nullptr, nullptr, Precedence::NONE},       // WHILE
-        {nullptr, nullptr, Precedence::NONE},       // BREAK
-        {nullptr, nullptr, Precedence::NONE},       // CONTINUE
-        {nullptr, nullptr, Precedence::NONE},       // END
-        {nullptr, nullptr, Precedence::NONE},       // ERROR
-    };
-    return rules[static_cast<int>(token.type)];
+  static const ParseRule& getRule(const Token& token) {
+    static constexpr std::array<ParseRule, kTokenTypes> kRules = ruleTable();
+    return kRules[static_cast<size_t>(token.type)];
   }
 };
 
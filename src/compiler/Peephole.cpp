@@ -0,0 +1,105 @@
+#include "Peephole.h"
+
+#include <limits>
+
+namespace lox {
+namespace compiler {
+
+namespace {
+
+// Compare-and-branch form of a comparison, or POP_JUMP_IF_FALSE if `code`
+// is not one.
+OpCode compareAndJump(OpCode code) {
+  switch (code) {
+    case OpCode::EQUAL:
+      return OpCode::EQUAL_JUMP_IF_FALSE;
+    case OpCode::NOT_EQUAL:
+      return OpCode::NOT_EQUAL_JUMP_IF_FALSE;
+    case OpCode::GREATER:
+      return OpCode::GREATER_JUMP_IF_FALSE;
+    case OpCode::LESS:
+      return OpCode::LESS_JUMP_IF_FALSE;
+    case OpCode::GREATER_EQUAL:
+      return OpCode::GREATER_EQUAL_JUMP_IF_FALSE;
+    case OpCode::LESS_EQUAL:
+      return OpCode::LESS_EQUAL_JUMP_IF_FALSE;
+    default:
+      return OpCode::POP_JUMP_IF_FALSE;
+  }
+}
+
+}  // namespace
+
+void Peephole::optimize(Chunk& chunk) {
+  auto instructions = Bytecode::decode(chunk);
+  fuse(instructions);
+  Bytecode::encode(instructions, chunk);
+}
+
+void Peephole::fuse(std::vector<Bytecode::Instruction>& in) {
+  std::vector<bool> isTarget = Bytecode::targets(in);
+
+  // Both paths out of JUMP_IF_FALSE usually start by popping the condition;
+  // pop it before jumping instead, and land past the POP at the target. That
+  // POP stays where it is, in case something else reaches it.
+  std::vector<bool> removed(in.size(), false);
+  for (size_t i = 0; i + 1 < in.size(); i++) {
+    int target = in[i].target;
+    if (in[i].code == OpCode::JUMP_IF_FALSE &&
+        in[i + 1].code == OpCode::POP && !isTarget[i + 1] &&
+        target < static_cast<int>(in.size()) &&
+        in[target].code == OpCode::POP) {
+      in[i].code = OpCode::POP_JUMP_IF_FALSE;
+      in[i].target = target + 1;
+      isTarget[target + 1] = true;
+      removed[i + 1] = true;
+    }
+  }
+
+  // Whether in[j] can be folded into the instruction before it.
+  auto fusable = [&](size_t j, OpCode code) {
+    return j < in.size() && !isTarget[j] && !removed[j] && in[j].code == code;
+  };
+
+  for (size_t i = 0; i < in.size();) {
+    if (removed[i]) {
+      i++;
+      continue;
+    }
+
+    auto& instruction = in[i];
+    size_t next = i + 1;
+    OpCode compare = compareAndJump(instruction.code);
+    if (compare != OpCode::POP_JUMP_IF_FALSE &&
+        fusable(next, OpCode::POP_JUMP_IF_FALSE)) {
+      instruction.code = compare;
+      instruction.operands = in[next].operands;
+      instruction.target = in[next].target;
+      removed[next++] = true;
+    } else if (instruction.code == OpCode::POP &&
+               fusable(next, OpCode::POP)) {
+      uint8_t count = 1;
+      while (fusable(next, OpCode::POP) &&
+             count < std::numeric_limits<uint8_t>::max()) {
+        count++;
+        removed[next++] = true;
+      }
+      instruction.code = OpCode::POPN;
+      instruction.operands = {count};
+    } else if (instruction.code == OpCode::GET_LOCAL &&
+               fusable(next, OpCode::GET_LOCAL)) {
+      instruction.code = OpCode::GET_LOCAL_GET_LOCAL;
+      instruction.operands.push_back(in[next].operands[0]);
+      removed[next++] = true;
+    } else if (instruction.code == OpCode::CONSTANT &&
+               fusable(next, OpCode::ADD)) {
+      instruction.code = OpCode::ADD_CONST;
+      removed[next++] = true;
+    }
+    i = next;
+  }
+  Bytecode::remove(in, removed);
+}
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <vector>
+
+#include "Bytecode.h"
+#include "Chunk.h"
+
+namespace lox {
+namespace compiler {
+
+// Post-compile pass that fuses common instruction sequences of a chunk into
+// superinstructions:
+//
+//   JUMP_IF_FALSE t; POP   (t is a POP)  ->  POP_JUMP_IF_FALSE t+1
+//   LESS; POP_JUMP_IF_FALSE t            ->  LESS_JUMP_IF_FALSE t
+//   POP; POP; ...                        ->  POPN n
+//   GET_LOCAL a; GET_LOCAL b             ->  GET_LOCAL_GET_LOCAL a b
+//   CONSTANT k; ADD                      ->  ADD_CONST k
+//
+// and the same compare-and-branch fusion for the other comparisons. Nothing
+// is fused across a jump target.
+class Peephole {
+ public:
+  static void optimize(Chunk& chunk);
+
+ private:
+  static void fuse(std::vector<Bytecode::Instruction>& instructions);
+};
+
+}  // namespace compiler
+}  // namespace lox
@@ -1,11 +1,68 @@
 #include "ReadAllScanner.h"
 
+#include <algorithm>
+#include <memory>
+#include <thread>
+
 namespace lox {
 namespace compiler {
 
-ReadAllScanner::ReadAllScanner(const std::string& source)
-    : Scanner(std::move(source)), current_token_{0} {
-  scan();
+namespace {
+
+// Smaller pieces cost more in threads than they save.
+constexpr size_t kPieceSize = 1 << 20;
+
+// The tokens of a piece of the source, scanned from its first byte as if
+// nothing came before it. A piece starts a line but may start inside a
+// string or a block comment, so its first tokens can be wrong; the ones from
+// where it agrees with the tokens before it are right, save for an offset in
+// their lines.
+class Piece final : public Scanner {
+ public:
+  Piece(std::string_view source, size_t begin) : Scanner(source) {
+    seek(begin, 1);
+  }
+
+  const Token& current() const override { return tokens.back(); }
+  const Token& previous() const override { return tokens.back(); }
+  const Token& advance() override { return tokens.back(); }
+
+  // Scans up to the first token that ends at or past `end`, an error or the
+  // end of the source.
+  void scan(size_t end) {
+    tokens.reserve((end - offset()) / 4 + 1);
+    ends.reserve(tokens.capacity());
+    Token::Type type;
+    do {
+      tokens.push_back(scanToken());
+      ends.push_back(offset());
+      type = tokens.back().type;
+    } while (ends.back() < end && type != Token::Type::ERROR &&
+             type != Token::Type::END);
+  }
+
+  std::vector<Token> tokens;
+  // Where each token ends. That and its line are all a scanner carries from
+  // one token to the next.
+  std::vector<size_t> ends;
+};
+
+}  // namespace
+
+ReadAllScanner::ReadAllScanner(std::string_view source, unsigned threads)
+    : Scanner(source), current_token_{0} {
+  // Scripts run to a token every three to five bytes. Regrowing the vector
+  // costs more than the scanning itself on large ones.
+  tokens_.reserve(source.size() / 4 + 1);
+  if (threads == 0) {
+    threads = std::min<size_t>(std::thread::hardware_concurrency(),
+                               source.size() / kPieceSize);
+  }
+  if (threads > 1) {
+    scan(source, threads);
+  } else {
+    scan();
+  }
 }
 ReadAllScanner::~ReadAllScanner(){};
 
@@ -19,16 +76,93 @@ const Token& ReadAllScanner::advance() {
 }
 
 void ReadAllScanner::scan() {
-  while (const char c = peekChar()) {
-    auto maybeToken = getToken(c);
-    if (maybeToken.has_value()) {
-      if (maybeToken.value().type == Token::Type::ERROR) {
-        parse_error(current(), "Unexpected error token");
+  while (!push(scanToken())) {
+  }
+}
+
+// Each thread scans a piece of the source starting a line. The pieces are
+// then joined in order: from the end of the tokens so far, this scanner goes
+// on by itself until its last token ends where one of the next piece's does,
+// and takes the piece's tokens from there. Usually that is the piece's first
+// token, scanned twice.
+void ReadAllScanner::scan(std::string_view source, unsigned threads) {
+  std::vector<size_t> starts{0};
+  for (unsigned i = 1; i < threads; i++) {
+    size_t newline = source.find(
+        '\n', std::max(starts.back(), source.size() / threads * i));
+    if (newline == std::string_view::npos) {
+      break;
+    }
+    if (newline + 1 < source.size()) {
+      starts.push_back(newline + 1);
+    }
+  }
+  std::vector<std::unique_ptr<Piece>> pieces;
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < starts.size(); i++) {
+    size_t end = i + 1 < starts.size() ? starts[i + 1] : source.size();
+    pieces.push_back(std::make_unique<Piece>(source, starts[i]));
+    Piece* piece = pieces.back().get();
+    if (i == 0) {
+      continue;
+    }
+    workers.emplace_back([piece, end] { piece->scan(end); });
+  }
+  pieces[0]->scan(starts.size() > 1 ? starts[1] : source.size());
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  size_t end = 0;
+  int line = 1;
+  for (size_t i = 0; i < pieces.size(); i++) {
+    const Piece& piece = *pieces[i];
+    auto sync = piece.ends.begin();
+    // The piece's line at `end`.
+    int from = 1;
+    if (end != starts[i]) {
+      seek(end, line);
+      while (true) {
+        sync = std::lower_bound(sync, piece.ends.end(), end);
+        if (sync == piece.ends.end() || *sync == end) {
+          break;
+        }
+        Token token = scanToken();
+        if (push(token)) {
+          return;
+        }
+        end = offset();
+        line = token.line;
+      }
+      if (sync == piece.ends.end()) {
+        continue;
       }
-      tokens_.push_back(std::move(maybeToken.value()));
+      from = piece.tokens[sync - piece.ends.begin()].line;
+      ++sync;
     }
+    for (size_t t = sync - piece.ends.begin(); t < piece.tokens.size(); t++) {
+      Token token = piece.tokens[t];
+      if (token.type != Token::Type::END) {
+        token.line += line - from;
+      }
+      if (push(token)) {
+        return;
+      }
+    }
+    end = piece.ends.back();
+    line = tokens_.back().line;
+  }
+  seek(end, line);
+  scan();
+}
+
+bool ReadAllScanner::push(const Token& token) {
+  if (token.type == Token::Type::ERROR) {
+    // There is no current token yet to report it at.
+    parse_error(token, "Unexpected error token");
   }
-  tokens_.push_back(end());
+  tokens_.push_back(token);
+  return token.type == Token::Type::END;
 }
 
 }  // namespace compiler
@@ -9,7 +9,9 @@ namespace compiler {
 
 class ReadAllScanner : public Scanner {
  public:
-  ReadAllScanner(const std::string& source);
+  // Scans on `threads` threads, with the same tokens as on one; 0 takes one
+  // per megabyte of source, up to the number of cores.
+  ReadAllScanner(std::string_view source, unsigned threads = 1);
   ~ReadAllScanner() override;
 
   const Token& current() const override;
@@ -21,6 +23,10 @@ class ReadAllScanner : public Scanner {
   int current_token_;
 
   void scan();
+  void scan(std::string_view source, unsigned threads);
+  // Adds `token`. Returns true at the end of the source and throws on an
+  // error.
+  bool push(const Token& token);
 };
 }  // namespace compiler
 }  // namespace lox
\ No newline at end of file
@@ -1,36 +1,83 @@
 #include "ReadByOneScanner.h"
 
+#include <algorithm>
+
 #include "ParseError.h"
 #include "Token.h"
 
 namespace lox {
 namespace compiler {
-ReadByOneScanner::ReadByOneScanner(const std::string& source)
+
+namespace {
+
+// The scanner looks at most this many bytes past a token, for the ".5" of a
+// number.
+constexpr size_t kLookahead = 2;
+
+}  // namespace
+
+ReadByOneScanner::ReadByOneScanner(std::string_view source)
     : Scanner(source), current_token_(end()), previous_token_(end()) {
   advance();
 }
+ReadByOneScanner::ReadByOneScanner(Source& source)
+    : Scanner(source.streamed() ? std::string_view() : source.text()),
+      current_token_(end()),
+      previous_token_(end()),
+      stream_(source.streamed() ? &source : nullptr) {
+  advance();
+}
 ReadByOneScanner::~ReadByOneScanner() {}
 
 const Token& ReadByOneScanner::current() const { return current_token_; }
 const Token& ReadByOneScanner::previous() const { return previous_token_; }
 const Token& ReadByOneScanner::advance() {
-  if (!isEndOfSource()) {
-    auto maybeToken = getToken(peekChar());
-    while (!maybeToken.has_value()) {
-      maybeToken = getToken(peekChar());
-    }
-    if (maybeToken.value().type == Token::Type::ERROR) {
-      parse_error(current(), "Error token after.");
-    }
-
-    previous_token_ = std::move(current_token_);
-    current_token_ = std::move(maybeToken.value());
-  } else {
-    previous_token_ = std::move(current_token_);
-    current_token_ = end();
+  Token token = stream_ ? scanStreamed() : scanToken();
+  if (token.type == Token::Type::ERROR) {
+    parse_error(current(), "Error token after.");
   }
+  previous_token_ = current_token_;
+  current_token_ = token;
   return previous();
 }
 
+// A token that reaches the end of the window may go on past it, so the
+// window is refilled and the token scanned again until it ends short of the
+// window's end or the stream does.
+Token ReadByOneScanner::scanStreamed() {
+  size_t start = offset();
+  int line = this->line();
+  Token token = scanToken();
+  while (!streamEnded_ && offset() + kLookahead > window_.size()) {
+    refill(start);
+    seek(window_, start, line);
+    token = scanToken();
+  }
+  if (token.type == Token::Type::IDENTIFIER) {
+    token.lexeme = *names_.emplace(token.lexeme).first;
+  } else if (keyword(token.lexeme) == token.type) {
+    token.lexeme = kKeywordTable[keywordSlot(token.lexeme)].word;
+  }
+  return token;
+}
+
+// Drops the window up to `start`, or to the current token if that is in the
+// window, and reads the next chunk of the stream onto it. `start` and the
+// current token are moved along.
+void ReadByOneScanner::refill(size_t& start) {
+  const char* lexeme = current_token_.lexeme.data();
+  bool held = lexeme >= window_.data() &&
+              lexeme <= window_.data() + window_.size();
+  size_t drop = held ? std::min<size_t>(start, lexeme - window_.data()) : start;
+  size_t kept = held ? lexeme - window_.data() - drop : 0;
+  window_.erase(0, drop);
+  start -= drop;
+  streamEnded_ = !stream_->read(window_);
+  if (held) {
+    current_token_.lexeme = std::string_view(window_.data() + kept,
+                                             current_token_.lexeme.size());
+  }
+}
+
 }  // namespace compiler
 }  // namespace lox
\ No newline at end of file
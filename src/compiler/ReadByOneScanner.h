@@ -1,13 +1,20 @@
 #pragma once
 
+#include <string>
+#include <unordered_set>
+
 #include "Scanner.h"
+#include "Source.h"
 
 namespace lox {
 namespace compiler {
 
 class ReadByOneScanner : public Scanner {
  public:
-  ReadByOneScanner(const std::string& source);
+  ReadByOneScanner(std::string_view source);
+  // Reads a streamed `source` as it goes, holding little more than the
+  // longest token in memory; other sources are scanned in place.
+  explicit ReadByOneScanner(Source& source);
   ~ReadByOneScanner() override;
 
   const Token& current() const override;
@@ -17,6 +24,17 @@ class ReadByOneScanner : public Scanner {
  private:
   Token current_token_;
   Token previous_token_;
+
+  // A streamed source and the part of it from the current token on. The
+  // parser holds on to names long after scanning them, so identifiers point
+  // into `names_` instead.
+  Source* stream_{nullptr};
+  bool streamEnded_{false};
+  std::string window_;
+  std::unordered_set<std::string> names_;
+
+  Token scanStreamed();
+  void refill(size_t& start);
 };
 }  // namespace compiler
 }  // namespace lox
\ No newline at end of file
@@ -0,0 +1,117 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace lox {
+namespace compiler {
+
+// X-macro list of the register backend's opcodes with their operand format,
+// one character per operand:
+//
+//   r  register          k  constant           u  upvalue
+//   n  argument count    g  global slot (2)    c  property cache (2)
+//   j  forward jump (2)  b  backward jump (2)
+//
+// A register is a slot of the current frame; locals keep their slot numbers.
+// The destination, when there is one, comes first.
+#define LOX_REGISTER_OPCODES(X)         \
+  X(MOVE, "rr")                         \
+  X(LOAD_CONSTANT, "rk")                \
+  X(LOAD_NIL, "r")                      \
+  X(LOAD_TRUE, "r")                     \
+  X(LOAD_FALSE, "r")                    \
+  X(GET_GLOBAL, "rg")                   \
+  X(SET_GLOBAL, "rg")                   \
+  X(DEFINE_GLOBAL, "rg")                \
+  X(GET_UPVALUE, "ru")                  \
+  X(SET_UPVALUE, "ru")                  \
+  X(GET_PROPERTY, "rrkc")               \
+  X(SET_PROPERTY, "rrkc")               \
+  X(ADD, "rrr")                         \
+  X(SUBSTRACT, "rrr")                   \
+  X(MULTIPLY, "rrr")                    \
+  X(DIVIDE, "rrr")                      \
+  X(ADD_CONSTANT, "rrk")                \
+  X(SUBSTRACT_CONSTANT, "rrk")          \
+  X(EQUAL, "rrr")                       \
+  X(NOT_EQUAL, "rrr")                   \
+  X(GREATER, "rrr")                     \
+  X(LESS, "rrr")                        \
+  X(GREATER_EQUAL, "rrr")               \
+  X(LESS_EQUAL, "rrr")                  \
+  X(NEGATE, "rr")                       \
+  X(NOT, "rr")                          \
+  X(JUMP, "j")                          \
+  X(LOOP, "b")                          \
+  X(JUMP_IF_FALSE, "rj")                \
+  X(EQUAL_JUMP_IF_FALSE, "rrj")         \
+  X(NOT_EQUAL_JUMP_IF_FALSE, "rrj")     \
+  X(GREATER_JUMP_IF_FALSE, "rrj")       \
+  X(LESS_JUMP_IF_FALSE, "rrj")          \
+  X(GREATER_EQUAL_JUMP_IF_FALSE, "rrj") \
+  X(LESS_EQUAL_JUMP_IF_FALSE, "rrj")    \
+  X(PRINT, "r")                         \
+  X(CALL, "rn")                         \
+  X(INVOKE, "rkn")                      \
+  X(SUPER_INVOKE, "rkn")                \
+  X(GET_SUPER, "rrrk")                  \
+  X(CLOSURE, "rk")                      \
+  X(CLOSE_UPVALUE, "r")                 \
+  X(CLASS, "rk")                        \
+  X(METHOD, "rrk")                      \
+  X(INHERIT, "rr")                      \
+  X(RETURN, "r")
+
+enum class RegisterOp {
+#define LOX_REGISTER_OPCODE_ENUM(name, format) name,
+  LOX_REGISTER_OPCODES(LOX_REGISTER_OPCODE_ENUM)
+#undef LOX_REGISTER_OPCODE_ENUM
+};
+
+const std::vector<std::string> registerCodes{
+#define LOX_REGISTER_OPCODE_NAME(name, format) #name,
+    LOX_REGISTER_OPCODES(LOX_REGISTER_OPCODE_NAME)
+#undef LOX_REGISTER_OPCODE_NAME
+};
+
+constexpr const char* kRegisterFormats[] = {
+#define LOX_REGISTER_OPCODE_FORMAT(name, format) format,
+    LOX_REGISTER_OPCODES(LOX_REGISTER_OPCODE_FORMAT)
+#undef LOX_REGISTER_OPCODE_FORMAT
+};
+
+inline const char* registerFormat(RegisterOp code) {
+  return kRegisterFormats[static_cast<size_t>(code)];
+}
+
+constexpr size_t operandSize(char format) {
+  return format == 'g' || format == 'c' || format == 'j' || format == 'b' ? 2
+                                                                         : 1;
+}
+
+// Size in bytes of an instruction, opcode included.
+inline size_t instructionSize(RegisterOp code) {
+  size_t size = 1;
+  for (const char* format = registerFormat(code); *format; format++) {
+    size += operandSize(*format);
+  }
+  return size;
+}
+
+// Register form of a chunk's code, which the register backend runs instead
+// of `Chunk::code`. Constants and property caches stay in the chunk. Empty
+// for a function that needs too many registers, which runs its stack code.
+struct RegisterCode {
+  // Register operands are one byte.
+  static constexpr size_t kMaxRegisters = 256;
+
+  std::vector<uint8_t> code;
+  std::vector<int> lines;
+  // Registers the frame needs, counting the callee and the arguments.
+  size_t frameSize{0};
+};
+
+}  // namespace compiler
+}  // namespace lox
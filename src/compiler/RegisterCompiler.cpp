@@ -0,0 +1,492 @@
+#include "RegisterCompiler.h"
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include "ParseError.h"
+
+namespace lox {
+namespace compiler {
+
+namespace {
+
+RegisterOp registerForm(OpCode code) {
+  switch (code) {
+    case OpCode::ADD:
+      return RegisterOp::ADD;
+    case OpCode::SUBSTRACT:
+      return RegisterOp::SUBSTRACT;
+    case OpCode::MULTIPLY:
+      return RegisterOp::MULTIPLY;
+    case OpCode::DIVIDE:
+      return RegisterOp::DIVIDE;
+    case OpCode::EQUAL:
+      return RegisterOp::EQUAL;
+    case OpCode::NOT_EQUAL:
+      return RegisterOp::NOT_EQUAL;
+    case OpCode::GREATER:
+      return RegisterOp::GREATER;
+    case OpCode::LESS:
+      return RegisterOp::LESS;
+    case OpCode::GREATER_EQUAL:
+      return RegisterOp::GREATER_EQUAL;
+    case OpCode::LESS_EQUAL:
+      return RegisterOp::LESS_EQUAL;
+    default:
+      throw std::logic_error("not a binary operator: " +
+                             codes[static_cast<size_t>(code)]);
+  }
+}
+
+RegisterOp compareJump(OpCode code) {
+  switch (code) {
+    case OpCode::EQUAL:
+      return RegisterOp::EQUAL_JUMP_IF_FALSE;
+    case OpCode::NOT_EQUAL:
+      return RegisterOp::NOT_EQUAL_JUMP_IF_FALSE;
+    case OpCode::GREATER:
+      return RegisterOp::GREATER_JUMP_IF_FALSE;
+    case OpCode::LESS:
+      return RegisterOp::LESS_JUMP_IF_FALSE;
+    case OpCode::GREATER_EQUAL:
+      return RegisterOp::GREATER_EQUAL_JUMP_IF_FALSE;
+    case OpCode::LESS_EQUAL:
+      return RegisterOp::LESS_EQUAL_JUMP_IF_FALSE;
+    default:
+      return RegisterOp::JUMP_IF_FALSE;
+  }
+}
+
+}  // namespace
+
+bool RegisterCompiler::compile(Chunk& chunk, int arity) {
+  chunk.registers = RegisterCode();
+  // Register d holds the value at stack depth d.
+  if (Bytecode::maxDepth(chunk, arity) > RegisterCode::kMaxRegisters) {
+    return false;
+  }
+  RegisterCompiler compiler(chunk);
+  compiler.instructions_ = Bytecode::decode(chunk);
+  compiler.targets_ = Bytecode::targets(compiler.instructions_);
+  size_t count = compiler.instructions_.size();
+  compiler.offsets_.assign(count + 1, -1);
+  compiler.depths_.assign(count + 1, -1);
+
+  // The callee and its arguments.
+  for (int slot = 0; slot <= arity; slot++) {
+    compiler.push({Operand::Kind::REGISTER, static_cast<uint8_t>(slot)});
+  }
+  for (size_t i = 0; i < count;) {
+    if (compiler.targets_[i]) {
+      compiler.label(i);
+    }
+    compiler.offsets_[i] = static_cast<int>(chunk.registers.code.size());
+    i = compiler.translate(i);
+  }
+  compiler.offsets_[count] = static_cast<int>(chunk.registers.code.size());
+  compiler.patchJumps();
+  return true;
+}
+
+size_t RegisterCompiler::translate(size_t i) {
+  using Kind = Operand::Kind;
+  const Instruction& instruction = instructions_[i];
+  const auto& operands = instruction.operands;
+  line_ = instruction.line;
+  reachable_ = true;
+
+  switch (instruction.code) {
+    case OpCode::CONSTANT:
+      push({Kind::CONSTANT, operands[0]});
+      break;
+    case OpCode::NIL:
+      push({Kind::NIL, 0});
+      break;
+    case OpCode::TRUE:
+      push({Kind::TRUE, 0});
+      break;
+    case OpCode::FALSE:
+      push({Kind::FALSE, 0});
+      break;
+    case OpCode::POP:
+      pop();
+      break;
+    case OpCode::GET_LOCAL:
+      push(stack_[operands[0]]);
+      break;
+    case OpCode::SET_LOCAL:
+      setLocal(operands[0]);
+      break;
+    case OpCode::GET_GLOBAL: {
+      auto reg = static_cast<uint8_t>(stack_.size());
+      emitResult(RegisterOp::GET_GLOBAL, {reg, operands[0], operands[1]});
+      push({Kind::REGISTER, reg});
+      break;
+    }
+    case OpCode::SET_GLOBAL:
+      emit(RegisterOp::SET_GLOBAL, {read(top()), operands[0], operands[1]});
+      break;
+    case OpCode::DEFINE_GLOBAL:
+      emit(RegisterOp::DEFINE_GLOBAL, {read(top()), operands[0], operands[1]});
+      pop();
+      break;
+    case OpCode::GET_UPVALUE: {
+      auto reg = static_cast<uint8_t>(stack_.size());
+      emitResult(RegisterOp::GET_UPVALUE, {reg, operands[0]});
+      push({Kind::REGISTER, reg});
+      break;
+    }
+    case OpCode::SET_UPVALUE:
+      emit(RegisterOp::SET_UPVALUE, {read(top()), operands[0]});
+      break;
+    case OpCode::GET_PROPERTY: {
+      auto reg = static_cast<uint8_t>(top());
+      uint8_t object = read(top());
+      pop();
+      emitResult(RegisterOp::GET_PROPERTY,
+                 {reg, object, operands[0], operands[1], operands[2]});
+      push({Kind::REGISTER, reg});
+      break;
+    }
+    case OpCode::SET_PROPERTY: {
+      auto reg = static_cast<uint8_t>(top() - 1);
+      uint8_t object = read(top() - 1);
+      uint8_t value = read(top());
+      emit(RegisterOp::SET_PROPERTY,
+           {object, value, operands[0], operands[1], operands[2]});
+      // The value is left where the object was.
+      Operand result = pop();
+      pop();
+      bool popped = i + 1 < instructions_.size() && !targets_[i + 1] &&
+                    instructions_[i + 1].code == OpCode::POP;
+      if (result.kind == Kind::REGISTER && result.index > reg && !popped) {
+        emitResult(RegisterOp::MOVE, {reg, result.index});
+        result = {Kind::REGISTER, reg};
+      }
+      push(result);
+      break;
+    }
+    case OpCode::NEGATE:
+    case OpCode::NOT: {
+      auto reg = static_cast<uint8_t>(top());
+      uint8_t operand = read(top());
+      pop();
+      emitResult(instruction.code == OpCode::NEGATE ? RegisterOp::NEGATE
+                                                    : RegisterOp::NOT,
+                 {reg, operand});
+      push({Kind::REGISTER, reg});
+      break;
+    }
+    case OpCode::ADD:
+    case OpCode::SUBSTRACT:
+    case OpCode::MULTIPLY:
+    case OpCode::DIVIDE:
+      binary(instruction.code);
+      break;
+    case OpCode::EQUAL:
+    case OpCode::NOT_EQUAL:
+    case OpCode::GREATER:
+    case OpCode::LESS:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::LESS_EQUAL:
+      // A comparison only feeding a branch becomes a compare-and-branch.
+      if (i + 1 < instructions_.size() && !targets_[i + 1] &&
+          ((instructions_[i + 1].code == OpCode::JUMP_IF_FALSE &&
+            poppedAfter(i + 1)) ||
+           instructions_[i + 1].code == OpCode::POP_JUMP_IF_FALSE)) {
+        binary(instruction.code, instructions_[i + 1].target,
+               instructions_[i + 1].code == OpCode::POP_JUMP_IF_FALSE);
+        return i + 2;
+      }
+      binary(instruction.code);
+      break;
+    case OpCode::PRINT:
+      emit(RegisterOp::PRINT, {read(top())});
+      break;
+    case OpCode::JUMP_IF_FALSE: {
+      // The condition only has to be in its slot if something reads it.
+      bool popped = poppedAfter(i);
+      flush(popped ? top() : stack_.size());
+      emitJump(RegisterOp::JUMP_IF_FALSE, {read(top())}, instruction.target);
+      break;
+    }
+    case OpCode::POP_JUMP_IF_FALSE: {
+      // The SSA lowering emits this one even without the peephole pass.
+      flush(top());
+      uint8_t condition = read(top());
+      pop();
+      emitJump(RegisterOp::JUMP_IF_FALSE, {condition}, instruction.target);
+      break;
+    }
+    case OpCode::JUMP:
+    case OpCode::LOOP:
+      flush();
+      emitJump(instruction.code == OpCode::JUMP ? RegisterOp::JUMP
+                                                : RegisterOp::LOOP,
+               {}, instruction.target);
+      reachable_ = false;
+      break;
+    case OpCode::CALL:
+    case OpCode::INVOKE:
+    case OpCode::SUPER_INVOKE: {
+      // Calls may run code that changes this frame's locals through
+      // upvalues, so nothing may still be read from them afterwards.
+      flush();
+      uint8_t argCount = operands.back();
+      size_t values = argCount + 1u;
+      if (instruction.code == OpCode::SUPER_INVOKE) {
+        values++;
+      }
+      auto base = static_cast<uint8_t>(stack_.size() - values);
+      if (instruction.code == OpCode::CALL) {
+        emit(RegisterOp::CALL, {base, argCount});
+      } else {
+        emit(instruction.code == OpCode::INVOKE ? RegisterOp::INVOKE
+                                                : RegisterOp::SUPER_INVOKE,
+             {base, operands[0], argCount});
+      }
+      stack_.resize(base);
+      push({Kind::REGISTER, base});
+      break;
+    }
+    case OpCode::GET_SUPER: {
+      auto reg = static_cast<uint8_t>(top() - 1);
+      uint8_t self = read(top() - 1);
+      uint8_t superclass = read(top());
+      pop();
+      pop();
+      emitResult(RegisterOp::GET_SUPER, {reg, self, superclass, operands[0]});
+      push({Kind::REGISTER, reg});
+      break;
+    }
+    case OpCode::CLOSURE: {
+      // Captured locals are referred to by address.
+      flush();
+      auto reg = static_cast<uint8_t>(stack_.size());
+      emit(RegisterOp::CLOSURE, {reg, operands[0]});
+      push({Kind::REGISTER, reg});
+      break;
+    }
+    case OpCode::CLOSE_UPVALUE: {
+      materialize(top());
+      emit(RegisterOp::CLOSE_UPVALUE, {static_cast<uint8_t>(top())});
+      pop();
+      break;
+    }
+    case OpCode::CLASS: {
+      auto reg = static_cast<uint8_t>(stack_.size());
+      emitResult(RegisterOp::CLASS, {reg, operands[0]});
+      push({Kind::REGISTER, reg});
+      break;
+    }
+    case OpCode::METHOD:
+      emit(RegisterOp::METHOD, {read(top() - 1), read(top()), operands[0]});
+      pop();
+      break;
+    case OpCode::INHERIT:
+      emit(RegisterOp::INHERIT, {read(top() - 1), read(top())});
+      pop();
+      break;
+    case OpCode::RETURN:
+      emit(RegisterOp::RETURN, {read(top())});
+      pop();
+      reachable_ = false;
+      break;
+    default:
+      throw std::logic_error("no register form for " +
+                             codes[static_cast<size_t>(instruction.code)]);
+  }
+  return i + 1;
+}
+
+void RegisterCompiler::label(size_t i) {
+  if (reachable_) {
+    flush();
+  }
+  last_ = -1;
+  // Coming from a jump, the depth is the one recorded there; every value is
+  // in its slot on all incoming edges.
+  size_t depth = depths_[i] != -1 ? depths_[i] : stack_.size();
+  stack_.resize(std::min(depth, stack_.size()));
+  while (stack_.size() < depth) {
+    push({Operand::Kind::REGISTER, static_cast<uint8_t>(stack_.size())});
+  }
+}
+
+void RegisterCompiler::binary(OpCode code, int target, bool popped) {
+  using Kind = Operand::Kind;
+  size_t position = top() - 1;
+  auto reg = static_cast<uint8_t>(position);
+  const Operand right = stack_[top()];
+  bool constant = right.kind == Kind::CONSTANT && target == -1 &&
+                  (code == OpCode::ADD || code == OpCode::SUBSTRACT);
+  if (target != -1) {
+    flush(position);
+  }
+  uint8_t a = read(position);
+  uint8_t b = constant ? right.index : read(top());
+  pop();
+  pop();
+
+  if (target != -1) {
+    // The comparison's slot is popped on both paths without being read.
+    if (!popped) {
+      push({Kind::REGISTER, reg});
+    }
+    emitJump(compareJump(code), {a, b}, target);
+    return;
+  }
+  if (constant) {
+    emitResult(code == OpCode::ADD ? RegisterOp::ADD_CONSTANT
+                                   : RegisterOp::SUBSTRACT_CONSTANT,
+               {reg, a, b});
+  } else {
+    emitResult(registerForm(code), {reg, a, b});
+  }
+  push({Kind::REGISTER, reg});
+}
+
+void RegisterCompiler::setLocal(uint8_t slot) {
+  const Operand value = stack_.back();
+  if (value.inRegister(slot)) {
+    return;
+  }
+  // Values still to be read from the local keep its old contents.
+  for (size_t position = slot + 1u; position < top(); position++) {
+    if (stack_[position].inRegister(slot)) {
+      materialize(position);
+    }
+  }
+  if (value.inRegister(top()) && retarget(static_cast<uint8_t>(top()), slot)) {
+    stack_.back() = {Operand::Kind::REGISTER, slot};
+  } else {
+    load(slot, value);
+  }
+  stack_[slot] = {Operand::Kind::REGISTER, slot};
+}
+
+bool RegisterCompiler::poppedAfter(size_t i) const {
+  const Instruction& jump = instructions_[i];
+  return i + 1 < instructions_.size() &&
+         instructions_[i + 1].code == OpCode::POP &&
+         static_cast<size_t>(jump.target) < instructions_.size() &&
+         instructions_[jump.target].code == OpCode::POP;
+}
+
+void RegisterCompiler::push(Operand operand) {
+  stack_.push_back(operand);
+  out_.frameSize = std::max(out_.frameSize, stack_.size());
+}
+
+RegisterCompiler::Operand RegisterCompiler::pop() {
+  // What the last instruction wrote may be gone.
+  last_ = -1;
+  Operand operand = stack_.back();
+  stack_.pop_back();
+  return operand;
+}
+
+uint8_t RegisterCompiler::read(size_t position) {
+  const Operand& operand = stack_[position];
+  if (operand.kind == Operand::Kind::REGISTER) {
+    return operand.index;
+  }
+  materialize(position);
+  return static_cast<uint8_t>(position);
+}
+
+void RegisterCompiler::materialize(size_t position) {
+  auto reg = static_cast<uint8_t>(position);
+  if (!stack_[position].inRegister(reg)) {
+    load(reg, stack_[position]);
+    stack_[position] = {Operand::Kind::REGISTER, reg};
+  }
+}
+
+void RegisterCompiler::flush(size_t end) {
+  for (size_t position = 0; position < end; position++) {
+    materialize(position);
+  }
+}
+
+void RegisterCompiler::load(uint8_t reg, const Operand& operand) {
+  switch (operand.kind) {
+    case Operand::Kind::REGISTER:
+      emitResult(RegisterOp::MOVE, {reg, operand.index});
+      break;
+    case Operand::Kind::CONSTANT:
+      emitResult(RegisterOp::LOAD_CONSTANT, {reg, operand.index});
+      break;
+    case Operand::Kind::NIL:
+      emitResult(RegisterOp::LOAD_NIL, {reg});
+      break;
+    case Operand::Kind::TRUE:
+      emitResult(RegisterOp::LOAD_TRUE, {reg});
+      break;
+    case Operand::Kind::FALSE:
+      emitResult(RegisterOp::LOAD_FALSE, {reg});
+      break;
+  }
+}
+
+bool RegisterCompiler::retarget(uint8_t from, uint8_t to) {
+  if (last_ == -1 || out_.code[last_ + 1] != from) {
+    return false;
+  }
+  out_.code[last_ + 1] = to;
+  return true;
+}
+
+void RegisterCompiler::emit(RegisterOp code,
+                            std::initializer_list<uint8_t> operands) {
+  last_ = -1;
+  out_.code.push_back(static_cast<uint8_t>(code));
+  out_.lines.push_back(line_);
+  for (uint8_t operand : operands) {
+    out_.code.push_back(operand);
+    out_.lines.push_back(0);
+  }
+}
+
+void RegisterCompiler::emitResult(RegisterOp code,
+                                  std::initializer_list<uint8_t> operands) {
+  int offset = static_cast<int>(out_.code.size());
+  emit(code, operands);
+  last_ = offset;
+}
+
+void RegisterCompiler::emitJump(RegisterOp code,
+                                std::initializer_list<uint8_t> operands,
+                                int target) {
+  emit(code, operands);
+  patches_.push_back({out_.code.size(), target});
+  out_.code.insert(out_.code.end(), 2, 0);
+  out_.lines.insert(out_.lines.end(), 2, 0);
+  if (depths_[target] == -1) {
+    depths_[target] = static_cast<int>(stack_.size());
+  }
+}
+
+void RegisterCompiler::patchJumps() {
+  for (const auto& patch : patches_) {
+    size_t end = patch.at + 2;
+    size_t target = offsets_[patch.target];
+    size_t jump = target < end ? end - target : target - end;
+    if (jump > std::numeric_limits<uint16_t>::max()) {
+      error("Too much code to jump over.");
+    }
+    out_.code[patch.at] = (jump >> 8) & 0xff;
+    out_.code[patch.at + 1] = jump & 0xff;
+  }
+}
+
+void RegisterCompiler::error(const std::string& message) const {
+  std::stringstream ss;
+  ss << "ParseError [line " << line_ << "]: " << message << "\n";
+  throw ParseError(ss.str());
+}
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include "Bytecode.h"
+#include "Chunk.h"
+#include "RegisterCode.h"
+
+namespace lox {
+namespace compiler {
+
+// Translates a chunk's stack bytecode into the three-address form the
+// register backend runs, leaving it in `chunk.registers`.
+//
+// Every stack slot of a frame becomes a register: locals keep their slot
+// numbers and the value at stack depth d lives in register d. Loads of
+// locals and literals are not copied into place right away. The translator
+// tracks where each value on the simulated stack can be read from and only
+// emits a MOVE or a load when it has to, so `a = b + c` becomes a single
+// `ADD a b c`. Values are put in their slots before jumps, jump targets,
+// closures and calls: control flow meets with one frame layout, and callees
+// find their arguments where the stack machine would have left them.
+class RegisterCompiler {
+ public:
+  // Returns false, leaving `chunk.registers` empty, if the function needs
+  // more than 256 registers; the VM then runs its stack code. Throws
+  // ParseError for a jump too long to encode.
+  static bool compile(Chunk& chunk, int arity);
+
+ private:
+  using Instruction = Bytecode::Instruction;
+
+  // Where a value on the simulated stack can be read from.
+  struct Operand {
+    enum class Kind { REGISTER, CONSTANT, NIL, TRUE, FALSE };
+    Kind kind;
+    uint8_t index;
+
+    bool inRegister(size_t reg) const {
+      return kind == Kind::REGISTER && index == reg;
+    }
+  };
+
+  struct Patch {
+    size_t at;
+    int target;
+  };
+
+  explicit RegisterCompiler(Chunk& chunk)
+      : chunk_(chunk), out_(chunk.registers) {}
+
+  // Translates the instruction at `i` and returns the index of the next one
+  // to translate.
+  size_t translate(size_t i);
+  void label(size_t i);
+  // Arithmetic and comparisons. With a `target`, a comparison jumps there
+  // when it is false instead of producing a value; `popped` when no slot is
+  // left for that value either.
+  void binary(OpCode code, int target = -1, bool popped = false);
+  void setLocal(uint8_t slot);
+  // Whether the value left by instruction `i` is popped on every path.
+  bool poppedAfter(size_t i) const;
+
+  void push(Operand operand);
+  Operand pop();
+  size_t top() const { return stack_.size() - 1; }
+
+  // Returns a register holding the value at `position`, loading it into its
+  // own slot if it is a literal.
+  uint8_t read(size_t position);
+  // Puts the value at `position` into its own slot.
+  void materialize(size_t position);
+  // Materializes every value below `end`.
+  void flush(size_t end);
+  void flush() { flush(stack_.size()); }
+  void load(uint8_t reg, const Operand& operand);
+
+  // Points the last instruction at `to` if it just wrote `from`.
+  bool retarget(uint8_t from, uint8_t to);
+
+  void emit(RegisterOp code, std::initializer_list<uint8_t> operands);
+  // Same, for instructions whose first operand is a destination.
+  void emitResult(RegisterOp code, std::initializer_list<uint8_t> operands);
+  void emitJump(RegisterOp code, std::initializer_list<uint8_t> operands,
+                int target);
+  void patchJumps();
+  [[noreturn]] void error(const std::string& message) const;
+
+  Chunk& chunk_;
+  RegisterCode& out_;
+  std::vector<Instruction> instructions_;
+  std::vector<bool> targets_;
+  std::vector<Operand> stack_;
+  int line_{0};
+  // False right after an unconditional jump or a return.
+  bool reachable_{true};
+  // Offset of the last instruction when it can be retargeted, else -1.
+  int last_{-1};
+  // Register code offset and stack depth of each stack instruction; depths
+  // are only known ahead for jump targets.
+  std::vector<int> offsets_;
+  std::vector<int> depths_;
+  std::vector<Patch> patches_;
+};
+
+}  // namespace compiler
+}  // namespace lox
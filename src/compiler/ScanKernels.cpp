@@ -0,0 +1,258 @@
+#include "ScanKernels.h"
+
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace lox {
+namespace compiler {
+
+namespace {
+
+// The bytes that end each run.
+bool endsBlanks(char c) {
+  return c != ' ' && c != '\t' && c != '\r' && c != '\0' && c != '\n';
+}
+bool endsLine(char c) { return c == '\n' || c == '\0'; }
+bool endsStar(char c) { return c == '*' || c == '\0'; }
+bool endsQuote(char c) { return c == '"' || c == '\\'; }
+bool endsDigits(char c) { return c < '0' || c > '9'; }
+bool endsWord(char c) {
+  char lower = static_cast<char>(c | 0x20);
+  return (lower < 'a' || lower > 'z') && endsDigits(c) && c != '_';
+}
+
+template <bool (*Ends)(char)>
+const char* untilScalar(const char* p, const char* end) {
+  while (p < end && !Ends(*p)) {
+    p++;
+  }
+  return p;
+}
+
+const char* blanksScalar(const char* p, const char* end, int& lines) {
+  for (; p < end && !endsBlanks(*p); p++) {
+    lines += *p == '\n';
+  }
+  return p;
+}
+
+constexpr ScanKernels kScalar{
+    "scalar",
+    blanksScalar,
+    untilScalar<endsLine>,
+    untilScalar<endsStar>,
+    untilScalar<endsQuote>,
+    untilScalar<endsWord>,
+    untilScalar<endsDigits>,
+};
+
+#if defined(__x86_64__)
+
+// The vector versions build a mask of the bytes that end the run, 16 or 32
+// at a time, and finish the last few bytes with the scalar loops. Ranges
+// are compared as signed bytes, which leaves out everything from 0x80 up as
+// the ranges are ASCII.
+namespace sse2 {
+
+__m128i load(const char* p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+__m128i is(__m128i v, char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); }
+__m128i in(__m128i v, char lo, char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+uint32_t bits(__m128i v) {
+  return static_cast<uint32_t>(_mm_movemask_epi8(v));
+}
+
+__m128i blank(__m128i v) {
+  __m128i spaces = _mm_or_si128(is(v, ' '), is(v, '\t'));
+  __m128i controls = _mm_or_si128(is(v, '\r'), is(v, '\0'));
+  return _mm_or_si128(_mm_or_si128(spaces, controls), is(v, '\n'));
+}
+uint32_t endsLine(__m128i v) {
+  return bits(_mm_or_si128(is(v, '\n'), is(v, '\0')));
+}
+uint32_t endsStar(__m128i v) {
+  return bits(_mm_or_si128(is(v, '*'), is(v, '\0')));
+}
+uint32_t endsQuote(__m128i v) {
+  return bits(_mm_or_si128(is(v, '"'), is(v, '\\')));
+}
+uint32_t endsDigits(__m128i v) { return ~bits(in(v, '0', '9')) & 0xffff; }
+uint32_t endsWord(__m128i v) {
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  __m128i word = _mm_or_si128(
+      _mm_or_si128(in(lower, 'a', 'z'), in(v, '0', '9')), is(v, '_'));
+  return ~bits(word) & 0xffff;
+}
+
+template <uint32_t (*Ends)(__m128i), bool (*EndsScalar)(char)>
+const char* until(const char* p, const char* end) {
+  for (; end - p >= 16; p += 16) {
+    uint32_t ends = Ends(load(p));
+    if (ends != 0) {
+      return p + __builtin_ctz(ends);
+    }
+  }
+  return untilScalar<EndsScalar>(p, end);
+}
+
+const char* blanks(const char* p, const char* end, int& lines) {
+  for (; end - p >= 16; p += 16) {
+    __m128i v = load(p);
+    uint32_t newlines = bits(is(v, '\n'));
+    uint32_t ends = ~bits(blank(v)) & 0xffff;
+    if (ends != 0) {
+      int n = __builtin_ctz(ends);
+      lines += __builtin_popcount(newlines & ((1u << n) - 1));
+      return p + n;
+    }
+    lines += __builtin_popcount(newlines);
+  }
+  return blanksScalar(p, end, lines);
+}
+
+}  // namespace sse2
+
+constexpr ScanKernels kSse2{
+    "sse2",
+    sse2::blanks,
+    sse2::until<sse2::endsLine, endsLine>,
+    sse2::until<sse2::endsStar, endsStar>,
+    sse2::until<sse2::endsQuote, endsQuote>,
+    sse2::until<sse2::endsWord, endsWord>,
+    sse2::until<sse2::endsDigits, endsDigits>,
+};
+
+// Compiled for AVX2 function by function, so the rest of the program runs
+// on CPUs without it.
+#define LOX_AVX2 __attribute__((target("avx2")))
+
+namespace avx2 {
+
+LOX_AVX2 __m256i load(const char* p) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+LOX_AVX2 __m256i is(__m256i v, char c) {
+  return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+}
+LOX_AVX2 __m256i in(__m256i v, char lo, char hi) {
+  return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                          _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+LOX_AVX2 uint32_t bits(__m256i v) {
+  return static_cast<uint32_t>(_mm256_movemask_epi8(v));
+}
+
+LOX_AVX2 __m256i blank(__m256i v) {
+  __m256i spaces = _mm256_or_si256(is(v, ' '), is(v, '\t'));
+  __m256i controls = _mm256_or_si256(is(v, '\r'), is(v, '\0'));
+  return _mm256_or_si256(_mm256_or_si256(spaces, controls), is(v, '\n'));
+}
+LOX_AVX2 uint32_t endsLine(__m256i v) {
+  return bits(_mm256_or_si256(is(v, '\n'), is(v, '\0')));
+}
+LOX_AVX2 uint32_t endsStar(__m256i v) {
+  return bits(_mm256_or_si256(is(v, '*'), is(v, '\0')));
+}
+LOX_AVX2 uint32_t endsQuote(__m256i v) {
+  return bits(_mm256_or_si256(is(v, '"'), is(v, '\\')));
+}
+LOX_AVX2 uint32_t endsDigits(__m256i v) { return ~bits(in(v, '0', '9')); }
+LOX_AVX2 uint32_t endsWord(__m256i v) {
+  __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+  __m256i word = _mm256_or_si256(
+      _mm256_or_si256(in(lower, 'a', 'z'), in(v, '0', '9')), is(v, '_'));
+  return ~bits(word);
+}
+
+template <uint32_t (*Ends)(__m256i), bool (*EndsScalar)(char)>
+LOX_AVX2 const char* until(const char* p, const char* end) {
+  for (; end - p >= 32; p += 32) {
+    uint32_t ends = Ends(load(p));
+    if (ends != 0) {
+      return p + __builtin_ctz(ends);
+    }
+  }
+  return untilScalar<EndsScalar>(p, end);
+}
+
+LOX_AVX2 const char* blanks(const char* p, const char* end, int& lines) {
+  for (; end - p >= 32; p += 32) {
+    __m256i v = load(p);
+    uint32_t newlines = bits(is(v, '\n'));
+    uint32_t ends = ~bits(blank(v));
+    if (ends != 0) {
+      int n = __builtin_ctz(ends);
+      lines += __builtin_popcount(newlines & ((1u << n) - 1));
+      return p + n;
+    }
+    lines += __builtin_popcount(newlines);
+  }
+  return blanksScalar(p, end, lines);
+}
+
+}  // namespace avx2
+
+constexpr ScanKernels kAvx2{
+    "avx2",
+    avx2::blanks,
+    avx2::until<avx2::endsLine, endsLine>,
+    avx2::until<avx2::endsStar, endsStar>,
+    avx2::until<avx2::endsQuote, endsQuote>,
+    avx2::until<avx2::endsWord, endsWord>,
+    avx2::until<avx2::endsDigits, endsDigits>,
+};
+
+#undef LOX_AVX2
+
+#endif
+
+// Null when the CPU cannot run the set.
+const ScanKernels* find(const std::string& name) {
+  if (name == kScalar.name) {
+    return &kScalar;
+  }
+#if defined(__x86_64__)
+  if (name == kSse2.name) {
+    return &kSse2;
+  }
+  if (name == kAvx2.name && __builtin_cpu_supports("avx2")) {
+    return &kAvx2;
+  }
+#endif
+  return nullptr;
+}
+
+const ScanKernels* selected{nullptr};
+
+}  // namespace
+
+const ScanKernels& ScanKernels::current() {
+  static const ScanKernels* best = [] {
+    for (const char* name : {"avx2", "sse2"}) {
+      if (const ScanKernels* kernels = find(name)) {
+        return kernels;
+      }
+    }
+    return &kScalar;
+  }();
+  return selected != nullptr ? *selected : *best;
+}
+
+bool ScanKernels::use(const std::string& name) {
+  const ScanKernels* kernels = find(name);
+  if (kernels == nullptr) {
+    return false;
+  }
+  selected = kernels;
+  return true;
+}
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+
+namespace lox {
+namespace compiler {
+
+// The loops the scanner spends its time in, over runs of bytes. Each returns
+// the first byte at or after `p` that ends the run, or `end`.
+//
+// There is a scalar set and, on x86-64, SSE2 and AVX2 sets that test 16 or
+// 32 bytes at once. The scanner uses the best one the CPU supports.
+struct ScanKernels {
+  const char* name;
+  // Past ' ', '\t', '\r', '\0' and '\n', adding the newlines to `lines`.
+  const char* (*blanks)(const char* p, const char* end, int& lines);
+  // To the '\n' or '\0' that ends a line comment.
+  const char* (*lineEnd)(const char* p, const char* end);
+  // To the next '*' or '\0' in a block comment.
+  const char* (*star)(const char* p, const char* end);
+  // To the next '"' or '\\' in a string literal.
+  const char* (*quote)(const char* p, const char* end);
+  // Past letters, digits and '_'.
+  const char* (*word)(const char* p, const char* end);
+  // Past digits.
+  const char* (*digits)(const char* p, const char* end);
+
+  // The set scanners use: the best one the CPU supports unless another
+  // was picked with use().
+  static const ScanKernels& current();
+  // Picks the set named "scalar", "sse2" or "avx2" for scanners created
+  // from now on; not to be called while scanning. Returns false if there
+  // is no such set or the CPU cannot run it.
+  static bool use(const std::string& name);
+};
+
+}  // namespace compiler
+}  // namespace lox
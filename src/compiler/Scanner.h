@@ -1,9 +1,13 @@
 #pragma once
-#include <folly/Optional.h>
-
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <sstream>
+#include <string_view>
 
 #include "ParseError.h"
+#include "ScanKernels.h"
 #include "Token.h"
 
 namespace lox {
@@ -11,8 +15,12 @@ namespace compiler {
 
 class Scanner {
  public:
-  Scanner(const std::string& source) : source_{source}, current_{0}, line_{1} {}
-  Scanner(std::string&& source) : source_{source}, current_{0}, line_{1} {}
+  // `source` has to outlive the scanner and its tokens.
+  Scanner(std::string_view source)
+      : source_{source},
+        current_{0},
+        line_{1},
+        kernels_(ScanKernels::current()) {}
   virtual ~Scanner(){};
 
   virtual const Token& current() const = 0;
@@ -76,118 +84,65 @@ class Scanner {
     }
     return result;
   }
-  folly::Optional<Token> getToken(const char c) {
-    // Single character tokens
-    if (matchChar('(')) {
-      return left_paren(line_);
-    } else if (matchChar(')')) {
-      return right_paren(line_);
-    } else if (matchChar('{')) {
-      return left_brace(line_);
-    } else if (matchChar('}')) {
-      return right_brace(line_);
-    } else if (matchChar(',')) {
-      return comma(line_);
-    } else if (matchChar('.')) {
-      return dot(line_);
-    } else if (matchChar('?')) {
-      return question(line_);
-    } else if (matchChar(':')) {
-      return colon(line_);
-    } else if (matchChar(';')) {
-      return semicolon(line_);
-    } else if (matchChar('\n')) {
-      line_++;
-      return none();
-    } else if (matchChar(' ') || matchChar('\t') || matchChar('\r') ||
-               matchChar('\0')) {
-      return none();  // ignore spaces, tabs and carry
 
-    } else if (matchChar('-')) {  // Single and Double character tokens
-      if (matchChar('-')) {
-        return minus_minus(line_);
-      } else if (matchChar('=')) {
-        return minus_equal(line_);
-      } else {
-        return minus(line_);
-      }
-    } else if (matchChar('+')) {
-      if (matchChar('+')) {
-        return plus_plus(line_);
-      } else if (matchChar('=')) {
-        return plus_equal(line_);
-      } else {
-        return plus(line_);
-      }
-    } else if (matchChar('/')) {
-      if (matchChar('*')) {
-        while (true) {
-          if (!peekChar()) {
-            return error(line_, "Unterminated multiline comment");
+  // Returns the next token, past blanks and comments, or END once the source
+  // is used up. Mistakes in the source come back as ERROR tokens.
+  Token scanToken() {
+    while (!isEndOfSource()) {
+      size_t start = current_;
+      const CharInfo& info = charInfo(source_[current_++]);
+      switch (info.kind) {
+        case CharInfo::NEWLINE:
+          line_++;
+          [[fallthrough]];
+        case CharInfo::BLANK:
+          // Mostly a single space between tokens.
+          if (isBlank(peekChar())) {
+            skip(kernels_.blanks(at(current_), at(source_.size()), line_));
           }
-          if (peekChar() != '*') {
-            nextChar();
-          } else {
-            nextChar();
-            if (peekChar() == '/') {
-              nextChar();
-              break;
+          break;
+        case CharInfo::DIGIT:
+          return number(start);
+        case CharInfo::ALPHA:
+          return identifier(start);
+        case CharInfo::QUOTE:
+          return string();
+        case CharInfo::SLASH:
+          if (matchChar('/')) {
+            skip(kernels_.lineEnd(at(current_), at(source_.size())));
+            break;
+          }
+          if (matchChar('*')) {
+            if (!skipBlockComment()) {
+              return error(line_, "Unterminated multiline comment");
             }
+            break;
           }
-        }
-        return none();
-      } else if (matchChar('/')) {
-        while (peekChar() && peekChar() != '\n') {
-          nextChar();
-        }
-        return none();
-      } else if (matchChar('=')) {
-        return slash_equal(line_);
-      } else {
-        return slash(line_);
-      }
-    } else if (matchChar('*')) {
-      if (matchChar('=')) {
-        return star_equal(line_);
-      } else {
-        return star(line_);
-      }
-    } else if (matchChar('!')) {
-      if (matchChar('=')) {
-        return bang_equal(line_);
-      } else {
-        return bang(line_);
-      }
-    } else if (matchChar('=')) {
-      if (matchChar('=')) {
-        return equal_equal(line_);
-      } else {
-        return equal(line_);
-      }
-    } else if (matchChar('>')) {
-      if (matchChar('=')) {
-        return greater_equal(line_);
-      } else {
-        return greater(line_);
-      }
-    } else if (matchChar('<')) {
-      if (matchChar('=')) {
-        return less_equal(line_);
-      } else {
-        return less(line_);
+          [[fallthrough]];
+        case CharInfo::PUNCTUATION:
+          return punctuation(info, start);
+        case CharInfo::OTHER:
+          return error(line_, "Unknown character");
       }
-    } else if (matchChar('"')) {  // string
-      return string(line_);
-    } else if (isdigit(c)) {  // number
-      return number(line_);
-    } else if (isalpha(c)) {  // identifiers
-      return identifier(line_);
-    } else {
-      return error(line_, "Unknown charracter: " + std::string{c});
     }
+    return end();
   }
+
   static inline Token end() { return Token(Token::Type::END, "EOF", -1); }
 
+  // Where scanning has got to, and moving it elsewhere.
+  size_t offset() const { return current_; }
+  int line() const { return line_; }
+  void seek(size_t offset, int line) {
+    current_ = offset;
+    line_ = line;
+  }
+  // Goes on in `source`, such as a refilled window of a streamed script.
+  void seek(std::string_view source, size_t offset, int line) {
+    source_ = source;
+    seek(offset, line);
+  }
+
   static inline void parse_error(const Token& token,
                                  const std::string_view& message) {
     std::stringstream ss;
@@ -197,149 +152,182 @@ class Scanner {
   }
 
  private:
-  const std::string source_;
-  int current_;
-  int line_;
+  // How the scanner treats a character. The kind picks the case in
+  // scanToken(); punctuation also lists the token it makes alone, followed
+  // by '=' and doubled, with END where it makes none.
+  struct CharInfo {
+    enum Kind : uint8_t {
+      OTHER,
+      BLANK,
+      NEWLINE,
+      DIGIT,
+      ALPHA,
+      QUOTE,
+      SLASH,
+      PUNCTUATION,
+    };
 
-  static inline folly::Optional<Token> none() {
-    return folly::Optional<Token>();
-  }
-  static inline Token error(const int line, const std::string& message) {
-    return Token(Token::Type::ERROR, std::move(message), line);
-  }
-  static inline Token left_paren(const int line) {
-    return Token(Token::Type::LEFT_PAREN, "(", line);
-  }
-  static inline Token right_paren(const int line) {
-    return Token(Token::Type::RIGHT_PAREN, ")", line);
-  }
-  static inline Token left_brace(const int line) {
-    return Token(Token::Type::LEFT_BRACE, "{", line);
-  }
-  static inline Token right_brace(const int line) {
-    return Token(Token::Type::RIGHT_BRACE, "}", line);
-  }
-  static inline Token comma(const int line) {
-    return Token(Token::Type::COMMA, ".", line);
-  }
-  static inline Token dot(const int line) {
-    return Token(Token::Type::DOT, ".", line);
-  }
-  static inline Token question(const int line) {
-    return Token(Token::Type::QUESTION, "?", line);
-  }
-  static inline Token colon(const int line) {
-    return Token(Token::Type::COLON, ":", line);
-  }
-  static inline Token semicolon(const int line) {
-    return Token(Token::Type::SEMICOLON, ";", line);
-  }
-  static inline Token minus_minus(const int line) {
-    return Token(Token::Type::MINUS_MINUS, "--", line);
-  }
-  static inline Token minus_equal(const int line) {
-    return Token(Token::Type::MINUS_EQUAL, "-=", line);
-  }
-  static inline Token minus(const int line) {
-    return Token(Token::Type::MINUS, "-", line);
-  }
-  static inline Token plus_plus(const int line) {
-    return Token(Token::Type::PLUS_PLUS, "++", line);
-  }
-  static inline Token plus_equal(const int line) {
-    return Token(Token::Type::PLUS_EQUAL, "+=", line);
-  }
-  static inline Token plus(const int line) {
-    return Token(Token::Type::PLUS, "+", line);
-  }
-  static inline Token slash_equal(const int line) {
-    return Token(Token::Type::SLASH_EQUAL, "/=", line);
-  }
-  static inline Token slash(const int line) {
-    return Token(Token::Type::SLASH, "/", line);
-  }
-  static inline Token star_equal(const int line) {
-    return Token(Token::Type::STAR_EQUAL, "*=", line);
-  }
-  static inline Token star(const int line) {
-    return Token(Token::Type::STAR, "*", line);
-  }
-  static inline Token bang(const int line) {
-    return Token(Token::Type::BANG, "!", line);
+    Kind kind{OTHER};
+    // Whether the character can go on an identifier.
+    bool word{false};
+    Token::Type alone{Token::Type::END};
+    Token::Type equal{Token::Type::END};
+    Token::Type twice{Token::Type::END};
+  };
+
+  static constexpr std::array<CharInfo, 256> charTable() {
+    using Type = Token::Type;
+    std::array<CharInfo, 256> table{};
+    auto punctuation = [&table](char c, Type alone, Type equal = Type::END,
+                                Type twice = Type::END) {
+      auto& info = table[static_cast<unsigned char>(c)];
+      info.kind = CharInfo::PUNCTUATION;
+      info.alone = alone;
+      info.equal = equal;
+      info.twice = twice;
+    };
+    for (char c : {' ', '\t', '\r', '\0'}) {
+      table[static_cast<unsigned char>(c)].kind = CharInfo::BLANK;
+    }
+    table['\n'].kind = CharInfo::NEWLINE;
+    for (int c = '0'; c <= '9'; c++) {
+      table[c].kind = CharInfo::DIGIT;
+      table[c].word = true;
+    }
+    for (int c = 'a'; c <= 'z'; c++) {
+      table[c].kind = table[c - 'a' + 'A'].kind = CharInfo::ALPHA;
+      table[c].word = table[c - 'a' + 'A'].word = true;
+    }
+    table['_'].word = true;
+    table['"'].kind = CharInfo::QUOTE;
+    punctuation('(', Type::LEFT_PAREN);
+    punctuation(')', Type::RIGHT_PAREN);
+    punctuation('{', Type::LEFT_BRACE);
+    punctuation('}', Type::RIGHT_BRACE);
+    punctuation(',', Type::COMMA);
+    punctuation('.', Type::DOT);
+    punctuation('?', Type::QUESTION);
+    punctuation(':', Type::COLON);
+    punctuation(';', Type::SEMICOLON);
+    punctuation('-', Type::MINUS, Type::MINUS_EQUAL, Type::MINUS_MINUS);
+    punctuation('+', Type::PLUS, Type::PLUS_EQUAL, Type::PLUS_PLUS);
+    punctuation('/', Type::SLASH, Type::SLASH_EQUAL);
+    table['/'].kind = CharInfo::SLASH;
+    punctuation('*', Type::STAR, Type::STAR_EQUAL);
+    punctuation('!', Type::BANG, Type::BANG_EQUAL);
+    punctuation('=', Type::EQUAL, Type::EQUAL_EQUAL);
+    punctuation('>', Type::GREATER, Type::GREATER_EQUAL);
+    punctuation('<', Type::LESS, Type::LESS_EQUAL);
+    return table;
   }
-  static inline Token bang_equal(const int line) {
-    return Token(Token::Type::BANG_EQUAL, "!=", line);
+
+  static const CharInfo& charInfo(char c) {
+    static constexpr std::array<CharInfo, 256> kChars = charTable();
+    return kChars[static_cast<unsigned char>(c)];
   }
-  static inline Token equal_equal(const int line) {
-    return Token(Token::Type::EQUAL_EQUAL, "==", line);
+
+  std::string_view source_;
+  size_t current_;
+  int line_;
+  const ScanKernels& kernels_;
+
+  const char* at(size_t offset) const { return source_.data() + offset; }
+  // Moves on to `p`, which a kernel returned.
+  void skip(const char* p) { current_ = p - source_.data(); }
+
+  static bool isBlank(char c) {
+    auto kind = charInfo(c).kind;
+    return kind == CharInfo::BLANK || kind == CharInfo::NEWLINE;
   }
-  static inline Token equal(const int line) {
-    return Token(Token::Type::EQUAL, "=", line);
+  static bool isDigit(char c) { return charInfo(c).kind == CharInfo::DIGIT; }
+
+  // Identifiers and numbers are mostly shorter than a vector, and cheaper to
+  // step through than to hand to a kernel. Steps over up to kShortRun bytes
+  // for which `in` holds, and returns whether the run goes on.
+  static constexpr size_t kShortRun = 8;
+  template <typename In>
+  bool shortRun(In in) {
+    size_t stop = std::min(current_ + kShortRun, source_.size());
+    while (current_ < stop && in(source_[current_])) {
+      current_++;
+    }
+    return current_ == stop && !isEndOfSource() && in(source_[current_]);
   }
-  static inline Token greater_equal(const int line) {
-    return Token(Token::Type::GREATER_EQUAL, ">=", line);
+  void digits() {
+    if (shortRun(isDigit)) {
+      skip(kernels_.digits(at(current_), at(source_.size())));
+    }
   }
-  static inline Token greater(const int line) {
-    return Token(Token::Type::GREATER, ">", line);
+
+  static inline Token error(const int line, std::string_view message) {
+    return Token(Token::Type::ERROR, message, line);
   }
-  static inline Token less_equal(const int line) {
-    return Token(Token::Type::LESS_EQUAL, "<=", line);
+
+  Token punctuation(const CharInfo& info, size_t start) {
+    Token::Type type = info.alone;
+    if (info.twice != Token::Type::END && matchChar(source_[start])) {
+      type = info.twice;
+    } else if (info.equal != Token::Type::END && matchChar('=')) {
+      type = info.equal;
+    }
+    return Token(type, source_.substr(start, current_ - start), line_);
   }
-  static inline Token less(const int line) {
-    return Token(Token::Type::LESS, "<", line);
+
+  // Past the opening "/*". Returns false if the comment is not closed.
+  bool skipBlockComment() {
+    while (true) {
+      skip(kernels_.star(at(current_), at(source_.size())));
+      if (!peekChar()) {
+        return false;
+      }
+      nextChar();
+      if (matchChar('/')) {
+        return true;
+      }
+    }
   }
-  inline Token string(const int line) {
-    int start = current_;
+
+  // Past the opening quote.
+  Token string() {
+    size_t start = current_;
     while (true) {
+      skip(kernels_.quote(at(current_), at(source_.size())));
       if (isEndOfSource()) {
-        return error(line, "Unterminated string");
+        return error(line_, "Unterminated string");
       }
-      if (matchChar('\\')) {
-        // escape character, for simplification we
-        //  only support one char escape characters
-        nextChar();
+      if (matchChar('"')) {
+        break;
       }
+      // escape character, for simplification we
+      //  only support one char escape characters
+      nextChar();
+      nextChar();
       if (matchChar('"')) {
         break;
       }
       nextChar();
     }
     return Token(Token::Type::STRING,
-                 source_.substr(start, current_ - start - 1), line);
+                 source_.substr(start, current_ - start - 1), line_);
   }
 
-  inline Token number(const int line) {
-    int start = current_;
-    while (isdigit(peekChar())) {
-      nextChar();
-    }
-
-    if (peekChar() == '.') {
+  Token number(size_t start) {
+    digits();
+    if (peekChar() == '.' && current_ + 1 < source_.length() &&
+        isDigit(source_[current_ + 1])) {
       nextChar();
-      if (isdigit(peekChar())) {
-        while (isdigit(peekChar())) {
-          nextChar();
-        }
-      } else {
-        current_--;
-      }
+      digits();
     }
     return Token(Token::Type::NUMBER, source_.substr(start, current_ - start),
-                 line);
+                 line_);
   }
-  inline Token identifier(const int line) {
-    int start = current_;
-    while (isalnum(peekChar()) || peekChar() == '_') {
-      nextChar();
+
+  Token identifier(size_t start) {
+    if (shortRun([](char c) { return charInfo(c).word; })) {
+      skip(kernels_.word(at(current_), at(source_.size())));
     }
     auto identifier = source_.substr(start, current_ - start);
-    Token::Type type;
-    try {
-      type = kLanguageKeywords.at(identifier);
-    } catch (std::out_of_range) {
-      type = Token::Type::IDENTIFIER;
-    }
-    return Token(type, std::move(identifier), line);
+    return Token(keyword(identifier), identifier, line_);
   }
 };
 }  // namespace compiler
@@ -1,17 +1,28 @@
 #pragma once
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
 #include "ReadAllScanner.h"
 #include "ReadByOneScanner.h"
 #include "Scanner.h"
+#include "Source.h"
+
+DECLARE_int32(scan_threads);
 
 namespace lox {
 namespace compiler {
 struct ScannerFactory {
-  static inline std::function<
-      std::unique_ptr<Scanner>(const std::string& source)>
+  static inline std::function<std::unique_ptr<Scanner>(std::string_view source)>
   get(const std::string& scanner) {
-    return [&scanner](const std::string& source) -> std::unique_ptr<Scanner> {
+    return [&scanner](std::string_view source) -> std::unique_ptr<Scanner> {
       if (scanner == "readall") {
-        return std::make_unique<ReadAllScanner>(source);
+        return std::make_unique<ReadAllScanner>(
+            source, static_cast<unsigned>(std::max(FLAGS_scan_threads, 0)));
       }
       if (scanner == "byone") {
         return std::make_unique<ReadByOneScanner>(source);
@@ -19,6 +30,14 @@ struct ScannerFactory {
       return nullptr;
     };
   }
+  // Only byone reads a streamed source as it goes; the others read it whole.
+  static inline std::unique_ptr<Scanner> get(const std::string& scanner,
+                                             Source& source) {
+    if (scanner == "byone") {
+      return std::make_unique<ReadByOneScanner>(source);
+    }
+    return get(scanner)(source.text());
+  }
 };
 
 }  // namespace compiler
@@ -1,6 +1,8 @@
 #pragma once
 #include <folly/Optional.h>
 
+#include <cstdint>
+#include <limits>
 #include <sstream>
 #include <vector>
 
@@ -25,19 +27,20 @@ class Scope {
   Scope() { locals_.push_back({}); }
 
   void declare(const Token& name, int depth) {
-    int position;
-
-    auto& scope = locals_.back();
-    if (!scope.empty()) {
-      position = scope.back().position + 1;
-    } else {
-      position = 1;
+    // Slot 0 holds the callee; every enclosing scope's locals are still live.
+    int position = 1;
+    for (const auto& scope : locals_) {
+      position += scope.size();
     }
 
     auto maybeDefined = find(name, depth);
     if (maybeDefined) {
       scope_error(name, "Variable already defined");
     }
+    // Local slot operands are one byte wide.
+    if (position > std::numeric_limits<uint8_t>::max()) {
+      scope_error(name, "Too many local variables in function.");
+    }
     locals_[depth].push_back({name, position});
   }
 
@@ -0,0 +1,78 @@
+#include "Source.h"
+
+#include <folly/FileUtil.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ParseError.h"
+
+namespace lox {
+namespace compiler {
+
+Source Source::file(const std::string& path) {
+  folly::File file(path);
+  struct stat info;
+  if (::fstat(file.fd(), &info) != 0 || !S_ISREG(info.st_mode)) {
+    return Source(std::move(file));
+  }
+  if (info.st_size == 0) {
+    return Source(std::string_view(), false);
+  }
+  size_t size = static_cast<size_t>(info.st_size);
+  void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file.fd(), 0);
+  if (data == MAP_FAILED) {
+    return Source(std::move(file));
+  }
+  // Scanned front to back, once.
+  ::madvise(data, size, MADV_SEQUENTIAL);
+  return Source(std::string_view(static_cast<const char*>(data), size), true);
+}
+
+Source Source::buffer(std::string_view text) { return Source(text, false); }
+
+Source Source::stream(int fd) { return Source(folly::File(fd, false)); }
+
+Source::Source(Source&& other) noexcept
+    : text_(other.text_),
+      mapped_(other.mapped_),
+      file_(std::move(other.file_)),
+      streamed_(other.streamed_),
+      read_(other.read_),
+      stream_(std::move(other.stream_)) {
+  other.mapped_ = false;
+  other.streamed_ = false;
+}
+
+Source::~Source() {
+  if (mapped_) {
+    ::munmap(const_cast<char*>(text_.data()), text_.size());
+  }
+}
+
+std::string_view Source::text() {
+  if (streamed_) {
+    while (read(stream_)) {
+    }
+    streamed_ = false;
+    read_ = true;
+  }
+  return read_ ? std::string_view(stream_) : text_;
+}
+
+bool Source::read(std::string& out) {
+  if (!streamed_) {
+    return false;
+  }
+  size_t size = out.size();
+  out.resize(size + kChunkSize);
+  ssize_t count = folly::readNoInt(file_.fd(), &out[size], kChunkSize);
+  if (count < 0) {
+    out.resize(size);
+    throw ParseError("Cannot read the script.\n");
+  }
+  out.resize(size + count);
+  return count > 0;
+}
+
+}  // namespace compiler
+}  // namespace lox
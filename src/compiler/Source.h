@@ -0,0 +1,57 @@
+#pragma once
+
+#include <folly/File.h>
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace lox {
+namespace compiler {
+
+// The text of a script: a read-only mapping of a file, a buffer the caller
+// owns, or a stream such as a pipe, read a chunk at a time. Scanners work on
+// the text in place, so a mapped script is never copied.
+class Source {
+ public:
+  // Bytes read from a stream at a time.
+  static constexpr size_t kChunkSize = 64 << 10;
+
+  // Maps the file at `path`. Files that cannot be mapped, such as pipes and
+  // /dev/stdin, are read as a stream. Throws if it cannot be opened.
+  static Source file(const std::string& path);
+  // `text` has to outlive the source and the tokens scanned from it.
+  static Source buffer(std::string_view text);
+  // Reads `fd`, which the source does not close.
+  static Source stream(int fd);
+
+  Source(Source&& other) noexcept;
+  Source(const Source&) = delete;
+  Source& operator=(const Source&) = delete;
+  ~Source();
+
+  // Whether the text has yet to be read. Then either text() or read() may be
+  // used, not both.
+  bool streamed() const { return streamed_; }
+  // The whole text. What is left of a stream is read into memory first.
+  std::string_view text();
+  // Appends the next chunk of a stream to `out`. Returns false at its end.
+  bool read(std::string& out);
+
+ private:
+  Source(std::string_view text, bool mapped) : text_(text), mapped_(mapped) {}
+  explicit Source(folly::File file)
+      : file_(std::move(file)), streamed_(true) {}
+
+  std::string_view text_;
+  bool mapped_{false};
+  folly::File file_;
+  bool streamed_{false};
+  // Whether the text is what text() read of a stream.
+  bool read_{false};
+  std::string stream_;
+};
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,590 @@
+#include "Ssa.h"
+
+#include <algorithm>
+
+namespace lox {
+namespace compiler {
+
+namespace {
+
+bool endsBlock(OpCode code) {
+  return code == OpCode::JUMP || code == OpCode::LOOP ||
+         code == OpCode::JUMP_IF_FALSE || code == OpCode::RETURN;
+}
+
+}  // namespace
+
+std::unique_ptr<Ssa> Ssa::build(const Chunk& chunk, int arity) {
+  for (const auto& constant : chunk.constants) {
+    if (!constant.isFunction()) {
+      continue;
+    }
+    for (const auto& upvalue : constant.asFunction()->chunk().upvalues) {
+      if (upvalue.isLocal) {
+        return nullptr;
+      }
+    }
+  }
+
+  auto instructions = Bytecode::decode(chunk);
+  size_t count = instructions.size();
+  if (count == 0) {
+    return nullptr;
+  }
+
+  // Split the code into basic blocks, numbered in code order.
+  std::vector<bool> leader(count + 1, false);
+  leader[0] = true;
+  for (size_t i = 0; i < count; i++) {
+    if (instructions[i].target != -1) {
+      leader[instructions[i].target] = true;
+    }
+    if (endsBlock(instructions[i].code)) {
+      leader[i + 1] = true;
+    }
+  }
+  std::vector<size_t> starts;
+  std::vector<int> blockAt(count + 1, -1);
+  for (size_t i = 0; i < count; i++) {
+    if (leader[i]) {
+      blockAt[i] = static_cast<int>(starts.size());
+      starts.push_back(i);
+    }
+  }
+  size_t n = starts.size();
+  auto end = [&](size_t b) { return b + 1 < n ? starts[b + 1] : count; };
+
+  std::vector<std::vector<int>> succs(n);
+  for (size_t b = 0; b < n; b++) {
+    const Instruction& last = instructions[end(b) - 1];
+    int next = b + 1 < n ? static_cast<int>(b + 1) : -1;
+    int target = last.target != -1 ? blockAt[last.target] : -1;
+    switch (last.code) {
+      case OpCode::JUMP:
+      case OpCode::LOOP:
+        succs[b] = {target};
+        break;
+      case OpCode::JUMP_IF_FALSE:
+        succs[b] = next == target ? std::vector<int>{next}
+                                  : std::vector<int>{next, target};
+        break;
+      case OpCode::RETURN:
+        break;
+      default:
+        succs[b] = {next};
+        break;
+    }
+    // Falling or jumping off the end of the code.
+    if (std::find(succs[b].begin(), succs[b].end(), -1) != succs[b].end()) {
+      return nullptr;
+    }
+  }
+
+  std::vector<bool> reachable(n, false);
+  std::vector<int> work{0};
+  reachable[0] = true;
+  while (!work.empty()) {
+    int b = work.back();
+    work.pop_back();
+    for (int succ : succs[b]) {
+      if (!reachable[succ]) {
+        reachable[succ] = true;
+        work.push_back(succ);
+      }
+    }
+  }
+
+  // An entry block of its own holds the parameters, so that the first
+  // block of code can be a loop header like any other.
+  std::unique_ptr<Ssa> ssa(new Ssa(arity));
+  ssa->blocks.push_back(std::make_unique<Block>());
+  Block* entry = ssa->blocks[0].get();
+  std::vector<Block*> blockOf(n, nullptr);
+  for (size_t b = 0; b < n; b++) {
+    if (reachable[b]) {
+      ssa->blocks.push_back(std::make_unique<Block>());
+      blockOf[b] = ssa->blocks.back().get();
+      blockOf[b]->id = static_cast<int>(ssa->blocks.size() - 1);
+    }
+  }
+  entry->succs.push_back(blockOf[0]);
+  blockOf[0]->preds.push_back(entry);
+  for (size_t b = 0; b < n; b++) {
+    if (!reachable[b]) {
+      continue;
+    }
+    for (int succ : succs[b]) {
+      blockOf[b]->succs.push_back(blockOf[succ]);
+      blockOf[succ]->preds.push_back(blockOf[b]);
+    }
+  }
+
+  // The stack each block leaves behind, by block id.
+  std::vector<std::vector<Node*>> exits(ssa->blocks.size());
+  std::vector<bool> done(ssa->blocks.size(), false);
+  for (int slot = 0; slot <= arity; slot++) {
+    exits[0].push_back(ssa->param(slot));
+  }
+  ssa->add(entry, OpCode::JUMP, {}, {}, instructions[0].line);
+  done[0] = true;
+
+  for (size_t b = 0; b < n; b++) {
+    Block* block = blockOf[b];
+    if (block == nullptr) {
+      continue;
+    }
+    // Code only ever jumps back to a loop header, which is also entered
+    // from above.
+    auto pred = std::find_if(block->preds.begin(), block->preds.end(),
+                             [&](Block* p) { return done[p->id]; });
+    if (pred == block->preds.end()) {
+      return nullptr;
+    }
+    std::vector<Node*> stack;
+    if (block->preds.size() == 1) {
+      stack = exits[(*pred)->id];
+    } else {
+      for (size_t slot = 0; slot < exits[(*pred)->id].size(); slot++) {
+        stack.push_back(ssa->phi(block, instructions[starts[b]].line));
+      }
+    }
+
+    auto pop = [&]() {
+      Node* top = stack.back();
+      stack.pop_back();
+      return top;
+    };
+    auto take = [&](size_t count) {
+      std::vector<Node*> values(stack.end() - count, stack.end());
+      stack.resize(stack.size() - count);
+      return values;
+    };
+
+    for (size_t i = starts[b]; i < end(b); i++) {
+      const Instruction& instruction = instructions[i];
+      OpCode code = instruction.code;
+      const auto& operands = instruction.operands;
+      int line = instruction.line;
+      auto add = [&](std::vector<Node*> inputs) {
+        return ssa->add(block, code, operands, std::move(inputs), line);
+      };
+
+      size_t needed = 0;
+      switch (code) {
+        case OpCode::CALL:
+        case OpCode::INVOKE:
+          needed = operands.back() + 1u;
+          break;
+        case OpCode::SUPER_INVOKE:
+          needed = operands.back() + 2u;
+          break;
+        case OpCode::SET_PROPERTY:
+        case OpCode::METHOD:
+        case OpCode::INHERIT:
+        case OpCode::GET_SUPER:
+        case OpCode::ADD:
+        case OpCode::SUBSTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+        case OpCode::EQUAL:
+        case OpCode::NOT_EQUAL:
+        case OpCode::GREATER:
+        case OpCode::LESS:
+        case OpCode::GREATER_EQUAL:
+        case OpCode::LESS_EQUAL:
+          needed = 2;
+          break;
+        case OpCode::GET_LOCAL:
+        case OpCode::SET_LOCAL:
+          needed = operands[0] + 1u;
+          break;
+        case OpCode::CONSTANT:
+        case OpCode::NIL:
+        case OpCode::TRUE:
+        case OpCode::FALSE:
+        case OpCode::GET_GLOBAL:
+        case OpCode::GET_UPVALUE:
+        case OpCode::CLOSURE:
+        case OpCode::CLASS:
+        case OpCode::JUMP:
+        case OpCode::LOOP:
+          break;
+        default:
+          needed = 1;
+          break;
+      }
+      if (stack.size() < needed) {
+        return nullptr;
+      }
+
+      switch (code) {
+        case OpCode::CONSTANT:
+        case OpCode::NIL:
+        case OpCode::TRUE:
+        case OpCode::FALSE:
+        case OpCode::GET_GLOBAL:
+        case OpCode::GET_UPVALUE:
+        case OpCode::CLOSURE:
+        case OpCode::CLASS:
+          stack.push_back(add({}));
+          break;
+        case OpCode::POP:
+          pop();
+          break;
+        case OpCode::GET_LOCAL:
+          stack.push_back(stack[operands[0]]);
+          break;
+        case OpCode::SET_LOCAL:
+          stack[operands[0]] = stack.back();
+          break;
+        case OpCode::SET_GLOBAL:
+        case OpCode::SET_UPVALUE:
+        case OpCode::PRINT:
+          add({stack.back()});
+          break;
+        case OpCode::DEFINE_GLOBAL:
+          add({pop()});
+          break;
+        case OpCode::NEGATE:
+        case OpCode::NOT:
+        case OpCode::GET_PROPERTY:
+          stack.push_back(add({pop()}));
+          break;
+        case OpCode::SET_PROPERTY: {
+          auto inputs = take(2);
+          add(inputs);
+          stack.push_back(inputs[1]);
+          break;
+        }
+        case OpCode::METHOD:
+        case OpCode::INHERIT:
+          add({stack[stack.size() - 2], pop()});
+          break;
+        case OpCode::ADD:
+        case OpCode::SUBSTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+        case OpCode::EQUAL:
+        case OpCode::NOT_EQUAL:
+        case OpCode::GREATER:
+        case OpCode::LESS:
+        case OpCode::GREATER_EQUAL:
+        case OpCode::LESS_EQUAL:
+        case OpCode::GET_SUPER:
+        case OpCode::CALL:
+        case OpCode::INVOKE:
+        case OpCode::SUPER_INVOKE:
+          stack.push_back(add(take(needed)));
+          break;
+        case OpCode::JUMP:
+        case OpCode::LOOP:
+          ssa->add(block, OpCode::JUMP, {}, {}, line);
+          break;
+        case OpCode::JUMP_IF_FALSE:
+          // Both ways lead to the same place.
+          if (block->succs.size() == 1) {
+            ssa->add(block, OpCode::JUMP, {}, {}, line);
+          } else {
+            ssa->add(block, code, {}, {stack.back()}, line);
+          }
+          break;
+        case OpCode::RETURN:
+          add({pop()});
+          break;
+        default:
+          // Upvalues to close, or code that was already rewritten.
+          return nullptr;
+      }
+    }
+    if (!endsBlock(instructions[end(b) - 1].code)) {
+      ssa->add(block, OpCode::JUMP, {}, {}, instructions[end(b) - 1].line);
+    }
+    exits[block->id] = std::move(stack);
+    done[block->id] = true;
+  }
+
+  for (const auto& block : ssa->blocks) {
+    if (block->phis.empty()) {
+      continue;
+    }
+    for (Block* pred : block->preds) {
+      const auto& stack = exits[pred->id];
+      if (stack.size() != block->phis.size()) {
+        return nullptr;
+      }
+      for (size_t slot = 0; slot < stack.size(); slot++) {
+        block->phis[slot]->inputs.push_back(stack[slot]);
+      }
+    }
+  }
+  return ssa;
+}
+
+void Ssa::dominators() {
+  // Cooper, Harvey and Kennedy's iterative algorithm over reverse postorder.
+  std::vector<int> postorder(blocks.size(), -1);
+  std::vector<Block*> order;
+  std::vector<std::pair<Block*, size_t>> work{{blocks[0].get(), 0}};
+  std::vector<bool> seen(blocks.size(), false);
+  seen[0] = true;
+  while (!work.empty()) {
+    auto& [block, next] = work.back();
+    if (next < block->succs.size()) {
+      Block* succ = block->succs[next++];
+      if (!seen[succ->id]) {
+        seen[succ->id] = true;
+        work.emplace_back(succ, 0);
+      }
+      continue;
+    }
+    postorder[block->id] = static_cast<int>(order.size());
+    order.push_back(block);
+    work.pop_back();
+  }
+  std::reverse(order.begin(), order.end());
+
+  for (const auto& block : blocks) {
+    block->idom = nullptr;
+    block->children.clear();
+  }
+  Block* entry = blocks[0].get();
+  entry->idom = entry;
+  auto intersect = [&](Block* a, Block* b) {
+    while (a != b) {
+      while (postorder[a->id] < postorder[b->id]) {
+        a = a->idom;
+      }
+      while (postorder[b->id] < postorder[a->id]) {
+        b = b->idom;
+      }
+    }
+    return a;
+  };
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (Block* block : order) {
+      if (block == entry) {
+        continue;
+      }
+      Block* idom = nullptr;
+      for (Block* pred : block->preds) {
+        if (pred->idom != nullptr) {
+          idom = idom == nullptr ? pred : intersect(pred, idom);
+        }
+      }
+      if (block->idom != idom) {
+        block->idom = idom;
+        changed = true;
+      }
+    }
+  }
+
+  entry->idom = nullptr;
+  for (Block* block : order) {
+    if (block->idom != nullptr) {
+      block->idom->children.push_back(block);
+      block->depth = block->idom->depth + 1;
+    }
+  }
+}
+
+bool Ssa::dominates(const Block* a, const Block* b) const {
+  while (b->depth > a->depth) {
+    b = b->idom;
+  }
+  return a == b;
+}
+
+void Ssa::replace(Node* node, Node* with) {
+  node->removed = true;
+  node->forward = with;
+}
+
+void Ssa::remove(Node* node) { node->removed = true; }
+
+Ssa::Node* Ssa::resolve(Node* node) {
+  while (node->forward != nullptr) {
+    node = node->forward;
+  }
+  return node;
+}
+
+void Ssa::compact() {
+  auto removed = [](Node* node) { return node->removed; };
+  for (const auto& block : blocks) {
+    auto& phis = block->phis;
+    auto& nodes = block->nodes;
+    phis.erase(std::remove_if(phis.begin(), phis.end(), removed), phis.end());
+    nodes.erase(std::remove_if(nodes.begin(), nodes.end(), removed),
+                nodes.end());
+    for (auto* list : {&phis, &nodes}) {
+      for (Node* node : *list) {
+        for (auto& input : node->inputs) {
+          input = resolve(input);
+        }
+      }
+    }
+  }
+}
+
+std::vector<std::vector<Ssa::Node*>> Ssa::users() const {
+  std::vector<std::vector<Node*>> users(nodes_.size());
+  for (const auto& block : blocks) {
+    for (const auto* list : {&block->phis, &block->nodes}) {
+      for (Node* node : *list) {
+        for (Node* input : node->inputs) {
+          users[resolve(input)->id].push_back(node);
+        }
+      }
+    }
+  }
+  return users;
+}
+
+Ssa::Node* Ssa::add(Block* block, OpCode code, std::vector<uint8_t> operands,
+                    std::vector<Node*> inputs, int line) {
+  Node* added = node(Node::Kind::OP, block, line);
+  added->code = code;
+  added->operands = std::move(operands);
+  added->inputs = std::move(inputs);
+  block->nodes.push_back(added);
+  return added;
+}
+
+Ssa::Node* Ssa::phi(Block* block, int line) {
+  Node* added = node(Node::Kind::PHI, block, line);
+  block->phis.push_back(added);
+  return added;
+}
+
+Ssa::Node* Ssa::param(int slot) {
+  Node* added = node(Node::Kind::PARAM, blocks[0].get(), 0);
+  added->slot = slot;
+  return added;
+}
+
+Ssa::Node* Ssa::node(Node::Kind kind, Block* block, int line) {
+  nodes_.push_back(std::make_unique<Node>());
+  Node* added = nodes_.back().get();
+  added->kind = kind;
+  added->block = block;
+  added->line = line;
+  added->id = static_cast<int>(nodes_.size() - 1);
+  return added;
+}
+
+bool SsaEffects::isLiteral(OpCode code) {
+  return code == OpCode::CONSTANT || code == OpCode::NIL ||
+         code == OpCode::TRUE || code == OpCode::FALSE;
+}
+
+bool SsaEffects::isPure(OpCode code) {
+  switch (code) {
+    case OpCode::CONSTANT:
+    case OpCode::NIL:
+    case OpCode::TRUE:
+    case OpCode::FALSE:
+    case OpCode::NEGATE:
+    case OpCode::ADD:
+    case OpCode::SUBSTRACT:
+    case OpCode::MULTIPLY:
+    case OpCode::DIVIDE:
+    case OpCode::NOT:
+    case OpCode::EQUAL:
+    case OpCode::GREATER:
+    case OpCode::LESS:
+    case OpCode::NOT_EQUAL:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::LESS_EQUAL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool SsaEffects::isLoad(OpCode code) {
+  return code == OpCode::GET_GLOBAL || code == OpCode::GET_UPVALUE ||
+         code == OpCode::GET_PROPERTY;
+}
+
+bool SsaEffects::mayThrow(OpCode code) {
+  switch (code) {
+    case OpCode::NEGATE:
+    case OpCode::ADD:
+    case OpCode::SUBSTRACT:
+    case OpCode::MULTIPLY:
+    case OpCode::DIVIDE:
+    case OpCode::GREATER:
+    case OpCode::LESS:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::LESS_EQUAL:
+    case OpCode::DEFINE_GLOBAL:
+    case OpCode::GET_GLOBAL:
+    case OpCode::SET_GLOBAL:
+    case OpCode::GET_PROPERTY:
+    case OpCode::SET_PROPERTY:
+    case OpCode::CALL:
+    case OpCode::INVOKE:
+    case OpCode::SUPER_INVOKE:
+    case OpCode::GET_SUPER:
+    case OpCode::INHERIT:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool SsaEffects::hasEffects(OpCode code) {
+  switch (code) {
+    case OpCode::RETURN:
+    case OpCode::PRINT:
+    case OpCode::DEFINE_GLOBAL:
+    case OpCode::SET_GLOBAL:
+    case OpCode::SET_UPVALUE:
+    case OpCode::SET_PROPERTY:
+    case OpCode::CALL:
+    case OpCode::INVOKE:
+    case OpCode::SUPER_INVOKE:
+    case OpCode::METHOD:
+    case OpCode::INHERIT:
+    case OpCode::JUMP:
+    case OpCode::JUMP_IF_FALSE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool SsaEffects::producesValue(OpCode code) {
+  switch (code) {
+    case OpCode::GET_GLOBAL:
+    case OpCode::GET_UPVALUE:
+    case OpCode::GET_PROPERTY:
+    case OpCode::CALL:
+    case OpCode::INVOKE:
+    case OpCode::SUPER_INVOKE:
+    case OpCode::GET_SUPER:
+    case OpCode::CLOSURE:
+    case OpCode::CLASS:
+      return true;
+    default:
+      return isPure(code);
+  }
+}
+
+bool SsaEffects::leavesInput(OpCode code) {
+  switch (code) {
+    case OpCode::PRINT:
+    case OpCode::SET_GLOBAL:
+    case OpCode::SET_UPVALUE:
+    case OpCode::SET_PROPERTY:
+    case OpCode::METHOD:
+    case OpCode::INHERIT:
+      return true;
+    default:
+      return false;
+  }
+}
+
+}  // namespace compiler
+}  // namespace lox
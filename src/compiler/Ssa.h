@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Bytecode.h"
+#include "Chunk.h"
+
+namespace lox {
+namespace compiler {
+
+// SSA form of one function, built from its stack bytecode for the -O2
+// passes. Locals and stack temporaries disappear: every instruction that
+// computes something becomes a node whose inputs are the nodes it would have
+// popped, GET_LOCAL and SET_LOCAL just rename values, and where control flow
+// meets with different values in a slot a phi picks between them. Nodes keep
+// their stack opcode and operand bytes, so a node is an instruction minus
+// its stack traffic.
+//
+// Functions whose locals are captured by a closure are left out: those
+// locals live in stack slots that upvalues point into.
+class Ssa {
+ public:
+  struct Block;
+
+  struct Node {
+    enum class Kind { PARAM, PHI, OP };
+
+    Kind kind;
+    // For OP nodes.
+    OpCode code{OpCode::NIL};
+    std::vector<uint8_t> operands;
+    // Phi inputs are in the order of the block's predecessors.
+    std::vector<Node*> inputs;
+    int line{0};
+    int id{0};
+    Block* block{nullptr};
+    // Frame slot of a parameter; the callee is slot 0.
+    int slot{0};
+    // Set once the node is gone; uses are redirected to `forward`.
+    bool removed{false};
+    Node* forward{nullptr};
+  };
+
+  struct Block {
+    int id{0};
+    std::vector<Node*> phis;
+    // In execution order. The last one is the terminator: JUMP,
+    // JUMP_IF_FALSE or RETURN.
+    std::vector<Node*> nodes;
+    std::vector<Block*> preds;
+    // JUMP_IF_FALSE falls through to the first and jumps to the second.
+    std::vector<Block*> succs;
+    // Dominator tree, filled in by dominators().
+    Block* idom{nullptr};
+    std::vector<Block*> children;
+    int depth{0};
+
+    Node* terminator() const { return nodes.back(); }
+  };
+
+  // Returns nullptr for functions the IR does not cover.
+  static std::unique_ptr<Ssa> build(const Chunk& chunk, int arity);
+
+  void dominators();
+  bool dominates(const Block* a, const Block* b) const;
+
+  // Makes every use of `node` a use of `with`, and drops `node`.
+  void replace(Node* node, Node* with);
+  void remove(Node* node);
+  // Applies the replacements and removals to the blocks.
+  void compact();
+  static Node* resolve(Node* node);
+
+  // Nodes reading each node, by id, phis included.
+  std::vector<std::vector<Node*>> users() const;
+
+  Node* add(Block* block, OpCode code, std::vector<uint8_t> operands,
+            std::vector<Node*> inputs, int line);
+  Node* phi(Block* block, int line);
+
+  int arity() const { return arity_; }
+  size_t size() const { return nodes_.size(); }
+
+  // Reachable blocks in code order, the entry first.
+  std::vector<std::unique_ptr<Block>> blocks;
+
+ private:
+  using Instruction = Bytecode::Instruction;
+
+  explicit Ssa(int arity) : arity_(arity) {}
+
+  Node* param(int slot);
+  Node* node(Node::Kind kind, Block* block, int line);
+
+  int arity_;
+  std::vector<std::unique_ptr<Node>> nodes_;
+};
+
+// What a node's opcode does, as far as the passes care.
+struct SsaEffects {
+  // CONSTANT, NIL, TRUE and FALSE.
+  static bool isLiteral(OpCode code);
+  // Computed from the inputs alone: literals, operators and comparisons.
+  static bool isPure(OpCode code);
+  // GET_GLOBAL, GET_UPVALUE and GET_PROPERTY.
+  static bool isLoad(OpCode code);
+  static bool mayThrow(OpCode code);
+  // Stores, output, calls, class setup and the terminators, which have to
+  // stay where they are.
+  static bool hasEffects(OpCode code);
+  static bool producesValue(OpCode code);
+  // Whether the instruction leaves one of its inputs on the stack.
+  static bool leavesInput(OpCode code);
+};
+
+}  // namespace compiler
+}  // namespace lox
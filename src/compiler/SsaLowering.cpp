@@ -0,0 +1,602 @@
+#include "SsaLowering.h"
+
+#include <algorithm>
+#include <set>
+
+namespace lox {
+namespace compiler {
+
+namespace {
+
+// A frame's share of the VM stack, which also keeps slots within a byte.
+constexpr int kMaxFrameSize = 256;
+
+}  // namespace
+
+bool SsaLowering::lower(const Ssa& ssa, Chunk& chunk) {
+  SsaLowering lowering(ssa);
+  lowering.place();
+  while (lowering.schedule()) {
+  }
+  lowering.allocate();
+  lowering.reserve();
+  return lowering.emit(chunk);
+}
+
+SsaLowering::SsaLowering(const Ssa& ssa)
+    : ssa_(ssa),
+      places_(ssa.size(), Place::NONE),
+      slots_(ssa.size(), -1),
+      firstUsers_(ssa.size(), nullptr),
+      early_(ssa.size()),
+      below_(ssa.size(), 0),
+      statements_(ssa.size(), false),
+      inPlace_(ssa.size(), false),
+      frameSize_(ssa.arity() + 1),
+      labels_(ssa.blocks.size(), -1) {}
+
+void SsaLowering::place() {
+  std::vector<int> uses(ssa_.size(), 0);
+  for (const auto& block : ssa_.blocks) {
+    for (const Node* phi : block->phis) {
+      for (const Node* input : phi->inputs) {
+        uses[input->id]++;
+      }
+    }
+    for (const Node* node : block->nodes) {
+      for (const Node* input : node->inputs) {
+        uses[input->id]++;
+        if (input->block == node->block && firstUsers_[input->id] == nullptr) {
+          firstUsers_[input->id] = node;
+        }
+      }
+    }
+  }
+
+  for (const auto& block : ssa_.blocks) {
+    for (const Node* phi : block->phis) {
+      places_[phi->id] = Place::SLOT;
+    }
+    for (const Node* node : block->nodes) {
+      Place& place = places_[node->id];
+      if (SsaEffects::isLiteral(node->code)) {
+        place = Place::LITERAL;
+      } else if (!SsaEffects::producesValue(node->code) ||
+                 uses[node->id] == 0) {
+        place = Place::NONE;
+      } else if (firstUsers_[node->id] == nullptr) {
+        place = Place::SLOT;
+      } else {
+        place = uses[node->id] == 1 ? Place::STACK : Place::TEE;
+      }
+    }
+  }
+}
+
+bool SsaLowering::schedule() {
+  arrange();
+  bool changed = false;
+  auto demote = [&](const Node* node) {
+    places_[node->id] = Place::SLOT;
+    changed = true;
+  };
+  // Plays the block's stack as emit() will leave it, checking that every
+  // node finds its inputs on top in order.
+  for (const auto& block : ssa_.blocks) {
+    std::vector<const Node*> stack;
+    std::vector<bool> defined(ssa_.size(), false);
+    auto available = [&](const Node* node) {
+      return node->kind != Node::Kind::OP || node->block != block.get() ||
+             places_[node->id] == Place::LITERAL || defined[node->id];
+    };
+    bool consistent = true;
+    for (const Node* node : block->nodes) {
+      if (places_[node->id] == Place::LITERAL) {
+        continue;
+      }
+      statements_[node->id] = stack.empty();
+      for (const auto& early : early_[node->id]) {
+        if (!available(early.value)) {
+          demote(early.before);
+          consistent = false;
+          break;
+        }
+        stack.push_back(early.value);
+      }
+      if (!consistent) {
+        break;
+      }
+      for (size_t i = lateInputs(node); i < node->inputs.size(); i++) {
+        stack.push_back(node->inputs[i]);
+      }
+      size_t count = node->inputs.size();
+      if (stack.size() < count ||
+          !std::equal(stack.end() - count, stack.end(),
+                      node->inputs.begin())) {
+        for (size_t i = 0; i < count; i++) {
+          if (onStack(node, i)) {
+            demote(node->inputs[i]);
+          }
+        }
+        consistent = false;
+        break;
+      }
+      stack.resize(stack.size() - count);
+      below_[node->id] = static_cast<int>(stack.size());
+      Place place = places_[node->id];
+      if (place == Place::STACK || place == Place::TEE) {
+        stack.push_back(node);
+      }
+      defined[node->id] = true;
+    }
+    if (consistent && !stack.empty()) {
+      for (const Node* node : stack) {
+        demote(node);
+      }
+    }
+  }
+  return changed;
+}
+
+void SsaLowering::arrange() {
+  for (auto& early : early_) {
+    early.clear();
+  }
+  // Users come after the values they take from the stack, so going
+  // backwards queues the pushes for an outer expression before the ones for
+  // the expressions nested in it, which is the order they go on the stack.
+  for (const auto& block : ssa_.blocks) {
+    for (auto it = block->nodes.rbegin(); it != block->nodes.rend(); ++it) {
+      const Node* node = *it;
+      if (places_[node->id] == Place::LITERAL) {
+        continue;
+      }
+      std::vector<const Node*> pushes;
+      for (size_t i = 0; i < node->inputs.size(); i++) {
+        const Node* input = node->inputs[i];
+        if (!onStack(node, i)) {
+          pushes.push_back(input);
+          continue;
+        }
+        for (const Node* value : pushes) {
+          early_[start(input)->id].push_back({value, input});
+        }
+        pushes.clear();
+      }
+    }
+  }
+}
+
+const SsaLowering::Node* SsaLowering::start(const Node* node) const {
+  for (;;) {
+    size_t i = 0;
+    while (i < node->inputs.size() && !onStack(node, i)) {
+      i++;
+    }
+    if (i == node->inputs.size()) {
+      return node;
+    }
+    node = node->inputs[i];
+  }
+}
+
+void SsaLowering::allocate() {
+  const auto& blocks = ssa_.blocks;
+  auto tracked = [&](const Node* node) {
+    return node->kind != Node::Kind::PARAM && inSlot(node);
+  };
+  auto predIndex = [](const Block* block, const Block* pred) {
+    auto it = std::find(block->preds.begin(), block->preds.end(), pred);
+    return static_cast<size_t>(it - block->preds.begin());
+  };
+
+  // Values in slots alive at the start and the end of each block. A phi's
+  // inputs are read at the end of the predecessor they come from.
+  std::vector<std::set<int>> liveIn(blocks.size());
+  std::vector<std::set<int>> liveOut(blocks.size());
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto it = blocks.rbegin(); it != blocks.rend(); ++it) {
+      const Block* block = it->get();
+      std::set<int> out;
+      for (const Block* succ : block->succs) {
+        out.insert(liveIn[succ->id].begin(), liveIn[succ->id].end());
+        size_t index = predIndex(succ, block);
+        for (const Node* phi : succ->phis) {
+          if (tracked(phi->inputs[index])) {
+            out.insert(phi->inputs[index]->id);
+          }
+        }
+      }
+      std::set<int> in = out;
+      for (auto node = block->nodes.rbegin(); node != block->nodes.rend();
+           ++node) {
+        in.erase((*node)->id);
+        for (const Node* input : (*node)->inputs) {
+          if (tracked(input)) {
+            in.insert(input->id);
+          }
+        }
+      }
+      for (const Node* phi : block->phis) {
+        in.erase(phi->id);
+      }
+      if (in != liveIn[block->id] || out != liveOut[block->id]) {
+        liveIn[block->id] = std::move(in);
+        liveOut[block->id] = std::move(out);
+        changed = true;
+      }
+    }
+  }
+
+  std::vector<std::set<int>> conflicts(ssa_.size());
+  auto conflict = [&](int a, int b) {
+    if (a != b) {
+      conflicts[a].insert(b);
+      conflicts[b].insert(a);
+    }
+  };
+  for (const auto& block : blocks) {
+    // Phis are written on the way out of each predecessor, all at once.
+    for (const Block* succ : block->succs) {
+      for (const Node* phi : succ->phis) {
+        for (int live : liveIn[succ->id]) {
+          conflict(phi->id, live);
+        }
+        for (const Node* other : succ->phis) {
+          conflict(phi->id, other->id);
+        }
+      }
+    }
+    std::set<int> live = liveOut[block->id];
+    for (auto node = block->nodes.rbegin(); node != block->nodes.rend();
+         ++node) {
+      if (tracked(*node)) {
+        for (int other : live) {
+          conflict((*node)->id, other);
+        }
+        live.erase((*node)->id);
+      }
+      for (const Node* input : (*node)->inputs) {
+        if (tracked(input)) {
+          live.insert(input->id);
+        }
+      }
+    }
+    for (const Node* phi : block->phis) {
+      for (int other : live) {
+        conflict(phi->id, other);
+      }
+    }
+  }
+
+  // Colors values in the order they are defined, trying the slot of a
+  // related phi first.
+  std::vector<std::vector<const Node*>> related(ssa_.size());
+  for (const auto& block : blocks) {
+    for (const Node* phi : block->phis) {
+      for (const Node* input : phi->inputs) {
+        if (tracked(input)) {
+          related[input->id].push_back(phi);
+          related[phi->id].push_back(input);
+        }
+      }
+    }
+  }
+  auto color = [&](const Node* node) {
+    std::set<int> taken;
+    for (int other : conflicts[node->id]) {
+      if (slots_[other] != -1) {
+        taken.insert(slots_[other]);
+      }
+    }
+    int slot = -1;
+    for (const Node* other : related[node->id]) {
+      if (slots_[other->id] != -1 && !taken.count(slots_[other->id])) {
+        slot = slots_[other->id];
+        break;
+      }
+    }
+    if (slot == -1) {
+      slot = ssa_.arity() + 1;
+      while (taken.count(slot)) {
+        slot++;
+      }
+    }
+    slots_[node->id] = slot;
+    frameSize_ = std::max(frameSize_, slot + 1);
+  };
+  for (const auto& block : blocks) {
+    for (const Node* phi : block->phis) {
+      color(phi);
+    }
+    for (const Node* node : block->nodes) {
+      if (tracked(node)) {
+        color(node);
+      }
+    }
+  }
+}
+
+void SsaLowering::reserve() {
+  // The blocks that run once, one after the other, from the entry.
+  std::vector<const Node*> nodes;
+  const auto& blocks = ssa_.blocks;
+  for (size_t b = 0; b < blocks.size(); b++) {
+    const Block* block = blocks[b].get();
+    if (b > 0 && (block->preds.size() != 1 ||
+                  block->preds[0] != blocks[b - 1].get() ||
+                  blocks[b - 1]->succs.size() != 1)) {
+      break;
+    }
+    for (const Node* node : block->nodes) {
+      if (places_[node->id] != Place::LITERAL) {
+        nodes.push_back(node);
+      }
+    }
+  }
+
+  // Slots defined there in order, with nothing else on the stack, are the
+  // values themselves. The NILs for the rest go at the last point before
+  // the first one that is not, where the stack holds nothing but slots.
+  std::vector<const Node*> inPlace;
+  size_t kept = 0;
+  int next = ssa_.arity() + 1;
+  for (const Node* node : nodes) {
+    if (statements_[node->id]) {
+      reserveAt_ = node;
+      reserveAfter_ = false;
+      kept = inPlace.size();
+    }
+    if (!inSlot(node) || slot(node) < next) {
+      continue;
+    }
+    if (below_[node->id] != 0 || slot(node) != next) {
+      break;
+    }
+    inPlace.push_back(node);
+    next++;
+    reserveAt_ = node;
+    reserveAfter_ = true;
+    kept = inPlace.size();
+  }
+  inPlace.resize(kept);
+  for (const Node* node : inPlace) {
+    inPlace_[node->id] = true;
+  }
+  reserved_ = ssa_.arity() + 1 + static_cast<int>(inPlace.size());
+}
+
+bool SsaLowering::emit(Chunk& chunk) {
+  const auto& blocks = ssa_.blocks;
+  int line = blocks[0]->nodes.front()->line;
+  auto reserve = [&](const Node* node, bool after) {
+    if (node != reserveAt_ || after != reserveAfter_) {
+      return;
+    }
+    for (int slot = reserved_; slot < frameSize_; slot++) {
+      add(OpCode::NIL, {}, line);
+    }
+  };
+
+  for (size_t b = 0; b < blocks.size(); b++) {
+    const Block* block = blocks[b].get();
+    const Block* next = b + 1 < blocks.size() ? blocks[b + 1].get() : nullptr;
+    bind(block->id);
+    for (const Node* node : block->nodes) {
+      Place place = places_[node->id];
+      if (place == Place::LITERAL) {
+        continue;
+      }
+      line = node->line;
+      reserve(node, false);
+      for (const auto& early : early_[node->id]) {
+        push(early.value, line);
+      }
+      for (size_t i = lateInputs(node); i < node->inputs.size(); i++) {
+        push(node->inputs[i], line);
+      }
+      depth_ -= static_cast<int>(node->inputs.size());
+
+      switch (node->code) {
+        case OpCode::JUMP: {
+          const Block* succ = block->succs[0];
+          copy(block, succ, line);
+          if (succ != next) {
+            jump(OpCode::JUMP, succ->id, line);
+          }
+          break;
+        }
+        case OpCode::JUMP_IF_FALSE: {
+          const Block* then = block->succs[0];
+          const Block* otherwise = block->succs[1];
+          bool stub = needsCopies(block, otherwise);
+          int label = otherwise->id;
+          if (stub) {
+            label = static_cast<int>(labels_.size());
+            labels_.push_back(-1);
+          }
+          jump(OpCode::POP_JUMP_IF_FALSE, label, line);
+          copy(block, then, line);
+          if (then != next || stub) {
+            jump(OpCode::JUMP, then->id, line);
+          }
+          if (stub) {
+            bind(label);
+            copy(block, otherwise, line);
+            jump(OpCode::JUMP, otherwise->id, line);
+          }
+          break;
+        }
+        default:
+          add(node->code, node->operands, line);
+          if (inPlace_[node->id]) {
+            reserve(node, true);
+            if (place == Place::TEE) {
+              push(node, line);
+            }
+          } else if (SsaEffects::producesValue(node->code)) {
+            depth_++;
+            maxDepth_ = std::max(maxDepth_, depth_);
+            if (place == Place::TEE || place == Place::SLOT) {
+              add(OpCode::SET_LOCAL, {static_cast<uint8_t>(slot(node))}, line);
+            }
+            if (place == Place::SLOT || place == Place::NONE) {
+              drop(node, line);
+              depth_--;
+            }
+          } else if (SsaEffects::leavesInput(node->code)) {
+            // SET_PROPERTY leaves the value, the others their first input.
+            drop(node->inputs[node->code == OpCode::SET_PROPERTY ? 1 : 0],
+                 line);
+          }
+          break;
+      }
+    }
+  }
+
+  if (frameSize_ + maxDepth_ > kMaxFrameSize) {
+    return false;
+  }
+  // Blocks that emit nothing leave jumps to the next instruction behind.
+  std::vector<int> moved(out_.size() + 1);
+  std::vector<Instruction> kept;
+  for (size_t i = 0; i < out_.size(); i++) {
+    moved[i] = static_cast<int>(kept.size());
+    auto& instruction = out_[i];
+    if (instruction.code != OpCode::JUMP ||
+        labels_[instruction.target] != static_cast<int>(i) + 1) {
+      kept.push_back(std::move(instruction));
+    }
+  }
+  moved[out_.size()] = static_cast<int>(kept.size());
+  out_ = std::move(kept);
+  for (int& label : labels_) {
+    label = moved[label];
+  }
+  for (size_t i = 0; i < out_.size(); i++) {
+    auto& instruction = out_[i];
+    if (instruction.target == -1) {
+      continue;
+    }
+    instruction.target = labels_[instruction.target];
+    if (instruction.target <= static_cast<int>(i)) {
+      if (instruction.code != OpCode::JUMP) {
+        return false;
+      }
+      instruction.code = OpCode::LOOP;
+    }
+  }
+  if (!Bytecode::fits(out_)) {
+    return false;
+  }
+  Bytecode::encode(out_, chunk);
+  return true;
+}
+
+bool SsaLowering::onStack(const Node* node, size_t i) const {
+  const Node* input = node->inputs[i];
+  switch (places_[input->id]) {
+    case Place::STACK:
+      return true;
+    case Place::TEE: {
+      // Only the first read of the first user.
+      auto begin = node->inputs.begin();
+      return firstUsers_[input->id] == node &&
+             std::find(begin, begin + i, input) == begin + i;
+    }
+    default:
+      return false;
+  }
+}
+
+size_t SsaLowering::lateInputs(const Node* node) const {
+  size_t i = node->inputs.size();
+  while (i > 0 && !onStack(node, i - 1)) {
+    i--;
+  }
+  return i;
+}
+
+bool SsaLowering::inSlot(const Node* node) const {
+  Place place = places_[node->id];
+  return node->kind != Node::Kind::OP || place == Place::TEE ||
+         place == Place::SLOT;
+}
+
+int SsaLowering::slot(const Node* node) const {
+  return node->kind == Node::Kind::PARAM ? node->slot : slots_[node->id];
+}
+
+void SsaLowering::push(const Node* node, int line) {
+  if (places_[node->id] == Place::LITERAL) {
+    add(node->code, node->operands, line);
+  } else if (popped_ != -1 && popped_ == slot(node)) {
+    // The value is still there, under the POP that dropped it.
+    out_.pop_back();
+    popped_ = -1;
+  } else {
+    add(OpCode::GET_LOCAL, {static_cast<uint8_t>(slot(node))}, line);
+  }
+  depth_++;
+  maxDepth_ = std::max(maxDepth_, depth_);
+}
+
+void SsaLowering::copy(const Block* from, const Block* to, int line) {
+  if (!needsCopies(from, to)) {
+    return;
+  }
+  size_t index = static_cast<size_t>(
+      std::find(to->preds.begin(), to->preds.end(), from) - to->preds.begin());
+  // Reading every input before writing any phi makes the copies parallel.
+  std::vector<const Node*> phis;
+  for (const Node* phi : to->phis) {
+    const Node* input = phi->inputs[index];
+    if (places_[input->id] == Place::LITERAL || slot(input) != slot(phi)) {
+      push(input, line);
+      phis.push_back(phi);
+    }
+  }
+  for (auto phi = phis.rbegin(); phi != phis.rend(); ++phi) {
+    add(OpCode::SET_LOCAL, {static_cast<uint8_t>(slot(*phi))}, line);
+    add(OpCode::POP, {}, line);
+    depth_--;
+  }
+}
+
+bool SsaLowering::needsCopies(const Block* from, const Block* to) const {
+  size_t index = static_cast<size_t>(
+      std::find(to->preds.begin(), to->preds.end(), from) - to->preds.begin());
+  for (const Node* phi : to->phis) {
+    const Node* input = phi->inputs[index];
+    if (places_[input->id] == Place::LITERAL || slot(input) != slot(phi)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void SsaLowering::drop(const Node* node, int line) {
+  add(OpCode::POP, {}, line);
+  if (inSlot(node)) {
+    popped_ = slot(node);
+  }
+}
+
+void SsaLowering::add(OpCode code, std::vector<uint8_t> operands, int line) {
+  out_.push_back({code, std::move(operands), line});
+  popped_ = -1;
+}
+
+void SsaLowering::jump(OpCode code, int label, int line) {
+  out_.push_back({code, {0, 0}, line, label});
+  popped_ = -1;
+}
+
+void SsaLowering::bind(int label) {
+  labels_[label] = static_cast<int>(out_.size());
+  popped_ = -1;
+}
+
+}  // namespace compiler
+}  // namespace lox
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Bytecode.h"
+#include "Chunk.h"
+#include "Ssa.h"
+
+namespace lox {
+namespace compiler {
+
+// Writes an SSA graph back to a chunk as stack bytecode.
+//
+// Blocks keep their order and nodes their place in them, so effects happen
+// in the order they always did. A value used once, further down its own
+// block, stays on the stack until its user pops it, the way the parser's
+// code leaves it. A value used more than once is also stored to a frame
+// slot, and one used from other blocks or by a phi only lives there. Those
+// slots come after the parameters and are shared by values that are never
+// alive at the same time; a phi and its inputs get the same slot when they
+// can, so the edges into its block need no copies. Like the parser's locals,
+// values computed first thing are left where they are as their slots, and
+// NILs hold the place of the others. Literals are pushed again wherever they
+// are used.
+class SsaLowering {
+ public:
+  // Returns false, leaving the chunk alone, if the frame would need more
+  // than 256 slots or a jump would be too long to encode.
+  static bool lower(const Ssa& ssa, Chunk& chunk);
+
+ private:
+  using Node = Ssa::Node;
+  using Block = Ssa::Block;
+  using Instruction = Bytecode::Instruction;
+
+  // Where a value is kept between its definition and its uses. TEE values
+  // are stored to their slot and also left on the stack for their first
+  // user.
+  enum class Place { NONE, LITERAL, STACK, TEE, SLOT };
+
+  // A value pushed from its slot or as a literal ahead of the expression
+  // computing `before`, which sits above it on the stack.
+  struct Early {
+    const Node* value;
+    const Node* before;
+  };
+
+  explicit SsaLowering(const Ssa& ssa);
+
+  void place();
+  // Settles which values can stay on the stack, moving to slots the ones
+  // that would be in the way. Returns whether it changed anything.
+  bool schedule();
+  // Works out where the inputs that are not on the stack get pushed: the
+  // ones after the last input on the stack right before their user, the
+  // others before the expression that computes the next one.
+  void arrange();
+  // First node emitted for the expression computing `node`.
+  const Node* start(const Node* node) const;
+  void allocate();
+  // Picks the values that can be left where they are computed to become
+  // their slots, instead of being stored over a NIL pushed on entry.
+  void reserve();
+  bool emit(Chunk& chunk);
+
+  // Whether `node` finds its input `i` already on the stack.
+  bool onStack(const Node* node, size_t i) const;
+  // Index of the first input pushed right before `node`.
+  size_t lateInputs(const Node* node) const;
+  bool inSlot(const Node* node) const;
+  int slot(const Node* node) const;
+
+  // Loads a value that is not on the stack.
+  void push(const Node* node, int line);
+  // Pops `node` off the stack.
+  void drop(const Node* node, int line);
+  // Copies the values phis of `to` take from `from`.
+  void copy(const Block* from, const Block* to, int line);
+  bool needsCopies(const Block* from, const Block* to) const;
+  void add(OpCode code, std::vector<uint8_t> operands, int line);
+  void jump(OpCode code, int label, int line);
+  void bind(int label);
+
+  const Ssa& ssa_;
+  std::vector<Place> places_;
+  std::vector<int> slots_;
+  std::vector<const Node*> firstUsers_;
+  // Pushes to emit before each node, by id.
+  std::vector<std::vector<Early>> early_;
+  // Values left on the stack under each node's result, and whether the
+  // stack holds nothing else before its inputs go on it.
+  std::vector<int> below_;
+  std::vector<bool> statements_;
+  // Values that become their slot where they are computed, and the slots
+  // taken that way, which the NILs pushed at `reserveAt_` come after.
+  std::vector<bool> inPlace_;
+  int reserved_{0};
+  const Node* reserveAt_{nullptr};
+  bool reserveAfter_{false};
+  // One past the highest slot in use.
+  int frameSize_;
+
+  std::vector<Instruction> out_;
+  // Instruction index of each label; blocks use their id as label.
+  std::vector<int> labels_;
+  int depth_{0};
+  int maxDepth_{0};
+  // Slot of the value the last instruction, a POP, dropped, or -1.
+  int popped_{-1};
+};
+
+}  // namespace compiler
+}  // namespace lox
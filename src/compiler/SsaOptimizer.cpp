@@ -0,0 +1,519 @@
+#include "SsaOptimizer.h"
+
+#include <algorithm>
+#include <set>
+#include <unordered_map>
+#include <utility>
+
+namespace lox {
+namespace compiler {
+
+namespace {
+
+void appendId(std::string& key, const Ssa::Node* node) {
+  int id = Ssa::resolve(const_cast<Ssa::Node*>(node))->id;
+  key.append(reinterpret_cast<const char*>(&id), sizeof(id));
+}
+
+// Identifies an operator by its opcode, operands and inputs.
+std::string valueKey(const Ssa::Node* node) {
+  std::string key(1, static_cast<char>(node->code));
+  key.append(node->operands.begin(), node->operands.end());
+  for (const auto* input : node->inputs) {
+    appendId(key, input);
+  }
+  return key;
+}
+
+// Prefix of the keys for properties called `name`.
+std::string propertyKey(uint8_t name) {
+  return std::string{'p', static_cast<char>(name)};
+}
+
+// Identifies what a load reads or a store writes.
+std::string placeKey(const Ssa::Node* node) {
+  const auto& operands = node->operands;
+  switch (node->code) {
+    case OpCode::GET_GLOBAL:
+    case OpCode::SET_GLOBAL:
+    case OpCode::DEFINE_GLOBAL:
+      return std::string{'g', static_cast<char>(operands[0]),
+                         static_cast<char>(operands[1])};
+    case OpCode::GET_UPVALUE:
+    case OpCode::SET_UPVALUE:
+      return std::string{'u', static_cast<char>(operands[0])};
+    default: {
+      std::string key = propertyKey(operands[0]);
+      appendId(key, node->inputs[0]);
+      return key;
+    }
+  }
+}
+
+bool isStore(OpCode code) {
+  return code == OpCode::SET_GLOBAL || code == OpCode::SET_UPVALUE ||
+         code == OpCode::SET_PROPERTY;
+}
+
+// Whether a bound method as input `i` of `code` behaves like any other
+// bound method of the same receiver and method.
+bool identityFreeUse(OpCode code, size_t i) {
+  switch (code) {
+    case OpCode::NEGATE:
+    case OpCode::ADD:
+    case OpCode::SUBSTRACT:
+    case OpCode::MULTIPLY:
+    case OpCode::DIVIDE:
+    case OpCode::NOT:
+    case OpCode::GREATER:
+    case OpCode::LESS:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::LESS_EQUAL:
+    case OpCode::PRINT:
+    case OpCode::JUMP_IF_FALSE:
+    case OpCode::GET_PROPERTY:
+      return true;
+    case OpCode::SET_PROPERTY:
+    case OpCode::CALL:
+    case OpCode::INVOKE:
+      return i == 0;
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+// Hash table whose changes can be rolled back when leaving a subtree of the
+// dominator tree.
+class SsaOptimizer::Table {
+ public:
+  Node* find(const std::string& key) const {
+    auto it = map_.find(key);
+    return it == map_.end() ? nullptr : it->second;
+  }
+
+  void set(const std::string& key, Node* node) {
+    auto it = map_.find(key);
+    log_.emplace_back(key, it == map_.end() ? nullptr : it->second);
+    map_[key] = node;
+  }
+
+  // Forgets the keys starting with `prefix`.
+  void forget(const std::string& prefix = "") {
+    std::vector<std::string> keys;
+    for (const auto& entry : map_) {
+      if (entry.first.compare(0, prefix.size(), prefix) == 0) {
+        keys.push_back(entry.first);
+      }
+    }
+    for (const auto& key : keys) {
+      log_.emplace_back(key, map_[key]);
+      map_.erase(key);
+    }
+  }
+
+  size_t mark() const { return log_.size(); }
+
+  void rollback(size_t mark) {
+    while (log_.size() > mark) {
+      auto& [key, previous] = log_.back();
+      if (previous == nullptr) {
+        map_.erase(key);
+      } else {
+        map_[key] = previous;
+      }
+      log_.pop_back();
+    }
+  }
+
+ private:
+  std::unordered_map<std::string, Node*> map_;
+  std::vector<std::pair<std::string, Node*>> log_;
+};
+
+void SsaOptimizer::optimize(Chunk& chunk, int arity) {
+  auto ssa = Ssa::build(chunk, arity);
+  if (ssa == nullptr) {
+    return;
+  }
+  SsaOptimizer optimizer(*ssa);
+  optimizer.propagateCopies();
+  int changes = optimizer.numberValues();
+  changes += optimizer.hoistInvariants();
+  changes += optimizer.eliminateDeadStores();
+  if (changes > 0) {
+    SsaLowering::lower(*ssa, chunk);
+  }
+}
+
+int SsaOptimizer::propagateCopies() {
+  int removed = 0;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (const auto& block : ssa_.blocks) {
+      for (Node* phi : block->phis) {
+        if (phi->removed) {
+          continue;
+        }
+        Node* same = nullptr;
+        bool trivial = true;
+        for (Node* input : phi->inputs) {
+          input = Ssa::resolve(input);
+          if (input == phi || input == same) {
+            continue;
+          }
+          if (same != nullptr) {
+            trivial = false;
+            break;
+          }
+          same = input;
+        }
+        if (trivial && same != nullptr) {
+          ssa_.replace(phi, same);
+          removed++;
+          changed = true;
+        }
+      }
+    }
+  }
+  ssa_.compact();
+  return removed;
+}
+
+int SsaOptimizer::numberValues() {
+  ssa_.dominators();
+  findLoops();
+  users_ = ssa_.users();
+  safe_.assign(ssa_.size(), false);
+  Table values;
+  Table memory;
+  int removed = number(ssa_.blocks[0].get(), values, memory);
+  ssa_.compact();
+  return removed;
+}
+
+int SsaOptimizer::number(Block* block, Table& values, Table& memory) {
+  int removed = 0;
+  size_t valuesMark = values.mark();
+  size_t memoryMark = memory.mark();
+  // Another way in may have stored anything.
+  if (block->preds.size() > 1) {
+    memory.forget();
+  }
+
+  for (Node* node : block->nodes) {
+    OpCode code = node->code;
+    if (SsaEffects::isPure(code)) {
+      auto key = valueKey(node);
+      Node* known = values.find(key);
+      if (known != nullptr && !SsaEffects::isLiteral(code) &&
+          !sameLoops(known->block, block)) {
+        // Keeping it would cost a store on every iteration to save one
+        // recomputation out of the loop.
+        known = nullptr;
+      }
+      if (known != nullptr) {
+        ssa_.replace(node, known);
+        removed += SsaEffects::isLiteral(code) ? 0 : 1;
+      } else {
+        values.set(key, node);
+      }
+      continue;
+    }
+    if (SsaEffects::isLoad(code)) {
+      auto key = placeKey(node);
+      Node* known = memory.find(key);
+      if (known != nullptr && code != OpCode::GET_PROPERTY) {
+        // Reading a global or upvalue again is as cheap as reading a slot,
+        // but it can no longer fail, so it goes if nothing uses it.
+        safe_[node->id] = true;
+        continue;
+      }
+      // Keeping a computed value for another block would cost a slot write
+      // even on the paths that never get there.
+      bool cheap = known != nullptr &&
+                   (known->block == block || known->kind != Node::Kind::OP ||
+                    SsaEffects::isLiteral(known->code));
+      if (cheap &&
+          (known->code != OpCode::GET_PROPERTY || identityFree(node))) {
+        ssa_.replace(node, known);
+        removed++;
+      } else {
+        memory.set(key, node);
+      }
+      continue;
+    }
+    switch (code) {
+      case OpCode::DEFINE_GLOBAL:
+      case OpCode::SET_GLOBAL:
+      case OpCode::SET_UPVALUE:
+        memory.set(placeKey(node), Ssa::resolve(node->inputs[0]));
+        break;
+      case OpCode::SET_PROPERTY:
+        // Other instances may be the same one.
+        memory.forget(propertyKey(node->operands[0]));
+        memory.set(placeKey(node), Ssa::resolve(node->inputs[1]));
+        break;
+      case OpCode::METHOD:
+      case OpCode::INHERIT:
+        memory.forget("p");
+        break;
+      case OpCode::CALL:
+      case OpCode::INVOKE:
+      case OpCode::SUPER_INVOKE:
+        memory.forget();
+        break;
+      default:
+        break;
+    }
+  }
+
+  for (Block* child : block->children) {
+    removed += number(child, values, memory);
+  }
+  memory.rollback(memoryMark);
+  values.rollback(valuesMark);
+  return removed;
+}
+
+int SsaOptimizer::hoistInvariants() {
+  users_ = ssa_.users();
+  int hoisted = 0;
+  for (const auto& block : ssa_.blocks) {
+    Block* header = block.get();
+    std::vector<Block*> body = loopBody(header);
+    if (body.empty()) {
+      continue;
+    }
+    auto inLoop = [&](const Block* member) {
+      const auto& loops = loops_[member->id];
+      return std::binary_search(loops.begin(), loops.end(), header->id);
+    };
+
+    Block* preheader = nullptr;
+    int entries = 0;
+    for (Block* pred : header->preds) {
+      if (!inLoop(pred)) {
+        preheader = pred;
+        entries++;
+      }
+    }
+    if (entries != 1 || preheader->succs.size() != 1) {
+      continue;
+    }
+
+    // What the loop may overwrite.
+    std::set<std::string> stored;
+    std::set<uint8_t> properties;
+    bool methods = false;
+    bool calls = false;
+    for (Block* member : body) {
+      for (Node* node : member->nodes) {
+        switch (node->code) {
+          case OpCode::DEFINE_GLOBAL:
+          case OpCode::SET_GLOBAL:
+          case OpCode::SET_UPVALUE:
+            stored.insert(placeKey(node));
+            break;
+          case OpCode::SET_PROPERTY:
+            properties.insert(node->operands[0]);
+            break;
+          case OpCode::METHOD:
+          case OpCode::INHERIT:
+            methods = true;
+            break;
+          case OpCode::CALL:
+          case OpCode::INVOKE:
+          case OpCode::SUPER_INVOKE:
+            calls = true;
+            break;
+          default:
+            break;
+        }
+      }
+    }
+    auto unchanged = [&](const Node* load) {
+      if (calls) {
+        return false;
+      }
+      if (load->code == OpCode::GET_PROPERTY) {
+        return !methods && !properties.count(load->operands[0]) &&
+               identityFree(load);
+      }
+      return !stored.count(placeKey(load));
+    };
+
+    std::vector<Node*> kept;
+    // Set once something has to stay put: from there on, only what can
+    // neither fail nor be seen may move above it.
+    bool blocked = false;
+    for (Node* node : header->nodes) {
+      OpCode code = node->code;
+      bool invariant = node != header->terminator();
+      for (const Node* input : node->inputs) {
+        invariant = invariant && !inLoop(input->block);
+      }
+      bool safe = !SsaEffects::mayThrow(code) || !blocked;
+      if (invariant && safe &&
+          (SsaEffects::isPure(code) ||
+           (SsaEffects::isLoad(code) && unchanged(node)))) {
+        auto& nodes = preheader->nodes;
+        nodes.insert(nodes.end() - 1, node);
+        node->block = preheader;
+        safe_[node->id] = false;
+        hoisted += SsaEffects::isLiteral(code) ? 0 : 1;
+        continue;
+      }
+      if (SsaEffects::hasEffects(code) || SsaEffects::mayThrow(code)) {
+        blocked = true;
+      }
+      kept.push_back(node);
+    }
+    header->nodes = std::move(kept);
+  }
+  return hoisted;
+}
+
+void SsaOptimizer::findLoops() {
+  loops_.assign(ssa_.blocks.size(), {});
+  for (const auto& block : ssa_.blocks) {
+    for (Block* member : loopBody(block.get())) {
+      loops_[member->id].push_back(block->id);
+    }
+  }
+}
+
+std::vector<SsaOptimizer::Block*> SsaOptimizer::loopBody(Block* header) {
+  std::vector<Block*> body;
+  for (Block* pred : header->preds) {
+    if (ssa_.dominates(header, pred)) {
+      body.push_back(pred);
+    }
+  }
+  if (body.empty()) {
+    return body;
+  }
+  // The blocks that reach a back edge without going through the header.
+  seen_.resize(ssa_.blocks.size(), 0);
+  int walk = ++walks_;
+  seen_[header->id] = walk;
+  std::vector<Block*> work;
+  for (Block* latch : body) {
+    if (seen_[latch->id] != walk) {
+      seen_[latch->id] = walk;
+      work.push_back(latch);
+    }
+  }
+  body = {header};
+  while (!work.empty()) {
+    Block* current = work.back();
+    work.pop_back();
+    body.push_back(current);
+    for (Block* pred : current->preds) {
+      if (seen_[pred->id] != walk) {
+        seen_[pred->id] = walk;
+        work.push_back(pred);
+      }
+    }
+  }
+  return body;
+}
+
+bool SsaOptimizer::sameLoops(const Block* from, const Block* to) const {
+  const auto& outer = loops_[to->id];
+  const auto& inner = loops_[from->id];
+  return std::includes(outer.begin(), outer.end(), inner.begin(),
+                       inner.end());
+}
+
+int SsaOptimizer::eliminateDeadStores() {
+  int removed = 0;
+  for (const auto& block : ssa_.blocks) {
+    const auto& nodes = block->nodes;
+    for (size_t i = 0; i < nodes.size(); i++) {
+      if (!isStore(nodes[i]->code)) {
+        continue;
+      }
+      auto key = placeKey(nodes[i]);
+      for (size_t j = i + 1; j < nodes.size(); j++) {
+        const Node* next = nodes[j];
+        if (next->code == nodes[i]->code && placeKey(next) == key) {
+          ssa_.remove(nodes[i]);
+          removed++;
+          break;
+        }
+        if (SsaEffects::hasEffects(next->code) ||
+            SsaEffects::mayThrow(next->code) ||
+            (SsaEffects::isLoad(next->code) && placeKey(next) == key)) {
+          break;
+        }
+      }
+    }
+  }
+  ssa_.compact();
+  return removed + removeDeadValues();
+}
+
+int SsaOptimizer::removeDeadValues() {
+  // Marks what effects and possible errors depend on; the rest goes.
+  std::vector<bool> live(ssa_.size(), false);
+  std::vector<Node*> work;
+  for (const auto& block : ssa_.blocks) {
+    for (Node* node : block->nodes) {
+      if (SsaEffects::hasEffects(node->code) ||
+          (SsaEffects::mayThrow(node->code) && !safe_[node->id])) {
+        live[node->id] = true;
+        work.push_back(node);
+      }
+    }
+  }
+  while (!work.empty()) {
+    Node* node = work.back();
+    work.pop_back();
+    for (Node* input : node->inputs) {
+      if (!live[input->id]) {
+        live[input->id] = true;
+        work.push_back(input);
+      }
+    }
+  }
+
+  int removed = 0;
+  for (const auto& block : ssa_.blocks) {
+    for (Node* phi : block->phis) {
+      if (!live[phi->id]) {
+        ssa_.remove(phi);
+      }
+    }
+    for (Node* node : block->nodes) {
+      if (!live[node->id]) {
+        ssa_.remove(node);
+        removed += SsaEffects::isLiteral(node->code) ? 0 : 1;
+      }
+    }
+  }
+  ssa_.compact();
+  return removed;
+}
+
+bool SsaOptimizer::identityFree(const Node* load) const {
+  for (const Node* user : users_[load->id]) {
+    if (user->removed) {
+      continue;
+    }
+    if (user->kind != Node::Kind::OP) {
+      return false;
+    }
+    for (size_t i = 0; i < user->inputs.size(); i++) {
+      if (Ssa::resolve(user->inputs[i]) == load &&
+          !identityFreeUse(user->code, i)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace compiler
+}  // namespace lox
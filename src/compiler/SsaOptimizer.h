@@ -0,0 +1,81 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Chunk.h"
+#include "Ssa.h"
+#include "SsaLowering.h"
+
+namespace lox {
+namespace compiler {
+
+// The -O2 passes, run over a function's SSA form before it is lowered back
+// to stack code:
+//
+//  - copy propagation: phis that only ever see one value go away, so a value
+//    copied around through locals is read from where it was computed;
+//  - global value numbering: walking the dominator tree, an operator that
+//    repeats one dominating it is replaced by it, and so is a property load
+//    when nothing in between could have changed what it reads. Globals and
+//    upvalues cost no more to load again than a slot, so only loads of them
+//    whose result goes unused are dropped. Blocks with several predecessors
+//    forget what was loaded, calls forget everything, and a store tells later
+//    loads what they will find. Values computed in a loop are not reused
+//    after it;
+//  - loop-invariant code motion: operators and loads at the head of a loop
+//    that depend on nothing the loop changes move to the block before it.
+//    Only what comes before the first effect of the header moves, so a
+//    runtime error still happens at the same point;
+//  - dead store elimination: a store to a global, upvalue or property that
+//    is overwritten before anything could see it is dropped, and so are
+//    values nothing uses, including stores to locals that are never read.
+//
+// Loading a method gives a new bound method each time and `==` tells them
+// apart, so property loads are only merged or hoisted when all their users
+// would behave the same with another bound method of the same receiver.
+// Functions the passes do not improve keep their original code.
+class SsaOptimizer {
+ public:
+  static void optimize(Chunk& chunk, int arity);
+
+ private:
+  using Node = Ssa::Node;
+  using Block = Ssa::Block;
+  class Table;
+
+  explicit SsaOptimizer(Ssa& ssa) : ssa_(ssa) {}
+
+  // Each pass returns how many nodes it removed or moved.
+  int propagateCopies();
+  int numberValues();
+  int hoistInvariants();
+  int eliminateDeadStores();
+
+  int number(Block* block, Table& values, Table& memory);
+  // Lists the loops each block is in, by the id of their header.
+  void findLoops();
+  // The blocks of the loop `header` starts, header first, or nothing if it
+  // does not start one.
+  std::vector<Block*> loopBody(Block* header);
+  // Whether `to` is in every loop `from` is in, so that reusing a value
+  // from `from` there does not make the loop keep it around.
+  bool sameLoops(const Block* from, const Block* to) const;
+  int removeDeadValues();
+  // Whether the users of a property load cannot tell its bound method, if
+  // it is one, from another.
+  bool identityFree(const Node* load) const;
+
+  Ssa& ssa_;
+  std::vector<std::vector<Node*>> users_;
+  // Loads that repeat one done before them and so cannot fail.
+  std::vector<bool> safe_;
+  std::vector<std::vector<int>> loops_;
+  // Per block, the last loopBody() walk that reached it.
+  std::vector<int> seen_;
+  int walks_{0};
+};
+
+}  // namespace compiler
+}  // namespace lox
@@ -1,8 +1,9 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <iostream>
-#include <string>
-#include <unordered_map>
+#include <string_view>
 
 namespace lox {
 namespace compiler {
@@ -69,26 +70,23 @@ struct Token {
     ERROR,
   };
 
-  Token(const Token::Type type, const std::string& lexeme, const int line)
-      : type(type), lexeme(lexeme), line{line} {};
-  Token(const Token& other)
-      : type{other.type}, lexeme(other.lexeme), line{other.line} {}
-  Token(Token&& other)
-      : type{other.type}, lexeme(std::move(other.lexeme)), line{other.line} {}
-  ~Token() = default;
-  lox::compiler::Token& operator=(lox::compiler::Token&& other) {
-    type = other.type;
-    lexeme = std::move(other.lexeme);
-    line = other.line;
-    return *this;
-  }
+  Token(const Token::Type type, std::string_view lexeme, const int line)
+      : type(type), line{line}, lexeme(lexeme) {};
 
   Token::Type type;
-  std::string lexeme;
   int line;
+  // Points into the source being compiled, or at a string literal for
+  // tokens the scanner or parser make up, so tokens copy for free. Only
+  // constants and names copy their characters out.
+  std::string_view lexeme;
+};
+
+struct Keyword {
+  std::string_view word;
+  Token::Type type{Token::Type::IDENTIFIER};
 };
 
-const std::unordered_map<std::string, Token::Type> kLanguageKeywords = {
+constexpr std::array<Keyword, 19> kLanguageKeywords{{
     {"and", Token::Type::AND},       {"class", Token::Type::CLASS},
     {"else", Token::Type::ELSE},     {"false", Token::Type::FALSE},
     {"fun", Token::Type::FUN},       {"for", Token::Type::FOR},
@@ -99,7 +97,43 @@ const std::unordered_map<std::string, Token::Type> kLanguageKeywords = {
     {"var", Token::Type::VAR},       {"while", Token::Type::WHILE},
     {"break", Token::Type::BREAK},   {"continue", Token::Type::CONTINUE},
     {"lambda", Token::Type::LAMBDA},
-};
+}};
+
+// Perfect hash of the keywords on their first and last letters and their
+// length: every keyword gets a slot of its own, so telling a word from an
+// identifier takes one hash and one compare. Adding a keyword may need new
+// multipliers; the static_assert below says when.
+constexpr size_t kKeywordSlots = 32;
+constexpr size_t keywordSlot(std::string_view word) {
+  return (static_cast<unsigned char>(word.front()) * 7 +
+          static_cast<unsigned char>(word.back()) * 9 + word.size()) %
+         kKeywordSlots;
+}
+
+constexpr std::array<Keyword, kKeywordSlots> keywordTable() {
+  std::array<Keyword, kKeywordSlots> table{};
+  for (const auto& keyword : kLanguageKeywords) {
+    table[keywordSlot(keyword.word)] = keyword;
+  }
+  return table;
+}
+constexpr std::array<Keyword, kKeywordSlots> kKeywordTable = keywordTable();
+
+constexpr bool keywordsHashPerfectly() {
+  for (const auto& keyword : kLanguageKeywords) {
+    if (kKeywordTable[keywordSlot(keyword.word)].word != keyword.word) {
+      return false;
+    }
+  }
+  return true;
+}
+static_assert(keywordsHashPerfectly(), "two keywords share a slot");
+
+// The keyword `word` spells, or IDENTIFIER. `word` must not be empty.
+constexpr Token::Type keyword(std::string_view word) {
+  const Keyword& entry = kKeywordTable[keywordSlot(word)];
+  return entry.word == word ? entry.type : Token::Type::IDENTIFIER;
+}
 
 }  // namespace compiler
 }  // namespace lox
\ No newline at end of file
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 
@@ -10,6 +16,8 @@ namespace lox {
 namespace compiler {
 
 struct Chunk;
+struct Object;
+struct StringObject;
 struct FunctionObject;
 struct NativeFunctionObject;
 struct ClosureObject;
@@ -18,21 +26,145 @@ struct ClassObject;
 struct InstanceObject;
 struct BoundMethodObject;
 
-using Function = std::shared_ptr<FunctionObject>;
-using NativeFunction = std::shared_ptr<NativeFunctionObject>;
-using Closure = std::shared_ptr<ClosureObject>;
-using UpvalueValue = std::shared_ptr<UpvalueObject>;
-using Class = std::shared_ptr<ClassObject>;
-using Instance = std::shared_ptr<InstanceObject>;
-using BoundMethod = std::shared_ptr<BoundMethodObject>;
+using String = StringObject*;
+using Function = FunctionObject*;
+using NativeFunction = NativeFunctionObject*;
+using Closure = ClosureObject*;
+using UpvalueValue = UpvalueObject*;
+using Class = ClassObject*;
+using Instance = InstanceObject*;
+using BoundMethod = BoundMethodObject*;
 
-using Value = std::variant<double, bool, std::monostate, std::string, Function,
-                           NativeFunction, Closure, UpvalueValue, Class,
-                           Instance, BoundMethod>;
+enum class ObjectType : uint8_t {
+  STRING,
+  FUNCTION,
+  NATIVE,
+  CLOSURE,
+  UPVALUE,
+  CLASS,
+  INSTANCE,
+  BOUND_METHOD,
+};
+
+// Common header of every heap allocated object. Objects are chained through
+// `next` so the Heap that allocated them can sweep them, `marked` is set by
+// the collector when the object is reachable and `size` is what the object
+// was charged at allocation time.
+struct Object {
+  explicit Object(ObjectType type) : type(type) {}
+  virtual ~Object() = default;
+
+  const ObjectType type;
+  bool marked{false};
+  uint32_t size{0};
+  Object* next{nullptr};
+};
+
+// NaN-boxed value: any bit pattern that is not a quiet NaN is a double,
+// otherwise the low bits carry nil/true/false or, with the sign bit set, an
+// Object pointer. Fits a register and copies as a plain 64-bit integer.
+class Value {
+ public:
+  constexpr Value() : bits_(kNil) {}
+  constexpr Value(std::monostate) : bits_(kNil) {}
+  constexpr Value(bool b) : bits_(b ? kTrue : kFalse) {}
+  // Marks a global slot that has not been defined yet. Never visible to
+  // Lox code.
+  static constexpr Value undefined() { return Value(kUndefined, 0); }
+  Value(double d) { std::memcpy(&bits_, &d, sizeof(double)); }
+  Value(Object* object)
+      : bits_(kSignBit | kQuietNan |
+              static_cast<uint64_t>(reinterpret_cast<uintptr_t>(object))) {}
+  Value(const char*) = delete;
+
+  bool isNumber() const { return (bits_ & kQuietNan) != kQuietNan; }
+  bool isNil() const { return bits_ == kNil; }
+  bool isUndefined() const { return bits_ == kUndefined; }
+  bool isBool() const { return (bits_ | 1) == kTrue; }
+  bool isObject() const {
+    return (bits_ & (kQuietNan | kSignBit)) == (kQuietNan | kSignBit);
+  }
+  bool isObject(ObjectType type) const {
+    return isObject() && asObject()->type == type;
+  }
+  bool isString() const { return isObject(ObjectType::STRING); }
+  bool isFunction() const { return isObject(ObjectType::FUNCTION); }
+  bool isClosure() const { return isObject(ObjectType::CLOSURE); }
+  bool isClass() const { return isObject(ObjectType::CLASS); }
+  bool isInstance() const { return isObject(ObjectType::INSTANCE); }
+
+  double asNumber() const {
+    double d;
+    std::memcpy(&d, &bits_, sizeof(double));
+    return d;
+  }
+  bool asBool() const { return bits_ == kTrue; }
+  Object* asObject() const {
+    return reinterpret_cast<Object*>(
+        static_cast<uintptr_t>(bits_ & ~(kSignBit | kQuietNan)));
+  }
+  String asString() const { return reinterpret_cast<String>(asObject()); }
+  Function asFunction() const {
+    return reinterpret_cast<Function>(asObject());
+  }
+  Closure asClosure() const { return reinterpret_cast<Closure>(asObject()); }
+  Class asClass() const { return reinterpret_cast<Class>(asObject()); }
+  Instance asInstance() const {
+    return reinterpret_cast<Instance>(asObject());
+  }
+
+  uint64_t bits() const { return bits_; }
+
+  bool operator==(const Value& other) const;
+  bool operator!=(const Value& other) const { return !(*this == other); }
+
+ private:
+  static constexpr uint64_t kSignBit = 0x8000000000000000;
+  static constexpr uint64_t kQuietNan = 0x7ffc000000000000;
+  static constexpr uint64_t kNil = kQuietNan | 1;
+  static constexpr uint64_t kFalse = kQuietNan | 2;
+  static constexpr uint64_t kTrue = kQuietNan | 3;
+  static constexpr uint64_t kUndefined = kQuietNan | 4;
+  // Generated code tests and builds values by their bits.
+  friend class Jit;
+
+  constexpr Value(uint64_t bits, int) : bits_(bits) {}
+
+  uint64_t bits_;
+};
+
+static_assert(sizeof(Value) == sizeof(uint64_t), "Value must be 8 bytes");
 
 std::ostream& operator<<(std::ostream& os, const Value& v);
 
-class FunctionObject {
+// FNV-1a, the hash carried by every interned string.
+inline uint32_t hashString(std::string_view chars) {
+  uint32_t hash = 2166136261u;
+  for (char c : chars) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+// Immutable string. All strings are interned by the Heap, so two strings
+// with the same contents are the same object and compare by pointer.
+struct StringObject : public Object {
+  StringObject(std::string chars, uint32_t hash)
+      : Object(ObjectType::STRING), chars(std::move(chars)), hash(hash) {}
+  const std::string chars;
+  const uint32_t hash;
+};
+
+// Hasher for containers keyed on interned strings.
+struct StringHash {
+  size_t operator()(const String& string) const { return string->hash; }
+};
+
+template <typename T>
+using StringMap = std::unordered_map<String, T, StringHash>;
+
+class FunctionObject : public Object {
  private:
   const int arity_;
   const std::string name_;
@@ -42,61 +174,262 @@ class FunctionObject {
  public:
   FunctionObject(int arity, const std::string& name,
                  std::unique_ptr<Chunk> chunk)
-      : arity_{arity}, name_(name), chunk_(std::move(chunk)) {}
+      : Object(ObjectType::FUNCTION),
+        arity_{arity},
+        name_(name),
+        chunk_(std::move(chunk)) {}
 
   const std::string& name() const { return name_; }
   const int arity() const { return arity_; }
   Chunk& chunk() { return *chunk_; }
 };
 
-typedef Value (*NativeFn)(int argCount, std::vector<Value>::iterator args);
+typedef Value (*NativeFn)(int argCount, Value* args);
 
-struct NativeFunctionObject {
+struct NativeFunctionObject : public Object {
+  NativeFunctionObject(const std::string& name, NativeFn function)
+      : Object(ObjectType::NATIVE), name(name), function(function) {}
   std::string name;
   NativeFn function;
 };
 
-class ClosureObject {
+class ClosureObject : public Object {
  public:
-  explicit ClosureObject(Function function) : function(function) {}
+  explicit ClosureObject(Function function)
+      : Object(ObjectType::CLOSURE), function(function) {}
   Function function;
   std::vector<UpvalueValue> upvalues;
 };
 
-class BoundMethodObject {
+class BoundMethodObject : public Object {
  public:
   explicit BoundMethodObject(Instance self, Closure method)
-      : self(self), method(method) {}
+      : Object(ObjectType::BOUND_METHOD), self(self), method(method) {}
   Instance self;
   Closure method;
 };
 
-struct UpvalueObject {
+struct UpvalueObject : public Object {
   Value* location;
   Value closed;
   UpvalueValue next;
   UpvalueObject(Value* slot)
-      : location(slot), closed(std::monostate()), next(nullptr) {}
+      : Object(ObjectType::UPVALUE),
+        location(slot),
+        closed(std::monostate()),
+        next(nullptr) {}
+};
+
+// Hidden class describing where each field of an instance lives. Instances
+// of a class start at the class's root shape and follow a transition per new
+// field, so instances that get the same fields in the same order share one
+// Shape and keep their values in a flat array indexed by slot.
+class Shape {
+ public:
+  // Past this many fields an instance switches to a dictionary.
+  static constexpr size_t kMaxFields = 64;
+  // Larger shapes also index their slots by name.
+  static constexpr size_t kMaxLinearSearch = 8;
+
+  Shape() = default;
+  Shape(const Shape&) = delete;
+  Shape& operator=(const Shape&) = delete;
+
+  size_t size() const { return names_.size(); }
+  String name(size_t slot) const { return names_[slot]; }
+
+  // Cheap negative test: false means `name` is not in this shape.
+  bool mayContain(String name) const {
+    return (filter_ & filterBit(name)) != 0;
+  }
+
+  int find(String name) const {
+    if (!slots_.empty()) {
+      auto found = slots_.find(name);
+      return found == slots_.end() ? -1 : found->second;
+    }
+    for (size_t slot = 0; slot < names_.size(); slot++) {
+      if (names_[slot] == name) {
+        return static_cast<int>(slot);
+      }
+    }
+    return -1;
+  }
+
+  // Shape reached by adding `name` as the next slot.
+  Shape* transition(String name) {
+    auto& next = transitions_[name];
+    if (!next) {
+      next = std::make_unique<Shape>();
+      next->names_ = names_;
+      next->names_.push_back(name);
+      next->filter_ = filter_ | filterBit(name);
+      if (next->names_.size() > kMaxLinearSearch) {
+        for (size_t slot = 0; slot < next->names_.size(); slot++) {
+          next->slots_.emplace(next->names_[slot], slot);
+        }
+      }
+    }
+    return next.get();
+  }
+
+  // Calls `visit` with every field name in this shape tree.
+  template <typename Visitor>
+  void forEachName(Visitor&& visit) const {
+    for (const auto& transition : transitions_) {
+      visit(transition.first);
+      transition.second->forEachName(visit);
+    }
+  }
+
+ private:
+  static uint64_t filterBit(String name) {
+    return uint64_t{1} << (name->hash & 63);
+  }
+
+  std::vector<String> names_;
+  // One bit per name, picked by its hash.
+  uint64_t filter_{0};
+  StringMap<int> slots_;
+  StringMap<std::unique_ptr<Shape>> transitions_;
 };
 
-struct ClassObject {
-  ClassObject(std::string& name) : name(std::move(name)) {}
+struct ClassObject : public Object {
+  ClassObject(const std::string& name)
+      : Object(ObjectType::CLASS), name(name) {}
 
   std::string name;
-  std::unordered_map<std::string, Closure> methods;
+  StringMap<Closure> methods;
+  Shape shape;
+  // Most fields seen on an instance so far, used to size new instances.
+  size_t fieldsHint{0};
+  // Bumped whenever `methods` changes, so cached lookups can be revalidated.
+  uint32_t version{0};
 };
 
-struct InstanceObject {
-  InstanceObject(Class klass) : klass(klass) {}
+struct InstanceObject : public Object {
+  InstanceObject(Class klass)
+      : Object(ObjectType::INSTANCE), klass(klass), shape(&klass->shape) {
+    fields.reserve(klass->fieldsHint);
+  }
+
+  // Cheap negative test: false means `name` is not a field of this instance.
+  bool mayHaveField(String name) const {
+    return shape == nullptr || shape->mayContain(name);
+  }
+
+  Value* getField(String name) {
+    if (shape != nullptr) {
+      int slot = shape->find(name);
+      return slot == -1 ? nullptr : &fields[slot];
+    }
+    auto found = dictionary->find(name);
+    return found == dictionary->end() ? nullptr : &found->second;
+  }
+
+  void setField(String name, const Value& value) {
+    if (Value* field = getField(name)) {
+      *field = value;
+      return;
+    }
+    if (shape != nullptr && shape->size() < Shape::kMaxFields) {
+      appendField(shape->transition(name), value);
+      return;
+    }
+    if (shape != nullptr) {
+      toDictionary();
+    }
+    dictionary->emplace(name, value);
+  }
+
+  // Adds a field in the next slot; `next` must be the matching transition.
+  void appendField(Shape* next, const Value& value) {
+    shape = next;
+    fields.push_back(value);
+    klass->fieldsHint = std::max(klass->fieldsHint, fields.size());
+  }
+
+  // Calls `visit` with every field value, and with the field names too once
+  // in dictionary mode; in shape mode the names are kept alive by the class.
+  template <typename Visitor>
+  void forEachField(Visitor&& visit) const {
+    if (shape != nullptr) {
+      for (const auto& value : fields) {
+        visit(value);
+      }
+      return;
+    }
+    for (const auto& field : *dictionary) {
+      visit(field.first);
+      visit(field.second);
+    }
+  }
+
   Class klass;
-  std::unordered_map<std::string, Value> fields;
+  // nullptr once the instance is in dictionary mode.
+  Shape* shape;
+  std::vector<Value> fields;
+  std::unique_ptr<StringMap<Value>> dictionary;
+
+ private:
+  void toDictionary() {
+    dictionary = std::make_unique<StringMap<Value>>();
+    for (size_t slot = 0; slot < fields.size(); slot++) {
+      dictionary->emplace(shape->name(slot), fields[slot]);
+    }
+    fields.clear();
+    fields.shrink_to_fit();
+    shape = nullptr;
+  }
 };
 
+// Dispatches on the dynamic type of the value, calling the visitor with a
+// double, bool, std::monostate (nil) or the typed object pointer.
+template <typename Visitor>
+decltype(auto) visit(Visitor&& visitor, const Value& v) {
+  if (v.isNumber()) {
+    return visitor(v.asNumber());
+  }
+  if (v.isBool()) {
+    return visitor(v.asBool());
+  }
+  if (!v.isObject()) {
+    return visitor(std::monostate());
+  }
+  Object* object = v.asObject();
+  switch (object->type) {
+    case ObjectType::STRING:
+      return visitor(static_cast<String>(object));
+    case ObjectType::FUNCTION:
+      return visitor(static_cast<Function>(object));
+    case ObjectType::NATIVE:
+      return visitor(static_cast<NativeFunction>(object));
+    case ObjectType::CLOSURE:
+      return visitor(static_cast<Closure>(object));
+    case ObjectType::UPVALUE:
+      return visitor(static_cast<UpvalueValue>(object));
+    case ObjectType::CLASS:
+      return visitor(static_cast<Class>(object));
+    case ObjectType::INSTANCE:
+      return visitor(static_cast<Instance>(object));
+    case ObjectType::BOUND_METHOD:
+    default:
+      return visitor(static_cast<BoundMethod>(object));
+  }
+}
+
+inline bool Value::operator==(const Value& other) const {
+  if (isNumber()) {
+    return other.isNumber() && asNumber() == other.asNumber();
+  }
+  return bits_ == other.bits_;
+}
+
 struct StringVisitor {
   std::string operator()(const double d) const { return std::to_string(d); }
   std::string operator()(const bool b) const { return b ? "true" : "false"; }
   std::string operator()(const std::monostate n) const { return "nil"; }
-  std::string operator()(const std::string& s) const { return s; }
+  std::string operator()(const String& s) const { return s->chars; }
 
   std::string operator()(const Function& func) const {
     return "Function<" + func->name() + ">";
@@ -109,7 +442,7 @@ struct StringVisitor {
   }
   std::string operator()(const UpvalueValue& upvalue) const {
     if (upvalue->location) {
-      return std::visit(StringVisitor(), *upvalue->location);
+      return visit(StringVisitor(), *upvalue->location);
     }
     return "nil";
   }
@@ -125,7 +458,7 @@ struct StringVisitor {
 };
 
 inline std::ostream& operator<<(std::ostream& os, const Value& v) {
-  os << std::visit(StringVisitor(), v);
+  os << visit(StringVisitor(), v);
   return os;
 }
 
@@ -139,4 +472,4 @@ struct FalsinessVisitor {
 };
 
 }  // namespace compiler
-}  // namespace lox
\ No newline at end of file
+}  // namespace lox
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace lox {
+namespace compiler {
+
+// Just enough of an x86-64 encoder for the JIT: 64-bit moves and integer
+// arithmetic between registers and [base + disp32] operands, scalar double
+// arithmetic, and jumps to labels bound later.
+class X64Assembler {
+ public:
+  enum Reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+  };
+  enum Xmm { XMM0, XMM1 };
+  enum Condition {
+    BELOW = 0x2,
+    ABOVE_EQUAL = 0x3,
+    EQUAL = 0x4,
+    NOT_EQUAL = 0x5,
+    BELOW_EQUAL = 0x6,
+    ABOVE = 0x7,
+    NOT_PARITY = 0xb,
+  };
+  using Label = int;
+
+  Label newLabel() {
+    labels_.push_back(-1);
+    return static_cast<Label>(labels_.size() - 1);
+  }
+  void bind(Label label) { labels_[label] = static_cast<int>(code_.size()); }
+  // Offset of a bound label in the code.
+  int offset(Label label) const { return labels_[label]; }
+
+  void movImm(Reg dst, uint64_t imm) {
+    if (imm <= 0xffffffff) {
+      // Writing the low half clears the high one.
+      rex(false, 0, dst);
+      byte(0xb8 + (dst & 7));
+      int32(static_cast<uint32_t>(imm));
+      return;
+    }
+    rex(true, 0, dst);
+    byte(0xb8 + (dst & 7));
+    for (int i = 0; i < 8; i++) {
+      byte(static_cast<uint8_t>(imm >> (8 * i)));
+    }
+  }
+  void mov(Reg dst, Reg src) { alu(0x89, dst, src); }
+  void load(Reg dst, Reg base, int32_t disp) { memory(0x8b, dst, base, disp); }
+  void store(Reg base, int32_t disp, Reg src) {
+    memory(0x89, src, base, disp);
+  }
+  void lea(Reg dst, Reg base, int32_t disp) { memory(0x8d, dst, base, disp); }
+
+  void add(Reg dst, Reg src) { alu(0x01, dst, src); }
+  void sub(Reg dst, Reg src) { alu(0x29, dst, src); }
+  void andq(Reg dst, Reg src) { alu(0x21, dst, src); }
+  void xorq(Reg dst, Reg src) { alu(0x31, dst, src); }
+  void cmp(Reg a, Reg b) { alu(0x39, a, b); }
+  void test(Reg a, Reg b) { alu(0x85, a, b); }
+  void addImm(Reg dst, int32_t imm) { immediate(0, dst, imm); }
+  void subImm(Reg dst, int32_t imm) { immediate(5, dst, imm); }
+  void cmpImm(Reg a, int32_t imm) { immediate(7, a, imm); }
+
+  // Sets the low byte of `dst`, one of RAX to RBX, to the condition and
+  // clears the rest.
+  void set(Condition condition, Reg dst) {
+    byte(0x0f);
+    byte(0x90 + condition);
+    byte(modrm(3, 0, dst));
+    byte(0x0f);
+    byte(0xb6);
+    byte(modrm(3, dst, dst));
+  }
+
+  void movq(Xmm dst, Reg src) { sse(0x66, 0x6e, dst, src, true); }
+  void movq(Reg dst, Xmm src) { sse(0x66, 0x7e, src, dst, true); }
+  void addsd(Xmm dst, Xmm src) { sse(0xf2, 0x58, dst, src, false); }
+  void subsd(Xmm dst, Xmm src) { sse(0xf2, 0x5c, dst, src, false); }
+  void mulsd(Xmm dst, Xmm src) { sse(0xf2, 0x59, dst, src, false); }
+  void divsd(Xmm dst, Xmm src) { sse(0xf2, 0x5e, dst, src, false); }
+  void ucomisd(Xmm a, Xmm b) { sse(0x66, 0x2e, a, b, false); }
+
+  void jmp(Label label) {
+    byte(0xe9);
+    fixup(label);
+  }
+  void jump(Condition condition, Label label) {
+    byte(0x0f);
+    byte(0x80 + condition);
+    fixup(label);
+  }
+  void jmp(Reg target) {
+    rex(false, 0, target);
+    byte(0xff);
+    byte(modrm(3, 4, target));
+  }
+  void call(Reg target) {
+    rex(false, 0, target);
+    byte(0xff);
+    byte(modrm(3, 2, target));
+  }
+  void push(Reg reg) {
+    rex(false, 0, reg);
+    byte(0x50 + (reg & 7));
+  }
+  void pop(Reg reg) {
+    rex(false, 0, reg);
+    byte(0x58 + (reg & 7));
+  }
+  void ret() { byte(0xc3); }
+
+  // Resolves the jumps and returns the code. Every label used has to be
+  // bound by then.
+  std::vector<uint8_t> finish() {
+    for (const auto& [at, label] : fixups_) {
+      int32_t distance = labels_[label] - static_cast<int>(at + 4);
+      std::memcpy(&code_[at], &distance, sizeof(distance));
+    }
+    fixups_.clear();
+    return code_;
+  }
+
+ private:
+  static uint8_t modrm(int mod, int reg, int rm) {
+    return static_cast<uint8_t>(mod << 6 | (reg & 7) << 3 | (rm & 7));
+  }
+
+  void byte(uint8_t value) { code_.push_back(value); }
+  void int32(uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+      byte(static_cast<uint8_t>(value >> (8 * i)));
+    }
+  }
+  // The prefix is left out when it would be empty.
+  void rex(bool wide, int reg, int rm) {
+    uint8_t prefix = 0x40 | (wide ? 8 : 0) | (reg >> 3) << 2 | (rm >> 3);
+    if (prefix != 0x40) {
+      byte(prefix);
+    }
+  }
+  void alu(uint8_t op, Reg rm, Reg reg) {
+    rex(true, reg, rm);
+    byte(op);
+    byte(modrm(3, reg, rm));
+  }
+  void immediate(int op, Reg rm, int32_t imm) {
+    rex(true, 0, rm);
+    byte(0x81);
+    byte(modrm(3, op, rm));
+    int32(static_cast<uint32_t>(imm));
+  }
+  // [base + disp32]; RSP and R12 as a base need a SIB byte.
+  void memory(uint8_t op, Reg reg, Reg base, int32_t disp) {
+    rex(true, reg, base);
+    byte(op);
+    byte(modrm(2, reg, base));
+    if ((base & 7) == RSP) {
+      byte(0x24);
+    }
+    int32(static_cast<uint32_t>(disp));
+  }
+  void sse(uint8_t prefix, uint8_t op, int reg, int rm, bool wide) {
+    byte(prefix);
+    rex(wide, reg, rm);
+    byte(0x0f);
+    byte(op);
+    byte(modrm(3, reg, rm));
+  }
+  void fixup(Label label) {
+    fixups_.emplace_back(code_.size(), label);
+    int32(0);
+  }
+
+  std::vector<uint8_t> code_;
+  std::vector<int> labels_;
+  std::vector<std::pair<size_t, Label>> fixups_;
+};
+
+}  // namespace compiler
+}  // namespace lox
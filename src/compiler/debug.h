@@ -4,6 +4,7 @@
 #include <string>
 
 #include "Chunk.h"
+#include "Globals.h"
 #include "Value.h"
 
 namespace lox {
@@ -11,23 +12,26 @@ namespace compiler {
 
 class Disassembler {
  public:
-  static inline void dis(const Chunk& chunk, const std::string& message) {
+  static inline void dis(const Chunk& chunk, const std::string& message,
+                         const Globals* globals = nullptr) {
     std::cout << "=== " << message << " ===\n";
-    dis(chunk);
+    dis(chunk, globals);
     std::cout << "=== === ===\n\n";
   }
 
-  static inline void dis(const Chunk& chunk) {
+  static inline void dis(const Chunk& chunk,
+                         const Globals* globals = nullptr) {
     for (size_t offset = 0; offset < chunk.code.size();) {
       std::cout << std::setfill('0') << std::setw(4) << offset << " ";
-      offset = dis(chunk, offset);
+      offset = dis(chunk, offset, globals);
       if (offset < 0) {
         break;
       }
     }
   }
 
-  static inline int dis(const Chunk& chunk, size_t offset) {
+  static inline int dis(const Chunk& chunk, size_t offset,
+                        const Globals* globals = nullptr) {
     if (offset >= chunk.code.size()) {
       std::cout << "Invalid chunk offset\n";
       return -1;
@@ -52,7 +56,7 @@ class Disassembler {
         uint16_t jump_ =
             (uint16_t)((chunk.code[offset + 1] << 8) | chunk.code[offset + 2]);
         std::cout << "JUMP " << jump_;
-        offset += 3;
+        offset += 2;
         break;
       }
       case OpCode::CALL:
@@ -112,8 +116,9 @@ class Disassembler {
         break;
       case OpCode::DEFINE_GLOBAL:
         std::cout << "DEFINE_GLOBAL '";
-        value(chunk.constants[chunk.code[++offset]]);
+        global(chunk, offset, globals);
         std::cout << "'";
+        offset += 2;
         break;
       case OpCode::GET_UPVALUE:
         std::cout << "GET_UPVALUE '";
@@ -127,22 +132,28 @@ class Disassembler {
       case OpCode::GET_PROPERTY:
         std::cout << "GET_PROPERTY '";
         value(chunk.constants[chunk.code[++offset]]);
-        std::cout << "'";
+        std::cout << "' ";
+        cache(chunk, offset);
+        offset += 2;
         break;
       case OpCode::SET_PROPERTY:
         std::cout << "SET_PROPERTY '";
         value(chunk.constants[chunk.code[++offset]]);
-        std::cout << "'";
+        std::cout << "' ";
+        cache(chunk, offset);
+        offset += 2;
         break;
       case OpCode::GET_GLOBAL:
         std::cout << "GET_GLOBAL '";
-        value(chunk.constants[chunk.code[++offset]]);
+        global(chunk, offset, globals);
         std::cout << "'";
+        offset += 2;
         break;
       case OpCode::SET_GLOBAL:
         std::cout << "SET_GLOBAL '";
-        value(chunk.constants[chunk.code[++offset]]);
+        global(chunk, offset, globals);
         std::cout << "'";
+        offset += 2;
         break;
       case OpCode::GET_LOCAL:
         std::cout << "GET_LOCAL '" << static_cast<int>(chunk.code[++offset])
@@ -196,6 +207,44 @@ class Disassembler {
       case OpCode::CLOSE_UPVALUE:
         std::cout << "CLOSE_UPVALUE ";
         break;
+      case OpCode::POP_JUMP_IF_FALSE:
+      case OpCode::EQUAL_JUMP_IF_FALSE:
+      case OpCode::NOT_EQUAL_JUMP_IF_FALSE:
+      case OpCode::GREATER_JUMP_IF_FALSE:
+      case OpCode::LESS_JUMP_IF_FALSE:
+      case OpCode::GREATER_EQUAL_JUMP_IF_FALSE:
+      case OpCode::LESS_EQUAL_JUMP_IF_FALSE: {
+        uint16_t jump_ =
+            (uint16_t)((chunk.code[offset + 1] << 8) | chunk.code[offset + 2]);
+        std::cout << codes[chunk.code[offset]] << " " << jump_;
+        offset += 2;
+        break;
+      }
+      case OpCode::POPN:
+        std::cout << "POPN " << static_cast<int>(chunk.code[++offset]);
+        break;
+      case OpCode::GET_LOCAL_GET_LOCAL:
+        std::cout << "GET_LOCAL_GET_LOCAL '"
+                  << static_cast<int>(chunk.code[offset + 1]) << "' '"
+                  << static_cast<int>(chunk.code[offset + 2]) << "'";
+        offset += 2;
+        break;
+      case OpCode::ADD_CONST:
+        std::cout << "ADD_CONST '";
+        value(chunk.constants[chunk.code[++offset]]);
+        std::cout << "'";
+        break;
+      case OpCode::ADD_NUM_NUM:
+      case OpCode::ADD_STR_STR:
+      case OpCode::SUBSTRACT_NUM_NUM:
+      case OpCode::MULTIPLY_NUM_NUM:
+      case OpCode::DIVIDE_NUM_NUM:
+      case OpCode::GREATER_NUM:
+      case OpCode::LESS_NUM:
+      case OpCode::GREATER_EQUAL_NUM:
+      case OpCode::LESS_EQUAL_NUM:
+        std::cout << codes[chunk.code[offset]] << " ";
+        break;
       default:
         std::cout << "UNKNOWN " << chunk.code[offset];
         break;
@@ -205,7 +254,83 @@ class Disassembler {
     return ++offset;
   }
 
+  // Register code, printed from the operand formats.
+  static inline void registers(const Chunk& chunk, const std::string& message,
+                               const Globals* globals = nullptr) {
+    std::cout << "=== " << message << " (" << chunk.registers.frameSize
+              << " registers) ===\n";
+    const auto& code = chunk.registers.code;
+    for (size_t offset = 0; offset < code.size();) {
+      auto op = static_cast<RegisterOp>(code[offset]);
+      size_t end = offset + instructionSize(op);
+      std::cout << std::setfill('0') << std::setw(4) << offset << " "
+                << registerCodes[code[offset]];
+      size_t at = offset + 1;
+      for (const char* format = registerFormat(op); *format; format++) {
+        size_t wide = (code[at] << 8) | code[at + 1];
+        std::cout << " ";
+        switch (*format) {
+          case 'r':
+            std::cout << "r" << +code[at];
+            break;
+          case 'k':
+            std::cout << "'";
+            value(chunk.constants[code[at]]);
+            std::cout << "'";
+            break;
+          case 'u':
+            std::cout << "u" << +code[at];
+            break;
+          case 'n':
+            std::cout << +code[at];
+            break;
+          case 'g':
+            std::cout << "'";
+            global(wide, globals);
+            std::cout << "'";
+            break;
+          case 'c':
+            propertyCache(chunk, wide);
+            break;
+          case 'j':
+            std::cout << "-> " << end + wide;
+            break;
+          case 'b':
+            std::cout << "-> " << end - wide;
+            break;
+        }
+        at += operandSize(*format);
+      }
+      std::cout << "\n";
+      offset = end;
+    }
+    std::cout << "=== === ===\n\n";
+  }
+
   static inline void value(const Value& v) { std::cout << v; }
+
+  static inline void global(const Chunk& chunk, size_t offset,
+                            const Globals* globals) {
+    global((chunk.code[offset + 1] << 8) | chunk.code[offset + 2], globals);
+  }
+
+  static inline void global(size_t slot, const Globals* globals) {
+    if (globals != nullptr && slot < globals->size()) {
+      value(globals->name(slot));
+    } else {
+      std::cout << "#" << slot;
+    }
+  }
+
+  static inline void cache(const Chunk& chunk, size_t offset) {
+    propertyCache(chunk,
+                  (chunk.code[offset + 1] << 8) | chunk.code[offset + 2]);
+  }
+
+  static inline void propertyCache(const Chunk& chunk, size_t index) {
+    std::cout << "ic#" << index << " (" << +chunk.caches[index].size
+              << " entries)";
+  }
 };
 }  // namespace compiler
 }  // namespace lox
\ No newline at end of file
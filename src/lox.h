@@ -1,13 +1,15 @@
 #pragma once
-#include <folly/File.h>
-#include <folly/FileUtil.h>
 #include <unistd.h>
 
 #include <iostream>
 #include <string_view>
 
+#include "compiler/BytecodeFile.h"
+#include "compiler/Source.h"
 #include "vm.h"
 
+DECLARE_bool(emit_bytecode);
+
 constexpr std::string_view kLoxInputPrompt{"[In]: "};
 constexpr std::string_view kLoxOutputPrompt{"[Out]: "};
 
@@ -41,14 +43,30 @@ class Lox {
   }
 
   void runFile(const std::string& path) {
-    auto f = folly::File(path);
-    std::string code;
-    folly::readFile(f.fd(), code);
-    auto result = vm_->interpret(code);
+    if (!FLAGS_emit_bytecode && BytecodeFile::is(path)) {
+      this->exit(vm_->load(path));
+    }
+    // Mapped rather than read, and pipes are read as they are scanned.
+    auto source = Source::file(path);
+    if (FLAGS_emit_bytecode) {
+      this->exit(vm_->emitBytecode(source, bytecodePath(path)));
+    }
+    auto result = vm_->interpret(source);
     this->exit(result);
   }
 
  private:
+  // script.lox -> script.loxc
+  static std::string bytecodePath(const std::string& path) {
+    std::string_view extension{".lox"};
+    if (path.size() > extension.size() &&
+        path.compare(path.size() - extension.size(), extension.size(),
+                     extension) == 0) {
+      return path + "c";
+    }
+    return path + ".loxc";
+  }
+
   std::unique_ptr<VM> vm_;
 };
 }  // namespace lang
@@ -0,0 +1,51 @@
+#include <folly/File.h>
+#include <folly/FileUtil.h>
+#include <gflags/gflags.h>
+
+#include <iostream>
+#include <string>
+
+#include "compiler/CppTranslator.h"
+#include "runtime/AotRuntime.h"
+
+DEFINE_bool(debug_gc, false, "Log every garbage collection");
+DEFINE_bool(gc_stress, false, "Collect garbage on every allocation");
+DEFINE_bool(fold, true, "Fold constant expressions and drop dead code");
+DEFINE_bool(peephole, true, "Fuse common bytecode sequences after compiling");
+DEFINE_string(scanner, "readall", "Scanner type [readall | byone]");
+DEFINE_int32(scan_threads, 1,
+             "Threads the readall scanner uses; 0 for one per megabyte of "
+             "source, up to the cores");
+DEFINE_string(backend, "stack", "Only the stack bytecode is translated");
+DEFINE_int32(O, 1,
+             "Optimization level: 0 for none, 1 for the bytecode passes, 2 to "
+             "add the SSA optimizer");
+DEFINE_string(output, "", "Where to write the C++ source");
+
+// Translates a Lox script to a C++ program, to be linked against the runtime
+// library and aot_main; see lox_add_executable() in CMakeLists.txt.
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc != 2 || FLAGS_output.empty()) {
+    std::cerr << "usage: lox2cpp --output=<file.cpp> <script.lox>\n";
+    return 64;
+  }
+  FLAGS_backend = "stack";
+
+  std::string path = argv[1];
+  std::string source;
+  folly::readFile(folly::File(path).fd(), source);
+  // Compiled the way the program will, natives first, so the globals get the
+  // same slots.
+  lox::lang::AotRuntime runtime;
+  Closure script = runtime.compile(source);
+  if (script == nullptr) {
+    return 65;
+  }
+  auto program = lox::compiler::CppTranslator::translate(
+      script->function, path, runtime.bytecode(script->function));
+  if (!folly::writeFile(program, FLAGS_output.c_str())) {
+    std::cerr << "lox2cpp: cannot write " << FLAGS_output << "\n";
+    return 74;
+  }
+}
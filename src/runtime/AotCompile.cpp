@@ -0,0 +1,28 @@
+#include "AotRuntime.h"
+
+#include "compiler/BytecodeFile.h"
+#include "compiler/Compiler.h"
+#include "compiler/ParseError.h"
+
+namespace lox {
+namespace lang {
+
+Closure AotRuntime::compile(const std::string& source) {
+  Compiler compiler;
+  heap_.pause();
+  try {
+    Closure closure = compiler.compile(source, heap_, globals_);
+    heap_.resume();
+    return closure && closure->function ? closure : nullptr;
+  } catch (ParseError&) {
+    heap_.resume();
+    return nullptr;
+  }
+}
+
+std::string AotRuntime::bytecode(Function script) const {
+  return BytecodeFile::bytes(script, globals_);
+}
+
+}  // namespace lang
+}  // namespace lox
@@ -0,0 +1,19 @@
+#include <gflags/gflags.h>
+
+#include "AotRuntime.h"
+
+DEFINE_bool(debug_gc, false, "Log every garbage collection");
+DEFINE_bool(gc_stress, false, "Collect garbage on every allocation");
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  lox::lang::AotRuntime runtime;
+  switch (runtime.run(lox::lang::kProgram)) {
+    case lox::lang::AotRuntime::Result::COMPILE_ERROR:
+      return 65;
+    case lox::lang::AotRuntime::Result::RUNTIME_ERROR:
+      return 70;
+    case lox::lang::AotRuntime::Result::OK:
+      return 0;
+  }
+}
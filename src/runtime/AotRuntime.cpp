@@ -0,0 +1,58 @@
+#include "AotRuntime.h"
+
+#include <iostream>
+#include <string_view>
+
+#include "compiler/BytecodeFile.h"
+#include "compiler/CppTranslator.h"
+#include "compiler/ParseError.h"
+
+namespace lox {
+namespace lang {
+
+AotRuntime::Result AotRuntime::run(const AotProgram& program) {
+  Closure closure{nullptr};
+  heap_.pause();
+  try {
+    std::string_view bytes(reinterpret_cast<const char*>(program.bytecode),
+                           program.size);
+    closure = BytecodeFile::load(bytes, program.path, heap_, globals_);
+    heap_.resume();
+  } catch (ParseError& error) {
+    heap_.resume();
+    std::cerr << error.what();
+    return Result::COMPILE_ERROR;
+  }
+  if (!attach(closure->function, program)) {
+    std::cerr << program.path << " loads differently than when it was "
+              << "translated; translate it again.\n";
+    return Result::COMPILE_ERROR;
+  }
+  try {
+    stack_.push(closure->function);
+    call(closure, 0);
+    stack_.pop();
+    return Result::OK;
+  } catch (RuntimeError&) {
+    return Result::RUNTIME_ERROR;
+  }
+}
+
+bool AotRuntime::attach(Function script, const AotProgram& program) {
+  auto functions = CppTranslator::functions(script);
+  if (functions.size() != program.count) {
+    return false;
+  }
+  for (size_t i = 0; i < functions.size(); i++) {
+    Chunk& chunk = functions[i]->chunk();
+    if (CppTranslator::fingerprint(chunk) != program.functions[i].fingerprint) {
+      return false;
+    }
+    chunk.translated = program.functions[i].code;
+    chunk.maxDepth = program.functions[i].maxDepth;
+  }
+  return true;
+}
+
+}  // namespace lang
+}  // namespace lox
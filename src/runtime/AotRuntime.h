@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "compiler/Chunk.h"
+#include "compiler/Value.h"
+
+#include "Runtime.h"
+
+namespace lox {
+namespace lang {
+
+// What lox2cpp generates for a script besides the functions themselves.
+struct AotProgram {
+  struct Function {
+    const char* name;
+    // Of the bytecode the function was translated from.
+    uint64_t fingerprint;
+    // Most stack slots the generated code uses, from the callee's up.
+    size_t maxDepth;
+    Chunk::Translated code;
+  };
+
+  const char* path;
+  // The script's bytecode file.
+  const unsigned char* bytecode;
+  size_t size;
+  // In the order of CppTranslator::functions().
+  const Function* functions;
+  size_t count;
+};
+
+// Defined by the generated code.
+extern const AotProgram kProgram;
+
+// Runtime of a program translated to C++ by lox2cpp. A call runs the
+// callee's generated function to completion on the frame it pushes.
+class AotRuntime final : public Runtime {
+ public:
+  enum class Result { OK, COMPILE_ERROR, RUNTIME_ERROR };
+
+  // For lox2cpp: compiles `source` with the current options, returning
+  // nullptr after a compile error, and the bytecode file of the result.
+  // Defined apart, in AotCompile.cpp, so programs do not link the compiler.
+  Closure compile(const std::string& source);
+  std::string bytecode(Function script) const;
+
+  // Loads the program's bytecode, gives its functions their generated code
+  // and runs the script.
+  Result run(const AotProgram& program);
+
+  void call(const Closure& closure, int argCount) override {
+    checkCall(closure, argCount);
+    Value* slots = stack_.sp() - argCount - 1;
+    Chunk& chunk = closure->function->chunk();
+    frames_.emplace_back(CallFrame(chunk.code.data(), slots, closure));
+    chunk.translated(this, slots);
+    // The result was left where the callee was.
+    stack_.truncate(slots + 1);
+    frames_.pop_back();
+  }
+
+  // For the generated code: the frame of the running function, and setting
+  // the stack top before an operation that uses the stack or may collect.
+  CallFrame& frame() { return frames_.back(); }
+  void top(Value* sp) { stack_.truncate(sp); }
+
+ private:
+  // Gives the functions their generated code and the stack depth it uses.
+  // Returns false if the bytecode differs from what was translated.
+  static bool attach(Function script, const AotProgram& program);
+};
+
+}  // namespace lang
+}  // namespace lox
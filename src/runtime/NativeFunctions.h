@@ -0,0 +1,27 @@
+#pragma once
+
+#include <chrono>
+#include <thread>
+
+#include "compiler/Value.h"
+
+namespace lox {
+namespace lang {
+
+static lox::compiler::Value clockNative(
+    int argCount, lox::compiler::Value* args) {
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static lox::compiler::Value sleepNative(
+    int argCount, lox::compiler::Value* args) {
+  if (!args->isNumber()) {
+    return false;
+  }
+  auto duration = static_cast<long long>(args->asNumber());
+  std::this_thread::sleep_for(std::chrono::seconds(duration));
+  return true;
+}
+
+}  // namespace lang
+}  // namespace lox
\ No newline at end of file
@@ -0,0 +1,148 @@
+#include "Runtime.h"
+
+#include <gflags/gflags.h>
+
+#include <iostream>
+
+DECLARE_bool(debug_gc);
+DECLARE_bool(gc_stress);
+
+namespace lox {
+namespace lang {
+
+Runtime::Runtime() {
+  frames_.reserve(FRAMES_MAX);
+  // Set up before the roots are registered, so nothing can be collected
+  // halfway through.
+  initString_ = heap_.makeString(std::string{kKlassConstructorName});
+  defineNative("clock", clockNative);
+  defineNative("sleep", sleepNative);
+  heap_.setRoots([this]() { markRoots(); });
+  heap_.setStressMode(FLAGS_gc_stress);
+  heap_.setLogging(FLAGS_debug_gc);
+}
+
+void Runtime::runtimeError(const std::string& message) {
+  std::cout << "RuntimeError: " << message << "\n";
+  frames_.clear();
+  stack_.reset();
+  throw RuntimeError("error");
+}
+
+void Runtime::inherit(const Value& superclass, const Value& subclass) {
+  if (!superclass.isClass() || !subclass.isClass()) {
+    runtimeError("Superclass must be a class");
+  }
+  for (auto& method : superclass.asClass()->methods) {
+    subclass.asClass()->methods.insert(method);
+  }
+  subclass.asClass()->version++;
+}
+
+Value Runtime::concatenate(const Value& a, const Value& b) {
+  if (a.isString() && b.isString()) {
+    return heap_.makeString(a.asString()->chars + b.asString()->chars);
+  }
+  if (!a.isString() && !b.isString()) {
+    runtimeError("Operands must be two numbers or two strings.");
+  }
+  return heap_.makeString(to_string(a) + to_string(b));
+}
+
+Value Runtime::getProperty(Instance instance, String name,
+                           PropertyCache& cache) {
+  const Shape* shape = instance->shape;
+  if (Value* field = instance->getField(name)) {
+    if (shape != nullptr) {
+      auto& entry = cache.add();
+      entry.klass = instance->klass;
+      entry.shape = shape;
+      entry.slot = static_cast<int>(field - instance->fields.data());
+    }
+    return *field;
+  }
+
+  Class klass = instance->klass;
+  Closure method = methodCache_.find(klass, name);
+  if (method == nullptr) {
+    runtimeError("Undefined class property");
+  }
+  if (shape != nullptr) {
+    auto& entry = cache.add();
+    entry.klass = klass;
+    entry.shape = shape;
+    entry.method = method;
+    entry.version = klass->version;
+  }
+  return heap_.allocate<BoundMethodObject>(instance, method);
+}
+
+void Runtime::setProperty(Instance instance, String name, const Value& value,
+                          PropertyCache& cache) {
+  const Shape* shape = instance->shape;
+  instance->setField(name, value);
+  if (shape == nullptr || instance->shape == nullptr) {
+    return;
+  }
+  auto& entry = cache.add();
+  entry.klass = instance->klass;
+  entry.shape = shape;
+  if (instance->shape == shape) {
+    entry.slot = shape->find(name);
+  } else {
+    entry.slot = static_cast<int>(instance->fields.size() - 1);
+    entry.next = instance->shape;
+  }
+}
+
+void Runtime::defineNative(const std::string& name, NativeFn function) {
+  int slot = globals_.resolve(heap_.makeString(name));
+  globals_.values()[slot] =
+      heap_.allocate<NativeFunctionObject>(name, function);
+}
+
+void Runtime::markRoots() {
+  // The method cache is not traced; drop it before anything is swept.
+  methodCache_.clear();
+  for (const auto& value : stack_) {
+    heap_.markValue(value);
+  }
+  for (const auto& frame : frames_) {
+    heap_.markObject(frame.closure);
+  }
+  heap_.markObject(initString_);
+  globals_.mark([this](String name, const Value& value) {
+    heap_.markObject(name);
+    heap_.markValue(value);
+  });
+  for (auto upvalue = openUpvalues; upvalue != nullptr;
+       upvalue = upvalue->next) {
+    heap_.markObject(upvalue);
+  }
+}
+
+UpvalueValue Runtime::captureUpvalue(Value* local) {
+  UpvalueValue prevUpvalue{nullptr};
+  UpvalueValue upvalue = this->openUpvalues;
+
+  while (upvalue != nullptr && upvalue->location > local) {
+    prevUpvalue = upvalue;
+    upvalue = upvalue->next;
+  }
+  if (upvalue != nullptr && upvalue->location == local) {
+    return upvalue;
+  }
+
+  UpvalueValue createdUpvalue = heap_.allocate<UpvalueObject>(local);
+  createdUpvalue->next = upvalue;
+  if (prevUpvalue == nullptr) {
+    openUpvalues = createdUpvalue;
+  } else {
+    prevUpvalue->next = createdUpvalue;
+  }
+
+  return createdUpvalue;
+}
+
+}  // namespace lang
+}  // namespace lox
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "compiler/Chunk.h"
+#include "compiler/Globals.h"
+#include "compiler/Heap.h"
+#include "compiler/MethodCache.h"
+#include "compiler/Value.h"
+
+#include "NativeFunctions.h"
+#include "RuntimeError.h"
+#include "Stack.h"
+
+constexpr std::string_view kKlassConstructorName = "init";
+
+using namespace lox::compiler;
+
+namespace lox {
+namespace lang {
+
+struct CallFrame {
+  CallFrame(uint8_t* ip, Value* slots, Closure closure)
+      : ip(ip), slots(slots), closure(closure) {}
+
+  uint8_t* ip;
+  // First stack slot of the frame; the stack storage never moves.
+  Value* slots;
+  Closure closure;
+};
+
+// What running Lox code needs apart from a way to execute chunks: the heap
+// and its roots, globals, the value stack and call frames, and the
+// operations instructions share, from calls and property accesses to
+// upvalues. The VM interprets chunks on top of it; translated programs run
+// their generated functions on it instead. Either one says what running a
+// closure means by overriding call().
+class Runtime {
+ public:
+  Runtime();
+  virtual ~Runtime() = default;
+  Runtime(const Runtime&) = delete;
+  Runtime& operator=(const Runtime&) = delete;
+
+  // Calls `closure` with its arguments on top of the stack, above the
+  // callee. The VM only pushes the frame for its loop to run; a translated
+  // program runs the callee to completion.
+  virtual void call(const Closure& closure, int argCount) = 0;
+
+  [[noreturn]] void runtimeError(const std::string& message);
+  Stack* stack() { return &stack_; }
+  Value* globals() { return globals_.values(); }
+
+  inline std::string to_string(const Value& v) {
+    return visit(StringVisitor(), v);
+  }
+  inline bool isFalsy(const Value& v) {
+    return visit(FalsinessVisitor(), v);
+  }
+
+  void callValue(Value callee, int argCount) {
+    visit(CallVisitor(argCount, *this), callee);
+  }
+  void invoke(String name, int argCount) {
+    const Value& receiver = stack_.peek(argCount);
+    if (!receiver.isInstance()) {
+      runtimeError("Only Instances have methods");
+    }
+    Instance instance = receiver.asInstance();
+
+    if (instance->mayHaveField(name)) {
+      if (Value* field = instance->getField(name)) {
+        Value value = *field;
+        stack_.set(stack_.size() - argCount - 1, value);
+        callValue(value, argCount);
+        return;
+      }
+    }
+
+    invokeFromClass(instance->klass, name, argCount);
+  }
+
+  void invokeFromClass(Class klass, String name, int argCount) {
+    Closure method = methodCache_.find(klass, name);
+    if (method == nullptr) {
+      runtimeError("Undefined property");
+    }
+    call(method, argCount);
+  }
+
+  void bindMethod(Class klass, String name) {
+    Closure method = methodCache_.find(klass, name);
+    if (method == nullptr) {
+      runtimeError("Undefined class property");
+    }
+    bindMethod(method);
+  }
+
+  void bindMethod(Closure method) {
+    auto instance = stack_.peek(0).asInstance();
+    BoundMethod bound = heap_.allocate<BoundMethodObject>(instance, method);
+    stack_.pop();
+    stack_.push(bound);
+  }
+
+  // GET_PROPERTY: replaces the instance on top of the stack with its
+  // property `name`.
+  void loadProperty(String name, PropertyCache& cache) {
+    if (!stack_.peek(0).isInstance()) {
+      runtimeError("Only instances have properties");
+    }
+    auto instance = stack_.peek(0).asInstance();
+    if (auto entry = probeCache(cache, instance)) {
+      if (entry->method == nullptr) {
+        stack_.popAndPush(instance->fields[entry->slot]);
+      } else {
+        bindMethod(entry->method);
+      }
+      return;
+    }
+    stack_.popAndPush(getProperty(instance, name, cache));
+  }
+
+  // SET_PROPERTY: stores the value on top of the stack in the instance under
+  // it, and leaves only the value.
+  void storeProperty(String name, PropertyCache& cache) {
+    if (!stack_.peek(1).isInstance()) {
+      runtimeError("Only instances have properties");
+    }
+    auto instance = stack_.peek(1).asInstance();
+    auto value = stack_.peek(0);
+    if (auto entry = probeCache(cache, instance)) {
+      if (entry->next != nullptr) {
+        instance->appendField(entry->next, value);
+      } else {
+        instance->fields[entry->slot] = value;
+      }
+    } else {
+      setProperty(instance, name, value, cache);
+    }
+    stack_.popTwoAndPush(value);
+  }
+
+  // CLOSURE: pushes a new closure of `function` made in `frame`.
+  void pushClosure(Function function, const CallFrame& frame) {
+    Closure closure = heap_.allocate<ClosureObject>(function);
+    // Rooted on the stack before capturing, which may allocate.
+    stack_.push(closure);
+    for (auto& upvalue : closure->function->chunk().upvalues) {
+      if (upvalue.isLocal) {
+        closure->upvalues.push_back(
+            captureUpvalue(&frame.slots[upvalue.index]));
+      } else {
+        closure->upvalues.push_back(frame.closure->upvalues[upvalue.index]);
+      }
+    }
+  }
+
+  // CLASS: pushes a new class called `name`.
+  void pushClass(String name) {
+    stack_.push(heap_.allocate<ClassObject>(name->chars));
+  }
+
+  // METHOD: adds the closure on top of the stack to the class under it.
+  void defineMethod(String name) {
+    defineMethod(stack_.peek(1).asClass(), name, stack_.peek(0).asClosure());
+    stack_.pop();
+  }
+
+  // Adds `method` to `klass`, invalidating the property caches that saw it.
+  void defineMethod(Class klass, String name, Closure method) {
+    klass->methods[name] = method;
+    klass->version++;
+  }
+
+  // INHERIT: copies the methods of the superclass under the subclass on top
+  // of the stack, then pops the subclass.
+  void inherit() {
+    inherit(stack_.peek(1), stack_.peek(0));
+    stack_.pop();  // subclass
+  }
+
+  // Copies the methods of `superclass` into `subclass`.
+  void inherit(const Value& superclass, const Value& subclass);
+
+  // Pops the superclass GET_SUPER and SUPER_INVOKE look methods up in.
+  Class popSuperclass() {
+    if (!stack_.peek(0).isClass()) {
+      runtimeError("Superclass must be a class");
+    }
+    auto superclass = stack_.peek(0).asClass();
+    stack_.pop();
+    return superclass;
+  }
+
+  void defineGlobal(Value& global) {
+    if (!global.isUndefined()) {
+      runtimeError("Variable already defined");
+    }
+    global = stack_.peek(0);
+    stack_.pop();
+  }
+
+  // The generic string concatenation of ADD.
+  Value concatenate(const Value& a, const Value& b);
+
+  void closeUpvalue(Value* last) {
+    while (this->openUpvalues != nullptr &&
+           this->openUpvalues->location >= last) {
+      auto upvalue = this->openUpvalues;
+      upvalue->closed = *upvalue->location;
+      upvalue->location = &upvalue->closed;
+      this->openUpvalues = upvalue->next;
+    }
+  }
+
+ protected:
+  struct CacheStats {
+    uint64_t hits{0};
+    uint64_t misses{0};
+    uint64_t invalidations{0};
+  };
+
+  // Raises the errors a call of `closure` runs into before it gets a frame.
+  void checkCall(const Closure& closure, int argCount) {
+    if (argCount != closure->function->arity()) {
+      runtimeError("Function arity mismatch");
+    }
+
+    if (!hasRoom(closure, stack_.sp() - argCount - 1)) {
+      runtimeError("Stack overflow.");
+    }
+  }
+
+  // Whether a frame of `closure` starting at `slots` fits on the stack.
+  bool hasRoom(const Closure& closure, const Value* slots) const {
+    return frames_.size() + 1 < FRAMES_MAX &&
+           stack_.hasRoom(slots, closure->function->chunk().maxDepth);
+  }
+
+  // Returns the entry of `cache` for the shape of `instance`, dropping it if
+  // the method it holds has been replaced since.
+  PropertyCache::Entry* probeCache(PropertyCache& cache, Instance instance) {
+    auto entry = cache.find(instance->shape);
+    if (entry != nullptr && entry->method != nullptr &&
+        entry->version != instance->klass->version) {
+      propertyCacheStats_.invalidations++;
+      cache.remove(entry);
+      entry = nullptr;
+    }
+    if (entry == nullptr) {
+      propertyCacheStats_.misses++;
+    } else {
+      propertyCacheStats_.hits++;
+    }
+    return entry;
+  }
+
+  // Slow path of GET_PROPERTY: returns the field or the bound method. The
+  // instance has to be reachable from a root.
+  Value getProperty(Instance instance, String name, PropertyCache& cache);
+  // Slow path of SET_PROPERTY.
+  void setProperty(Instance instance, String name, const Value& value,
+                   PropertyCache& cache);
+
+  UpvalueValue captureUpvalue(Value* local);
+
+  Heap heap_;
+  String initString_;
+  Globals globals_;
+  std::vector<CallFrame> frames_;
+  UpvalueValue openUpvalues{nullptr};
+  Stack stack_;
+  CacheStats propertyCacheStats_;
+  MethodCache methodCache_;
+
+ private:
+  struct CallVisitor {
+    const int argCount;
+    Runtime& runtime;
+
+    CallVisitor(int argCount, Runtime& runtime)
+        : argCount(argCount), runtime(runtime) {}
+
+    void operator()(const Closure& closure) const {
+      runtime.call(closure, argCount);
+    }
+    void operator()(const NativeFunction& native) const {
+      Value* args = runtime.stack_.sp() - argCount;
+      auto result = native->function(argCount, args);
+      // Replaces the callee and its arguments.
+      runtime.stack_.truncate(args - 1);
+      runtime.stack_.push(result);
+    }
+    void operator()(const Class& klass) const {
+      Instance instance = runtime.heap_.allocate<InstanceObject>(klass);
+      runtime.stack_.set(runtime.stack_.size() - argCount - 1, instance);
+
+      if (Closure initializer =
+              runtime.methodCache_.find(klass, runtime.initString_)) {
+        runtime.call(initializer, argCount);
+      } else if (argCount != 0) {
+        runtime.runtimeError("Expected zero argument");
+      }
+    }
+    void operator()(const BoundMethod& bound) const {
+      runtime.stack_.set(runtime.stack_.size() - argCount - 1, bound->self);
+      runtime.call(bound->method, argCount);
+    }
+
+    template <typename T>
+    void operator()(const T& value) const {
+      runtime.runtimeError("Can only call functions and classes.");
+    }
+  };
+
+  void defineNative(const std::string& name, NativeFn function);
+  void markRoots();
+};
+
+}  // namespace lang
+}  // namespace lox
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <memory>
+
+#include "compiler/Chunk.h"
+#include "compiler/Value.h"
+
+#define FRAMES_MAX 64
+
+constexpr size_t kMaxStackSize{lox::compiler::Chunk::kMaxStackSize};
+
+namespace lox {
+namespace lang {
+
+// Fixed-capacity value stack. The storage is allocated once and never moves,
+// so call frames and open upvalues can point straight into it. Nothing here
+// is bounds checked: every call checks there is room for the most its
+// callee's frame holds, Chunk::maxDepth, with hasRoom().
+class Stack {
+ public:
+  Stack()
+      : values_(std::make_unique<lox::compiler::Value[]>(kMaxStackSize)),
+        sp_(values_.get()) {}
+  Stack(const Stack&) = delete;
+  Stack& operator=(const Stack&) = delete;
+
+  // One past the top value.
+  lox::compiler::Value* sp() const { return sp_; }
+  lox::compiler::Value& get(size_t i) { return values_[i]; }
+
+  lox::compiler::Value& back() { return sp_[-1]; }
+  const lox::compiler::Value& peek() const { return peek(0); }
+  const lox::compiler::Value& peek(size_t i) const { return sp_[-1 - i]; }
+  void set(size_t i, const lox::compiler::Value& value) { values_[i] = value; }
+
+  void pop() { sp_--; }
+  void push(const lox::compiler::Value& value) { *sp_++ = value; }
+  void popAndPush(const lox::compiler::Value& value) { sp_[-1] = value; }
+  void popTwoAndPush(const lox::compiler::Value& value) {
+    sp_--;
+    sp_[-1] = value;
+  }
+  bool empty() const { return sp_ == values_.get(); }
+  size_t size() const { return sp_ - values_.get(); }
+  // Whether `count` values fit from `from` up.
+  bool hasRoom(const lox::compiler::Value* from, size_t count) const {
+    return count <= kMaxStackSize - (from - values_.get());
+  }
+  lox::compiler::Value* begin() { return values_.get(); }
+  lox::compiler::Value* end() { return sp_; }
+  void reset() { sp_ = values_.get(); }
+  // Drops everything from `top` up, e.g. a returning frame.
+  void truncate(lox::compiler::Value* top) { sp_ = top; }
+
+ private:
+  std::unique_ptr<lox::compiler::Value[]> values_;
+  lox::compiler::Value* sp_;
+};
+
+}  // namespace lang
+}  // namespace lox
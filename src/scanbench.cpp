@@ -0,0 +1,151 @@
+#include <folly/File.h>
+#include <folly/FileUtil.h>
+#include <gflags/gflags.h>
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "compiler/ParseError.h"
+#include "compiler/ScanKernels.h"
+#include "compiler/ScannerFactory.h"
+
+DEFINE_string(scanners, "readall,byone", "Scanners to measure");
+DEFINE_string(kernels, "scalar,sse2,avx2",
+              "Scan kernels to measure each scanner with");
+DEFINE_double(seconds, 1.0, "Time to spend on each scanner");
+DEFINE_int32(scan_threads, 1,
+             "Threads the readall scanner uses; 0 for one per megabyte of "
+             "source, up to the cores");
+DEFINE_bool(check, false,
+            "Check that readall scans each script to the same tokens on 1 "
+            "to 16 threads, rather than measuring");
+
+namespace {
+
+using lox::compiler::ParseError;
+using lox::compiler::ReadAllScanner;
+using lox::compiler::Scanner;
+using lox::compiler::Token;
+
+// Scans `source` to the end and returns the number of tokens.
+size_t scan(const std::string& scanner, const std::string& source) {
+  auto tokens = lox::compiler::ScannerFactory::get(scanner)(source);
+  if (tokens == nullptr) {
+    throw std::invalid_argument("scanbench: no scanner " + scanner + "\n");
+  }
+  size_t count = 1;
+  while (!tokens->isAtEnd()) {
+    tokens->advance();
+    count++;
+  }
+  return count;
+}
+
+// The tokens readall scans `source` to on `threads` threads, one per line,
+// or the error it stops at.
+std::string tokens(const std::string& source, unsigned threads) {
+  std::stringstream out;
+  try {
+    ReadAllScanner scanner(source, threads);
+    for (bool end = false; !end; scanner.advance()) {
+      const Token& token = scanner.current();
+      end = scanner.isAtEnd();
+      out << static_cast<int>(token.type) << " " << token.line << " "
+          << static_cast<const void*>(token.lexeme.data()) << " "
+          << token.lexeme << "\n";
+    }
+  } catch (ParseError& error) {
+    out << error.what();
+  }
+  return out.str();
+}
+
+// Compares the tokens of each source on several threads with those on one.
+// Returns the number of sources they differ on.
+int check(const std::vector<std::string>& sources, char** paths) {
+  int failed = 0;
+  for (size_t i = 0; i < sources.size(); i++) {
+    std::string expected = tokens(sources[i], 1);
+    for (unsigned threads : {2, 3, 4, 8, 16}) {
+      if (tokens(sources[i], threads) != expected) {
+        std::cerr << paths[i] << ": different tokens on " << threads
+                  << " threads\n";
+        failed++;
+        break;
+      }
+    }
+  }
+  std::cout << sources.size() - failed << " of " << sources.size()
+            << " scripts scan the same on 1 to 16 threads\n";
+  return failed;
+}
+
+}  // namespace
+
+// Scanner throughput: scans the given scripts over and over with each
+// scanner and set of scan kernels, and reports the best pass in MB/s. With
+// --check it instead checks the scripts scan the same on any number of
+// threads.
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc < 2) {
+    std::cerr << "usage: scanbench [--scanners=readall,byone] "
+              << "[--kernels=scalar,sse2,avx2] [--scan_threads=N] [--check] "
+              << "<script.lox>...\n";
+    return 64;
+  }
+  std::vector<std::string> sources;
+  size_t bytes = 0;
+  for (int i = 1; i < argc; i++) {
+    sources.emplace_back();
+    folly::readFile(folly::File(argv[i]).fd(), sources.back());
+    bytes += sources.back().size();
+  }
+  if (FLAGS_check) {
+    return check(sources, argv + 1) == 0 ? 0 : 1;
+  }
+
+  std::stringstream scanners(FLAGS_scanners);
+  for (std::string scanner; std::getline(scanners, scanner, ',');) {
+    std::stringstream kernels(FLAGS_kernels);
+    for (std::string kernel; std::getline(kernels, kernel, ',');) {
+      if (!lox::compiler::ScanKernels::use(kernel)) {
+        std::cerr << "scanbench: cannot use the " << kernel << " kernels\n";
+        continue;
+      }
+      using Clock = std::chrono::steady_clock;
+      std::chrono::duration<double> best{0}, spent{0};
+      size_t tokens = 0;
+      try {
+        for (int pass = 0; pass == 0 || spent.count() < FLAGS_seconds;
+             pass++) {
+          auto start = Clock::now();
+          tokens = 0;
+          for (const auto& source : sources) {
+            tokens += scan(scanner, source);
+          }
+          std::chrono::duration<double> elapsed = Clock::now() - start;
+          spent += elapsed;
+          if (pass == 0 || elapsed < best) {
+            best = elapsed;
+          }
+        }
+      } catch (ParseError& error) {
+        std::cerr << scanner << ": " << error.what();
+        return 65;
+      } catch (std::invalid_argument& error) {
+        std::cerr << error.what();
+        return 64;
+      }
+      std::printf("%-8s %-7s %8.1f MB/s  %zu bytes, %zu tokens\n",
+                  scanner.c_str(), kernel.c_str(), bytes / best.count() / 1e6,
+                  bytes, tokens);
+    }
+  }
+}
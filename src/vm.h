@@ -2,596 +2,1442 @@
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <exception>
 #include <iostream>
 #include <stack>
 #include <string>
 #include <string_view>
 #include <unordered_map>
-#include <variant>
 
-#include "NativeFunctions.h"
-#include "RuntimeError.h"
-#include "Stack.h"
+#include "compiler/BytecodeFile.h"
 #include "compiler/Chunk.h"
 #include "compiler/Compiler.h"
+#include "compiler/Jit.h"
 #include "compiler/ParseError.h"
+#include "compiler/Source.h"
 #include "compiler/Value.h"
 #include "compiler/debug.h"
+#include "runtime/Runtime.h"
 
 DECLARE_bool(debug);
 DECLARE_bool(debug_stack);
-#define FRAMES_MAX 64
+DECLARE_bool(stats);
+DECLARE_bool(dump_quickened);
+DECLARE_string(backend);
+DECLARE_string(jit);
 
-constexpr std::string_view kKlassConstructorName = "init";
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(LOX_NO_COMPUTED_GOTO)
+#define LOX_COMPUTED_GOTO
+#endif
 
-using namespace lox::compiler;
+// Calls and loop iterations after which a function is compiled to native
+// code, and how often its code may bail out before it is given up on.
+constexpr uint32_t kJitCallThreshold{1000};
+constexpr uint32_t kJitLoopThreshold{1000};
+constexpr uint32_t kJitMaxBailouts{16};
 
-template <class... Ts>
-struct overloaded : Ts... {
-  using Ts::operator()...;
-};
-template <class... Ts>
-overloaded(Ts...) -> overloaded<Ts...>;
+using namespace lox::compiler;
 
 namespace lox {
 namespace lang {
 
-struct CallFrame {
-  CallFrame(int ip, unsigned long offset, Closure closure)
-      : ip(ip), stackOffset(offset), closure(closure) {}
-
-  int ip;
-  unsigned long stackOffset;
-  Closure closure;
-};
-
-class VM {
+class VM final : public Runtime {
  public:
   enum class InterpretResult { OK, COMPILE_ERROR, RUNTIME_ERROR };
 
-  VM(std::unique_ptr<Compiler> compiler) : compiler_(std::move(compiler)) {
-    defineNative("clock", clockNative);
-    defineNative("sleep", sleepNative);
-  }
-  ~VM() = default;
+  VM(std::unique_ptr<Compiler> compiler) : compiler_(std::move(compiler)) {}
 
   InterpretResult interpret(const std::string& code) {
-    try {
-      auto closure = compiler_->compile(code);
-      if (closure && closure->function) {
-        stack_.push(closure->function);
-        call(closure, 0);
-        auto interpret_result = run();
-        return interpret_result;
-      } else {
-        return InterpretResult::COMPILE_ERROR;
-      }
-    } catch (RuntimeError&) {
-      return InterpretResult::RUNTIME_ERROR;
-    } catch (ParseError&) {
+    Source source = Source::buffer(code);
+    return interpret(source);
+  }
+  InterpretResult interpret(Source& source) {
+    Closure closure = compile(source);
+    if (closure == nullptr) {
       return InterpretResult::COMPILE_ERROR;
     }
+    return execute(closure);
   }
 
-  void call(const Closure& closure, int argCount) {
-    if (argCount != closure->function->arity()) {
-      runtimeError("Function arity mismatch");
+  // Runs the compiled script in the bytecode file at `path`.
+  InterpretResult load(const std::string& path) {
+    if (registers_) {
+      std::cout << "Bytecode files run on the stack backend only.\n";
+      return InterpretResult::COMPILE_ERROR;
+    }
+    Closure closure{nullptr};
+    heap_.pause();
+    try {
+      closure = BytecodeFile::load(path, heap_, globals_);
+    } catch (ParseError& error) {
+      heap_.resume();
+      std::cout << error.what();
+      return InterpretResult::COMPILE_ERROR;
     }
+    heap_.resume();
+    return execute(closure);
+  }
 
-    if (frames_.size() + 1 == FRAMES_MAX) {
-      runtimeError("Stack overflow.");
+  // Compiles `source` and writes it to the bytecode file at `path` instead
+  // of running it.
+  InterpretResult emitBytecode(Source& source, const std::string& path) {
+    if (registers_) {
+      std::cout << "Bytecode files run on the stack backend only.\n";
+      return InterpretResult::COMPILE_ERROR;
     }
+    Closure closure = compile(source);
+    if (closure == nullptr) {
+      return InterpretResult::COMPILE_ERROR;
+    }
+    if (!BytecodeFile::write(closure->function, globals_, path)) {
+      std::cout << "Cannot write " << path << ".\n";
+      return InterpretResult::COMPILE_ERROR;
+    }
+    return InterpretResult::OK;
+  }
 
+  void call(const Closure& closure, int argCount) override {
+    checkCall(closure, argCount);
+
+    Chunk& chunk = closure->function->chunk();
+    bool registers = runsRegisters(chunk);
     if (FLAGS_debug) {
-      Disassembler::dis(closure->function->chunk(), closure->function->name());
+      if (registers) {
+        Disassembler::registers(chunk, closure->function->name(), &globals_);
+      } else {
+        Disassembler::dis(chunk, closure->function->name(), &globals_);
+      }
     }
+    // Each loop runs only its own kind of frame, so a callee of the other
+    // kind runs to completion in its loop before the caller goes on.
+    bool nested = !frames_.empty() &&
+                  runsRegisters(frames_.back().closure->function->chunk()) !=
+                      registers;
 
-    unsigned long offset = stack_.size() - argCount - 1;
-    frames_.emplace_back(CallFrame(0, offset, closure));
+    Value* slots = stack_.sp() - argCount - 1;
+    if (!registers) {
+      frames_.emplace_back(CallFrame(chunk.code.data(), slots, closure));
+      if (nested) {
+        run(frames_.size() - 1);
+      } else if (jit_ != JitMode::OFF &&
+                 warm(closure->function, false, chunk.code.data())) {
+        runNative(chunk.code.data());
+      }
+      return;
+    }
+    // The frame owns all its registers from the start. Those past the
+    // arguments may still hold values of a frame that has returned.
+    Value* top = slots + chunk.registers.frameSize;
+    std::fill(stack_.sp(), top, Value());
+    stack_.truncate(top);
+    frames_.emplace_back(
+        CallFrame(chunk.registers.code.data(), slots, closure));
+    if (nested) {
+      runRegisters(frames_.size() - 1);
+    }
   }
 
-  void runtimeError(const std::string& message) {
-    std::cout << "RuntimeError: " << message << "\n";
-    frames_.pop_back();
-    stack_.reset();
-    throw RuntimeError("error");
+ private:
+  // Returns nullptr after a compile error.
+  Closure compile(Source& source) {
+    heap_.pause();
+    try {
+      Closure closure = compiler_->compile(source, heap_, globals_);
+      heap_.resume();
+      return closure && closure->function ? closure : nullptr;
+    } catch (ParseError&) {
+      heap_.resume();
+      return nullptr;
+    }
   }
-  Stack* stack() { return &stack_; }
 
-  inline std::string to_string(const Value& v) {
-    return std::visit(StringVisitor(), v);
+  InterpretResult execute(Closure closure) {
+    try {
+      stack_.push(closure->function);
+      call(closure, 0);
+      auto interpret_result = InterpretResult::OK;
+      if (runsRegisters(closure->function->chunk())) {
+        interpret_result = runRegisters();
+      } else if (!frames_.empty()) {
+        interpret_result = run();
+      } else {
+        // The script ran to the end in native code.
+        stack_.pop();
+      }
+      printStats(closure->function);
+      return interpret_result;
+    } catch (RuntimeError&) {
+      printStats(closure->function);
+      return InterpretResult::RUNTIME_ERROR;
+    }
   }
 
- private:
-  std::unique_ptr<Compiler> compiler_;
-  std::unordered_map<std::string, Value> globals_;
-  std::vector<CallFrame> frames_;
-  UpvalueValue openUpvalues{nullptr};
-  Stack stack_;
+  // Whether frames of `chunk` run in runRegisters(): with the register
+  // backend, unless the function needed too many registers.
+  bool runsRegisters(const Chunk& chunk) const {
+    return registers_ && !chunk.registers.code.empty();
+  }
 
-  struct CallVisitor {
-    const int argCount;
-    VM& vm;
+  enum class JitMode { OFF, ON, ALWAYS };
+  static JitMode jitMode(const std::string& flag) {
+    if (flag == "always") {
+      return JitMode::ALWAYS;
+    }
+    return flag == "on" ? JitMode::ON : JitMode::OFF;
+  }
 
-    CallVisitor(int argCount, VM& vm) : argCount(argCount), vm(vm) {}
+  std::unique_ptr<Compiler> compiler_;
+  const bool registers_{FLAGS_backend == "register"};
+  // Native code runs frames of the stack backend only.
+  const JitMode jit_{registers_ || !Jit::supported() ? JitMode::OFF
+                                                     : jitMode(FLAGS_jit)};
+  uint64_t dispatched_{0};
+  uint64_t quickened_{0};
+  uint64_t deoptimized_{0};
+  uint64_t jitCompiled_{0};
+  uint64_t jitBailouts_{0};
+  // Set by the bail helper for runNative().
+  bool bailed_{false};
+  // What a helper caught, rethrown once out of the generated code.
+  std::exception_ptr jitError_;
 
-    void operator()(const Closure& closure) const {
-      vm.call(closure, argCount);
+  // Counts a call of `function`, or with `loop` an iteration of one of its
+  // loops, and compiles it once it gets hot. Returns whether its native
+  // code can take the top frame over at `ip`.
+  bool warm(Function function, bool loop, const uint8_t* ip) {
+    Chunk& chunk = function->chunk();
+    NativeCode& native = chunk.native;
+    if (native.disabled) {
+      return false;
     }
-    void operator()(const NativeFunction& native) const {
-      auto result = native->function(argCount, vm.stack_.end() - argCount);
-
-      for (int i = 0; i == argCount; i++) {
-        vm.stack_.pop();
+    if (!native.compiled()) {
+      uint32_t& count = loop ? native.loops : native.calls;
+      uint32_t threshold = loop ? kJitLoopThreshold : kJitCallThreshold;
+      if (jit_ != JitMode::ALWAYS && ++count < threshold) {
+        return false;
+      }
+      if (!Jit::compile(chunk, {jitStep, jitCall, jitInvoke, jitBail})) {
+        native.disabled = true;
+        return false;
+      }
+      jitCompiled_++;
+      if (FLAGS_debug) {
+        std::cout << "=== jit: " << function->name() << " (" << native.size()
+                  << " bytes) ===\n\n";
       }
-      vm.stack_.push(result);
     }
-    void operator()(const Class& klass) const {
-      Instance instance = std::make_shared<InstanceObject>(klass);
-      vm.stack_.set(vm.stack_.size() - argCount - 1, instance);
+    return native.enters(ip - chunk.code.data());
+  }
 
-      auto found = klass->methods.find(std::string{kKlassConstructorName});
-      if (found != klass->methods.end()) {
-        auto initializer = found->second;
-        vm.call(initializer, argCount);
-      } else if (argCount != 0) {
-        vm.runtimeError("Expected zero argument");
-      }
+  // Runs the top frame in native code from `ip`. Returns true if the frame
+  // returned, leaving its result where the callee was, or false if the code
+  // left the rest of it to the interpreter.
+  bool runNative(const uint8_t* ip) {
+    CallFrame& frame = frames_.back();
+    Chunk& chunk = frame.closure->function->chunk();
+    Value* sp = chunk.native.enter(this, frame.slots, stack_.sp(),
+                                   ip - chunk.code.data(), globals_.values());
+    if (sp == nullptr) {
+      std::exception_ptr error = jitError_;
+      jitError_ = nullptr;
+      std::rethrow_exception(error);
     }
-    void operator()(const BoundMethod& bound) const {
-      vm.stack_.set(vm.stack_.size() - argCount - 1, bound->self);
-      vm.call(bound->method, argCount);
+    stack_.truncate(sp);
+    if (bailed_) {
+      bailed_ = false;
+      return false;
     }
+    frames_.pop_back();
+    return true;
+  }
+
+  // Whether generated code calling `closure` can go straight into its
+  // native code, skipping what call() would do.
+  bool direct(Closure closure, int argCount, Value* sp) {
+    const NativeCode& native = closure->function->chunk().native;
+    return native.compiled() && !native.disabled && !FLAGS_debug &&
+           argCount == closure->function->arity() &&
+           hasRoom(closure, sp - argCount - 1);
+  }
 
-    template <typename T>
-    void operator()(const T& value) const {
-      vm.runtimeError("Can only call functions and classes.");
+  // Runs `closure` in native code for generated code calling it, and returns
+  // the stack top after the call, or nullptr after an error.
+  Value* enterDirect(Closure closure, int argCount, Value* sp) {
+    Chunk& chunk = closure->function->chunk();
+    Value* slots = sp - argCount - 1;
+    frames_.emplace_back(CallFrame(chunk.code.data(), slots, closure));
+    Value* top = chunk.native.enter(this, slots, sp, 0, globals_.values());
+    if (top != nullptr && bailed_) {
+      bailed_ = false;
+      return callOut(top, frames_.size() - 1, [] {});
+    }
+    if (top != nullptr) {
+      frames_.pop_back();
     }
-  };
-  void callValue(Value callee, int argCount) {
-    std::visit(CallVisitor(argCount, *this), callee);
+    return top;
   }
-  void invoke(const std::string& name, int argCount) {
-    try {
-      Instance instance = std::get<Instance>(stack_.peek(argCount));
 
-      auto field = instance->fields.find(name);
-      if (field != instance->fields.end()) {
-        Value value = field->second;
-        stack_.set(stack_.size() - argCount - 1, value);
-        callValue(value, argCount);
-        return;
+  // Does `call` for generated code with the stack ending at `sp`, then runs
+  // the frames above `base` to their end. Returns the stack top, or nullptr
+  // after an error: exceptions must not unwind through generated code, so
+  // they are kept for runNative() to rethrow.
+  template <typename Call>
+  Value* callOut(Value* sp, size_t base, Call&& call) {
+    try {
+      stack_.truncate(sp);
+      call();
+      if (frames_.size() > base) {
+        run(base);
       }
-
-      invokeFromClass(instance->klass, name, argCount);
-    } catch (std::bad_variant_access&) {
-      runtimeError("Only Instances have methods");
+      return stack_.sp();
+    } catch (...) {
+      jitError_ = std::current_exception();
+      return nullptr;
     }
   }
 
-  void invokeFromClass(Class klass, const std::string& name, int argCount) {
-    auto found = klass->methods.find(name);
-    if (found == klass->methods.end()) {
-      runtimeError("Undefined property");
+  // Helpers the native code calls; see Jit.
+  static Value* jitStep(void* vm, Value* sp, const uint8_t* ip) {
+    auto self = static_cast<VM*>(vm);
+    return self->callOut(sp, self->frames_.size(), [&] { self->step(ip); });
+  }
+  static Value* jitCall(void* vm, Value* sp, const uint8_t* ip) {
+    auto self = static_cast<VM*>(vm);
+    int argCount = ip[1];
+    Value callee = sp[-1 - argCount];
+    if (callee.isClosure() &&
+        self->direct(callee.asClosure(), argCount, sp)) {
+      return self->enterDirect(callee.asClosure(), argCount, sp);
     }
-    Closure method = found->second;
-    call(method, argCount);
+    return self->callOut(sp, self->frames_.size(),
+                         [&] { self->callValue(callee, argCount); });
   }
-
-  void bindMethod(Class klass, const std::string& name) {
-    auto method = klass->methods.find(name);
-    if (method == klass->methods.end()) {
-      runtimeError("Undefined class property");
+  static Value* jitInvoke(void* vm, Value* sp, const uint8_t* ip) {
+    auto self = static_cast<VM*>(vm);
+    int argCount = ip[2];
+    Value receiver = sp[-1 - argCount];
+    if (receiver.isInstance()) {
+      Instance instance = receiver.asInstance();
+      const Chunk& chunk = self->frames_.back().closure->function->chunk();
+      String name = chunk.constants[ip[1]].asString();
+      if (!instance->mayHaveField(name) || !instance->getField(name)) {
+        // What invoke() would do, without looking the method up again.
+        Closure method = self->methodCache_.find(instance->klass, name);
+        if (method != nullptr && self->direct(method, argCount, sp)) {
+          return self->enterDirect(method, argCount, sp);
+        }
+        if (method != nullptr) {
+          return self->callOut(sp, self->frames_.size(),
+                               [&] { self->call(method, argCount); });
+        }
+      }
     }
-    auto closure = method->second;
-    auto instance = std::get<Instance>(stack_.peek(0));
-    BoundMethod bound = std::make_shared<BoundMethodObject>(instance, closure);
-    stack_.pop();
-    stack_.push(bound);
+    return jitStep(vm, sp, ip);
+  }
+  static Value* jitBail(void* vm, Value* sp, const uint8_t* ip) {
+    auto self = static_cast<VM*>(vm);
+    CallFrame& frame = self->frames_.back();
+    frame.ip = const_cast<uint8_t*>(ip);
+    NativeCode& native = frame.closure->function->chunk().native;
+    if (++native.bailouts == kJitMaxBailouts) {
+      native.disabled = true;
+    }
+    self->jitBailouts_++;
+    self->bailed_ = true;
+    return sp;
   }
 
-  void defineNative(const std::string& name, NativeFn function) {
-    auto obj = std::make_shared<NativeFunctionObject>();
-    obj->name = name;
-    obj->function = function;
-    globals_[name] = obj;
+  // Runs the instruction at `ip` of the top frame for its native code.
+  // Arithmetic and comparisons only get here when their operands are not
+  // numbers, and global accesses when the global is undefined.
+  void step(const uint8_t* ip) {
+    CallFrame& frame = frames_.back();
+    Chunk& chunk = frame.closure->function->chunk();
+    const uint8_t* operands = ip + 1;
+    auto string = [&]() { return chunk.constants[operands[0]].asString(); };
+    auto word = [&](int i) {
+      return static_cast<uint16_t>(operands[i] << 8 | operands[i + 1]);
+    };
+    switch (static_cast<OpCode>(*ip)) {
+      case OpCode::RETURN:
+        closeUpvalue(frame.slots);
+        break;
+      case OpCode::PRINT:
+        std::cout << "[Out]: " << stack_.peek(0) << "\n";
+        break;
+      case OpCode::DEFINE_GLOBAL:
+        defineGlobal(globals_.values()[word(0)]);
+        break;
+      case OpCode::GET_GLOBAL:
+      case OpCode::SET_GLOBAL:
+        runtimeError("Undefined variable");
+        break;
+      case OpCode::GET_UPVALUE:
+        stack_.push(*frame.closure->upvalues[operands[0]]->location);
+        break;
+      case OpCode::SET_UPVALUE:
+        *frame.closure->upvalues[operands[0]]->location = stack_.peek(0);
+        break;
+      case OpCode::CLOSE_UPVALUE:
+        closeUpvalue(&stack_.back());
+        stack_.pop();
+        break;
+      case OpCode::CLOSURE:
+        pushClosure(chunk.constants[operands[0]].asFunction(), frame);
+        break;
+      case OpCode::CLASS:
+        pushClass(string());
+        break;
+      case OpCode::METHOD:
+        defineMethod(string());
+        break;
+      case OpCode::INHERIT:
+        inherit();
+        break;
+      case OpCode::GET_SUPER:
+        bindMethod(popSuperclass(), string());
+        break;
+      case OpCode::GET_PROPERTY:
+        loadProperty(string(), chunk.caches[word(1)]);
+        break;
+      case OpCode::SET_PROPERTY:
+        storeProperty(string(), chunk.caches[word(1)]);
+        break;
+      case OpCode::CALL:
+        callValue(stack_.peek(operands[0]), operands[0]);
+        break;
+      case OpCode::INVOKE:
+        invoke(string(), operands[1]);
+        break;
+      case OpCode::SUPER_INVOKE:
+        invokeFromClass(popSuperclass(), string(), operands[1]);
+        break;
+      case OpCode::ADD:
+      case OpCode::ADD_STR_STR: {
+        const Value b = stack_.peek(0);
+        const Value a = stack_.peek(1);
+        stack_.popTwoAndPush(concatenate(a, b));
+        break;
+      }
+      case OpCode::ADD_CONST:
+        stack_.popAndPush(
+            concatenate(stack_.peek(0), chunk.constants[operands[0]]));
+        break;
+      case OpCode::NEGATE:
+        runtimeError("Operand must be a number.");
+        break;
+      default:
+        runtimeError("Operands must be numbers.");
+        break;
+    }
   }
 
-  void closeUpvalue(Value* last) {
-    while (this->openUpvalues != nullptr &&
-           this->openUpvalues->location >= last) {
-      auto upvalue = this->openUpvalues;
-      upvalue->closed = *upvalue->location;
-      upvalue->location = &upvalue->closed;
-      this->openUpvalues = upvalue->next;
+  void printStats(Function script) {
+    if (FLAGS_dump_quickened) {
+      dumpQuickened(script);
+    }
+    if (!FLAGS_stats) {
+      return;
+    }
+    std::cerr << "[stats] instructions dispatched: " << dispatched_ << "\n";
+    std::cerr << "[stats] quickening: " << quickened_ << " specializations, "
+              << deoptimized_ << " deoptimizations\n";
+    const auto& stats = propertyCacheStats_;
+    std::cerr << "[stats] property caches: " << stats.hits << " hits, "
+              << stats.misses << " misses, " << stats.invalidations
+              << " invalidations\n";
+    const auto& methods = methodCache_.stats();
+    std::cerr << "[stats] method cache: " << methods.hits << " hits, "
+              << methods.misses << " misses, " << methods.invalidations
+              << " invalidations\n";
+    if (jit_ != JitMode::OFF) {
+      std::cerr << "[stats] jit: " << jitCompiled_ << " functions compiled, "
+                << jitBailouts_ << " bailouts\n";
     }
   }
 
-  InterpretResult run() {
-    auto read_byte = [this]() -> uint8_t {
-      return this->frames_.back().closure->function->chunk().code.at(
-          this->frames_.back().ip++);
-    };
-    auto read_short = [this]() -> uint16_t {
-      this->frames_.back().ip += 2;
-      uint8_t left = this->frames_.back().closure->function->chunk().code.at(
-          this->frames_.back().ip - 2);
-      uint8_t right = this->frames_.back().closure->function->chunk().code.at(
-          this->frames_.back().ip - 1);
-      return (uint16_t)(left << 8 | right);
-    };
-    auto read_constant = [this]() -> Value {
-      return this->frames_.back()
-          .closure->function->chunk()
-          .constants[this->frames_.back().closure->function->chunk().code.at(
-              this->frames_.back().ip++)];
-    };
-    auto read_string = [&read_constant]() -> std::string {
-      return std::get<std::string>(read_constant());
-    };
-    auto read_function = [&read_constant]() -> Function {
-      return std::get<Function>(read_constant());
-    };
+  // Prints, for `function` and every function nested in it, how many of its
+  // arithmetic and comparison instructions are currently specialized.
+  void dumpQuickened(Function function) {
+    const Chunk& chunk = function->chunk();
+    size_t sites = 0;
+    size_t specialized = 0;
+    for (size_t offset = 0; offset < chunk.code.size();) {
+      auto code = static_cast<OpCode>(chunk.code[offset]);
+      if (code >= OpCode::ADD_NUM_NUM) {
+        sites++;
+        specialized++;
+      } else if (code == OpCode::ADD ||
+                 (code >= OpCode::SUBSTRACT && code <= OpCode::DIVIDE) ||
+                 (code >= OpCode::GREATER && code <= OpCode::LESS) ||
+                 code == OpCode::GREATER_EQUAL || code == OpCode::LESS_EQUAL) {
+        sites++;
+      }
+      offset += instructionSize(code);
+    }
+    std::cerr << "[quickened] " << function->name() << ": " << specialized
+              << "/" << sites << " sites\n";
+    for (const auto& constant : chunk.constants) {
+      if (constant.isFunction()) {
+        dumpQuickened(constant.asFunction());
+      }
+    }
+  }
 
-    for (;;) {
-      const uint8_t op = read_byte();
+  // Runs frames until the one above `base` returns; with no base, the whole
+  // script.
+  InterpretResult run(size_t base = 0) {
+    // The current frame's state lives in locals so the compiler can keep it
+    // in registers. It is written back before anything that may push or pop
+    // a frame and reloaded afterwards.
+    CallFrame* frame;
+    uint8_t* ip;
+    const Value* constants;
+    PropertyCache* caches;
+    Value* slots;
+    // Only the compiler adds global slots, so the storage cannot move while
+    // the VM runs.
+    Value* globals = globals_.values();
 
-      if (FLAGS_debug_stack) {
-        std::cout << "=== Stack: " << codes[static_cast<int>(op)] << " ===\n";
-        if (!stack_.empty()) {
-          for (const auto& v : stack_) {
-            std::cout << "=> " << v << "\n";
-          }
-        } else {
-          std::cout << "\tempty\n";
-        }
-        std::cout << "=== ===== ===\n";
-      }
+#define LOAD_FRAME()                                                \
+  do {                                                              \
+    frame = &frames_.back();                                        \
+    ip = frame->ip;                                                 \
+    constants = frame->closure->function->chunk().constants.data(); \
+    caches = frame->closure->function->chunk().caches.data();       \
+    slots = frame->slots;                                           \
+  } while (false)
+#define STORE_FRAME() frame->ip = ip
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_STRING() (READ_CONSTANT().asString())
+// Rewrites the instruction being executed into its specialized form.
+#define QUICKEN(code)                            \
+  do {                                           \
+    ip[-1] = static_cast<uint8_t>(OpCode::code); \
+    quickened_++;                                \
+  } while (false)
+#define BINARY_OP(op, quick)                            \
+  do {                                                  \
+    const Value b = stack_.peek(0);                     \
+    const Value a = stack_.peek(1);                     \
+    if (!a.isNumber() || !b.isNumber()) {               \
+      runtimeError("Operands must be numbers.");        \
+    }                                                   \
+    QUICKEN(quick);                                     \
+    stack_.popTwoAndPush(a.asNumber() op b.asNumber()); \
+  } while (false)
+// Specialized number operation. If the guard fails the instruction goes back
+// to its generic form, which is executed right away.
+#define NUMBER_OP(op, generic)                          \
+  const Value b = stack_.peek(0);                       \
+  const Value a = stack_.peek(1);                       \
+  if (a.isNumber() && b.isNumber()) {                   \
+    stack_.popTwoAndPush(a.asNumber() op b.asNumber()); \
+    DISPATCH();                                         \
+  }                                                     \
+  DEOPTIMIZE(generic)
+// Compare-and-branch: pops both operands and jumps when the comparison is
+// false.
+#define NUMBER_COMPARE_JUMP(op)                  \
+  do {                                           \
+    uint16_t offset = READ_SHORT();              \
+    const Value b = stack_.peek(0);              \
+    const Value a = stack_.peek(1);              \
+    if (!a.isNumber() || !b.isNumber()) {        \
+      runtimeError("Operands must be numbers."); \
+    }                                            \
+    stack_.pop();                                \
+    stack_.pop();                                \
+    if (!(a.asNumber() op b.asNumber())) {       \
+      ip += offset;                              \
+    }                                            \
+  } while (false)
+#define VALUE_COMPARE_JUMP(op)      \
+  do {                              \
+    uint16_t offset = READ_SHORT(); \
+    const Value b = stack_.peek(0); \
+    const Value a = stack_.peek(1); \
+    stack_.pop();                   \
+    stack_.pop();                   \
+    if (!(a op b)) {                \
+      ip += offset;                 \
+    }                               \
+  } while (false)
+#define DEOPTIMIZE(code)                       \
+  ip[-1] = static_cast<uint8_t>(OpCode::code); \
+  ip--;                                        \
+  deoptimized_++;                              \
+  DISPATCH()
 
-#define BINARY_OP(op)                                              \
-  do {                                                             \
-    binary_op([](double a, double b) -> Value { return a op b; }); \
+#ifdef LOX_COMPUTED_GOTO
+    static const void* kDispatchTable[] = {
+#define LOX_OPCODE_LABEL(name, operands) &&op_##name,
+        LOX_OPCODES(LOX_OPCODE_LABEL)
+#undef LOX_OPCODE_LABEL
+    };
+#define CASE(name) op_##name
+#define DISPATCH()            \
+  do {                        \
+    op = READ_BYTE();         \
+    if (trace) {              \
+      traceInstruction(op);   \
+    }                         \
+    goto *kDispatchTable[op]; \
   } while (false)
+#else
+#define CASE(name) case OpCode::name
+#define DISPATCH() break
+#endif
 
+    uint8_t op;
+    const bool trace = FLAGS_debug_stack || FLAGS_stats;
+    LOAD_FRAME();
+
+#ifdef LOX_COMPUTED_GOTO
+    DISPATCH();
+    {
+#else
+    for (;;) {
+      op = READ_BYTE();
+      if (trace) {
+        traceInstruction(op);
+      }
       switch (static_cast<OpCode>(op)) {
-        case OpCode::METHOD: {
-          auto name = read_string();
-          Closure method = std::get<Closure>(stack_.peek(0));
-          Class klass = std::get<Class>(stack_.peek(1));
-          klass->methods.insert({name, method});
-          stack_.pop();
-          break;
-        }
-        case OpCode::INHERIT: {
-          try {
-            auto superclass = std::get<Class>(stack_.peek(1));
-            auto subclass = std::get<Class>(stack_.peek(0));
-            for (auto& method : superclass->methods) {
-              subclass->methods.insert(method);
+#endif
+      CASE(METHOD) : {
+        defineMethod(READ_STRING());
+        DISPATCH();
+      }
+      CASE(INHERIT) : {
+        inherit();
+        DISPATCH();
+      }
+      CASE(GET_SUPER) : {
+        auto method = READ_STRING();
+        auto superclass = popSuperclass();
+        bindMethod(superclass, method);
+        DISPATCH();
+      }
+      CASE(SUPER_INVOKE) : {
+        auto method = READ_STRING();
+        auto argCount = READ_BYTE();
+        auto superclass = popSuperclass();
+
+        STORE_FRAME();
+        invokeFromClass(superclass, method, argCount);
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(CLASS) : {
+        pushClass(READ_STRING());
+        DISPATCH();
+      }
+      CASE(CLOSURE) : {
+        pushClosure(READ_CONSTANT().asFunction(), *frame);
+        DISPATCH();
+      }
+      CASE(INVOKE) : {
+        auto method = READ_STRING();
+        int argCount = READ_BYTE();
+        STORE_FRAME();
+        invoke(method, argCount);
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(CALL) : {
+        int argCount = READ_BYTE();
+        STORE_FRAME();
+        callValue(stack_.peek(argCount), argCount);
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(LOOP) : {
+        uint16_t offset = READ_SHORT();
+        ip -= offset;
+        if (jit_ != JitMode::OFF && warm(frame->closure->function, true, ip)) {
+          // Goes on in native code from the loop header.
+          if (runNative(ip) && frames_.size() == base) {
+            if (base == 0) {
+              stack_.pop();
             }
-            stack_.pop();  // subclass
-            // stack_.pop();  // parent
-          } catch (std::bad_variant_access&) {
-            runtimeError("Superclass must be a class");
+            return InterpretResult::OK;
           }
-          break;
+          LOAD_FRAME();
         }
-        case OpCode::GET_SUPER: {
-          auto method = read_string();
-          auto superclass = std::get<Class>(stack_.peek(0));
-          stack_.pop();
-          bindMethod(superclass, method);
-          break;
-        }
-        case OpCode::SUPER_INVOKE: {
-          auto method = read_string();
-          auto argCount = read_byte();
-          auto superclass = std::get<Class>(stack_.peek(0));
-          stack_.pop();
-
-          invokeFromClass(superclass, method, argCount);
-          break;
+        DISPATCH();
+      }
+      CASE(JUMP_IF_FALSE) : {
+        uint16_t offset = READ_SHORT();
+        if (isFalsy(stack_.peek(0))) {
+          ip += offset;
         }
-        case OpCode::CLASS: {
-          auto name = read_string();
-          Class klass = std::make_shared<ClassObject>(name);
-          stack_.push(klass);
-          break;
+        DISPATCH();
+      }
+      CASE(POP_JUMP_IF_FALSE) : {
+        uint16_t offset = READ_SHORT();
+        if (isFalsy(stack_.peek(0))) {
+          ip += offset;
         }
-        case OpCode::CLOSURE: {
-          auto function = read_function();
-          Closure closure = std::make_shared<ClosureObject>(function);
-          for (auto& upvalue : closure->function->chunk().upvalues) {
-            if (upvalue.isLocal) {
-              int offset = frames_.back().stackOffset + upvalue.index;
-              closure->upvalues.push_back(captureUpvalue(&stack_.get(offset)));
-            } else {
-              closure->upvalues.push_back(
-                  frames_.back().closure->upvalues[upvalue.index]);
-            }
-          }
-          stack_.push(closure);
-          break;
+        stack_.pop();
+        DISPATCH();
+      }
+      CASE(EQUAL_JUMP_IF_FALSE) : {
+        VALUE_COMPARE_JUMP(==);
+        DISPATCH();
+      }
+      CASE(NOT_EQUAL_JUMP_IF_FALSE) : {
+        VALUE_COMPARE_JUMP(!=);
+        DISPATCH();
+      }
+      CASE(GREATER_JUMP_IF_FALSE) : {
+        NUMBER_COMPARE_JUMP(>);
+        DISPATCH();
+      }
+      CASE(LESS_JUMP_IF_FALSE) : {
+        NUMBER_COMPARE_JUMP(<);
+        DISPATCH();
+      }
+      CASE(GREATER_EQUAL_JUMP_IF_FALSE) : {
+        NUMBER_COMPARE_JUMP(>=);
+        DISPATCH();
+      }
+      CASE(LESS_EQUAL_JUMP_IF_FALSE) : {
+        NUMBER_COMPARE_JUMP(<=);
+        DISPATCH();
+      }
+      CASE(JUMP) : {
+        uint16_t offset = READ_SHORT();
+        ip += offset;
+        DISPATCH();
+      }
+      CASE(POP) : {
+        stack_.pop();
+        DISPATCH();
+      }
+      CASE(POPN) : {
+        uint8_t count = READ_BYTE();
+        stack_.truncate(stack_.sp() - count);
+        DISPATCH();
+      }
+      CASE(CLOSE_UPVALUE) : {
+        closeUpvalue(&stack_.back());
+        stack_.pop();
+        DISPATCH();
+      }
+      CASE(RETURN) : {
+        auto returnValue = stack_.peek();
+        stack_.pop();
+        closeUpvalue(slots);
+
+        frames_.pop_back();
+        stack_.truncate(slots);
+        if (frames_.empty()) {
+          return InterpretResult::OK;
         }
-        case OpCode::INVOKE: {
-          auto method = read_string();
-          int argCount = read_byte();
-          invoke(method, argCount);
-          break;
+
+        stack_.push(returnValue);
+        if (frames_.size() == base) {
+          return InterpretResult::OK;
         }
-        case OpCode::CALL: {
-          int argCount = read_byte();
-          callValue(stack_.peek(argCount), argCount);
-          break;
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(PRINT) : {
+        std::cout << "[Out]: " << stack_.peek(0) << "\n";
+        DISPATCH();
+      }
+      CASE(DEFINE_GLOBAL) : {
+        defineGlobal(globals[READ_SHORT()]);
+        DISPATCH();
+      }
+      CASE(SET_GLOBAL) : {
+        Value& global = globals[READ_SHORT()];
+        if (global.isUndefined()) {
+          runtimeError("Undefined variable");
         }
-        case OpCode::LOOP: {
-          uint16_t offset = read_short();
-          this->frames_.back().ip -= offset;
-          break;
+
+        global = stack_.peek(0);
+        DISPATCH();
+      }
+      CASE(SET_PROPERTY) : {
+        auto name = READ_STRING();
+        storeProperty(name, caches[READ_SHORT()]);
+        DISPATCH();
+      }
+      CASE(GET_PROPERTY) : {
+        auto name = READ_STRING();
+        loadProperty(name, caches[READ_SHORT()]);
+        DISPATCH();
+      }
+      CASE(GET_UPVALUE) : {
+        uint8_t slot = READ_BYTE();
+        stack_.push(*frame->closure->upvalues[slot]->location);
+        DISPATCH();
+      }
+      CASE(SET_UPVALUE) : {
+        uint8_t slot = READ_BYTE();
+        *frame->closure->upvalues[slot]->location = stack_.peek(0);
+        DISPATCH();
+      }
+      CASE(GET_GLOBAL) : {
+        const Value& global = globals[READ_SHORT()];
+        if (global.isUndefined()) {
+          runtimeError("Undefined variable");
         }
-        case OpCode::JUMP_IF_FALSE: {
-          uint16_t offset = read_short();
-          if (isFalsy(stack_.peek(0))) {
-            this->frames_.back().ip += offset;
+        stack_.push(global);
+        DISPATCH();
+      }
+      CASE(GET_LOCAL) : {
+        uint8_t slot = READ_BYTE();
+        stack_.push(slots[slot]);
+        DISPATCH();
+      }
+      CASE(GET_LOCAL_GET_LOCAL) : {
+        uint8_t first = READ_BYTE();
+        uint8_t second = READ_BYTE();
+        stack_.push(slots[first]);
+        stack_.push(slots[second]);
+        DISPATCH();
+      }
+      CASE(SET_LOCAL) : {
+        uint8_t slot = READ_BYTE();
+        slots[slot] = stack_.peek(0);
+        DISPATCH();
+      }
+      CASE(CONSTANT) : {
+        stack_.push(READ_CONSTANT());
+        DISPATCH();
+      }
+      CASE(NIL) : {
+        stack_.push(std::monostate());
+        DISPATCH();
+      }
+      CASE(TRUE) : {
+        stack_.push(true);
+        DISPATCH();
+      }
+      CASE(FALSE) : {
+        stack_.push(false);
+        DISPATCH();
+      }
+      CASE(ADD) : {
+        const Value b = stack_.peek(0);
+        const Value a = stack_.peek(1);
+        if (a.isNumber() && b.isNumber()) {
+          QUICKEN(ADD_NUM_NUM);
+          stack_.popTwoAndPush(a.asNumber() + b.asNumber());
+        } else {
+          if (a.isString() && b.isString()) {
+            QUICKEN(ADD_STR_STR);
           }
-          break;
+          stack_.popTwoAndPush(concatenate(a, b));
         }
-        case OpCode::JUMP: {
-          uint16_t offset = read_short();
-          this->frames_.back().ip += offset;
-          break;
+        DISPATCH();
+      }
+      CASE(ADD_CONST) : {
+        const Value b = READ_CONSTANT();
+        const Value a = stack_.peek(0);
+        if (a.isNumber() && b.isNumber()) {
+          stack_.popAndPush(a.asNumber() + b.asNumber());
+        } else {
+          stack_.popAndPush(concatenate(a, b));
         }
-        case OpCode::POP: {
-          if (!stack_.empty()) {
-            stack_.pop();
-          }
-          break;
+        DISPATCH();
+      }
+      CASE(ADD_NUM_NUM) : {
+        NUMBER_OP(+, ADD);
+      }
+      CASE(ADD_STR_STR) : {
+        const Value b = stack_.peek(0);
+        const Value a = stack_.peek(1);
+        if (a.isString() && b.isString()) {
+          stack_.popTwoAndPush(
+              heap_.makeString(a.asString()->chars + b.asString()->chars));
+          DISPATCH();
         }
-        case OpCode::CLOSE_UPVALUE: {
-          if (!stack_.empty()) {
-            closeUpvalue(&stack_.back());
-            stack_.pop();
-          }
-          break;
+        DEOPTIMIZE(ADD);
+      }
+      CASE(SUBSTRACT) : {
+        BINARY_OP(-, SUBSTRACT_NUM_NUM);
+        DISPATCH();
+      }
+      CASE(SUBSTRACT_NUM_NUM) : {
+        NUMBER_OP(-, SUBSTRACT);
+      }
+      CASE(MULTIPLY) : {
+        BINARY_OP(*, MULTIPLY_NUM_NUM);
+        DISPATCH();
+      }
+      CASE(MULTIPLY_NUM_NUM) : {
+        NUMBER_OP(*, MULTIPLY);
+      }
+      CASE(DIVIDE) : {
+        BINARY_OP(/, DIVIDE_NUM_NUM);
+        DISPATCH();
+      }
+      CASE(DIVIDE_NUM_NUM) : {
+        NUMBER_OP(/, DIVIDE);
+      }
+      CASE(NOT) : {
+        stack_.popAndPush(isFalsy(stack_.peek()));
+        DISPATCH();
+      }
+      CASE(EQUAL) : {
+        stack_.popTwoAndPush(stack_.peek(0) == stack_.peek(1));
+        DISPATCH();
+      }
+      CASE(NOT_EQUAL) : {
+        stack_.popTwoAndPush(stack_.peek(0) != stack_.peek(1));
+        DISPATCH();
+      }
+      CASE(GREATER) : {
+        BINARY_OP(>, GREATER_NUM);
+        DISPATCH();
+      }
+      CASE(GREATER_NUM) : {
+        NUMBER_OP(>, GREATER);
+      }
+      CASE(LESS) : {
+        BINARY_OP(<, LESS_NUM);
+        DISPATCH();
+      }
+      CASE(LESS_NUM) : {
+        NUMBER_OP(<, LESS);
+      }
+      CASE(GREATER_EQUAL) : {
+        BINARY_OP(>=, GREATER_EQUAL_NUM);
+        DISPATCH();
+      }
+      CASE(GREATER_EQUAL_NUM) : {
+        NUMBER_OP(>=, GREATER_EQUAL);
+      }
+      CASE(LESS_EQUAL) : {
+        BINARY_OP(<=, LESS_EQUAL_NUM);
+        DISPATCH();
+      }
+      CASE(LESS_EQUAL_NUM) : {
+        NUMBER_OP(<=, LESS_EQUAL);
+      }
+      CASE(NEGATE) : {
+        if (!stack_.peek().isNumber()) {
+          runtimeError("Operand must be a number.");
         }
-        case OpCode::RETURN: {
-          auto returnValue = stack_.peek();
-          stack_.pop();
-          closeUpvalue(&stack_.get(frames_.back().stackOffset));
+        stack_.popAndPush(-stack_.peek().asNumber());
+        DISPATCH();
+      }
+#ifndef LOX_COMPUTED_GOTO
+      default:
+        return InterpretResult::COMPILE_ERROR;
+#endif
+    }
+#ifndef LOX_COMPUTED_GOTO
+    }
+#endif
+    return InterpretResult::COMPILE_ERROR;
 
-          auto lastOffset = frames_.back().stackOffset;
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef QUICKEN
+#undef BINARY_OP
+#undef NUMBER_OP
+#undef NUMBER_COMPARE_JUMP
+#undef VALUE_COMPARE_JUMP
+#undef DEOPTIMIZE
+#undef CASE
+#undef DISPATCH
+  }
 
-          frames_.pop_back();
-          if (frames_.empty()) {
-            stack_.pop();
-            return InterpretResult::OK;
-          }
+  // Interpreter loop of the register backend. Operands name registers of
+  // the current frame, which are its stack slots, so calls still pass the
+  // callee and its arguments through the stack. The stack top stays at the
+  // end of the current frame's registers except around calls.
+  // Runs register frames until the one above `base` returns, like run().
+  InterpretResult runRegisters(size_t base = 0) {
+    CallFrame* frame;
+    uint8_t* ip;
+    const Value* constants;
+    PropertyCache* caches;
+    Value* slots;
+    Value* globals = globals_.values();
 
-          stack_.resize(lastOffset);
-          stack_.push(returnValue);
+#define LOAD_FRAME()                                    \
+  do {                                                  \
+    frame = &frames_.back();                            \
+    ip = frame->ip;                                     \
+    Chunk& chunk = frame->closure->function->chunk();   \
+    constants = chunk.constants.data();                 \
+    caches = chunk.caches.data();                       \
+    slots = frame->slots;                               \
+    stack_.truncate(slots + chunk.registers.frameSize); \
+  } while (false)
+#define STORE_FRAME() frame->ip = ip
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_REGISTER() (slots[READ_BYTE()])
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_STRING() (READ_CONSTANT().asString())
+#define NUMBER_OP(op)                            \
+  do {                                           \
+    Value& dst = READ_REGISTER();                \
+    const Value& a = READ_REGISTER();            \
+    const Value& b = READ_REGISTER();            \
+    if (!a.isNumber() || !b.isNumber()) {        \
+      runtimeError("Operands must be numbers."); \
+    }                                            \
+    dst = Value(a.asNumber() op b.asNumber());   \
+  } while (false)
+#define NUMBER_COMPARE_JUMP(op)                  \
+  do {                                           \
+    const Value& a = READ_REGISTER();            \
+    const Value& b = READ_REGISTER();            \
+    uint16_t offset = READ_SHORT();              \
+    if (!a.isNumber() || !b.isNumber()) {        \
+      runtimeError("Operands must be numbers."); \
+    }                                            \
+    if (!(a.asNumber() op b.asNumber())) {       \
+      ip += offset;                              \
+    }                                            \
+  } while (false)
+#define VALUE_COMPARE_JUMP(op)        \
+  do {                                \
+    const Value& a = READ_REGISTER(); \
+    const Value& b = READ_REGISTER(); \
+    uint16_t offset = READ_SHORT();   \
+    if (!(a op b)) {                  \
+      ip += offset;                   \
+    }                                 \
+  } while (false)
 
-          break;
-        }
-        case OpCode::PRINT: {
-          std::cout << "[Out]: " << stack_.peek(0) << "\n";
-          break;
-        }
-        case OpCode::DEFINE_GLOBAL: {
-          std::string name = read_string();
-          auto it = globals_.find(name);
-          if (it != globals_.end()) {
-            runtimeError("Variable already defined");
-          }
+#ifdef LOX_COMPUTED_GOTO
+    static const void* kDispatchTable[] = {
+#define LOX_REGISTER_OPCODE_LABEL(name, format) &&op_##name,
+        LOX_REGISTER_OPCODES(LOX_REGISTER_OPCODE_LABEL)
+#undef LOX_REGISTER_OPCODE_LABEL
+    };
+#define CASE(name) op_##name
+#define DISPATCH()                  \
+  do {                              \
+    op = READ_BYTE();               \
+    if (trace) {                    \
+      traceRegisterInstruction(op); \
+    }                               \
+    goto *kDispatchTable[op];       \
+  } while (false)
+#else
+#define CASE(name) case RegisterOp::name
+#define DISPATCH() break
+#endif
 
-          globals_.insert({std::move(name), stack_.peek(0)});
-          stack_.pop();
-          break;
-        }
-        case OpCode::SET_GLOBAL: {
-          auto name = read_string();
-          auto it = globals_.find(name);
-          if (it == globals_.end()) {
-            runtimeError("Undefined variable");
-          }
+    uint8_t op;
+    const bool trace = FLAGS_debug_stack || FLAGS_stats;
+    LOAD_FRAME();
 
-          it->second = std::move(stack_.peek(0));
-          break;
-        }
-        case OpCode::SET_PROPERTY: {
-          try {
-            auto instance = std::get<Instance>(stack_.peek(1));
-            auto field = read_string();
-            auto value = stack_.peek(0);
-            instance->fields.insert({field, value});
-            stack_.popTwoAndPush(value);
-          } catch (std::bad_variant_access&) {
-            runtimeError("Only instances have properties");
-          }
-          break;
+#ifdef LOX_COMPUTED_GOTO
+    DISPATCH();
+    {
+#else
+    for (;;) {
+      op = READ_BYTE();
+      if (trace) {
+        traceRegisterInstruction(op);
+      }
+      switch (static_cast<RegisterOp>(op)) {
+#endif
+      CASE(MOVE) : {
+        Value& dst = READ_REGISTER();
+        dst = READ_REGISTER();
+        DISPATCH();
+      }
+      CASE(LOAD_CONSTANT) : {
+        Value& dst = READ_REGISTER();
+        dst = READ_CONSTANT();
+        DISPATCH();
+      }
+      CASE(LOAD_NIL) : {
+        READ_REGISTER() = Value();
+        DISPATCH();
+      }
+      CASE(LOAD_TRUE) : {
+        READ_REGISTER() = true;
+        DISPATCH();
+      }
+      CASE(LOAD_FALSE) : {
+        READ_REGISTER() = false;
+        DISPATCH();
+      }
+      CASE(GET_GLOBAL) : {
+        Value& dst = READ_REGISTER();
+        const Value& global = globals[READ_SHORT()];
+        if (global.isUndefined()) {
+          runtimeError("Undefined variable");
         }
-        case OpCode::GET_PROPERTY: {
-          try {
-            auto instance = std::get<Instance>(stack_.peek(0));
-            auto name = read_string();
-            auto field = instance->fields.find(name);
-            if (field != instance->fields.end()) {
-              stack_.pop();
-              stack_.push(field->second);
-              break;
-            }
-            bindMethod(instance->klass, name);
-          } catch (std::bad_variant_access&) {
-            runtimeError("Only instances have properties");
-          }
-          break;
+        dst = global;
+        DISPATCH();
+      }
+      CASE(SET_GLOBAL) : {
+        const Value& value = READ_REGISTER();
+        Value& global = globals[READ_SHORT()];
+        if (global.isUndefined()) {
+          runtimeError("Undefined variable");
         }
-        case OpCode::GET_UPVALUE: {
-          uint8_t slot = read_byte();
-          auto upvalue = frames_.back().closure->upvalues[slot];
-          stack_.push(*frames_.back().closure->upvalues[slot]->location);
-          break;
+        global = value;
+        DISPATCH();
+      }
+      CASE(DEFINE_GLOBAL) : {
+        const Value& value = READ_REGISTER();
+        Value& global = globals[READ_SHORT()];
+        if (!global.isUndefined()) {
+          runtimeError("Variable already defined");
         }
-        case OpCode::SET_UPVALUE: {
-          uint8_t slot = read_byte();
-          *frames_.back().closure->upvalues[slot]->location = stack_.peek(0);
-          break;
+        global = value;
+        DISPATCH();
+      }
+      CASE(GET_UPVALUE) : {
+        Value& dst = READ_REGISTER();
+        dst = *frame->closure->upvalues[READ_BYTE()]->location;
+        DISPATCH();
+      }
+      CASE(SET_UPVALUE) : {
+        const Value& value = READ_REGISTER();
+        *frame->closure->upvalues[READ_BYTE()]->location = value;
+        DISPATCH();
+      }
+      CASE(GET_PROPERTY) : {
+        Value& dst = READ_REGISTER();
+        const Value& object = READ_REGISTER();
+        auto name = READ_STRING();
+        auto& cache = caches[READ_SHORT()];
+        if (!object.isInstance()) {
+          runtimeError("Only instances have properties");
         }
-        case OpCode::GET_GLOBAL: {
-          auto name = read_string();
-          auto it = globals_.find(name);
-          if (it == globals_.end()) {
-            runtimeError("Undefined variable");
+        auto instance = object.asInstance();
+        if (auto entry = probeCache(cache, instance)) {
+          if (entry->method == nullptr) {
+            dst = instance->fields[entry->slot];
+          } else {
+            dst = heap_.allocate<BoundMethodObject>(instance, entry->method);
           }
-          stack_.push(it->second);
-          break;
-        }
-        case OpCode::GET_LOCAL: {
-          uint8_t slot = read_byte();
-          stack_.push(stack_.get(frames_.back().stackOffset + slot));
-          break;
-        }
-        case OpCode::SET_LOCAL: {
-          uint8_t slot = read_byte();
-          stack_.set(frames_.back().stackOffset + slot, stack_.peek(0));
-          break;
-        }
-        case OpCode::CONSTANT: {
-          stack_.push(read_constant());
-          break;
+          DISPATCH();
         }
-        case OpCode::NIL: {
-          stack_.push(std::monostate());
-          break;
-        }
-        case OpCode::TRUE: {
-          stack_.push(true);
-          break;
-        }
-        case OpCode::FALSE: {
-          stack_.push(false);
-          break;
+        dst = getProperty(instance, name, cache);
+        DISPATCH();
+      }
+      CASE(SET_PROPERTY) : {
+        const Value& object = READ_REGISTER();
+        const Value& value = READ_REGISTER();
+        auto name = READ_STRING();
+        auto& cache = caches[READ_SHORT()];
+        if (!object.isInstance()) {
+          runtimeError("Only instances have properties");
         }
-        case OpCode::ADD: {
-          auto success = std::visit(
-              overloaded{
-                  [this](const double& a, const double& b) -> bool {
-                    this->stack()->popTwoAndPush(a + b);
-                    return true;
-                  },
-                  [this](const std::string& a, const std::string& b) -> bool {
-                    this->stack()->popTwoAndPush(a + b);
-                    return true;
-                  },
-                  [this](const std::string& a, const auto& b) -> bool {
-                    this->stack()->popTwoAndPush(a + this->to_string(b));
-                    return true;
-                  },
-                  [this](const auto& a, const std::string& b) -> bool {
-                    this->stack()->popTwoAndPush(this->to_string(a) + b);
-                    return true;
-                  },
-                  [this](auto& a, auto& b) -> bool { return false; },
-              },
-              stack_.peek(1), stack_.peek(0));
-          if (!success) {
-            runtimeError("Operands must be two numbers or two strings.");
+        auto instance = object.asInstance();
+        if (auto entry = probeCache(cache, instance)) {
+          if (entry->next != nullptr) {
+            instance->appendField(entry->next, value);
+          } else {
+            instance->fields[entry->slot] = value;
           }
-          break;
+        } else {
+          setProperty(instance, name, value, cache);
         }
-        case OpCode::SUBSTRACT: {
-          BINARY_OP(-);
-          break;
+        DISPATCH();
+      }
+      CASE(ADD) : {
+        Value& dst = READ_REGISTER();
+        const Value& a = READ_REGISTER();
+        const Value& b = READ_REGISTER();
+        if (a.isNumber() && b.isNumber()) {
+          dst = Value(a.asNumber() + b.asNumber());
+        } else {
+          dst = concatenate(a, b);
         }
-        case OpCode::MULTIPLY: {
-          BINARY_OP(*);
-          break;
+        DISPATCH();
+      }
+      CASE(ADD_CONSTANT) : {
+        Value& dst = READ_REGISTER();
+        const Value& a = READ_REGISTER();
+        const Value& b = READ_CONSTANT();
+        if (a.isNumber() && b.isNumber()) {
+          dst = Value(a.asNumber() + b.asNumber());
+        } else {
+          dst = concatenate(a, b);
         }
-        case OpCode::DIVIDE: {
-          BINARY_OP(/);
-          break;
+        DISPATCH();
+      }
+      CASE(SUBSTRACT) : {
+        NUMBER_OP(-);
+        DISPATCH();
+      }
+      CASE(SUBSTRACT_CONSTANT) : {
+        Value& dst = READ_REGISTER();
+        const Value& a = READ_REGISTER();
+        const Value& b = READ_CONSTANT();
+        if (!a.isNumber() || !b.isNumber()) {
+          runtimeError("Operands must be numbers.");
         }
-        case OpCode::NOT: {
-          stack_.popAndPush(isFalsy(stack_.peek()));
-          break;
+        dst = Value(a.asNumber() - b.asNumber());
+        DISPATCH();
+      }
+      CASE(MULTIPLY) : {
+        NUMBER_OP(*);
+        DISPATCH();
+      }
+      CASE(DIVIDE) : {
+        NUMBER_OP(/);
+        DISPATCH();
+      }
+      CASE(EQUAL) : {
+        Value& dst = READ_REGISTER();
+        const Value& a = READ_REGISTER();
+        const Value& b = READ_REGISTER();
+        dst = a == b;
+        DISPATCH();
+      }
+      CASE(NOT_EQUAL) : {
+        Value& dst = READ_REGISTER();
+        const Value& a = READ_REGISTER();
+        const Value& b = READ_REGISTER();
+        dst = a != b;
+        DISPATCH();
+      }
+      CASE(GREATER) : {
+        NUMBER_OP(>);
+        DISPATCH();
+      }
+      CASE(LESS) : {
+        NUMBER_OP(<);
+        DISPATCH();
+      }
+      CASE(GREATER_EQUAL) : {
+        NUMBER_OP(>=);
+        DISPATCH();
+      }
+      CASE(LESS_EQUAL) : {
+        NUMBER_OP(<=);
+        DISPATCH();
+      }
+      CASE(NEGATE) : {
+        Value& dst = READ_REGISTER();
+        const Value& a = READ_REGISTER();
+        if (!a.isNumber()) {
+          runtimeError("Operand must be a number.");
         }
-        case OpCode::EQUAL: {
-          stack_.popTwoAndPush(stack_.peek(0) == stack_.peek(1));
-          break;
+        dst = Value(-a.asNumber());
+        DISPATCH();
+      }
+      CASE(NOT) : {
+        Value& dst = READ_REGISTER();
+        dst = isFalsy(READ_REGISTER());
+        DISPATCH();
+      }
+      CASE(JUMP) : {
+        uint16_t offset = READ_SHORT();
+        ip += offset;
+        DISPATCH();
+      }
+      CASE(LOOP) : {
+        uint16_t offset = READ_SHORT();
+        ip -= offset;
+        DISPATCH();
+      }
+      CASE(JUMP_IF_FALSE) : {
+        const Value& condition = READ_REGISTER();
+        uint16_t offset = READ_SHORT();
+        if (isFalsy(condition)) {
+          ip += offset;
         }
-        case OpCode::NOT_EQUAL: {
-          stack_.popTwoAndPush(stack_.peek(0) != stack_.peek(1));
-          break;
+        DISPATCH();
+      }
+      CASE(EQUAL_JUMP_IF_FALSE) : {
+        VALUE_COMPARE_JUMP(==);
+        DISPATCH();
+      }
+      CASE(NOT_EQUAL_JUMP_IF_FALSE) : {
+        VALUE_COMPARE_JUMP(!=);
+        DISPATCH();
+      }
+      CASE(GREATER_JUMP_IF_FALSE) : {
+        NUMBER_COMPARE_JUMP(>);
+        DISPATCH();
+      }
+      CASE(LESS_JUMP_IF_FALSE) : {
+        NUMBER_COMPARE_JUMP(<);
+        DISPATCH();
+      }
+      CASE(GREATER_EQUAL_JUMP_IF_FALSE) : {
+        NUMBER_COMPARE_JUMP(>=);
+        DISPATCH();
+      }
+      CASE(LESS_EQUAL_JUMP_IF_FALSE) : {
+        NUMBER_COMPARE_JUMP(<=);
+        DISPATCH();
+      }
+      CASE(PRINT) : {
+        std::cout << "[Out]: " << READ_REGISTER() << "\n";
+        DISPATCH();
+      }
+      CASE(CALL) : {
+        uint8_t base = READ_BYTE();
+        int argCount = READ_BYTE();
+        stack_.truncate(slots + base + argCount + 1);
+        STORE_FRAME();
+        callValue(slots[base], argCount);
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(INVOKE) : {
+        uint8_t base = READ_BYTE();
+        auto method = READ_STRING();
+        int argCount = READ_BYTE();
+        stack_.truncate(slots + base + argCount + 1);
+        STORE_FRAME();
+        invoke(method, argCount);
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(SUPER_INVOKE) : {
+        uint8_t base = READ_BYTE();
+        auto method = READ_STRING();
+        int argCount = READ_BYTE();
+        // The superclass sits right above the arguments.
+        const Value& superclass = slots[base + argCount + 1];
+        if (!superclass.isClass()) {
+          runtimeError("Superclass must be a class");
         }
-        case OpCode::GREATER: {
-          BINARY_OP(>);
-          break;
+        stack_.truncate(slots + base + argCount + 1);
+        STORE_FRAME();
+        invokeFromClass(superclass.asClass(), method, argCount);
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(GET_SUPER) : {
+        Value& dst = READ_REGISTER();
+        const Value& self = READ_REGISTER();
+        const Value& superclass = READ_REGISTER();
+        auto name = READ_STRING();
+        if (!superclass.isClass()) {
+          runtimeError("Superclass must be a class");
         }
-        case OpCode::LESS: {
-          BINARY_OP(<);
-          break;
+        Closure method = methodCache_.find(superclass.asClass(), name);
+        if (method == nullptr) {
+          runtimeError("Undefined class property");
         }
-        case OpCode::GREATER_EQUAL: {
-          BINARY_OP(>=);
-          break;
+        dst = heap_.allocate<BoundMethodObject>(self.asInstance(), method);
+        DISPATCH();
+      }
+      CASE(CLOSURE) : {
+        Value& dst = READ_REGISTER();
+        auto function = READ_CONSTANT().asFunction();
+        Closure closure = heap_.allocate<ClosureObject>(function);
+        // Rooted in its register before capturing, which may allocate.
+        dst = closure;
+        for (auto& upvalue : closure->function->chunk().upvalues) {
+          if (upvalue.isLocal) {
+            closure->upvalues.push_back(
+                captureUpvalue(&slots[upvalue.index]));
+          } else {
+            closure->upvalues.push_back(
+                frame->closure->upvalues[upvalue.index]);
+          }
         }
-        case OpCode::LESS_EQUAL: {
-          BINARY_OP(<=);
-          break;
+        DISPATCH();
+      }
+      CASE(CLOSE_UPVALUE) : {
+        closeUpvalue(&READ_REGISTER());
+        DISPATCH();
+      }
+      CASE(CLASS) : {
+        Value& dst = READ_REGISTER();
+        auto name = READ_STRING();
+        dst = heap_.allocate<ClassObject>(name->chars);
+        DISPATCH();
+      }
+      CASE(METHOD) : {
+        Class klass = READ_REGISTER().asClass();
+        Closure method = READ_REGISTER().asClosure();
+        defineMethod(klass, READ_STRING(), method);
+        DISPATCH();
+      }
+      CASE(INHERIT) : {
+        const Value& superclass = READ_REGISTER();
+        const Value& subclass = READ_REGISTER();
+        inherit(superclass, subclass);
+        DISPATCH();
+      }
+      CASE(RETURN) : {
+        Value result = READ_REGISTER();
+        closeUpvalue(slots);
+
+        frames_.pop_back();
+        if (frames_.empty()) {
+          stack_.truncate(slots);
+          return InterpretResult::OK;
         }
-        case OpCode::NEGATE: {
-          Value value = stack_.peek();
-          try {
-            auto negated = -std::get<double>(stack_.peek());
-            stack_.popAndPush(negated);
-          } catch (std::bad_variant_access&) {
-            runtimeError("Operand must be a number.");
-          }
-          break;
+
+        // Where the caller put the callee.
+        *slots = result;
+        if (frames_.size() == base) {
+          stack_.truncate(slots + 1);
+          return InterpretResult::OK;
         }
-        default:
-          return InterpretResult::COMPILE_ERROR;
+        LOAD_FRAME();
+        DISPATCH();
       }
+#ifndef LOX_COMPUTED_GOTO
+      default:
+        return InterpretResult::COMPILE_ERROR;
+#endif
     }
+#ifndef LOX_COMPUTED_GOTO
+    }
+#endif
     return InterpretResult::COMPILE_ERROR;
-#undef BINARY_OP
-  }
 
-  inline void binary_op(std::function<Value(double, double)> op) {
-    try {
-      auto b = std::get<double>(stack_.peek(0));
-      auto a = std::get<double>(stack_.peek(1));
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_REGISTER
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef NUMBER_OP
+#undef NUMBER_COMPARE_JUMP
+#undef VALUE_COMPARE_JUMP
+#undef CASE
+#undef DISPATCH
+  }
 
-      stack_.popTwoAndPush(op(a, b));
-    } catch (std::bad_variant_access&) {
-      runtimeError("Operands must be numbers.");
+  void traceInstruction(uint8_t op) {
+    dispatched_++;
+    if (FLAGS_debug_stack) {
+      traceStack(codes[op]);
     }
   }
 
-  UpvalueValue captureUpvalue(Value* local) {
-    UpvalueValue prevUpvalue{nullptr};
-    UpvalueValue upvalue = this->openUpvalues;
-
-    while (upvalue != nullptr && upvalue->location > local) {
-      prevUpvalue = upvalue;
-      upvalue = upvalue->next;
-    }
-    if (upvalue != nullptr && upvalue->location == local) {
-      return upvalue;
+  void traceRegisterInstruction(uint8_t op) {
+    dispatched_++;
+    if (FLAGS_debug_stack) {
+      traceStack(registerCodes[op]);
     }
+  }
 
-    UpvalueValue createdUpvalue = std::make_shared<UpvalueObject>(local);
-    createdUpvalue->next = upvalue;
-    if (prevUpvalue == nullptr) {
-      openUpvalues = createdUpvalue;
+  void traceStack(const std::string& name) {
+    std::cout << "=== Stack: " << name << " ===\n";
+    if (!stack_.empty()) {
+      for (const auto& v : stack_) {
+        std::cout << "=> " << v << "\n";
+      }
     } else {
-      prevUpvalue->next = createdUpvalue;
+      std::cout << "\tempty\n";
     }
-
-    return createdUpvalue;
-  }
-
-  inline bool isFalsy(const Value& v) {
-    return std::visit(FalsinessVisitor(), v);
+    std::cout << "=== ===== ===\n";
   }
 };
 
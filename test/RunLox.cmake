@@ -0,0 +1,84 @@
+# cmake -DSCRIPT=<script.lox> -P RunLox.cmake -- <program> [arguments...]
+#
+# Runs the program and checks what it prints against the comments in
+# SCRIPT, which use the Crafting Interpreters test conventions:
+#   // expect: <value>              the next value printed
+#   // expect runtime error: <msg>  fails at run time with <msg>, exit 70
+#   // Error at '<lexeme>': <msg>   fails to compile with <msg> at <lexeme>,
+#                                   exit 65
+# Numbers are printed with six decimals, so their trailing zeros are
+# dropped before comparing.
+
+set(command)
+math(EXPR last "${CMAKE_ARGC} - 1")
+set(found FALSE)
+foreach(i RANGE ${last})
+  if (found)
+    list(APPEND command "${CMAKE_ARGV${i}}")
+  elseif ("${CMAKE_ARGV${i}}" STREQUAL "--")
+    set(found TRUE)
+  endif()
+endforeach()
+if (NOT command)
+  message(FATAL_ERROR "No program to run")
+endif()
+
+file(STRINGS ${SCRIPT} lines)
+set(expected)
+set(error "")
+set(lexeme "")
+set(status 0)
+foreach(line IN LISTS lines)
+  if (line MATCHES "// expect: (.*)$")
+    list(APPEND expected "${CMAKE_MATCH_1}")
+  elseif (line MATCHES "// expect runtime error: (.*)$")
+    set(error "${CMAKE_MATCH_1}")
+    set(status 70)
+  elseif (line MATCHES "// (\\[line [0-9]+\\] )?Error[^:]*: (.*)$")
+    set(error "${CMAKE_MATCH_2}")
+    set(status 65)
+    if (line MATCHES "Error at '\"?([^']*[^'\"])\"?':")
+      set(lexeme "[at ${CMAKE_MATCH_1}]")
+    endif()
+  endif()
+endforeach()
+
+execute_process(
+  COMMAND ${command}
+  RESULT_VARIABLE result
+  OUTPUT_VARIABLE output
+  ERROR_VARIABLE output
+)
+
+string(REPLACE "\n" ";" printed "${output}")
+set(values)
+foreach(line IN LISTS printed)
+  if (line MATCHES "^\\[Out\\]: (.*)$")
+    set(value "${CMAKE_MATCH_1}")
+    if (value MATCHES "^-?[0-9]+\\.[0-9]+$")
+      string(REGEX REPLACE "0+$" "" value "${value}")
+      string(REGEX REPLACE "\\.$" "" value "${value}")
+    endif()
+    list(APPEND values "${value}")
+  endif()
+endforeach()
+
+if (NOT "${values}" STREQUAL "${expected}")
+  message(FATAL_ERROR
+    "Expected [${expected}] but printed [${values}]\n${output}")
+endif()
+if (NOT result EQUAL status)
+  message(FATAL_ERROR "Expected exit ${status} but got ${result}\n${output}")
+endif()
+if (error)
+  string(FIND "${output}" "${error}" at)
+  if (at EQUAL -1)
+    message(FATAL_ERROR "Expected error \"${error}\"\n${output}")
+  endif()
+endif()
+if (lexeme)
+  string(FIND "${output}" "${lexeme}" at)
+  if (at EQUAL -1)
+    message(FATAL_ERROR "Expected the error ${lexeme}\n${output}")
+  endif()
+endif()